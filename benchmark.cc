@@ -0,0 +1,480 @@
+// Benchmark.cc
+//
+// Standalone benchmark of Datastructures, without Qt and the command interpreter
+// (build with benchmark.pro, or directly with
+//  g++ -std=c++17 -O2 -pthread benchmark.cc datastructures.cc mutationlog.cc changefeed.cc workloadtrace.cc
+//      perfstats.cc -o prg1-benchmark).
+//
+// Every public operation is run for each N as repeated measurements: the data set
+// is built (outside of timing), call arguments are generated beforehand, warmup
+// repetitions are run and discarded, and then each measured repetition times a
+// batch of calls. Statistics are computed over the repetitions. The process can be
+// pinned to one CPU so that migrations and frequency differences between cores
+// don't add noise. Each call of a batch query (get_publication_names() etc.) asks for
+// Context::BATCH_SIZE ids.
+//
+// Allocations per call are counted only with --allocs on, because counting makes every
+// allocation update shared counters, which would be part of the measured times.
+//
+// Usage: prg1-benchmark [--sizes 1000,10000,100000] [--reps 7] [--warmup 1] [--ops 1000]
+//                       [--cpu N] [--seed S] [--filter text] [--format table|csv] [--allocs on|off]
+
+#include "datastructures.hh"
+#include "perfstats.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include <sched.h>
+#include <unistd.h>
+}
+
+namespace
+{
+using Clock = std::chrono::steady_clock;
+
+struct Options
+{
+    std::vector<unsigned int> sizes = {1000, 10000, 100000};
+    unsigned int reps = 7;
+    unsigned int warmup = 1;
+    unsigned int ops = 1000;
+    int cpu = -1; // -1 = no pinning
+    unsigned long seed = 1;
+    std::string filter;
+    bool csv = false;
+    bool allocs = false;
+};
+
+// Data set and pre-generated call arguments of one benchmark.
+struct Context
+{
+    Datastructures ds;
+    unsigned int n = 0;
+    std::minstd_rand rng;
+
+    std::vector<AffiliationID> affiliation_args;
+    std::vector<PublicationID> publication_args;
+    std::vector<PublicationID> publication_args2;
+    std::vector<Coord> coord_args;
+    std::vector<Year> year_args;
+    std::vector<AffiliationID> new_affiliations;
+    std::vector<PublicationID> new_publications;
+    std::vector<std::vector<PublicationID>> publication_batches;
+    std::vector<std::vector<AffiliationID>> affiliation_batches;
+
+    std::size_t sink = 0; // Results are summed here, so that calls can't be optimized away
+
+    static AffiliationID affiliation_id(unsigned long i) { return "A" + std::to_string(i); }
+    static PublicationID publication_id(unsigned long i) { return i; }
+
+    Coord random_coord() { return {static_cast<int>(rng() % 10000), static_cast<int>(rng() % 10000)}; }
+    AffiliationID random_affiliation() { return affiliation_id(rng() % n); }
+    PublicationID random_publication() { return publication_id(rng() % n); }
+    // Biased like perftest: roots are in the beginning and leaves in the end of the binary tree
+    PublicationID random_root_publication() { return publication_id(rng() % std::max(1u, n / 20)); }
+    PublicationID random_leaf_publication() { return publication_id(n / 2 + rng() % std::max(1u, n - n / 2)); }
+
+    // Same shape as random_add: n affiliations, n publications with 4 affiliations
+    // each, references forming a binary tree.
+    void build(unsigned int size)
+    {
+        n = size;
+        ds.clear_all();
+        ds.begin_bulk();
+        for (unsigned int i = 0; i < n; ++i) {
+            ds.add_affiliation(affiliation_id(i), "name" + std::to_string(rng() % n), random_coord());
+        }
+        for (unsigned int i = 0; i < n; ++i) {
+            std::vector<AffiliationID> affiliations;
+            for (int j = 0; j < 4; ++j) { affiliations.push_back(random_affiliation()); }
+            ds.add_publication(publication_id(i), std::to_string(i), static_cast<Year>(rng() % 9999), affiliations);
+            if (i > 0) { ds.add_reference(publication_id(i), publication_id(i / 2)); }
+        }
+        ds.end_bulk();
+    }
+
+    // Arguments of batch queries, calls batches of BATCH_SIZE random ids.
+    static std::size_t const BATCH_SIZE = 64;
+    void generate_batches(std::size_t calls)
+    {
+        publication_batches.assign(calls, {});
+        affiliation_batches.assign(calls, {});
+        for (std::size_t i = 0; i < calls; ++i) {
+            for (std::size_t j = 0; j < BATCH_SIZE; ++j) {
+                publication_batches[i].push_back(random_publication());
+                affiliation_batches[i].push_back(random_affiliation());
+            }
+        }
+    }
+
+    void generate_args(std::size_t calls)
+    {
+        affiliation_args.clear();
+        publication_args.clear();
+        publication_args2.clear();
+        coord_args.clear();
+        year_args.clear();
+        for (std::size_t i = 0; i < calls; ++i) {
+            affiliation_args.push_back(random_affiliation());
+            publication_args.push_back(random_publication());
+            publication_args2.push_back(random_leaf_publication());
+            coord_args.push_back(random_coord());
+            year_args.push_back(static_cast<Year>(rng() % 9999));
+        }
+    }
+};
+
+struct Benchmark
+{
+    char const* name;
+    bool linear; // O(n) or worse per call: fewer calls for large n
+    bool mutating; // Data set is rebuilt before every repetition
+    std::function<void(Context&, std::size_t)> prepare; // Extra setup (not timed), may be empty
+    std::function<void(Context&, std::size_t)> run; // Makes the given number of calls
+};
+
+template <typename Container>
+std::size_t size_of(Container const& container) { return container.size(); }
+
+std::vector<Benchmark> const& benchmarks()
+{
+    static std::vector<Benchmark> const list = {
+        {"get_affiliation_count", false, false, {}, [](Context& c, std::size_t calls) {
+             for (std::size_t i = 0; i < calls; ++i) { c.sink += c.ds.get_affiliation_count(); } }},
+        {"get_all_affiliations", true, false, {}, [](Context& c, std::size_t calls) {
+             for (std::size_t i = 0; i < calls; ++i) { c.sink += size_of(c.ds.get_all_affiliations()); } }},
+        {"get_affiliation_name", false, false, {}, [](Context& c, std::size_t calls) {
+             for (std::size_t i = 0; i < calls; ++i) { c.sink += c.ds.get_affiliation_name(c.affiliation_args[i]).size(); } }},
+        {"get_affiliation_coord", false, false, {}, [](Context& c, std::size_t calls) {
+             for (std::size_t i = 0; i < calls; ++i) { c.sink += c.ds.get_affiliation_coord(c.affiliation_args[i]).x; } }},
+        {"get_affiliation_coords", false, false, [](Context& c, std::size_t calls) { c.generate_batches(calls); },
+         [](Context& c, std::size_t calls) {
+             for (std::size_t i = 0; i < calls; ++i) { c.sink += size_of(c.ds.get_affiliation_coords(c.affiliation_batches[i])); } }},
+        {"get_affiliations_alphabetically", true, false, {}, [](Context& c, std::size_t calls) {
+             for (std::size_t i = 0; i < calls; ++i) { c.sink += size_of(c.ds.get_affiliations_alphabetically()); } }},
+        {"get_affiliations_distance_increasing", true, false, {}, [](Context& c, std::size_t calls) {
+             for (std::size_t i = 0; i < calls; ++i) { c.sink += size_of(c.ds.get_affiliations_distance_increasing()); } }},
+        {"find_affiliation_with_coord", true, false, {}, [](Context& c, std::size_t calls) {
+             for (std::size_t i = 0; i < calls; ++i) { c.sink += c.ds.find_affiliation_with_coord(c.coord_args[i]).size(); } }},
+        {"change_affiliation_coord", false, false, {}, [](Context& c, std::size_t calls) {
+             for (std::size_t i = 0; i < calls; ++i) { c.sink += c.ds.change_affiliation_coord(c.affiliation_args[i], c.coord_args[i]); } }},
+        {"all_publications", true, false, {}, [](Context& c, std::size_t calls) {
+             for (std::size_t i = 0; i < calls; ++i) { c.sink += size_of(c.ds.all_publications()); } }},
+        {"get_publication_name", false, false, {}, [](Context& c, std::size_t calls) {
+             for (std::size_t i = 0; i < calls; ++i) { c.sink += c.ds.get_publication_name(c.publication_args[i]).size(); } }},
+        {"get_publication_year", false, false, {}, [](Context& c, std::size_t calls) {
+             for (std::size_t i = 0; i < calls; ++i) { c.sink += c.ds.get_publication_year(c.publication_args[i]); } }},
+        {"get_publication_names", false, false, [](Context& c, std::size_t calls) { c.generate_batches(calls); },
+         [](Context& c, std::size_t calls) {
+             for (std::size_t i = 0; i < calls; ++i) { c.sink += size_of(c.ds.get_publication_names(c.publication_batches[i])); } }},
+        {"get_publication_years", false, false, [](Context& c, std::size_t calls) { c.generate_batches(calls); },
+         [](Context& c, std::size_t calls) {
+             for (std::size_t i = 0; i < calls; ++i) { c.sink += size_of(c.ds.get_publication_years(c.publication_batches[i])); } }},
+        {"get_affiliations", false, false, {}, [](Context& c, std::size_t calls) {
+             for (std::size_t i = 0; i < calls; ++i) { c.sink += size_of(c.ds.get_affiliations(c.publication_args[i])); } }},
+        {"get_direct_references", false, false, {}, [](Context& c, std::size_t calls) {
+             for (std::size_t i = 0; i < calls; ++i) { c.sink += size_of(c.ds.get_direct_references(c.publication_args[i])); } }},
+        {"get_publications", false, false, {}, [](Context& c, std::size_t calls) {
+             for (std::size_t i = 0; i < calls; ++i) { c.sink += size_of(c.ds.get_publications(c.affiliation_args[i])); } }},
+        {"get_parent", false, false, {}, [](Context& c, std::size_t calls) {
+             for (std::size_t i = 0; i < calls; ++i) { c.sink += c.ds.get_parent(c.publication_args[i]); } }},
+        {"get_parents", false, false, [](Context& c, std::size_t calls) { c.generate_batches(calls); },
+         [](Context& c, std::size_t calls) {
+             for (std::size_t i = 0; i < calls; ++i) { c.sink += size_of(c.ds.get_parents(c.publication_batches[i])); } }},
+        {"get_publications_info", false, false, [](Context& c, std::size_t calls) { c.generate_batches(calls); },
+         [](Context& c, std::size_t calls) {
+             for (std::size_t i = 0; i < calls; ++i) { c.sink += size_of(c.ds.get_publications_info(c.publication_batches[i])); } }},
+        {"get_publications_after", false, false, {}, [](Context& c, std::size_t calls) {
+             for (std::size_t i = 0; i < calls; ++i) { c.sink += size_of(c.ds.get_publications_after(c.affiliation_args[i], c.year_args[i])); } }},
+        {"get_referenced_by_chain", false, false, {}, [](Context& c, std::size_t calls) {
+             for (std::size_t i = 0; i < calls; ++i) { c.sink += size_of(c.ds.get_referenced_by_chain(c.publication_args2[i])); } }},
+        {"get_all_references", true, false, [](Context& c, std::size_t calls) {
+             for (std::size_t i = 0; i < calls; ++i) { c.publication_args[i] = c.random_root_publication(); } },
+         [](Context& c, std::size_t calls) {
+             for (std::size_t i = 0; i < calls; ++i) { c.sink += size_of(c.ds.get_all_references(c.publication_args[i])); } }},
+        {"get_affiliations_closest_to", true, false, {}, [](Context& c, std::size_t calls) {
+             for (std::size_t i = 0; i < calls; ++i) { c.sink += size_of(c.ds.get_affiliations_closest_to(c.coord_args[i])); } }},
+        {"get_closest_common_parent", false, false, {}, [](Context& c, std::size_t calls) {
+             for (std::size_t i = 0; i < calls; ++i) { c.sink += c.ds.get_closest_common_parent(c.publication_args2[i], c.publication_args2[calls - 1 - i]); } }},
+        {"cursor_all_affiliations", true, false, {}, [](Context& c, std::size_t calls) {
+             std::vector<AffiliationID> page;
+             for (std::size_t i = 0; i < calls; ++i) {
+                 auto cursor = c.ds.all_affiliations_cursor();
+                 while (c.ds.next_page(cursor, page, 4096)) { c.sink += page.size(); }
+             } }},
+        {"cursor_all_publications", true, false, {}, [](Context& c, std::size_t calls) {
+             std::vector<PublicationID> page;
+             for (std::size_t i = 0; i < calls; ++i) {
+                 auto cursor = c.ds.all_publications_cursor();
+                 while (c.ds.next_page(cursor, page, 4096)) { c.sink += page.size(); }
+             } }},
+        {"cursor_publications", false, false, {}, [](Context& c, std::size_t calls) {
+             std::vector<PublicationID> page;
+             for (std::size_t i = 0; i < calls; ++i) {
+                 auto cursor = c.ds.publications_cursor(c.affiliation_args[i]);
+                 while (c.ds.next_page(cursor, page, 4096)) { c.sink += page.size(); }
+             } }},
+        {"cursor_all_references", true, false, [](Context& c, std::size_t calls) {
+             for (std::size_t i = 0; i < calls; ++i) { c.publication_args[i] = c.random_root_publication(); } },
+         [](Context& c, std::size_t calls) {
+             std::vector<PublicationID> page;
+             for (std::size_t i = 0; i < calls; ++i) {
+                 auto cursor = c.ds.all_references_cursor(c.publication_args[i]);
+                 while (c.ds.next_page(cursor, page, 4096)) { c.sink += page.size(); }
+             } }},
+        {"add_affiliation", false, true, [](Context& c, std::size_t calls) {
+             c.new_affiliations.clear();
+             for (std::size_t i = 0; i < calls; ++i) { c.new_affiliations.push_back("N" + std::to_string(i)); } },
+         [](Context& c, std::size_t calls) {
+             for (std::size_t i = 0; i < calls; ++i) { c.sink += c.ds.add_affiliation(c.new_affiliations[i], "new", c.coord_args[i]); } }},
+        {"add_publication", false, true, {}, [](Context& c, std::size_t calls) {
+             for (std::size_t i = 0; i < calls; ++i) {
+                 c.sink += c.ds.add_publication(c.n + i, "new", c.year_args[i], {c.affiliation_args[i]});
+             } }},
+        {"add_reference", false, true, [](Context& c, std::size_t calls) {
+             // Publications without a parent, references to them are timed
+             for (std::size_t i = 0; i < calls; ++i) { c.ds.add_publication(c.n + i, "new", c.year_args[i], {}); } },
+         [](Context& c, std::size_t calls) {
+             for (std::size_t i = 0; i < calls; ++i) { c.sink += c.ds.add_reference(c.n + i, c.publication_args[i]); } }},
+        {"add_affiliation_to_publication", false, true, {}, [](Context& c, std::size_t calls) {
+             for (std::size_t i = 0; i < calls; ++i) {
+                 c.sink += c.ds.add_affiliation_to_publication(c.affiliation_args[i], c.publication_args[i]);
+             } }},
+        {"remove_affiliation", true, true, [](Context& c, std::size_t calls) {
+             // Distinct ids, so that every call removes something
+             c.new_affiliations.clear();
+             for (std::size_t i = 0; i < calls; ++i) { c.new_affiliations.push_back(Context::affiliation_id(i * c.n / calls)); } },
+         [](Context& c, std::size_t calls) {
+             for (std::size_t i = 0; i < calls; ++i) { c.sink += c.ds.remove_affiliation(c.new_affiliations[i]); } }},
+        {"remove_publication", true, true, [](Context& c, std::size_t calls) {
+             c.new_publications.clear();
+             for (std::size_t i = 0; i < calls; ++i) { c.new_publications.push_back(Context::publication_id(i * c.n / calls)); } },
+         [](Context& c, std::size_t calls) {
+             for (std::size_t i = 0; i < calls; ++i) { c.sink += c.ds.remove_publication(c.new_publications[i]); } }},
+        {"clear_all", true, true, {}, [](Context& c, std::size_t) {
+             c.ds.clear_all(); }},
+        {"bulk_add", true, true, [](Context& c, std::size_t) {
+             c.ds.clear_all(); },
+         [](Context& c, std::size_t) {
+             // Whole data set as one bulk, time per call is for all n affiliations and publications
+             c.ds.begin_bulk();
+             for (unsigned int i = 0; i < c.n; ++i) {
+                 c.ds.add_affiliation(Context::affiliation_id(i), "name", c.coord_args[i % c.coord_args.size()]);
+                 c.ds.add_publication(i, "pub", c.year_args[i % c.year_args.size()], {Context::affiliation_id(i)});
+             }
+             c.sink += c.ds.end_bulk(); }},
+        {"save_snapshot", true, false, {}, [](Context& c, std::size_t calls) {
+             for (std::size_t i = 0; i < calls; ++i) { c.sink += c.ds.save_snapshot("prg1-benchmark.snapshot", 0); } }},
+        {"load_snapshot", true, true, [](Context& c, std::size_t) {
+             c.ds.save_snapshot("prg1-benchmark.snapshot", 0); },
+         [](Context& c, std::size_t calls) {
+             unsigned long long sequence = 0;
+             for (std::size_t i = 0; i < calls; ++i) { c.sink += c.ds.load_snapshot("prg1-benchmark.snapshot", sequence); } }},
+    };
+    return list;
+}
+
+// Number of calls in one repetition.
+std::size_t calls_per_rep(Benchmark const& benchmark, Options const& options, unsigned int n)
+{
+    std::string name = benchmark.name;
+    if (name == "clear_all" || name == "bulk_add") { return 1; }
+    std::size_t calls = options.ops;
+    if (benchmark.linear && n > 1000) { calls = std::max<std::size_t>(1, static_cast<std::size_t>(options.ops) * 1000 / n); }
+    if (benchmark.mutating && name.compare(0, 6, "remove") == 0) { calls = std::min<std::size_t>(calls, n); }
+    return std::max<std::size_t>(calls, 1);
+}
+
+struct Statistics
+{
+    double min = 0;
+    double median = 0;
+    double mean = 0;
+    double stddev = 0;
+};
+
+Statistics statistics(std::vector<double> values)
+{
+    Statistics stats;
+    if (values.empty()) { return stats; }
+    std::sort(values.begin(), values.end());
+    stats.min = values.front();
+    auto middle = values.size() / 2;
+    stats.median = (values.size() % 2) ? values[middle] : (values[middle - 1] + values[middle]) / 2;
+    for (double value : values) { stats.mean += value; }
+    stats.mean /= values.size();
+    if (values.size() > 1) {
+        double sum = 0;
+        for (double value : values) { sum += (value - stats.mean) * (value - stats.mean); }
+        stats.stddev = std::sqrt(sum / (values.size() - 1));
+    }
+    return stats;
+}
+
+bool pin_to_cpu(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+std::string cpu_model()
+{
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    std::string line;
+    while (std::getline(cpuinfo, line)) {
+        if (line.compare(0, 10, "model name") == 0) {
+            auto colon = line.find(':');
+            if (colon != std::string::npos) { return line.substr(colon + 2); }
+        }
+    }
+    return "unknown";
+}
+
+bool parse_options(int argc, char* argv[], Options& options)
+{
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) { return false; }
+        std::string value = argv[++i];
+        if (arg == "--sizes") {
+            options.sizes.clear();
+            std::istringstream sizes(value);
+            std::string size;
+            while (std::getline(sizes, size, ',')) { options.sizes.push_back(std::stoul(size)); }
+        }
+        else if (arg == "--reps") { options.reps = std::max(1ul, std::stoul(value)); }
+        else if (arg == "--warmup") { options.warmup = std::stoul(value); }
+        else if (arg == "--ops") { options.ops = std::max(1ul, std::stoul(value)); }
+        else if (arg == "--cpu") { options.cpu = std::stoi(value); }
+        else if (arg == "--seed") { options.seed = std::stoul(value); }
+        else if (arg == "--filter") { options.filter = value; }
+        else if (arg == "--format" && (value == "table" || value == "csv")) { options.csv = (value == "csv"); }
+        else if (arg == "--allocs" && (value == "on" || value == "off")) { options.allocs = (value == "on"); }
+        else { return false; }
+    }
+    return !options.sizes.empty();
+}
+}
+
+int main(int argc, char* argv[])
+{
+    Options options;
+    try {
+        if (!parse_options(argc, argv, options)) {
+            std::cerr << "Usage: " << argv[0] << " [--sizes n1,n2,...] [--reps R] [--warmup W] [--ops K]"
+                      << " [--cpu N] [--seed S] [--filter text] [--format table|csv] [--allocs on|off]" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    catch (std::exception const&) {
+        std::cerr << "Invalid number in arguments" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::ios::sync_with_stdio(false);
+    MemoryStats::set_counting(options.allocs);
+
+    bool pinned = options.cpu >= 0 && pin_to_cpu(options.cpu);
+    if (options.cpu >= 0 && !pinned) { std::cerr << "Couldn't pin to CPU " << options.cpu << ", running unpinned" << std::endl; }
+
+    // Header with the information needed to compare results between machines
+    char const* prefix = options.csv ? "# " : "";
+    std::cout << prefix << "CPU: " << cpu_model() << (pinned ? ", pinned to CPU " + std::to_string(options.cpu) : ", not pinned") << std::endl;
+    std::cout << prefix << "Compiler: " << __VERSION__
+#ifdef _GLIBCXX_DEBUG
+              << " (debug STL, results not representative!)"
+#endif
+              << std::endl;
+    std::cout << prefix << "Repetitions: " << options.reps << ", warmup: " << options.warmup << ", calls per repetition: "
+              << options.ops << " (O(n) operations with n > 1000: " << options.ops << "*1000/n)" << ", seed: " << options.seed << std::endl;
+
+    if (options.csv) {
+        std::cout << "operation,n,calls,min_ns,median_ns,mean_ns,stddev_ns,cv_percent,allocs_per_call" << std::endl;
+    }
+    else {
+        std::cout << std::setw(38) << "operation" << " , " << std::setw(8) << "n" << " , " << std::setw(6) << "calls" << " , "
+                  << std::setw(12) << "min (ns)" << " , " << std::setw(12) << "median (ns)" << " , " << std::setw(12) << "mean (ns)"
+                  << " , " << std::setw(12) << "stddev (ns)" << " , " << std::setw(7) << "cv (%)" << " , " << std::setw(10) << "allocs" << std::endl;
+    }
+
+    std::cout << std::fixed << std::setprecision(options.csv ? 3 : 1);
+
+    std::size_t sink = 0;
+    for (unsigned int n : options.sizes) {
+        Context context;
+        context.rng.seed(options.seed);
+        context.build(n);
+
+        for (auto const& benchmark : benchmarks()) {
+            if (!options.filter.empty() && std::string(benchmark.name).find(options.filter) == std::string::npos) { continue; }
+
+            auto calls = calls_per_rep(benchmark, options, n);
+            std::vector<double> times; // ns per call of each measured repetition
+            MemoryStats::Allocations allocations;
+
+            for (unsigned int rep = 0; rep < options.warmup + options.reps; ++rep) {
+                if (benchmark.mutating) {
+                    context.rng.seed(options.seed);
+                    context.build(n);
+                }
+                context.generate_args(std::max<std::size_t>(calls, benchmark.mutating ? n : 0));
+                if (benchmark.prepare) { benchmark.prepare(context, calls); }
+
+                auto before = MemoryStats::allocations();
+                auto start = Clock::now();
+                benchmark.run(context, calls);
+                auto end = Clock::now();
+
+                if (rep >= options.warmup) {
+                    allocations += MemoryStats::allocations() - before;
+                    times.push_back(std::chrono::duration<double, std::nano>(end - start).count() / calls);
+                }
+            }
+            // Mutating benchmarks leave the data set changed
+            if (benchmark.mutating) {
+                context.rng.seed(options.seed);
+                context.build(n);
+            }
+
+            auto stats = statistics(times);
+            double cv = (stats.mean > 0) ? 100.0 * stats.stddev / stats.mean : 0;
+            double allocs_per_call = static_cast<double>(allocations.count) / (static_cast<double>(calls) * options.reps);
+            std::ostringstream allocs; // Empty (or "-") if not counted
+            allocs << std::fixed << std::setprecision(options.csv ? 3 : 1);
+            if (options.allocs) { allocs << allocs_per_call; }
+            else if (!options.csv) { allocs << "-"; }
+            if (options.csv) {
+                std::cout << benchmark.name << "," << n << "," << calls << "," << stats.min << "," << stats.median << ","
+                          << stats.mean << "," << stats.stddev << "," << cv << "," << allocs.str() << std::endl;
+            }
+            else {
+                std::cout << std::setw(38) << benchmark.name << " , " << std::setw(8) << n << " , " << std::setw(6) << calls << " , "
+                          << std::setw(12) << stats.min << " , " << std::setw(12) << stats.median << " , " << std::setw(12) << stats.mean
+                          << " , " << std::setw(12) << stats.stddev << " , " << std::setw(7) << cv
+                          << " , " << std::setw(10) << allocs.str() << std::endl;
+            }
+        }
+        sink += context.sink;
+    }
+
+    std::remove("prg1-benchmark.snapshot");
+    // Printing the sink keeps the compiler from removing the benchmarked calls
+    std::cerr << "(checksum " << sink << ")" << std::endl;
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,36 @@
+#-------------------------------------------------
+#
+# Standalone benchmark of Datastructures (no Qt, no GUI event loop).
+# Build it separately from prg1.pro, e.g. in its own build directory:
+#   qmake ../benchmark.pro && make
+# Run ./prg1-benchmark --help for the options.
+#
+#-------------------------------------------------
+
+# Uncomment the line below to enable debug STL (makes the results meaningless for comparison)
+#QMAKE_CXXFLAGS += -D_GLIBCXX_DEBUG -D_GLIBCXX_DEBUG_PEDANTIC
+
+QT -= core gui
+CONFIG += console c++17 warn_on release
+CONFIG -= qt app_bundle
+
+TARGET = prg1-benchmark
+TEMPLATE = app
+
+SOURCES += \
+    benchmark.cc \
+    datastructures.cc \
+    mutationlog.cc \
+    changefeed.cc \
+    workloadtrace.cc \
+    perfstats.cc
+
+HEADERS += \
+    datastructures.hh \
+    shardedmap.hh \
+    parallelsort.hh \
+    parallelwalk.hh \
+    mutationlog.hh \
+    changefeed.hh \
+    workloadtrace.hh \
+    perfstats.hh
@@ -0,0 +1,250 @@
+// Changefeed.cc
+
+#include "changefeed.hh"
+
+#include <algorithm>
+#include <cstring>
+
+namespace
+{
+// Header word of a slot: kind, part number of the slot, number of slots of the event and
+// length of the affiliation id.
+std::uint64_t encode_header(ChangeFeed::Kind kind, std::size_t part, std::size_t parts, std::size_t length)
+{
+    return static_cast<std::uint64_t>(kind) | (static_cast<std::uint64_t>(part) << 8) |
+           (static_cast<std::uint64_t>(parts) << 16) | (static_cast<std::uint64_t>(length) << 32);
+}
+
+std::uint64_t encode_coord(Coord xy)
+{
+    return (static_cast<std::uint64_t>(static_cast<std::uint32_t>(xy.x)) << 32) | static_cast<std::uint32_t>(xy.y);
+}
+
+Coord decode_coord(std::uint64_t word)
+{
+    return {static_cast<int>(static_cast<std::uint32_t>(word >> 32)), static_cast<int>(static_cast<std::uint32_t>(word))};
+}
+}
+
+ChangeFeed::ChangeFeed(std::size_t capacity)
+{
+    std::size_t slots = 4;
+    while (slots < capacity) {
+        slots *= 2;
+    }
+    slots_.reset(new Slot[slots]);
+    for (std::size_t i = 0; i < slots; ++i) {
+        for (auto& word : slots_[i].words) {
+            word.store(0, std::memory_order_relaxed); // Version 0: never written.
+        }
+    }
+    mask_ = slots - 1;
+    // An event may take at most half of the ring, so the newest one is always intact.
+    std::size_t max_slots = std::min(slots / 2, MAX_SLOTS);
+    max_id_length_ = (FIRST_ID_WORDS + (max_slots - 1) * NEXT_ID_WORDS) * sizeof(std::uint64_t);
+}
+
+ChangeFeed::Subscription ChangeFeed::subscribe() const
+{
+    for (;;) {
+        auto position = head_.load(std::memory_order_acquire);
+        if (position == 0) {
+            return Subscription(*this, 0, 1);
+        }
+        // Every slot of an event has its sequence number, so the last one is read.
+        auto const& slot = slots_[(position - 1) & mask_];
+        auto version = slot.words[0].load(std::memory_order_acquire);
+        auto sequence = slot.words[1].load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (version == 2 * (position - 1) + 2 && slot.words[0].load(std::memory_order_relaxed) == version) {
+            return Subscription(*this, position, sequence + 1);
+        }
+    }
+}
+
+void ChangeFeed::publish_add_affiliation(AffiliationID const& id, Coord xy)
+{
+    publish(Kind::ADD_AFFILIATION, id, NO_PUBLICATION, NO_PUBLICATION, xy);
+}
+
+void ChangeFeed::publish_add_publication(PublicationID id)
+{
+    publish(Kind::ADD_PUBLICATION, NO_AFFILIATION, id, NO_PUBLICATION, NO_COORD);
+}
+
+void ChangeFeed::publish_add_reference(PublicationID id, PublicationID parentid)
+{
+    publish(Kind::ADD_REFERENCE, NO_AFFILIATION, id, parentid, NO_COORD);
+}
+
+void ChangeFeed::publish_add_affiliation_to_publication(AffiliationID const& affiliationid, PublicationID publicationid)
+{
+    publish(Kind::ADD_AFFILIATION_TO_PUBLICATION, affiliationid, publicationid, NO_PUBLICATION, NO_COORD);
+}
+
+void ChangeFeed::publish_change_affiliation_coord(AffiliationID const& id, Coord newcoord)
+{
+    publish(Kind::CHANGE_AFFILIATION_COORD, id, NO_PUBLICATION, NO_PUBLICATION, newcoord);
+}
+
+void ChangeFeed::publish_remove_affiliation(AffiliationID const& id)
+{
+    publish(Kind::REMOVE_AFFILIATION, id, NO_PUBLICATION, NO_PUBLICATION, NO_COORD);
+}
+
+void ChangeFeed::publish_remove_publication(PublicationID id)
+{
+    publish(Kind::REMOVE_PUBLICATION, NO_AFFILIATION, id, NO_PUBLICATION, NO_COORD);
+}
+
+void ChangeFeed::publish_clear_all()
+{
+    publish(Kind::CLEAR_ALL, NO_AFFILIATION, NO_PUBLICATION, NO_PUBLICATION, NO_COORD);
+}
+
+void ChangeFeed::publish(Kind kind, AffiliationID const& affiliation, PublicationID publication,
+                         PublicationID parent, Coord xy)
+{
+    std::size_t const first_bytes = FIRST_ID_WORDS * sizeof(std::uint64_t);
+    std::size_t const next_bytes = NEXT_ID_WORDS * sizeof(std::uint64_t);
+    std::size_t length = std::min(affiliation.size(), max_id_length_);
+    std::size_t parts = 1;
+    if (length > first_bytes) {
+        parts += (length - first_bytes + next_bytes - 1) / next_bytes;
+    }
+    auto sequence = last_sequence_.load(std::memory_order_relaxed) + 1;
+    auto position = head_.load(std::memory_order_relaxed); // Only the producer changes it.
+
+    // The rest of the id first, so that a consumer which sees the first slot sees them too.
+    for (std::size_t part = parts - 1; part > 0; --part) {
+        std::uint64_t data[SLOT_WORDS] = {};
+        data[1] = sequence;
+        data[2] = encode_header(kind, part, parts, length);
+        std::size_t offset = first_bytes + (part - 1) * next_bytes;
+        std::memcpy(&data[3], affiliation.data() + offset, std::min(length - offset, next_bytes));
+        write_slot(position + part, data);
+    }
+    std::uint64_t data[SLOT_WORDS] = {};
+    data[1] = sequence;
+    data[2] = encode_header(kind, 0, parts, length);
+    data[3] = publication;
+    data[4] = parent;
+    data[5] = encode_coord(xy);
+    std::memcpy(&data[6], affiliation.data(), std::min(length, first_bytes));
+    write_slot(position, data);
+
+    head_.store(position + parts, std::memory_order_release);
+    last_sequence_.store(sequence, std::memory_order_release);
+}
+
+void ChangeFeed::write_slot(std::uint64_t position, std::uint64_t const (&data)[SLOT_WORDS])
+{
+    auto& slot = slots_[position & mask_];
+    slot.words[0].store(2 * position + 1, std::memory_order_relaxed); // Being written.
+    std::atomic_thread_fence(std::memory_order_release); // Before any field, for the consumer's recheck.
+    for (std::size_t i = 1; i < SLOT_WORDS; ++i) {
+        slot.words[i].store(data[i], std::memory_order_relaxed);
+    }
+    slot.words[0].store(2 * position + 2, std::memory_order_release);
+}
+
+ChangeFeed::ReadResult ChangeFeed::read(std::uint64_t position, Event& event, std::size_t& parts) const
+{
+    std::size_t const first_bytes = FIRST_ID_WORDS * sizeof(std::uint64_t);
+    std::size_t const next_bytes = NEXT_ID_WORDS * sizeof(std::uint64_t);
+
+    auto const& first = slots_[position & mask_];
+    auto version = first.words[0].load(std::memory_order_acquire);
+    if (version < 2 * position + 2) {
+        return ReadResult::EMPTY; // Not published yet (or being written).
+    }
+    if (version > 2 * position + 2) {
+        return ReadResult::OVERWRITTEN;
+    }
+    std::uint64_t data[SLOT_WORDS];
+    for (std::size_t i = 1; i < SLOT_WORDS; ++i) {
+        data[i] = first.words[i].load(std::memory_order_relaxed);
+    }
+
+    // Fields are checked before they are used, a torn copy may contain anything.
+    std::size_t part = (data[2] >> 8) & 0xff;
+    parts = (data[2] >> 16) & 0xffff;
+    std::size_t length = data[2] >> 32;
+    bool valid = parts >= 1 && parts <= std::min(capacity() / 2, MAX_SLOTS) && length <= max_id_length_;
+
+    std::string id(valid && part == 0 ? length : 0, '\0');
+    std::memcpy(id.data(), &data[6], std::min(id.size(), first_bytes));
+    std::uint64_t versions[MAX_SLOTS];
+    for (std::size_t i = 1; valid && part == 0 && i < parts; ++i) {
+        auto const& slot = slots_[(position + i) & mask_];
+        versions[i] = slot.words[0].load(std::memory_order_acquire);
+        if (versions[i] != 2 * (position + i) + 2) {
+            return ReadResult::OVERWRITTEN; // Written before the first slot, so newer.
+        }
+        std::uint64_t words[NEXT_ID_WORDS];
+        for (std::size_t w = 0; w < NEXT_ID_WORDS; ++w) {
+            words[w] = slot.words[3 + w].load(std::memory_order_relaxed);
+        }
+        std::size_t offset = first_bytes + (i - 1) * next_bytes;
+        if (offset < id.size()) {
+            std::memcpy(id.data() + offset, words, std::min(id.size() - offset, next_bytes));
+        }
+    }
+
+    // If the producer wrote any of the slots during the copy, their versions have changed.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (first.words[0].load(std::memory_order_relaxed) != version) {
+        return ReadResult::OVERWRITTEN;
+    }
+    for (std::size_t i = 1; valid && part == 0 && i < parts; ++i) {
+        if (slots_[(position + i) & mask_].words[0].load(std::memory_order_relaxed) != versions[i]) {
+            return ReadResult::OVERWRITTEN;
+        }
+    }
+    if (!valid) {
+        return ReadResult::OVERWRITTEN; // Can't happen with an intact copy.
+    }
+    if (part != 0) {
+        return ReadResult::CONTINUATION;
+    }
+
+    event.sequence = data[1];
+    event.kind = static_cast<Kind>(data[2] & 0xff);
+    event.affiliation = std::move(id);
+    event.publication = data[3];
+    event.parent = data[4];
+    event.coord = decode_coord(data[5]);
+    return ReadResult::EVENT;
+}
+
+std::size_t ChangeFeed::Subscription::poll(std::vector<Event>& events, std::size_t max_events)
+{
+    std::size_t count = 0;
+    while (count < max_events) {
+        Event event;
+        std::size_t parts = 0;
+        auto result = feed_->read(position_, event, parts);
+        if (result == ReadResult::EMPTY) {
+            break;
+        }
+        if (result == ReadResult::CONTINUATION) {
+            ++position_; // Looking for the start of the next event after falling behind.
+            continue;
+        }
+        if (result == ReadResult::OVERWRITTEN) {
+            // Continues from the oldest slot that may still be intact. The events skipped are
+            // counted from the sequence numbers when the next one is read.
+            auto head = feed_->head_.load(std::memory_order_acquire);
+            position_ = std::max(position_ + 1, (head > feed_->capacity()) ? head - feed_->capacity() : 0);
+            continue;
+        }
+        if (event.sequence > next_sequence_) {
+            lost_ += event.sequence - next_sequence_;
+        }
+        next_sequence_ = event.sequence + 1;
+        position_ += parts;
+        events.push_back(std::move(event));
+        ++count;
+    }
+    return count;
+}
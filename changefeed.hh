@@ -0,0 +1,147 @@
+// Changefeed.hh
+//
+// Ring buffer of Datastructures mutation events, for consumers that follow the data
+// (caches, search indexes) instead of polling listings and diffing them. Datastructures
+// publishes one event for every successful mutation (see Datastructures::set_change_feed),
+// with the ids and coordinates it touched but not names. Events are numbered from 1 in
+// the order of publication.
+//
+// One producer, any number of consumers. A consumer is a Subscription that keeps its own
+// position, so the producer neither waits for consumers nor locks anything. A consumer
+// more than the capacity behind finds its oldest events overwritten. poll() then counts
+// them as lost and continues from the oldest event still in the ring, and the consumer
+// has to resynchronize (e.g. by rereading the listings).
+//
+// Each slot of the ring is one cache line of atomic words and has its own version (a
+// seqlock). The producer marks the slot as being written, writes the fields and then
+// stores the final version, which is 2*position+2 for the slot written as position. A
+// consumer reads the version, the fields and the version again, and if the versions
+// differ (or are newer than its position), the slot was overwritten under it. An event
+// whose affiliation id doesn't fit in one slot continues in the next slots, which are
+// written before the first one.
+
+#ifndef CHANGEFEED_HH
+#define CHANGEFEED_HH
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include "datastructures.hh"
+
+class ChangeFeed
+{
+public:
+    enum class Kind : unsigned char
+    {
+        ADD_AFFILIATION = 1,
+        ADD_PUBLICATION,
+        ADD_REFERENCE,
+        ADD_AFFILIATION_TO_PUBLICATION,
+        CHANGE_AFFILIATION_COORD,
+        REMOVE_AFFILIATION,
+        REMOVE_PUBLICATION,
+        CLEAR_ALL
+    };
+
+    // Fields that the kind of event doesn't use are NO_AFFILIATION, NO_PUBLICATION and NO_COORD.
+    struct Event
+    {
+        unsigned long long sequence = 0;
+        Kind kind = Kind::CLEAR_ALL;
+        AffiliationID affiliation = NO_AFFILIATION;
+        PublicationID publication = NO_PUBLICATION;
+        PublicationID parent = NO_PUBLICATION; // Of ADD_REFERENCE.
+        Coord coord = NO_COORD;
+    };
+
+    // Reads events in order from where it was created. Each consumer thread uses its own.
+    class Subscription
+    {
+    public:
+        // Estimate of performance: O(e)
+        // Short rationale for estimate: Each of the e events read is copied from its slot(s).
+        // Appends at most max_events new events to events and returns their number (0 if
+        // there are none yet).
+        std::size_t poll(std::vector<Event>& events, std::size_t max_events = std::numeric_limits<std::size_t>::max());
+
+        // Number of events overwritten before this subscription read them.
+        unsigned long long lost() const { return lost_; }
+
+    private:
+        friend class ChangeFeed;
+        Subscription(ChangeFeed const& feed, std::uint64_t position, unsigned long long next_sequence)
+            : feed_(&feed), position_(position), next_sequence_(next_sequence) {}
+
+        ChangeFeed const* feed_;
+        std::uint64_t position_; // Slot of the next event.
+        unsigned long long next_sequence_;
+        unsigned long long lost_ = 0;
+    };
+
+    // Capacity is the number of slots, rounded up to a power of two (at least 4). Events
+    // with long affiliation ids take several slots, ids longer than max_id_length() are cut.
+    explicit ChangeFeed(std::size_t capacity = DEFAULT_CAPACITY);
+
+    ChangeFeed(ChangeFeed const&) = delete;
+    ChangeFeed& operator=(ChangeFeed const&) = delete;
+
+    std::size_t capacity() const { return mask_ + 1; }
+    std::size_t max_id_length() const { return max_id_length_; }
+    unsigned long long last_sequence() const { return last_sequence_.load(std::memory_order_acquire); }
+
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: The position and sequence number of the newest event
+    // are read (again if it is overwritten at the same time).
+    // Subscription starts from the next event published.
+    Subscription subscribe() const;
+
+    // Estimate of performance: O(k), k being the length of the affiliation id.
+    // Short rationale for estimate: The fields are stored to one slot (more for long ids)
+    // with atomic stores, without locking or waiting for consumers.
+    // Producer only: calls must not run at the same time.
+    void publish_add_affiliation(AffiliationID const& id, Coord xy);
+    void publish_add_publication(PublicationID id);
+    void publish_add_reference(PublicationID id, PublicationID parentid);
+    void publish_add_affiliation_to_publication(AffiliationID const& affiliationid, PublicationID publicationid);
+    void publish_change_affiliation_coord(AffiliationID const& id, Coord newcoord);
+    void publish_remove_affiliation(AffiliationID const& id);
+    void publish_remove_publication(PublicationID id);
+    void publish_clear_all();
+
+    static std::size_t const DEFAULT_CAPACITY = 1 << 16;
+
+private:
+    static std::size_t const SLOT_WORDS = 8;
+    static std::size_t const FIRST_ID_WORDS = 2; // Id bytes in the first slot of an event.
+    static std::size_t const NEXT_ID_WORDS = 5;  // Id bytes in each further slot.
+    static std::size_t const MAX_SLOTS = 256;    // Slots of one event (part number is 8 bits).
+
+    // Words: version, sequence, header (kind, part, parts, id length), then publication,
+    // parent, coordinates and the start of the id in the first slot, or the rest of the id
+    // in the others.
+    struct alignas(64) Slot
+    {
+        std::atomic<std::uint64_t> words[SLOT_WORDS];
+    };
+
+    enum class ReadResult { EVENT, EMPTY, CONTINUATION, OVERWRITTEN };
+
+    void publish(Kind kind, AffiliationID const& affiliation, PublicationID publication,
+                 PublicationID parent, Coord xy);
+    void write_slot(std::uint64_t position, std::uint64_t const (&data)[SLOT_WORDS]);
+    // Reads the event starting at position, parts is set to its number of slots.
+    ReadResult read(std::uint64_t position, Event& event, std::size_t& parts) const;
+
+    std::unique_ptr<Slot[]> slots_;
+    std::size_t mask_;
+    std::size_t max_id_length_;
+
+    alignas(64) std::atomic<std::uint64_t> head_{0}; // Position after the newest event.
+    std::atomic<unsigned long long> last_sequence_{0};
+};
+
+#endif // CHANGEFEED_HH
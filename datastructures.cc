@@ -5,12 +5,20 @@
 // Student number: H252889
 
 #include "datastructures.hh"
+#include "mutationlog.hh"
+#include "changefeed.hh"
+#include "workloadtrace.hh"
+#include "parallelsort.hh"
+#include "parallelwalk.hh"
 
 #include <random>
+#include <algorithm>
+#include <fstream>
+#include <iterator>
 
 #include <cmath>
 #include <map>
-#include <QDebug>
+#include <thread>
 
 std::minstd_rand rand_engine; // Reasonably quick pseudo-random generator
 
@@ -25,6 +33,35 @@ Type random_in_range(Type start, Type end)
     return static_cast<Type>(start+num);
 }
 
+// Items a batch query prefetches ahead of the one it copies.
+std::size_t const BATCH_PREFETCH_DISTANCE = 8;
+
+// Prefetches the item that a batch query reads BATCH_PREFETCH_DISTANCE items later. Results
+// are read in the callers' order, which jumps around the maps.
+template <typename Value>
+void prefetch_ahead(std::vector<Value const*> const& values, std::size_t i)
+{
+#if defined(__GNUC__)
+    if (i + BATCH_PREFETCH_DISTANCE < values.size() && values[i + BATCH_PREFETCH_DISTANCE] != nullptr) {
+        __builtin_prefetch(values[i + BATCH_PREFETCH_DISTANCE]);
+    }
+#else
+    (void)values;
+    (void)i;
+#endif
+}
+
+// Order of staged affiliations and publications: by id, and equal ids in staging order (so
+// that the first of duplicates is kept).
+struct StagedOrder
+{
+    template <typename Staged>
+    bool operator()(Staged const& s1, Staged const& s2) const
+    {
+        return (s1.id < s2.id) || (s1.id == s2.id && s1.order < s2.order);
+    }
+};
+
 // Modify the code below to implement the functionality of the class.
 // Also remove comments from the parameter names when you implement
 // an operation (Commenting out parameter name prevents compiler from
@@ -41,39 +78,80 @@ Datastructures::Datastructures()
 Datastructures::~Datastructures()
 {
     // Write any cleanup you need here
+    free_snapshots();
 }
 
 unsigned int Datastructures::get_affiliation_count()
 {
+    if (concurrency_ == Concurrency::SNAPSHOT) {
+        if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::GET_AFFILIATION_COUNT); }
+        return SnapshotReader(*this)->get_affiliation_count();
+    }
+    OperationLock lock(*this, false);
+    if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::GET_AFFILIATION_COUNT); }
     // O(1).
     return affiliationsMap_.size();
 }
 
 void Datastructures::clear_all()
+{
+    OperationLock lock(*this, true);
+    if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::CLEAR_ALL); }
+    clear_data();
+    lock.changed([](Datastructures& copy) { copy.clear_all(); });
+    if (mutation_log_) { mutation_log_->log_clear_all(); }
+    if (change_feed_) { auto feed = lock_feed(); change_feed_->publish_clear_all(); }
+}
+
+void Datastructures::clear_data()
 {
     affiliationsMap_.clear();
     publicationsMap_.clear();
+    stagedAffiliations_.clear();
+    stagedPublications_.clear();
+    stagedReferences_.clear();
+    stagedConnections_.clear();
+    ++generation_;
     changedNames_ = true;
     changedCoordinates_ = true;
 }
 
 std::vector<AffiliationID> Datastructures::get_all_affiliations()
 {
+    if (concurrency_ == Concurrency::SNAPSHOT) {
+        if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::GET_ALL_AFFILIATIONS); }
+        return SnapshotReader(*this)->get_all_affiliations();
+    }
+    OperationLock lock(*this, false);
+    if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::GET_ALL_AFFILIATIONS); }
     std::vector<AffiliationID> aff_vector;
     aff_vector.reserve(affiliationsMap_.size()); //.size is constant. Reserve linear.
     auto iter_end = affiliationsMap_.end();
-    for (auto iter = affiliationsMap_.begin(); iter != iter_end; iter++) { // O(n)
+    for (auto iter = affiliationsMap_.begin(); iter != iter_end; ++iter) { // O(n)
         aff_vector.push_back(iter->first); // Amortized constant.
     }
     return aff_vector;
 }
 
 bool Datastructures::add_affiliation(AffiliationID id, const Name &name, Coord xy)
-{    
+{
+    OperationLock lock(*this, true, &id, nullptr);
+    if (workload_trace_) { workload_trace_->record_add_affiliation(id, name, xy); }
+    if (bulk_) {
+        auto staging = lock_staging();
+        // Duplicates are found in commit.
+        stagedAffiliations_.push_back({id, name, xy, stagedAffiliations_.size(), nullptr}); // Amortized constant.
+        if (mutation_log_) { mutation_log_->log_add_affiliation(id, name, xy); }
+        return true;
+    }
+
     bool succeeded = affiliationsMap_.insert({id, Affiliation(name, xy)}).second; // worst case O(log(n)).
     if (succeeded) {
         changedCoordinates_ = true;
         changedNames_ = true;
+        lock.changed([id, name, xy](Datastructures& copy) { copy.add_affiliation(id, name, xy); });
+        if (mutation_log_) { mutation_log_->log_add_affiliation(id, name, xy); }
+        if (change_feed_) { auto feed = lock_feed(); change_feed_->publish_add_affiliation(id, xy); }
     }
     return succeeded;
 
@@ -81,6 +159,12 @@ bool Datastructures::add_affiliation(AffiliationID id, const Name &name, Coord x
 
 Name Datastructures::get_affiliation_name(AffiliationID id)
 {
+    if (concurrency_ == Concurrency::SNAPSHOT) {
+        if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::GET_AFFILIATION_NAME, id); }
+        return SnapshotReader(*this)->get_affiliation_name(id);
+    }
+    OperationLock lock(*this, false, &id, nullptr);
+    if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::GET_AFFILIATION_NAME, id); }
     auto iter = affiliationsMap_.find(id); // Logarithmic
     if (iter == affiliationsMap_.end()) {
         return NO_NAME;
@@ -92,6 +176,12 @@ Name Datastructures::get_affiliation_name(AffiliationID id)
 
 Coord Datastructures::get_affiliation_coord(AffiliationID id)
 {
+    if (concurrency_ == Concurrency::SNAPSHOT) {
+        if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::GET_AFFILIATION_COORD, id); }
+        return SnapshotReader(*this)->get_affiliation_coord(id);
+    }
+    OperationLock lock(*this, false, &id, nullptr);
+    if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::GET_AFFILIATION_COORD, id); }
     auto iter = affiliationsMap_.find(id);
     if (iter == affiliationsMap_.end()) {
         return NO_COORD;
@@ -103,11 +193,30 @@ Coord Datastructures::get_affiliation_coord(AffiliationID id)
 
 std::vector<AffiliationID> Datastructures::get_affiliations_alphabetically()
 {
+    if (concurrency_ == Concurrency::SNAPSHOT) {
+        if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::GET_AFFILIATIONS_ALPHABETICALLY); }
+        SnapshotReader reader(*this);
+        return reader.listing(&SnapshotCopy::by_name, [&reader] { return reader->affiliations_by_name(); });
+    }
+    OperationLock lock(*this, false);
+    if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::GET_AFFILIATIONS_ALPHABETICALLY); }
     // If no changes have been made, then can return already once saved sorted vector.
-    if (!changedNames_) {
+    if (!changedNames_.load(std::memory_order_acquire)) {
         return sortedNameVector_;
     }
+    // Other queries may be running at the same time, only one of them rebuilds the vector.
+    std::lock_guard<std::mutex> rebuild(cache_mutex_);
+    if (!changedNames_.load(std::memory_order_relaxed)) {
+        return sortedNameVector_;
+    }
+    sortedNameVector_ = affiliations_by_name(); // Saving to if needed later.
+    changedNames_.store(false, std::memory_order_release);
+    return sortedNameVector_;
+}
 
+// Private function for sorting the affiliations by name.
+std::vector<AffiliationID> Datastructures::affiliations_by_name() const
+{
     std::vector<AffiliationID> aff_vector;
     std::vector<std::pair<AffiliationID, Name>> pair_vector;
     int size = affiliationsMap_.size(); // Constant.
@@ -115,11 +224,11 @@ std::vector<AffiliationID> Datastructures::get_affiliations_alphabetically()
     pair_vector.reserve(size); // Linear. Reserves vector space for affiliations.
 
     auto iter_end = affiliationsMap_.end();
-    for (auto iter = affiliationsMap_.begin(); iter != iter_end; iter++) { // O(n)
+    for (auto iter = affiliationsMap_.begin(); iter != iter_end; ++iter) { // O(n)
         pair_vector.push_back({iter->first, iter->second.name}); // Amortized constant.
     }
 
-    std::sort(pair_vector.begin(), pair_vector.end(), [](auto p1, auto p2) { // O(N*logN)
+    sort_listing(pair_vector, [](auto const& p1, auto const& p2) { // O(N*logN)
         return p1.second < p2.second;
     });
 
@@ -127,18 +236,34 @@ std::vector<AffiliationID> Datastructures::get_affiliations_alphabetically()
     for (auto iter = pair_vector.begin(); iter != pair_end; iter++) { // O(n)
         aff_vector.push_back(iter->first); // Amortized constant.
     }
-    sortedNameVector_ = aff_vector; // Saving to if needed later.
-    changedNames_ = false;
     return aff_vector;
 }
 
 std::vector<AffiliationID> Datastructures::get_affiliations_distance_increasing()
 {
+    if (concurrency_ == Concurrency::SNAPSHOT) {
+        if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::GET_AFFILIATIONS_DISTANCE_INCREASING); }
+        SnapshotReader reader(*this);
+        return reader.listing(&SnapshotCopy::by_distance, [&reader] { return reader->affiliations_by_distance(); });
+    }
+    OperationLock lock(*this, false);
+    if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::GET_AFFILIATIONS_DISTANCE_INCREASING); }
     // If no changes have been made, then can return once already sorted vector.
-    if (!changedCoordinates_) {
+    if (!changedCoordinates_.load(std::memory_order_acquire)) {
+        return sortedCoordVector_;
+    }
+    std::lock_guard<std::mutex> rebuild(cache_mutex_);
+    if (!changedCoordinates_.load(std::memory_order_relaxed)) {
         return sortedCoordVector_;
     }
+    sortedCoordVector_ = affiliations_by_distance();
+    changedCoordinates_.store(false, std::memory_order_release);
+    return sortedCoordVector_;
+}
 
+// Private function for sorting the affiliations by distance from (0,0).
+std::vector<AffiliationID> Datastructures::affiliations_by_distance() const
+{
     std::vector<AffiliationID> aff_vector;
     std::vector<std::pair<AffiliationID, Coord>> pair_vector;
     auto size = affiliationsMap_.size();
@@ -146,11 +271,11 @@ std::vector<AffiliationID> Datastructures::get_affiliations_distance_increasing(
     pair_vector.reserve(size); // O(n), reserve is linear. Reserves vector space for affiliations.
 
     auto iter_end = affiliationsMap_.end();
-    for (auto iter = affiliationsMap_.begin(); iter != iter_end; iter++) { // O(n)
+    for (auto iter = affiliationsMap_.begin(); iter != iter_end; ++iter) { // O(n)
         pair_vector.push_back({iter->first, iter->second.coordinates}); // Amortized constant.
     }
 
-    std::sort(pair_vector.begin(), pair_vector.end(), [](auto p1, auto p2) { // O(N*logN)
+    sort_listing(pair_vector, [](auto const& p1, auto const& p2) { // O(N*logN)
         double distance1 = sqrt(pow(p1.second.x,2) + pow(p1.second.y,2));
         double distance2 = sqrt(pow(p2.second.x,2) + pow(p2.second.y,2));
         if (distance1 < distance2) {
@@ -168,13 +293,17 @@ std::vector<AffiliationID> Datastructures::get_affiliations_distance_increasing(
     for (auto iter = pair_vector.begin(); iter != pair_end; iter++) { // O(n)
         aff_vector.push_back(iter->first); // Amortized constant.
     }
-    sortedCoordVector_ = aff_vector;
-    changedCoordinates_ = false;
     return aff_vector;
 }
 
 AffiliationID Datastructures::find_affiliation_with_coord(Coord xy)
 {
+    if (concurrency_ == Concurrency::SNAPSHOT) {
+        if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::FIND_AFFILIATION_WITH_COORD, xy); }
+        return SnapshotReader(*this)->find_affiliation_with_coord(xy);
+    }
+    OperationLock lock(*this, false);
+    if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::FIND_AFFILIATION_WITH_COORD, xy); }
     auto iter = std::find_if(affiliationsMap_.begin(), affiliationsMap_.end(), [&xy](auto p) // O(n)
     {return p.second.coordinates == xy;}); // lineaarinen N
 
@@ -183,10 +312,19 @@ AffiliationID Datastructures::find_affiliation_with_coord(Coord xy)
 
 bool Datastructures::change_affiliation_coord(AffiliationID id, Coord newcoord)
 {
+    OperationLock lock(*this, true, &id, nullptr);
+    if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::CHANGE_AFFILIATION_COORD, id, newcoord); }
+    if (bulk_) {
+        lock.lock_all(); // Commit touches everything.
+        commit_staged();
+    }
     auto iter = affiliationsMap_.find(id); // O(log(n))
     if (iter != affiliationsMap_.end()) {
         iter->second.coordinates = newcoord;
         changedCoordinates_ = true;
+        lock.changed([id, newcoord](Datastructures& copy) { copy.change_affiliation_coord(id, newcoord); });
+        if (mutation_log_) { mutation_log_->log_change_affiliation_coord(id, newcoord); }
+        if (change_feed_) { auto feed = lock_feed(); change_feed_->publish_change_affiliation_coord(id, newcoord); }
         return true;
     }
     else {
@@ -196,15 +334,36 @@ bool Datastructures::change_affiliation_coord(AffiliationID id, Coord newcoord)
 
 bool Datastructures::add_publication(PublicationID id, const Name &name, Year year, const std::vector<AffiliationID> &affiliations)
 {
-    return publicationsMap_.insert({id, Node(id, name, year, affiliations)}).second; // Logarithmic but passing a vector so O(n).
+    OperationLock lock(*this, true, nullptr, &id);
+    if (workload_trace_) { workload_trace_->record_add_publication(id, name, year, affiliations); }
+    if (bulk_) {
+        auto staging = lock_staging();
+        stagedPublications_.push_back({id, name, year, affiliations, stagedPublications_.size(), nullptr});
+        if (mutation_log_) { mutation_log_->log_add_publication(id, name, year, affiliations); }
+        return true;
+    }
+
+    bool succeeded = publicationsMap_.insert({id, Node(id, name, year, affiliations)}).second; // Logarithmic but passing a vector so O(n).
+    if (succeeded) {
+        lock.changed([id, name, year, affiliations](Datastructures& copy) { copy.add_publication(id, name, year, affiliations); });
+        if (mutation_log_) { mutation_log_->log_add_publication(id, name, year, affiliations); }
+        if (change_feed_) { auto feed = lock_feed(); change_feed_->publish_add_publication(id); }
+    }
+    return succeeded;
 }
 
 std::vector<PublicationID> Datastructures::all_publications()
 {
+    if (concurrency_ == Concurrency::SNAPSHOT) {
+        if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::ALL_PUBLICATIONS); }
+        return SnapshotReader(*this)->all_publications();
+    }
+    OperationLock lock(*this, false);
+    if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::ALL_PUBLICATIONS); }
     std::vector<PublicationID> pub_vector;
     pub_vector.reserve(publicationsMap_.size()); // Linear
     auto iter_end = publicationsMap_.end();
-    for (auto iter = publicationsMap_.begin(); iter != iter_end; iter++) { // O(n)
+    for (auto iter = publicationsMap_.begin(); iter != iter_end; ++iter) { // O(n)
         pub_vector.push_back(iter->first); // Amortized constant.
     }
     return pub_vector;
@@ -212,6 +371,12 @@ std::vector<PublicationID> Datastructures::all_publications()
 
 Name Datastructures::get_publication_name(PublicationID id)
 {
+    if (concurrency_ == Concurrency::SNAPSHOT) {
+        if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::GET_PUBLICATION_NAME, id); }
+        return SnapshotReader(*this)->get_publication_name(id);
+    }
+    OperationLock lock(*this, false, nullptr, &id);
+    if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::GET_PUBLICATION_NAME, id); }
     auto iter = publicationsMap_.find(id); // Logarithmic.
     if (iter != publicationsMap_.end()) {
         return iter->second.name;
@@ -223,6 +388,12 @@ Name Datastructures::get_publication_name(PublicationID id)
 
 Year Datastructures::get_publication_year(PublicationID id)
 {
+    if (concurrency_ == Concurrency::SNAPSHOT) {
+        if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::GET_PUBLICATION_YEAR, id); }
+        return SnapshotReader(*this)->get_publication_year(id);
+    }
+    OperationLock lock(*this, false, nullptr, &id);
+    if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::GET_PUBLICATION_YEAR, id); }
     auto iter = publicationsMap_.find(id); // Logarithmic.
     if (iter != publicationsMap_.end()) {
         return iter->second.year;
@@ -234,6 +405,12 @@ Year Datastructures::get_publication_year(PublicationID id)
 
 std::vector<AffiliationID> Datastructures::get_affiliations(PublicationID id)
 {
+    if (concurrency_ == Concurrency::SNAPSHOT) {
+        if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::GET_AFFILIATIONS, id); }
+        return SnapshotReader(*this)->get_affiliations(id);
+    }
+    OperationLock lock(*this, false, nullptr, &id);
+    if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::GET_AFFILIATIONS, id); }
     auto iter = publicationsMap_.find(id); // Logarithmic.
     if (iter != publicationsMap_.end()) {
         return iter->second.affiliations; // O(n)
@@ -245,13 +422,25 @@ std::vector<AffiliationID> Datastructures::get_affiliations(PublicationID id)
 
 bool Datastructures::add_reference(PublicationID id, PublicationID parentid)
 {
+    OperationLock lock(*this, true, nullptr, &id, &parentid);
+    if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::ADD_REFERENCE, id, parentid); }
+    if (bulk_) {
+        auto staging = lock_staging();
+        stagedReferences_.push_back({id, parentid, stagedPublications_.size()}); // Resolved in commit.
+        if (mutation_log_) { mutation_log_->log_add_reference(id, parentid); }
+        return true;
+    }
+
     auto iter1 = publicationsMap_.find(id); // logarithmic.
     auto iter2 = publicationsMap_.find(parentid); // logarithmic.
     auto iter_end = publicationsMap_.end();
 
     if (iter1 != iter_end && iter2 != iter_end) {
-        iter2->second.referencing.push_back(std::make_shared<Node>(iter1->second)); // Adding to referencing list.
+        iter2->second.referencing.push_back(&(iter1->second)); // Adding to referencing list.
         iter1->second.parent = &(iter2->second); // Adding parent to the publication which has been referenced by.
+        lock.changed([id, parentid](Datastructures& copy) { copy.add_reference(id, parentid); });
+        if (mutation_log_) { mutation_log_->log_add_reference(id, parentid); }
+        if (change_feed_) { auto feed = lock_feed(); change_feed_->publish_add_reference(id, parentid); }
         return true;
     }
     else {
@@ -261,6 +450,12 @@ bool Datastructures::add_reference(PublicationID id, PublicationID parentid)
 
 std::vector<PublicationID> Datastructures::get_direct_references(PublicationID id)
 {
+    if (concurrency_ == Concurrency::SNAPSHOT) {
+        if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::GET_DIRECT_REFERENCES, id); }
+        return SnapshotReader(*this)->get_direct_references(id);
+    }
+    OperationLock lock(*this, false, nullptr, &id);
+    if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::GET_DIRECT_REFERENCES, id); }
     auto iter = publicationsMap_.find(id); // logarithmic.
     if (iter != publicationsMap_.end()) {
         std::vector<PublicationID> pub_vector;
@@ -277,12 +472,26 @@ std::vector<PublicationID> Datastructures::get_direct_references(PublicationID i
 
 bool Datastructures::add_affiliation_to_publication(AffiliationID affiliationid, PublicationID publicationid)
 {
+    OperationLock lock(*this, true, &affiliationid, &publicationid);
+    if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::ADD_AFFILIATION_TO_PUBLICATION, affiliationid, publicationid); }
+    if (bulk_) {
+        auto staging = lock_staging();
+        stagedConnections_.push_back({affiliationid, publicationid, stagedAffiliations_.size(), stagedPublications_.size()});
+        if (mutation_log_) { mutation_log_->log_add_affiliation_to_publication(affiliationid, publicationid); }
+        return true;
+    }
+
     auto iter_pub = publicationsMap_.find(publicationid);
     auto iter_aff = affiliationsMap_.find(affiliationid);
 
     if (iter_pub != publicationsMap_.end() && iter_aff != affiliationsMap_.end()) {
         iter_pub->second.affiliations.push_back(affiliationid); // Adding affiliation to publication's list.
         iter_aff->second.publications.push_back(publicationid); // Adding publication to affiliation's list.
+        lock.changed([affiliationid, publicationid](Datastructures& copy) {
+            copy.add_affiliation_to_publication(affiliationid, publicationid);
+        });
+        if (mutation_log_) { mutation_log_->log_add_affiliation_to_publication(affiliationid, publicationid); }
+        if (change_feed_) { auto feed = lock_feed(); change_feed_->publish_add_affiliation_to_publication(affiliationid, publicationid); }
         return true;
     }
     else {
@@ -292,6 +501,12 @@ bool Datastructures::add_affiliation_to_publication(AffiliationID affiliationid,
 
 std::vector<PublicationID> Datastructures::get_publications(AffiliationID id)
 {
+    if (concurrency_ == Concurrency::SNAPSHOT) {
+        if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::GET_PUBLICATIONS, id); }
+        return SnapshotReader(*this)->get_publications(id);
+    }
+    OperationLock lock(*this, false, &id, nullptr);
+    if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::GET_PUBLICATIONS, id); }
     auto iter = affiliationsMap_.find(id);
     if (iter != affiliationsMap_.end()) {
         return iter->second.publications;
@@ -303,6 +518,12 @@ std::vector<PublicationID> Datastructures::get_publications(AffiliationID id)
 
 PublicationID Datastructures::get_parent(PublicationID id)
 {
+    if (concurrency_ == Concurrency::SNAPSHOT) {
+        if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::GET_PARENT, id); }
+        return SnapshotReader(*this)->get_parent(id);
+    }
+    OperationLock lock(*this, false, nullptr, &id);
+    if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::GET_PARENT, id); }
     auto iter = publicationsMap_.find(id);
     if (iter != publicationsMap_.end()) {
         return (iter->second.parent != nullptr) ? iter->second.parent->id : NO_PUBLICATION; // when no parent.
@@ -314,6 +535,12 @@ PublicationID Datastructures::get_parent(PublicationID id)
 
 std::vector<std::pair<Year, PublicationID> > Datastructures::get_publications_after(AffiliationID affiliationid, Year year)
 {
+    if (concurrency_ == Concurrency::SNAPSHOT) {
+        if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::GET_PUBLICATIONS_AFTER, affiliationid, year); }
+        return SnapshotReader(*this)->get_publications_after(affiliationid, year);
+    }
+    OperationLock lock(*this, false);
+    if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::GET_PUBLICATIONS_AFTER, affiliationid, year); }
     // equal_range possible to use?
 
     auto iter = affiliationsMap_.find(affiliationid); // O(log(n))
@@ -332,7 +559,7 @@ std::vector<std::pair<Year, PublicationID> > Datastructures::get_publications_af
         }
 
         // Sorting the vector lastly.
-        std::sort(vec.begin(), vec.end(), [](auto p1, auto p2) { // O(n*log(n))
+        sort_listing(vec, [](auto p1, auto p2) { // O(n*log(n))
             if (p1.first < p2.first) {
                 return true;
             }
@@ -352,6 +579,17 @@ std::vector<std::pair<Year, PublicationID> > Datastructures::get_publications_af
 }
 
 std::vector<PublicationID> Datastructures::get_referenced_by_chain(PublicationID id)
+{
+    if (concurrency_ == Concurrency::SNAPSHOT) {
+        if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::GET_REFERENCED_BY_CHAIN, id); }
+        return SnapshotReader(*this)->get_referenced_by_chain(id);
+    }
+    OperationLock lock(*this, false);
+    if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::GET_REFERENCED_BY_CHAIN, id); }
+    return referenced_by_chain(id);
+}
+
+std::vector<PublicationID> Datastructures::referenced_by_chain(PublicationID id)
 {
     auto iter = publicationsMap_.find(id); // O(log(n))
     if (iter == publicationsMap_.end()) {
@@ -369,33 +607,42 @@ std::vector<PublicationID> Datastructures::get_referenced_by_chain(PublicationID
     }
 }
 
-// Not working!
 std::vector<PublicationID> Datastructures::get_all_references(PublicationID id)
 {
-    auto iter = publicationsMap_.find(id);
-    if (iter != publicationsMap_.end()) {
-        if (iter->second.referencing.empty()) {
-            return std::vector<PublicationID>();
-        }
-
-        std::vector<PublicationID> all_references;
-        //return iterate_references(all_references, iter->second.referencing);
-        return no_publications_vector_;
+    if (concurrency_ == Concurrency::SNAPSHOT) {
+        if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::GET_ALL_REFERENCES, id); }
+        return SnapshotReader(*this)->get_all_references(id);
     }
-    else {
-        return no_publications_vector_;
+    OperationLock lock(*this, false);
+    if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::GET_ALL_REFERENCES, id); }
+    auto iter = publicationsMap_.find(id); // O(log(n))
+    if (iter == publicationsMap_.end()) {
+        return {NO_PUBLICATION};
     }
+
+    // Same order as all_references_cursor(), also when walked in parallel.
+    auto children = [](Node const* node) -> std::vector<Node*> const& { return node->referencing; };
+    auto publication = [](Node const* node) { return node->id; };
+    ParallelWalk<Node, PublicationID, decltype(children), decltype(publication)> walk(
+        children, publication, worker_threads(traversal_threads_), traversal_min_items_);
+    return walk.run(&(iter->second)); // O(n/t + t)
 }
 
 std::vector<AffiliationID> Datastructures::get_affiliations_closest_to(Coord xy)
 {
+    if (concurrency_ == Concurrency::SNAPSHOT) {
+        if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::GET_AFFILIATIONS_CLOSEST_TO, xy); }
+        return SnapshotReader(*this)->get_affiliations_closest_to(xy);
+    }
+    OperationLock lock(*this, false);
+    if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::GET_AFFILIATIONS_CLOSEST_TO, xy); }
     if (affiliationsMap_.empty()) {
         return std::vector<AffiliationID>();
     }
 
     std::vector<std::pair<AffiliationID, Coord>> pair_vector;
     auto iter_end = affiliationsMap_.end();
-    for (auto iter = affiliationsMap_.begin(); iter != iter_end; iter++) { // O(n)
+    for (auto iter = affiliationsMap_.begin(); iter != iter_end; ++iter) { // O(n)
         pair_vector.push_back({iter->first,iter->second.coordinates}); // Average O(1)
     }
 
@@ -427,14 +674,18 @@ std::vector<AffiliationID> Datastructures::get_affiliations_closest_to(Coord xy)
 
 bool Datastructures::remove_affiliation(AffiliationID id)
 {
+    OperationLock lock(*this, true);
+    if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::REMOVE_AFFILIATION, id); }
+    commit_staged();
     auto iter = affiliationsMap_.find(id); // O(log(n)
     if (iter == affiliationsMap_.end()) {
         return false;
     }
 
     affiliationsMap_.erase(iter); // Amortized constant
+    ++generation_;
 
-    for (auto i = publicationsMap_.begin(); i != publicationsMap_.end(); i++) { // O(n)
+    for (auto i = publicationsMap_.begin(); i != publicationsMap_.end(); ++i) { // O(n)
         auto vec = i->second.affiliations;
         auto aff_iter = std::remove_if(vec.begin(), vec.end(), [&id](auto item) { // O(n)
             return item == id;
@@ -446,11 +697,20 @@ bool Datastructures::remove_affiliation(AffiliationID id)
     }
     changedNames_ = true;
     changedCoordinates_ = true;
+    lock.changed([id](Datastructures& copy) { copy.remove_affiliation(id); });
+    if (mutation_log_) { mutation_log_->log_remove_affiliation(id); }
+    if (change_feed_) { auto feed = lock_feed(); change_feed_->publish_remove_affiliation(id); }
     return true;
 }
 
 PublicationID Datastructures::get_closest_common_parent(PublicationID id1, PublicationID id2)
 {
+    if (concurrency_ == Concurrency::SNAPSHOT) {
+        if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::GET_CLOSEST_COMMON_PARENT, id1, id2); }
+        return SnapshotReader(*this)->get_closest_common_parent(id1, id2);
+    }
+    OperationLock lock(*this, false);
+    if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::GET_CLOSEST_COMMON_PARENT, id1, id2); }
     auto iter1 = publicationsMap_.find(id1); // O(log(n))
     auto iter2 = publicationsMap_.find(id2);
     auto iter_end = publicationsMap_.end();
@@ -460,8 +720,8 @@ PublicationID Datastructures::get_closest_common_parent(PublicationID id1, Publi
 
     std::vector<PublicationID> parents1_vec;
     std::vector<PublicationID> parents2_vec;
-    parents1_vec = get_referenced_by_chain(id1); // O(n)
-    parents2_vec = get_referenced_by_chain(id2);
+    parents1_vec = referenced_by_chain(id1); // O(n)
+    parents2_vec = referenced_by_chain(id2);
 
     if (parents1_vec.empty() || parents2_vec.empty()) {
         return NO_PUBLICATION;
@@ -483,12 +743,15 @@ PublicationID Datastructures::get_closest_common_parent(PublicationID id1, Publi
 
 bool Datastructures::remove_publication(PublicationID publicationid)
 {
+    OperationLock lock(*this, true);
+    if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::REMOVE_PUBLICATION, publicationid); }
+    commit_staged();
     auto iter = publicationsMap_.find(publicationid);
     if (iter == publicationsMap_.end()) {
         return false;
     }
 
-    for (auto it = publicationsMap_.begin(); it != publicationsMap_.end(); it++) {
+    for (auto it = publicationsMap_.begin(); it != publicationsMap_.end(); ++it) {
         if ((it->second.parent != nullptr) && (it->second.parent->id == publicationid)) {
             it->second.parent = nullptr;
         }
@@ -505,8 +768,9 @@ bool Datastructures::remove_publication(PublicationID publicationid)
     }
 
     publicationsMap_.erase(iter);
+    ++generation_;
 
-    for (auto i = affiliationsMap_.begin(); i != affiliationsMap_.end(); i++) {
+    for (auto i = affiliationsMap_.begin(); i != affiliationsMap_.end(); ++i) {
         auto vec = i->second.publications;
         auto pub_iter = std::remove_if(vec.begin(), vec.end(), [&publicationid](auto item) {
             return item == publicationid;
@@ -520,19 +784,1217 @@ bool Datastructures::remove_publication(PublicationID publicationid)
 
     changedNames_ = true;
     changedCoordinates_ = true;
+    lock.changed([publicationid](Datastructures& copy) { copy.remove_publication(publicationid); });
+    if (mutation_log_) { mutation_log_->log_remove_publication(publicationid); }
+    if (change_feed_) { auto feed = lock_feed(); change_feed_->publish_remove_publication(publicationid); }
     return true;
 }
 
-// Private function for iterating through tree structure parents. Recursive function.
-// Recursive until no more parents and there can be n-1 parents maximum.
-std::vector<PublicationID> Datastructures::iterate_parents(std::vector<PublicationID>& vec, Node* parent) {
-    if (parent != nullptr) {
-        vec.push_back(parent->id);
-        return iterate_parents(vec, parent->parent);
+Datastructures::Cursor Datastructures::all_affiliations_cursor()
+{
+    OperationLock lock(*this, false);
+    return Cursor(Cursor::Kind::ALL_AFFILIATIONS, generation_);
+}
+
+Datastructures::Cursor Datastructures::all_publications_cursor()
+{
+    OperationLock lock(*this, false);
+    return Cursor(Cursor::Kind::ALL_PUBLICATIONS, generation_);
+}
+
+Datastructures::Cursor Datastructures::publications_cursor(AffiliationID id)
+{
+    OperationLock lock(*this, false);
+    Cursor cursor(Cursor::Kind::PUBLICATIONS, generation_);
+    cursor.affiliation_ = id;
+    return cursor;
+}
+
+Datastructures::Cursor Datastructures::all_references_cursor(PublicationID id)
+{
+    OperationLock lock(*this, false);
+    Cursor cursor(Cursor::Kind::ALL_REFERENCES, generation_);
+    cursor.publication_ = id;
+    return cursor;
+}
+
+bool Datastructures::next_page(Cursor& cursor, std::vector<AffiliationID>& page, std::size_t page_size)
+{
+    OperationLock lock(*this, false);
+    page.clear();
+    if (cursor.done_ || cursor.generation_ != generation_ || cursor.kind_ != Cursor::Kind::ALL_AFFILIATIONS) {
+        cursor.done_ = true;
+        return false;
+    }
+
+    // Continuing after the last returned id, so the cursor survives insertions.
+    auto iter = cursor.started_ ? affiliationsMap_.upper_bound(cursor.affiliation_) : affiliationsMap_.begin(); // O(log(n))
+    cursor.started_ = true;
+    auto iter_end = affiliationsMap_.end();
+    for (; iter != iter_end && page.size() < page_size; ++iter) { // O(k)
+        page.push_back(iter->first);
+    }
+
+    if (page.empty()) {
+        cursor.done_ = true;
+        return false;
+    }
+    cursor.affiliation_ = page.back();
+    return true;
+}
+
+bool Datastructures::next_page(Cursor& cursor, std::vector<PublicationID>& page, std::size_t page_size)
+{
+    OperationLock lock(*this, false);
+    return fill_page(cursor, page, page_size);
+}
+
+bool Datastructures::fill_page(Cursor& cursor, std::vector<PublicationID>& page, std::size_t page_size)
+{
+    page.clear();
+    if (cursor.done_ || cursor.generation_ != generation_ || cursor.kind_ == Cursor::Kind::ALL_AFFILIATIONS) {
+        cursor.done_ = true;
+        return false;
+    }
+
+    switch (cursor.kind_) {
+    case Cursor::Kind::ALL_PUBLICATIONS: {
+        auto iter = cursor.started_ ? publicationsMap_.upper_bound(cursor.publication_) : publicationsMap_.begin(); // O(log(n))
+        auto iter_end = publicationsMap_.end();
+        for (; iter != iter_end && page.size() < page_size; ++iter) { // O(k)
+            page.push_back(iter->first);
+        }
+        if (!page.empty()) { cursor.publication_ = page.back(); }
+        break;
+    }
+    case Cursor::Kind::PUBLICATIONS: {
+        auto iter = affiliationsMap_.find(cursor.affiliation_); // O(log(n))
+        if (iter == affiliationsMap_.end()) {
+            // Same as get_publications() for a missing affiliation.
+            if (!cursor.started_) { page.push_back(NO_PUBLICATION); }
+            break;
+        }
+        auto const& publications = iter->second.publications;
+        auto count = std::min(page_size, publications.size() - std::min(cursor.offset_, publications.size()));
+        page.insert(page.end(), publications.begin() + cursor.offset_, publications.begin() + cursor.offset_ + count); // O(k)
+        cursor.offset_ += count;
+        break;
+    }
+    case Cursor::Kind::ALL_REFERENCES: {
+        if (!cursor.started_) {
+            auto iter = publicationsMap_.find(cursor.publication_); // O(log(n))
+            if (iter == publicationsMap_.end()) {
+                page.push_back(NO_PUBLICATION);
+                break;
+            }
+            cursor.stack_.push_back({&(iter->second), 0});
+        }
+        // Depth first with an explicit stack, so deep chains don't overflow the call stack.
+        while (!cursor.stack_.empty() && page.size() < page_size) { // O(k)
+            auto& [node, next] = cursor.stack_.back();
+            if (next < node->referencing.size()) {
+                Node const* child = node->referencing[next++];
+                page.push_back(child->id);
+                cursor.stack_.push_back({child, 0});
+            }
+            else {
+                cursor.stack_.pop_back();
+            }
+        }
+        break;
+    }
+    default:
+        break;
+    }
+
+    cursor.started_ = true;
+    if (page.empty()) {
+        cursor.done_ = true;
+        std::vector<std::pair<Node const*, std::size_t>>().swap(cursor.stack_);
+        return false;
+    }
+    return true;
+}
+
+std::vector<Name> Datastructures::get_publication_names(std::vector<PublicationID> const& ids)
+{
+    if (concurrency_ == Concurrency::SNAPSHOT) {
+        if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::GET_PUBLICATION_NAMES, ids); }
+        return SnapshotReader(*this)->get_publication_names(ids);
+    }
+    OperationLock lock(*this, false);
+    if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::GET_PUBLICATION_NAMES, ids); }
+    auto nodes = publicationsMap_.find_many(ids); // O(m*log(m) + m*log(n))
+    std::vector<Name> names;
+    names.reserve(ids.size());
+    for (std::size_t i = 0; i < nodes.size(); ++i) { // O(m)
+        prefetch_ahead(nodes, i);
+        names.push_back((nodes[i] != nullptr) ? nodes[i]->name : NO_NAME);
+    }
+    return names;
+}
+
+std::vector<Year> Datastructures::get_publication_years(std::vector<PublicationID> const& ids)
+{
+    if (concurrency_ == Concurrency::SNAPSHOT) {
+        if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::GET_PUBLICATION_YEARS, ids); }
+        return SnapshotReader(*this)->get_publication_years(ids);
+    }
+    OperationLock lock(*this, false);
+    if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::GET_PUBLICATION_YEARS, ids); }
+    auto nodes = publicationsMap_.find_many(ids); // O(m*log(m) + m*log(n))
+    std::vector<Year> years;
+    years.reserve(ids.size());
+    for (std::size_t i = 0; i < nodes.size(); ++i) { // O(m)
+        prefetch_ahead(nodes, i);
+        years.push_back((nodes[i] != nullptr) ? nodes[i]->year : NO_YEAR);
+    }
+    return years;
+}
+
+std::vector<PublicationID> Datastructures::get_parents(std::vector<PublicationID> const& ids)
+{
+    if (concurrency_ == Concurrency::SNAPSHOT) {
+        if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::GET_PARENTS, ids); }
+        return SnapshotReader(*this)->get_parents(ids);
+    }
+    OperationLock lock(*this, false);
+    if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::GET_PARENTS, ids); }
+    auto nodes = publicationsMap_.find_many(ids); // O(m*log(m) + m*log(n))
+    std::vector<PublicationID> parents;
+    parents.reserve(ids.size());
+    for (std::size_t i = 0; i < nodes.size(); ++i) { // O(m)
+        prefetch_ahead(nodes, i);
+        parents.push_back((nodes[i] != nullptr && nodes[i]->parent != nullptr) ? nodes[i]->parent->id : NO_PUBLICATION);
+    }
+    return parents;
+}
+
+std::vector<Datastructures::PublicationInfo> Datastructures::get_publications_info(std::vector<PublicationID> const& ids)
+{
+    if (concurrency_ == Concurrency::SNAPSHOT) {
+        if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::GET_PUBLICATIONS_INFO, ids); }
+        return SnapshotReader(*this)->get_publications_info(ids);
+    }
+    OperationLock lock(*this, false);
+    if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::GET_PUBLICATIONS_INFO, ids); }
+    auto nodes = publicationsMap_.find_many(ids); // O(m*log(m) + m*log(n))
+    std::vector<PublicationInfo> infos;
+    infos.reserve(ids.size());
+    for (std::size_t i = 0; i < nodes.size(); ++i) { // O(m)
+        prefetch_ahead(nodes, i);
+        if (nodes[i] != nullptr) {
+            infos.push_back({nodes[i]->name, nodes[i]->year, (nodes[i]->parent != nullptr) ? nodes[i]->parent->id : NO_PUBLICATION});
+        }
+        else {
+            infos.push_back({NO_NAME, NO_YEAR, NO_PUBLICATION});
+        }
+    }
+    return infos;
+}
+
+std::vector<Coord> Datastructures::get_affiliation_coords(std::vector<AffiliationID> const& ids)
+{
+    if (concurrency_ == Concurrency::SNAPSHOT) {
+        if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::GET_AFFILIATION_COORDS, ids); }
+        return SnapshotReader(*this)->get_affiliation_coords(ids);
+    }
+    OperationLock lock(*this, false);
+    if (workload_trace_) { workload_trace_->record(WorkloadTrace::Operation::GET_AFFILIATION_COORDS, ids); }
+    auto affiliations = affiliationsMap_.find_many(ids); // O(m*log(m) + m*log(n))
+    std::vector<Coord> coords;
+    coords.reserve(ids.size());
+    for (std::size_t i = 0; i < affiliations.size(); ++i) { // O(m)
+        prefetch_ahead(affiliations, i);
+        coords.push_back((affiliations[i] != nullptr) ? affiliations[i]->coordinates : NO_COORD);
+    }
+    return coords;
+}
+
+void Datastructures::begin_bulk()
+{
+    OperationLock lock(*this, true);
+    bulk_ = true;
+}
+
+unsigned int Datastructures::end_bulk()
+{
+    OperationLock lock(*this, true);
+    bulk_ = false;
+    lock.changed();
+    return commit_staged();
+}
+
+// Private function for committing the staged bulk operations. Affiliations and publications
+// are inserted in id order so that each insertion can use the previous one as a hint.
+// References and connections are then applied in their original order.
+unsigned int Datastructures::commit_staged()
+{
+    if (stagedAffiliations_.empty() && stagedPublications_.empty() &&
+        stagedReferences_.empty() && stagedConnections_.empty()) {
+        return 0;
+    }
+
+    unsigned int threads = worker_threads(ingest_threads_);
+    if (threads <= 1 || std::max(stagedAffiliations_.size(), stagedPublications_.size()) < ingest_min_items_) {
+        std::sort(stagedAffiliations_.begin(), stagedAffiliations_.end(), StagedOrder()); // O(k*log(k))
+        std::sort(stagedPublications_.begin(), stagedPublications_.end(), StagedOrder());
     }
     else {
-        return vec;
+        parallel_sort(stagedAffiliations_.begin(), stagedAffiliations_.end(), StagedOrder(), threads); // O(k*log(k)/t + k*log(t))
+        parallel_sort(stagedPublications_.begin(), stagedPublications_.end(), StagedOrder(), threads);
+    }
+
+    unsigned int rejected = insert_staged(stagedAffiliations_, affiliationsMap_, [](StagedAffiliation& staged) {
+        return Affiliation(std::move(staged.name), staged.coordinates);
+    });
+    rejected += insert_staged(stagedPublications_, publicationsMap_, [](StagedPublication& staged) {
+        return Node(staged.id, std::move(staged.name), staged.year, std::move(staged.affiliations));
+    });
+    return rejected + resolve_staged();
+}
+
+template <typename Staged, typename Map, typename MakeValue>
+unsigned int Datastructures::insert_staged(std::vector<Staged>& staged, Map& map, MakeValue make_value)
+{
+    auto insert = [&staged, &make_value](typename Map::OrderedInserter& inserter, std::size_t i) {
+        auto& item = staged[i];
+        if (i > 0 && staged[i-1].id == item.id) {
+            return false;
+        }
+        auto [value, inserted] = inserter.emplace(item.id, make_value(item)); // Amortized constant.
+        if (inserted) {
+            item.inserted = value;
+        }
+        return inserted;
+    };
+
+    unsigned int rejected = 0;
+    auto threads = std::min<std::size_t>(worker_threads(ingest_threads_), map.shard_count());
+    if (threads <= 1 || staged.size() < ingest_min_items_) {
+        typename Map::OrderedInserter inserter(map);
+        for (std::size_t i = 0; i < staged.size(); ++i) { // O(k)
+            if (!insert(inserter, i)) {
+                ++rejected;
+            }
+        }
+        return rejected;
+    }
+
+    // Items of each shard, still in id order. Threads insert to different shards, which are separate maps.
+    std::vector<std::vector<std::size_t>> shard_items(map.shard_count());
+    for (std::size_t i = 0; i < staged.size(); ++i) { // O(k)
+        shard_items[map.shard_index(staged[i].id)].push_back(i);
+    }
+    std::vector<typename Map::OrderedInserter> inserters;
+    for (std::size_t t = 0; t < threads; ++t) {
+        inserters.emplace_back(map); // Before the threads start, because these read every shard.
+    }
+    std::vector<unsigned int> thread_rejected(threads, 0);
+    std::vector<std::thread> workers;
+    for (std::size_t t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t]() {
+            unsigned int count = 0;
+            for (std::size_t shard = t; shard < shard_items.size(); shard += threads) {
+                for (auto i : shard_items[shard]) { // O(k/t)
+                    if (!insert(inserters[t], i)) {
+                        ++count;
+                    }
+                }
+            }
+            thread_rejected[t] = count;
+        });
+    }
+    for (std::size_t t = 0; t < threads; ++t) {
+        workers[t].join();
+        rejected += thread_rejected[t];
+    }
+    return rejected;
+}
+
+unsigned int Datastructures::resolve_staged()
+{
+    auto feed = lock_feed();
+    if (change_feed_) {
+        // Only the inserted ones, in id order.
+        for (auto const& staged : stagedAffiliations_) {
+            if (staged.inserted != nullptr) { change_feed_->publish_add_affiliation(staged.id, staged.coordinates); }
+        }
+        for (auto const& staged : stagedPublications_) {
+            if (staged.inserted != nullptr) { change_feed_->publish_add_publication(staged.id); }
+        }
+    }
+
+    unsigned int rejected = 0;
+    for (auto const& staged : stagedReferences_) { // O(k*log(k))
+        Node* child = find_for_staged(staged.id, staged.publications_before);
+        Node* parent = find_for_staged(staged.parentid, staged.publications_before);
+        if (child != nullptr && parent != nullptr) {
+            parent->referencing.push_back(child);
+            child->parent = parent;
+            if (change_feed_) { change_feed_->publish_add_reference(staged.id, staged.parentid); }
+        }
+        else {
+            ++rejected;
+        }
+    }
+
+    for (auto const& staged : stagedConnections_) { // O(k*log(k))
+        Affiliation* affiliation = find_for_staged(staged.affiliationid, staged.affiliations_before);
+        Node* publication = find_for_staged(staged.publicationid, staged.publications_before);
+        if (affiliation != nullptr && publication != nullptr) {
+            publication->affiliations.push_back(staged.affiliationid);
+            affiliation->publications.push_back(staged.publicationid);
+            if (change_feed_) { change_feed_->publish_add_affiliation_to_publication(staged.affiliationid, staged.publicationid); }
+        }
+        else {
+            ++rejected;
+        }
+    }
+
+    if (bulk_) {
+        stagedAffiliations_.clear();
+        stagedPublications_.clear();
+        stagedReferences_.clear();
+        stagedConnections_.clear();
+    }
+    else {
+        // Releasing the staging memory when the bulk has ended.
+        std::vector<StagedAffiliation>().swap(stagedAffiliations_);
+        std::vector<StagedPublication>().swap(stagedPublications_);
+        std::vector<StagedReference>().swap(stagedReferences_);
+        std::vector<StagedConnection>().swap(stagedConnections_);
+    }
+
+    // Ordered caches are rebuilt (once) when they are needed next time.
+    changedNames_ = true;
+    changedCoordinates_ = true;
+    return rejected;
+}
+
+unsigned int Datastructures::add_bulk(std::vector<BulkPartition>& partitions)
+{
+    OperationLock lock(*this, true);
+    if (workload_trace_) {
+        for (auto const& partition : partitions) {
+            for (auto const& staged : partition.affiliations_) {
+                workload_trace_->record_add_affiliation(staged.id, staged.name, staged.coordinates);
+            }
+        }
+        for (auto const& partition : partitions) {
+            for (auto const& staged : partition.publications_) {
+                workload_trace_->record_add_publication(staged.id, staged.name, staged.year, staged.affiliations);
+            }
+        }
+        for (auto const& partition : partitions) {
+            for (auto const& staged : partition.references_) {
+                workload_trace_->record(WorkloadTrace::Operation::ADD_REFERENCE, staged.id, staged.parentid);
+            }
+        }
+        for (auto const& partition : partitions) {
+            for (auto const& staged : partition.connections_) {
+                workload_trace_->record(WorkloadTrace::Operation::ADD_AFFILIATION_TO_PUBLICATION, staged.affiliationid, staged.publicationid);
+            }
+        }
+    }
+    if (bulk_) {
+        commit_staged(); // Staged before, so committed first.
+    }
+    lock.changed();
+
+    // Runs start where the earlier partitions end.
+    std::vector<std::size_t> affiliation_bounds{0};
+    std::vector<std::size_t> publication_bounds{0};
+    for (auto const& partition : partitions) {
+        affiliation_bounds.push_back(affiliation_bounds.back() + partition.affiliations_.size());
+        publication_bounds.push_back(publication_bounds.back() + partition.publications_.size());
+    }
+    stagedAffiliations_.resize(affiliation_bounds.back());
+    stagedPublications_.resize(publication_bounds.back());
+
+    // Each thread sorts partitions into runs and moves them to the staging vectors.
+    unsigned int threads = worker_threads(ingest_threads_);
+    if (std::max(stagedAffiliations_.size(), stagedPublications_.size()) < ingest_min_items_) {
+        threads = 1;
+    }
+    std::atomic<std::size_t> next_partition{0};
+    auto sort_partitions = [&]() {
+        for (auto p = next_partition++; p < partitions.size(); p = next_partition++) {
+            auto& partition = partitions[p];
+            partition.sort(); // O(k/t*log(k/t))
+            for (std::size_t i = 0; i < partition.affiliations_.size(); ++i) {
+                auto& target = stagedAffiliations_[affiliation_bounds[p] + i];
+                target = std::move(partition.affiliations_[i]);
+                target.order += affiliation_bounds[p];
+            }
+            for (std::size_t i = 0; i < partition.publications_.size(); ++i) {
+                auto& target = stagedPublications_[publication_bounds[p] + i];
+                target = std::move(partition.publications_[i]);
+                target.order += publication_bounds[p];
+            }
+            partition.affiliations_.clear();
+            partition.publications_.clear();
+        }
+    };
+    std::vector<std::thread> workers;
+    for (unsigned int t = 1; t < std::min<std::size_t>(threads, partitions.size()); ++t) {
+        workers.emplace_back(sort_partitions);
+    }
+    sort_partitions();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    parallel_merge_runs(stagedAffiliations_.begin(), stagedAffiliations_.end(), affiliation_bounds, StagedOrder(), threads); // O(k*log(p)/t)
+    parallel_merge_runs(stagedPublications_.begin(), stagedPublications_.end(), publication_bounds, StagedOrder(), threads);
+
+    // References and connections see everything added in the bulk.
+    for (auto& partition : partitions) {
+        for (auto const& staged : partition.references_) {
+            stagedReferences_.push_back({staged.id, staged.parentid, stagedPublications_.size()});
+        }
+        for (auto const& staged : partition.connections_) {
+            stagedConnections_.push_back({staged.affiliationid, staged.publicationid,
+                                          stagedAffiliations_.size(), stagedPublications_.size()});
+        }
+        std::vector<StagedReference>().swap(partition.references_);
+        std::vector<StagedConnection>().swap(partition.connections_);
+        partition.sorted_ = true;
+    }
+
+    if (mutation_log_) {
+        // Logged in the order of commit, which gives the same result when replayed.
+        for (auto const& staged : stagedAffiliations_) {
+            mutation_log_->log_add_affiliation(staged.id, staged.name, staged.coordinates);
+        }
+        for (auto const& staged : stagedPublications_) {
+            mutation_log_->log_add_publication(staged.id, staged.name, staged.year, staged.affiliations);
+        }
+        for (auto const& staged : stagedReferences_) {
+            mutation_log_->log_add_reference(staged.id, staged.parentid);
+        }
+        for (auto const& staged : stagedConnections_) {
+            mutation_log_->log_add_affiliation_to_publication(staged.affiliationid, staged.publicationid);
+        }
+    }
+
+    unsigned int rejected = insert_staged(stagedAffiliations_, affiliationsMap_, [](StagedAffiliation& staged) {
+        return Affiliation(std::move(staged.name), staged.coordinates);
+    });
+    rejected += insert_staged(stagedPublications_, publicationsMap_, [](StagedPublication& staged) {
+        return Node(staged.id, std::move(staged.name), staged.year, std::move(staged.affiliations));
+    });
+    return rejected + resolve_staged();
+}
+
+void Datastructures::BulkPartition::add_affiliation(AffiliationID id, Name const& name, Coord xy)
+{
+    affiliations_.push_back({id, name, xy, affiliations_.size(), nullptr});
+    sorted_ = false;
+}
+
+void Datastructures::BulkPartition::add_publication(PublicationID id, Name const& name, Year year,
+                                                    std::vector<AffiliationID> const& affiliations)
+{
+    publications_.push_back({id, name, year, affiliations, publications_.size(), nullptr});
+    sorted_ = false;
+}
+
+void Datastructures::BulkPartition::add_reference(PublicationID id, PublicationID parentid)
+{
+    references_.push_back({id, parentid, 0}); // Before counts are set in add_bulk().
+}
+
+void Datastructures::BulkPartition::add_affiliation_to_publication(AffiliationID affiliationid, PublicationID publicationid)
+{
+    connections_.push_back({affiliationid, publicationid, 0, 0});
+}
+
+void Datastructures::BulkPartition::sort()
+{
+    if (!sorted_) {
+        std::sort(affiliations_.begin(), affiliations_.end(), StagedOrder()); // O(k*log(k))
+        std::sort(publications_.begin(), publications_.end(), StagedOrder());
+        sorted_ = true;
+    }
+}
+
+Datastructures::Affiliation* Datastructures::find_for_staged(AffiliationID const& id, std::size_t before)
+{
+    auto iter = std::lower_bound(stagedAffiliations_.begin(), stagedAffiliations_.end(), id, [](auto const& staged, auto const& key) { // O(log(k))
+        return staged.id < key;
+    });
+    if (iter != stagedAffiliations_.end() && iter->id == id && iter->inserted != nullptr) {
+        // Added in this bulk, valid only if staged before the operation.
+        return (iter->order < before) ? iter->inserted : nullptr;
+    }
+    auto map_iter = affiliationsMap_.find(id); // O(log(n))
+    return (map_iter != affiliationsMap_.end()) ? &(map_iter->second) : nullptr;
+}
+
+Datastructures::Node* Datastructures::find_for_staged(PublicationID id, std::size_t before)
+{
+    auto iter = std::lower_bound(stagedPublications_.begin(), stagedPublications_.end(), id, [](auto const& staged, auto key) { // O(log(k))
+        return staged.id < key;
+    });
+    if (iter != stagedPublications_.end() && iter->id == id && iter->inserted != nullptr) {
+        return (iter->order < before) ? iter->inserted : nullptr;
+    }
+    auto map_iter = publicationsMap_.find(id); // O(log(n))
+    return (map_iter != publicationsMap_.end()) ? &(map_iter->second) : nullptr;
+}
+
+void Datastructures::set_mutation_log(MutationLog* log)
+{
+    mutation_log_ = log;
+}
+
+void Datastructures::set_change_feed(ChangeFeed* feed)
+{
+    change_feed_ = feed;
+}
+
+void Datastructures::set_workload_trace(WorkloadTrace* trace)
+{
+    workload_trace_ = trace;
+}
+
+void Datastructures::set_concurrency(Concurrency concurrency)
+{
+    if (concurrency_ == Concurrency::SNAPSHOT && concurrency != Concurrency::SNAPSHOT) {
+        free_snapshots();
+    }
+    if (concurrency == Concurrency::SNAPSHOT && concurrency_ != Concurrency::SNAPSHOT) {
+        for (auto& copy : snapshot_copies_) {
+            copy_data(copy); // O(n*log(n))
+        }
+    }
+    concurrency_ = concurrency;
+    allocate_stripes();
+}
+
+Datastructures::Concurrency Datastructures::concurrency() const
+{
+    return concurrency_;
+}
+
+void Datastructures::set_shard_count(unsigned int count)
+{
+    if (count == affiliationsMap_.shard_count()) {
+        return;
+    }
+    affiliationsMap_.reshard(count); // O(n*log(n))
+    publicationsMap_.reshard(count); // O(n*log(n))
+    allocate_stripes();
+    if (concurrency_ == Concurrency::SNAPSHOT) {
+        record_snapshot_change(nullptr); // Copies keep the old shard count otherwise.
+        publish_snapshot();
+    }
+}
+
+unsigned int Datastructures::shard_count() const
+{
+    return affiliationsMap_.shard_count();
+}
+
+void Datastructures::set_sort_threads(unsigned int threads)
+{
+    sort_threads_ = threads;
+}
+
+unsigned int Datastructures::sort_threads() const
+{
+    return sort_threads_;
+}
+
+void Datastructures::set_sort_min_items(std::size_t items)
+{
+    sort_min_items_ = items;
+}
+
+std::size_t Datastructures::sort_min_items() const
+{
+    return sort_min_items_;
+}
+
+void Datastructures::set_traversal_threads(unsigned int threads)
+{
+    traversal_threads_ = threads;
+}
+
+unsigned int Datastructures::traversal_threads() const
+{
+    return traversal_threads_;
+}
+
+void Datastructures::set_traversal_min_items(std::size_t items)
+{
+    traversal_min_items_ = items;
+}
+
+std::size_t Datastructures::traversal_min_items() const
+{
+    return traversal_min_items_;
+}
+
+void Datastructures::set_ingest_threads(unsigned int threads)
+{
+    ingest_threads_ = threads;
+}
+
+unsigned int Datastructures::ingest_threads() const
+{
+    return ingest_threads_;
+}
+
+void Datastructures::set_ingest_min_items(std::size_t items)
+{
+    ingest_min_items_ = items;
+}
+
+std::size_t Datastructures::ingest_min_items() const
+{
+    return ingest_min_items_;
+}
+
+unsigned int Datastructures::worker_threads(unsigned int setting)
+{
+    return (setting != 0) ? setting : std::max(1u, std::thread::hardware_concurrency());
+}
+
+template <typename Item, typename Compare>
+void Datastructures::sort_listing(std::vector<Item>& items, Compare comp) const
+{
+    unsigned int threads = worker_threads(sort_threads_);
+    if (threads <= 1 || items.size() < sort_min_items_) {
+        std::stable_sort(items.begin(), items.end(), comp); // O(n*log(n))
+    }
+    else {
+        parallel_sort(items.begin(), items.end(), comp, threads); // O(n*log(n)/t + n*log(t))
+    }
+}
+
+// Private function for creating a lock for each shard in STRIPED mode (and freeing them otherwise).
+void Datastructures::allocate_stripes()
+{
+    if (concurrency_ == Concurrency::STRIPED) {
+        affiliation_stripes_ = std::make_unique<Stripe[]>(affiliationsMap_.shard_count());
+        publication_stripes_ = std::make_unique<Stripe[]>(publicationsMap_.shard_count());
+    }
+    else {
+        affiliation_stripes_.reset();
+        publication_stripes_.reset();
+    }
+}
+
+std::unique_lock<std::mutex> Datastructures::lock_staging()
+{
+    if (concurrency_ == Concurrency::STRIPED) {
+        return std::unique_lock<std::mutex>(staging_mutex_);
+    }
+    return std::unique_lock<std::mutex>();
+}
+
+std::unique_lock<std::mutex> Datastructures::lock_feed()
+{
+    if (concurrency_ == Concurrency::STRIPED) {
+        return std::unique_lock<std::mutex>(feed_mutex_);
+    }
+    return std::unique_lock<std::mutex>();
+}
+
+Datastructures::OperationLock::OperationLock(Datastructures& ds, bool write) : ds_(ds)
+{
+    if (ds.concurrency_ == Concurrency::NONE) {
+        return;
+    }
+    shared_ = !write && (ds.concurrency_ == Concurrency::SHARED || ds.concurrency_ == Concurrency::STRIPED);
+    lock_data();
+}
+
+Datastructures::OperationLock::OperationLock(Datastructures& ds, bool write, AffiliationID const* affiliation,
+                                             PublicationID const* publication, PublicationID const* publication2)
+    : ds_(ds)
+{
+    if (ds.concurrency_ != Concurrency::STRIPED) {
+        if (ds.concurrency_ != Concurrency::NONE) {
+            shared_ = !write && ds.concurrency_ == Concurrency::SHARED;
+            lock_data();
+        }
+        return;
+    }
+
+    shared_ = !write;
+    if (affiliation != nullptr) {
+        auto& stripe = ds.affiliation_stripes_[ds.affiliationsMap_.shard_index(*affiliation)];
+        lock(stripe.mutex, stripe.waiting_writers);
+    }
+    // Publication stripes in increasing index order, so that two writers can't deadlock.
+    auto none = ds.publicationsMap_.shard_count();
+    auto first = (publication != nullptr) ? ds.publicationsMap_.shard_index(*publication) : none;
+    auto second = (publication2 != nullptr) ? ds.publicationsMap_.shard_index(*publication2) : none;
+    if (second < first) {
+        std::swap(first, second);
+    }
+    if (first != none) {
+        lock(ds.publication_stripes_[first].mutex, ds.publication_stripes_[first].waiting_writers);
+    }
+    if (second != none && second != first) {
+        lock(ds.publication_stripes_[second].mutex, ds.publication_stripes_[second].waiting_writers);
+    }
+}
+
+Datastructures::OperationLock::~OperationLock()
+{
+    if (changed_ && ds_.concurrency_ == Concurrency::SNAPSHOT && !ds_.bulk_) {
+        ds_.publish_snapshot();
+    }
+    unlock();
+}
+
+void Datastructures::OperationLock::changed()
+{
+    changed_ = true;
+    if (ds_.concurrency_ == Concurrency::SNAPSHOT) {
+        ds_.record_snapshot_change(nullptr);
+    }
+}
+
+void Datastructures::OperationLock::lock_all()
+{
+    if (ds_.concurrency_ != Concurrency::STRIPED || (all_stripes_ && !shared_)) {
+        return;
+    }
+    // Nothing has been changed yet, so the stripes can be released before locking all.
+    unlock();
+    shared_ = false;
+    lock_data();
+}
+
+void Datastructures::OperationLock::lock_data()
+{
+    if (ds_.concurrency_ != Concurrency::STRIPED) {
+        lock(ds_.data_mutex_, ds_.waiting_writers_);
+        return;
+    }
+    all_stripes_ = true;
+    for (std::size_t i = 0; i < ds_.affiliationsMap_.shard_count(); ++i) { // O(k)
+        lock(ds_.affiliation_stripes_[i].mutex, ds_.affiliation_stripes_[i].waiting_writers);
+    }
+    for (std::size_t i = 0; i < ds_.publicationsMap_.shard_count(); ++i) { // O(k)
+        lock(ds_.publication_stripes_[i].mutex, ds_.publication_stripes_[i].waiting_writers);
+    }
+}
+
+void Datastructures::OperationLock::lock(std::shared_mutex& mutex, std::atomic<unsigned int>& waiting_writers)
+{
+    if (shared_) {
+        // Writers go first: a steady stream of queries would otherwise keep the lock shared
+        // (std::shared_mutex prefers readers) and a writer could wait indefinitely.
+        while (waiting_writers.load() != 0) {
+            std::this_thread::yield();
+        }
+        mutex.lock_shared();
+    }
+    else {
+        waiting_writers.fetch_add(1);
+        mutex.lock();
+        waiting_writers.fetch_sub(1);
+    }
+    if (!all_stripes_) {
+        *std::find(std::begin(held_), std::end(held_), nullptr) = &mutex;
+    }
+}
+
+void Datastructures::OperationLock::unlock()
+{
+    auto release = [this](std::shared_mutex& mutex) {
+        if (shared_) {
+            mutex.unlock_shared();
+        }
+        else {
+            mutex.unlock();
+        }
+    };
+    if (all_stripes_) {
+        for (std::size_t i = 0; i < ds_.affiliationsMap_.shard_count(); ++i) {
+            release(ds_.affiliation_stripes_[i].mutex);
+        }
+        for (std::size_t i = 0; i < ds_.publicationsMap_.shard_count(); ++i) {
+            release(ds_.publication_stripes_[i].mutex);
+        }
+        all_stripes_ = false;
+    }
+    for (auto& held : held_) {
+        if (held != nullptr) {
+            release(*held);
+            held = nullptr;
+        }
+    }
+}
+
+Datastructures::SnapshotReader::SnapshotReader(Datastructures& ds)
+{
+    while (true) {
+        // Counting before checking (both sequentially consistent): a writer that switches
+        // the copy after the check sees the count, see publish_snapshot().
+        auto index = ds.snapshot_index_.load();
+        count_ = &ds.snapshot_copies_[index].readers[reader_stripe()].count;
+        count_->fetch_add(1);
+        if (ds.snapshot_index_.load() == index) {
+            copy_ = &ds.snapshot_copies_[index];
+            return;
+        }
+        count_->fetch_sub(1); // Switched in between, a writer may be changing the copy.
+    }
+}
+
+Datastructures::SnapshotReader::~SnapshotReader()
+{
+    count_->fetch_sub(1, std::memory_order_release);
+}
+
+template <typename MakeListing>
+std::vector<AffiliationID> Datastructures::SnapshotReader::listing(
+    std::atomic<std::vector<AffiliationID>*> SnapshotCopy::* cache, MakeListing make_listing) const
+{
+    auto& stored = copy_->*cache;
+    auto listing = stored.load(std::memory_order_acquire);
+    if (listing == nullptr) {
+        auto made = std::make_unique<std::vector<AffiliationID>>(make_listing()); // O(n*log(n))
+        if (stored.compare_exchange_strong(listing, made.get(), std::memory_order_acq_rel)) {
+            listing = made.release();
+        }
+        // Otherwise another query stored its listing first, and listing now points to it.
+    }
+    return *listing;
+}
+
+unsigned int Datastructures::reader_stripe()
+{
+    static std::atomic<unsigned int> next_stripe{0};
+    thread_local unsigned int stripe = next_stripe.fetch_add(1) % READER_STRIPES;
+    return stripe;
+}
+
+Datastructures::SnapshotCopy::~SnapshotCopy()
+{
+    delete by_name.load();
+    delete by_distance.load();
+}
+
+// A change is recorded for both copies. nullptr (or any change during a bulk) makes
+// them stale, so that publish_snapshot() copies all data.
+void Datastructures::record_snapshot_change(std::function<void(Datastructures&)> change)
+{
+    for (auto& copy : snapshot_copies_) {
+        if (change == nullptr || bulk_) {
+            copy.stale = true;
+            copy.changes.clear();
+        }
+        else if (!copy.stale) {
+            copy.changes.push_back(change);
+        }
+    }
+}
+
+// Private function for bringing the copy that queries don't read up to date and switching
+// queries to it. Called by writers (holding the lock) after each change. The other copy
+// keeps its changes for the next call.
+void Datastructures::publish_snapshot()
+{
+    auto index = 1 - snapshot_index_.load();
+    auto& copy = snapshot_copies_[index];
+    // Queries that started before the previous switch may still read it.
+    wait_for_readers(copy); // O(s)
+
+    if (copy.stale) {
+        copy_data(copy); // O(n*log(n))
+    }
+    else {
+        for (auto const& change : copy.changes) { // O(c)
+            change(*copy.data);
+        }
+        copy.changes.clear();
+        // The flags of the copy tell whether the changes affected the ordered listings
+        // (the copy's own caches aren't used, queries use the listings of SnapshotCopy).
+        if (copy.data->changedNames_.exchange(false)) {
+            delete copy.by_name.exchange(nullptr);
+        }
+        if (copy.data->changedCoordinates_.exchange(false)) {
+            delete copy.by_distance.exchange(nullptr);
+        }
+    }
+    copy.data->sort_threads_ = sort_threads_.load();
+    copy.data->sort_min_items_ = sort_min_items_.load();
+    copy.data->traversal_threads_ = traversal_threads_.load();
+    copy.data->traversal_min_items_ = traversal_min_items_.load();
+
+    snapshot_index_.store(index);
+}
+
+// A query counted after the previous switch has seen that switch, so it reads the other
+// copy (or tries again). The counts can only drop to zero.
+void Datastructures::wait_for_readers(SnapshotCopy& copy)
+{
+    for (unsigned int i = 0; i < READER_STRIPES; ++i) { // O(s)
+        while (copy.readers[i].count.load() != 0) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+// Private function for replacing a copy (which no query reads) with a copy of all data.
+void Datastructures::copy_data(SnapshotCopy& snapshot)
+{
+    snapshot.data = std::make_unique<Datastructures>();
+    snapshot.changes.clear();
+    snapshot.stale = false;
+    auto& copy = *snapshot.data;
+    copy.affiliationsMap_ = affiliationsMap_; // O(n)
+    copy.publicationsMap_ = publicationsMap_; // O(n)
+
+    // Ordered listings are copied if they are up to date, otherwise the first query makes them.
+    copy.changedNames_ = false;
+    copy.changedCoordinates_ = false;
+    delete snapshot.by_name.exchange(changedNames_ ? nullptr : new std::vector<AffiliationID>(sortedNameVector_));
+    delete snapshot.by_distance.exchange(changedCoordinates_ ? nullptr : new std::vector<AffiliationID>(sortedCoordVector_));
+
+    // Copied nodes still point to the originals, links are redirected to the copies.
+    auto& copies = copy.publicationsMap_;
+    for (auto& [id, node] : copies) { // O(n*log(n))
+        if (node.parent != nullptr) {
+            node.parent = &(copies.find(node.parent->id)->second);
+        }
+        for (auto& child : node.referencing) {
+            child = &(copies.find(child->id)->second);
+        }
+    }
+    copy.generation_ = generation_;
+    copy.sort_threads_ = sort_threads_.load();
+    copy.sort_min_items_ = sort_min_items_.load();
+    copy.traversal_threads_ = traversal_threads_.load();
+    copy.traversal_min_items_ = traversal_min_items_.load();
+    copy.ingest_threads_ = ingest_threads_.load();
+    copy.ingest_min_items_ = ingest_min_items_.load();
+}
+
+// Private function for freeing the copies, when no queries are running.
+void Datastructures::free_snapshots()
+{
+    for (auto& copy : snapshot_copies_) {
+        copy.data.reset();
+        copy.changes.clear();
+        copy.stale = true;
+        delete copy.by_name.exchange(nullptr);
+        delete copy.by_distance.exchange(nullptr);
+    }
+}
+
+// Snapshot layout (host byte order, see mutationlog.hh for the encoding):
+//   magic, u64 sequence, u64 affiliation count, affiliations, u64 publication count, publications
+//   affiliation = id, name, x, y, u32 count + publication ids
+//   publication = id, name, year, u32 count + affiliation ids, u32 count + referencing ids, parent id
+bool Datastructures::save_snapshot(std::string const& filename, unsigned long long sequence)
+{
+    OperationLock lock(*this, true);
+    commit_staged();
+
+    std::string buf;
+    buf.append(SNAPSHOT_MAGIC);
+    MutationLog::put_u64(buf, sequence);
+
+    MutationLog::put_u64(buf, affiliationsMap_.size());
+    for (auto const& [id, affiliation] : affiliationsMap_) { // O(n)
+        MutationLog::put_string(buf, id);
+        MutationLog::put_string(buf, affiliation.name);
+        MutationLog::put_i32(buf, affiliation.coordinates.x);
+        MutationLog::put_i32(buf, affiliation.coordinates.y);
+        MutationLog::put_u32(buf, affiliation.publications.size());
+        for (auto publication : affiliation.publications) {
+            MutationLog::put_u64(buf, publication);
+        }
+    }
+
+    MutationLog::put_u64(buf, publicationsMap_.size());
+    for (auto const& [id, node] : publicationsMap_) { // O(n)
+        MutationLog::put_u64(buf, id);
+        MutationLog::put_string(buf, node.name);
+        MutationLog::put_u16(buf, node.year);
+        MutationLog::put_u32(buf, node.affiliations.size());
+        for (auto const& affiliation : node.affiliations) {
+            MutationLog::put_string(buf, affiliation);
+        }
+        MutationLog::put_u32(buf, node.referencing.size());
+        for (auto const& reference : node.referencing) {
+            MutationLog::put_u64(buf, reference->id);
+        }
+        // add_reference() can give a publication a new parent while it stays in the old
+        // parent's list, so the parent isn't always the only list the publication is in.
+        MutationLog::put_u64(buf, (node.parent != nullptr) ? node.parent->id : NO_PUBLICATION);
+    }
+
+    return MutationLog::write_file_durably(filename, buf);
+}
+
+bool Datastructures::load_snapshot(std::string const& filename, unsigned long long& sequence)
+{
+    std::ifstream input(filename, std::ios::binary);
+    if (!input) {
+        return false;
+    }
+    std::string data((std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>());
+    if (data.compare(0, SNAPSHOT_MAGIC.size(), SNAPSHOT_MAGIC) != 0) {
+        return false;
+    }
+
+    MutationLog::Reader reader{data.data() + SNAPSHOT_MAGIC.size(), data.data() + data.size()};
+    std::uint64_t seq = 0;
+    std::uint64_t count = 0;
+    if (!reader.get_u64(seq) || !reader.get_u64(count)) {
+        return false;
+    }
+
+    // The file is read into new maps, so that the current data is kept if it is broken.
+    // Set_shard_count() isn't called at the same time, so the count can be read unlocked.
+    ShardedMap<AffiliationID, Affiliation> affiliations(affiliationsMap_.shard_count());
+    ShardedMap<PublicationID, Node> publications(publicationsMap_.shard_count());
+
+    // Counts are checked against the bytes left before anything is reserved, so that a
+    // corrupt count can't make the load allocate more than the file could hold.
+    auto fits = [&reader](std::uint64_t items, std::size_t min_item_size) {
+        return items <= static_cast<std::uint64_t>(reader.end - reader.pos) / min_item_size;
+    };
+
+    bool ok = fits(count, MIN_SNAPSHOT_AFFILIATION_SIZE);
+    ShardedMap<AffiliationID, Affiliation>::OrderedInserter aff_inserter(affiliations);
+    AffiliationID previous_affiliation;
+    for (std::uint64_t i = 0; ok && i < count; ++i) { // O(n)
+        std::string id, name;
+        std::int32_t x = 0, y = 0;
+        std::uint32_t pubcount = 0;
+        ok = reader.get_string(id) && reader.get_string(name) && reader.get_i32(x) && reader.get_i32(y) && reader.get_u32(pubcount)
+             && fits(pubcount, sizeof(std::uint64_t))
+             && (i == 0 || previous_affiliation < id);
+        if (!ok) { break; }
+        previous_affiliation = id;
+        // Ids are stored in order (checked above) so inserting is amortized constant.
+        Affiliation* affiliation = aff_inserter.emplace(id, Affiliation(name, {x, y})).first;
+        affiliation->publications.reserve(pubcount);
+        for (std::uint32_t j = 0; ok && j < pubcount; ++j) {
+            std::uint64_t publication = 0;
+            ok = reader.get_u64(publication);
+            affiliation->publications.push_back(publication);
+        }
+    }
+
+    std::vector<std::pair<PublicationID, std::vector<PublicationID>>> references;
+    std::vector<std::pair<PublicationID, PublicationID>> parents;
+    ShardedMap<PublicationID, Node>::OrderedInserter pub_inserter(publications);
+    ok = ok && reader.get_u64(count) && fits(count, MIN_SNAPSHOT_PUBLICATION_SIZE);
+    PublicationID previous_publication = 0;
+    for (std::uint64_t i = 0; ok && i < count; ++i) { // O(n)
+        std::uint64_t id = 0;
+        std::string name;
+        std::uint16_t year = 0;
+        std::uint32_t affcount = 0;
+        ok = reader.get_u64(id) && reader.get_string(name) && reader.get_u16(year) && reader.get_u32(affcount)
+             && fits(affcount, sizeof(std::uint32_t)) // Strings have at least their length.
+             && (i == 0 || previous_publication < id);
+        if (!ok) { break; }
+        previous_publication = id;
+        std::vector<AffiliationID> pubaffiliations;
+        pubaffiliations.reserve(affcount);
+        for (std::uint32_t j = 0; ok && j < affcount; ++j) {
+            std::string affiliation;
+            ok = reader.get_string(affiliation);
+            pubaffiliations.push_back(affiliation);
+        }
+        std::uint32_t refcount = 0;
+        ok = ok && reader.get_u32(refcount) && fits(refcount, sizeof(std::uint64_t));
+        std::vector<PublicationID> referencing;
+        referencing.reserve(refcount);
+        for (std::uint32_t j = 0; ok && j < refcount; ++j) {
+            std::uint64_t reference = 0;
+            ok = reader.get_u64(reference);
+            referencing.push_back(reference);
+        }
+        std::uint64_t parentid = 0;
+        ok = ok && reader.get_u64(parentid);
+        if (!ok) { break; }
+        pub_inserter.emplace(id, Node(id, name, year, pubaffiliations));
+        if (!referencing.empty()) {
+            references.push_back({id, std::move(referencing)});
+        }
+        if (parentid != static_cast<std::uint64_t>(NO_PUBLICATION)) {
+            parents.push_back({id, parentid});
+        }
+    }
+
+    if (!ok) {
+        return false;
+    }
+
+    // References can be resolved only after all publications exist. The lists are restored
+    // as they were saved, even when a publication is in several of them (see save_snapshot()).
+    for (auto const& [parentid, referencing] : references) { // O(n*log(n))
+        auto parent = publications.find(parentid);
+        for (auto id : referencing) {
+            auto child = publications.find(id);
+            if (parent != publications.end() && child != publications.end()) {
+                parent->second.referencing.push_back(&(child->second));
+            }
+        }
+    }
+    for (auto const& [id, parentid] : parents) { // O(n*log(n))
+        auto parent = publications.find(parentid);
+        if (parent == publications.end()) {
+            return false; // Only an existing publication can be a parent.
+        }
+        publications.find(id)->second.parent = &(parent->second);
+    }
+
+    // Loading happens without logging, the snapshot is already persistent. Moving the
+    // maps keeps their items where they are, so the links stay valid.
+    OperationLock lock(*this, true);
+    lock.changed();
+    clear_data();
+    affiliationsMap_ = std::move(affiliations);
+    publicationsMap_ = std::move(publications);
+    sequence = seq;
+    if (change_feed_) { auto feed = lock_feed(); publish_all_to_feed(); }
+    return true;
+}
+
+// Private function for publishing all data to the change feed as a clear_all() and the
+// additions that rebuild it, so that subscribers follow a load that replaced everything.
+void Datastructures::publish_all_to_feed()
+{
+    change_feed_->publish_clear_all();
+    for (auto const& [id, affiliation] : affiliationsMap_) { // O(n)
+        change_feed_->publish_add_affiliation(id, affiliation.coordinates);
+    }
+    for (auto const& [id, node] : publicationsMap_) { // O(n)
+        change_feed_->publish_add_publication(id);
+    }
+    for (auto const& [id, node] : publicationsMap_) { // O(n)
+        for (auto const& child : node.referencing) {
+            change_feed_->publish_add_reference(child->id, id);
+        }
+        // Affiliations given to add_publication() are only in the publication's list.
+        for (auto const& affiliation : node.affiliations) {
+            change_feed_->publish_add_affiliation_to_publication(affiliation, id);
+        }
+    }
+}
+
+// Private function for iterating through tree structure parents. Loops up the parent
+// pointers until there are no more parents, and there can be n-1 parents maximum.
+// A loop instead of recursion, so that long reference chains can't overflow the stack.
+std::vector<PublicationID> Datastructures::iterate_parents(std::vector<PublicationID>& vec, Node* parent) {
+    for ( ; parent != nullptr; parent = parent->parent) { // O(n)
+        vec.push_back(parent->id);
     }
+    return vec;
 }
 
 //std::vector<PublicationID> Datastructures::iterate_references(std::vector<PublicationID>& vec, std::vector<Node*>& referencing) {
@@ -16,6 +16,15 @@
 #include <exception>
 #include <map>
 #include <memory>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+
+#include "shardedmap.hh"
+
+class MutationLog;
+class WorkloadTrace;
+class ChangeFeed;
 
 // Types for IDs
 using AffiliationID = std::string;
@@ -102,6 +111,7 @@ public:
     // Estimate of performance: O(1)
     // Short rationale for estimate: Map's size() is constant.
     unsigned int get_affiliation_count();
+    static constexpr char const* GET_AFFILIATION_COUNT_ESTIMATE = "1";
 
     // Estimate of performance: O(n)
     // Short rationale for estimate: Map's clear() is linear and
@@ -113,6 +123,7 @@ public:
     // so reallocating memory doesn't happen while adding elements to vector in a loop.
     // Looping through all the map's items is linear and push_back is amortized constant.
     std::vector<AffiliationID> get_all_affiliations();
+    static constexpr char const* GET_ALL_AFFILIATIONS_ESTIMATE = "n";
 
     // Estimate of performance: O(log(n))
     // Short rationale for estimate: Insertion to map is in the worst case logarithmic.
@@ -121,10 +132,12 @@ public:
     // Estimate of performance: O(log(n))
     // Short rationale for estimate: map.find() is logarithmic.
     Name get_affiliation_name(AffiliationID id);
+    static constexpr char const* GET_AFFILIATION_NAME_ESTIMATE = "log n";
 
     // Estimate of performance: O(log(n))
     // Short rationale for estimate: map.find() is logarithmic.
     Coord get_affiliation_coord(AffiliationID id);
+    static constexpr char const* GET_AFFILIATION_COORD_ESTIMATE = "log n";
 
 
     // We recommend you implement the operations below only after implementing the ones above
@@ -134,20 +147,24 @@ public:
     // that reallocating doesn't happen while adding items to a vector in a loop. Loops are linear.
     // Sorting is O(n*log(n)) and that's why perfomance is that.
     std::vector<AffiliationID> get_affiliations_alphabetically();
+    static constexpr char const* GET_AFFILIATIONS_ALPHABETICALLY_ESTIMATE = "n log n";
 
     // Estimate of performance: O(n*log(n))
     // Short rationale for estimate: Vector's reserve() (linear) reserves enough memory for each vector so
     // that reallocating doesn't happen while adding items to a vector in a loop. Loops are linear and
     // push_back is amortized constant. Sorting is O(n*log(n)) and that's why perfomance is that.
     std::vector<AffiliationID> get_affiliations_distance_increasing();
+    static constexpr char const* GET_AFFILIATIONS_DISTANCE_INCREASING_ESTIMATE = "n log n";
 
     // Estimate of performance: O(n)
     // Short rationale for estimate: Using find_if is at worst linear.
     AffiliationID find_affiliation_with_coord(Coord xy);
+    static constexpr char const* FIND_AFFILIATION_WITH_COORD_ESTIMATE = "n";
 
     // Estimate of performance: O(log(n))
     // Short rationale for estimate: map.find() is logarithmic.
     bool change_affiliation_coord(AffiliationID id, Coord newcoord);
+    static constexpr char const* CHANGE_AFFILIATION_COORD_ESTIMATE = "log n";
 
 
     // We recommend you implement the operations below only after implementing the ones above
@@ -162,19 +179,23 @@ public:
     // so reallocating memory doesn't happen while adding elements to vector in a loop.
     // Looping through all the map items is linear and push_back is amortized constant.
     std::vector<PublicationID> all_publications();
+    static constexpr char const* ALL_PUBLICATIONS_ESTIMATE = "n";
 
     // Estimate of performance: O(log(n))
     // Short rationale for estimate: map.find() is logarithmic.
     Name get_publication_name(PublicationID id);
+    static constexpr char const* GET_PUBLICATION_NAME_ESTIMATE = "log n";
 
     // Estimate of performance: O(log(n))
     // Short rationale for estimate: map.find() is logarithmic.
     Year get_publication_year(PublicationID id);
+    static constexpr char const* GET_PUBLICATION_YEAR_ESTIMATE = "log n";
 
     // Estimate of performance: O(n)
     // Short rationale for estimate: map.find() is logarithmic but passing a vector of size n
     // causes the performance to be O(n).
     std::vector<AffiliationID> get_affiliations(PublicationID id);
+    static constexpr char const* GET_AFFILIATIONS_ESTIMATE = "n";
 
     // Estimate of performance: O(log(n))
     // Short rationale for estimate: find() from maps is in the worst case logarithmic.
@@ -185,58 +206,293 @@ public:
     // Short rationale for estimate: find() is O(log(n)) and reserving (reserver()) enough memory for a vector is linear operation.
     // For_each is linear as well and adding elements to the end of the vector is amortized constant. So performance is O(n).
     std::vector<PublicationID> get_direct_references(PublicationID id);
+    static constexpr char const* GET_DIRECT_REFERENCES_ESTIMATE = "n";
 
     // Estimate of performance: O(log(n))
     // Short rationale for estimate: Find() from map is O(log(n)). Adding elements to the end
     // of the vector can now cause memory reallocating. No for loops used here.
     bool add_affiliation_to_publication(AffiliationID affiliationid, PublicationID publicationid);
+    static constexpr char const* ADD_AFFILIATION_TO_PUBLICATION_ESTIMATE = "log n";
 
     // Estimate of performance: O(n)
     // Short rationale for estimate: map.find() is logarithmic but passing a vector of size n
     // causes the performance to be O(n).
     std::vector<PublicationID> get_publications(AffiliationID id);
+    static constexpr char const* GET_PUBLICATIONS_ESTIMATE = "n";
 
     // Estimate of performance: O(log(n))
     // Short rationale for estimate: map.find() is logarithmic.
     PublicationID get_parent(PublicationID id);
+    static constexpr char const* GET_PARENT_ESTIMATE = "log n";
 
     // Estimate of performance: O(n*log(n))
     // Short rationale for estimate: For loop is linear and inside it is used map.find() which is O(log(n))
     // so that's why perfomance can be at worst O(n*(log(n)). Sorting is as well O(n*(log(n)).
     // Also, using reserve() to reserve enough memory for a vector.
     std::vector<std::pair<Year, PublicationID>> get_publications_after(AffiliationID affiliationid, Year year);
+    static constexpr char const* GET_PUBLICATIONS_AFTER_ESTIMATE = "n log n";
 
     // Estimate of performance: O(n)
     // Short rationale for estimate: map.find() is logarithmic. This function is using
-    // recursive function iterate_parents to check all the parent nodes. So at worst
+    // function iterate_parents to check all the parent nodes. So at worst
     // case it can loop through all possible parents (n-1). So at worst this is O(n).
     std::vector<PublicationID> get_referenced_by_chain(PublicationID id);
+    static constexpr char const* GET_REFERENCED_BY_CHAIN_ESTIMATE = "n";
 
 
     // Non-compulsory operations
 
-    // Estimate of performance:
-    // Short rationale for estimate:
+    // Estimate of performance: O(n/t + t)
+    // Short rationale for estimate: Every publication in the subtree is visited once
+    // (depth first, with an explicit stack). Subtrees of more than
+    // traversal_min_items() publications are split between t threads (see
+    // set_traversal_threads()).
     std::vector<PublicationID> get_all_references(PublicationID id);
+    static constexpr char const* GET_ALL_REFERENCES_ESTIMATE = "n"; // T is fixed during perftest
 
     // Estimate of performance: O(n*log(n))
     // Short rationale for estimate: O(n*log(n)) because of the std::sort.
     std::vector<AffiliationID> get_affiliations_closest_to(Coord xy);
+    static constexpr char const* GET_AFFILIATIONS_CLOSEST_TO_ESTIMATE = "n log n";
 
     // Estimate of performance: O(n^2)
     // Short rationale for estimate: map.find() is logarithmic. Looping through a vector
     // and using remove_if which is O(n) inside this loop.
     bool remove_affiliation(AffiliationID id);
+    static constexpr char const* REMOVE_AFFILIATION_ESTIMATE = "n^2";
 
     // Estimate of performance: O(n^2)
     // Short rationale for estimate: Looping through a vector
     // and using find_if which is O(n) inside this loop.
     PublicationID get_closest_common_parent(PublicationID id1, PublicationID id2);
+    static constexpr char const* GET_CLOSEST_COMMON_PARENT_ESTIMATE = "n^2";
 
     // Estimate of performance: O(n^2)
     // Short rationale for estimate: map.find() is logarithmic. Looping through a vector
     // and using remove_if which is O(n) inside this loop.
     bool remove_publication(PublicationID publicationid);
+    static constexpr char const* REMOVE_PUBLICATION_ESTIMATE = "n^2";
+
+
+    // Cursors for reading large results page by page
+
+    // Position of a paged listing. Additions don't affect a cursor, but removals and
+    // clear_all() end it (like they would invalidate iterators).
+    class Cursor;
+
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: Only the starting position is stored.
+    Cursor all_affiliations_cursor(); // Same items and order as get_all_affiliations()
+    Cursor all_publications_cursor(); // Same items and order as all_publications()
+    Cursor publications_cursor(AffiliationID id); // Same as get_publications()
+    Cursor all_references_cursor(PublicationID id); // Same as get_all_references()
+
+    // Estimate of performance: O(k + log(n))
+    // Short rationale for estimate: The position is found again with map.upper_bound()
+    // (logarithmic) and then k items are copied. Reference cursor keeps its depth first
+    // stack so it doesn't need a lookup.
+    // Replaces page with at most page_size next items. Returns false when the cursor has
+    // ended (page is then empty).
+    bool next_page(Cursor& cursor, std::vector<AffiliationID>& page, std::size_t page_size);
+    bool next_page(Cursor& cursor, std::vector<PublicationID>& page, std::size_t page_size);
+
+
+    // Batch queries
+
+    // Estimate of performance: O(m*log(m) + m*log(n))
+    // Short rationale for estimate: The m ids are sorted and looked up in order, each
+    // search continuing from the previous one's position (see ShardedMap::find_many()).
+    // Results are then copied in the order of ids, prefetching a few items ahead.
+    // Same results as calling the single id operation for each id (also in the workload
+    // trace), but with one lock for the whole batch.
+    std::vector<Name> get_publication_names(std::vector<PublicationID> const& ids);
+    std::vector<Year> get_publication_years(std::vector<PublicationID> const& ids);
+    std::vector<PublicationID> get_parents(std::vector<PublicationID> const& ids);
+    std::vector<Coord> get_affiliation_coords(std::vector<AffiliationID> const& ids);
+
+    // Name, year and parent of a publication (NO_NAME, NO_YEAR and NO_PUBLICATION if it
+    // doesn't exist).
+    struct PublicationInfo
+    {
+        Name name;
+        Year year;
+        PublicationID parent;
+    };
+    // The three queries above in one batch, so that all fields of a publication come from
+    // the same state of the data even if other threads change it. Recorded in the
+    // workload trace as one batch query of its own.
+    std::vector<PublicationInfo> get_publications_info(std::vector<PublicationID> const& ids);
+    static constexpr char const* BATCH_QUERIES_ESTIMATE = "log n"; // M is fixed during perftest
+
+
+    // Bulk insertion
+
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: Only a flag is set.
+    // Between begin_bulk() and end_bulk() add_affiliation, add_publication, add_reference and
+    // add_affiliation_to_publication only append to staging vectors (amortized constant).
+    // They then return always true: duplicates and missing ids are detected and counted
+    // in end_bulk(). Queries see only committed data
+    // until end_bulk(). Other mutations commit the staged data first.
+    void begin_bulk();
+
+    // Estimate of performance: O(k*log(k) + k*log(n))
+    // Short rationale for estimate: k staged items are sorted by id and inserted into maps
+    // in order using the previous position as hint, which is amortized constant when new ids
+    // are adjacent and logarithmic otherwise. References and connections are resolved with
+    // binary search from the sorted staging vectors.
+    // Returns the number of staged operations that were rejected.
+    unsigned int end_bulk();
+
+    // Operations collected by one thread for add_bulk(), without locking. Each thread of a
+    // parallel ingest fills its own partition from its part of the input.
+    class BulkPartition;
+
+    // Estimate of performance: O(k*log(k)/t + k*log(n)/t + m*(log(k) + log(n)))
+    // Short rationale for estimate: The partitions are sorted by t threads into runs, which
+    // are merged in parallel. The k affiliations and publications are inserted in id order
+    // with a thread for each group of shards (see set_shard_count(), one thread if there is
+    // one shard). The m references and connections are then resolved in one thread like in
+    // end_bulk().
+    // Commits the operations of the partitions as one bulk. All affiliations and publications
+    // are added before the references and connections, so these can refer to ones of any
+    // partition. Of duplicate ids the first in partition order is kept. The partitions are
+    // emptied. Returns the number of operations that were rejected.
+    unsigned int add_bulk(std::vector<BulkPartition>& partitions);
+
+
+    // Persistence (write-ahead log and snapshots)
+
+    // Attaches a log where every successful mutation is recorded, nullptr detaches.
+    void set_mutation_log(MutationLog* log);
+
+    // Attaches a feed where every successful mutation is published for subscribers, nullptr
+    // detaches. Bulk operations are published when they are committed (only the accepted ones),
+    // and load_snapshot() as clear_all followed by the loaded data.
+    void set_change_feed(ChangeFeed* feed);
+
+    // Attaches a trace where every call of the functions above is recorded, nullptr detaches.
+    void set_workload_trace(WorkloadTrace* trace);
+
+
+    // Concurrent use
+
+    // NONE: no synchronization, for one thread (default). EXCLUSIVE: every operation takes
+    // one lock, so calls from several threads run one at a time. SHARED: queries take the
+    // lock shared and run in parallel, mutations take it exclusively. In SHARED mode the
+    // ordered caches of get_affiliations_alphabetically() and
+    // get_affiliations_distance_increasing() are rebuilt by the first query after a change
+    // and the other queries use that result.
+    // SNAPSHOT: queries don't lock at all. They read one of two copies of the data. A
+    // mutation is made to the data and then to the copy that no query reads, and queries
+    // are switched to that copy. The other copy gets the mutation at the next change, once
+    // the queries still reading it have finished (the writer waits for them, queries never
+    // wait). So a mutation costs about three times as much as in NONE mode. Bulk commits
+    // (end_bulk(), add_bulk()), load_snapshot() and set_shard_count() copy all data
+    // instead, once per call. Writers run one at a time, and cursors lock like writers.
+    // STRIPED: like SHARED, but with a lock for each shard (see set_shard_count()).
+    // Operations on one affiliation or publication (and add_reference() and
+    // add_affiliation_to_publication()) lock only the shards of their ids, so writers
+    // of different shards run in parallel. Other operations lock every shard.
+    // Must not be changed while other threads are using the object. Attached logs and
+    // traces record the calls while holding the lock, so they see them in the order they
+    // got it. Queries of SNAPSHOT mode don't lock and are traced before they read.
+    enum class Concurrency { NONE, EXCLUSIVE, SHARED, SNAPSHOT, STRIPED };
+
+    // Estimate of performance: O(1), O(n*log(n)) when switching to SNAPSHOT
+    // Short rationale for estimate: Only the mode is stored, SNAPSHOT makes the two copies
+    // of the data (see copy_data()).
+    void set_concurrency(Concurrency concurrency);
+    Concurrency concurrency() const;
+
+    // Estimate of performance: O(n*log(n))
+    // Short rationale for estimate: Every affiliation and publication is moved to the map
+    // of its new shard (by hash of id). Items themselves aren't copied.
+    // Affiliations and publications are both split into count shards (1 by default).
+    // Listings merge the shards, so results are the same with any count.
+    // Must not be called while other threads are using the object.
+    void set_shard_count(unsigned int count);
+    unsigned int shard_count() const;
+
+    // Threads used for sorting listings of at least sort_min_items() items
+    // (get_affiliations_alphabetically(), get_affiliations_distance_increasing() and
+    // get_publications_after()), 0 for one per hardware thread (the default). Smaller
+    // listings, and all with 1 thread, are sorted in the calling thread. The minimum is
+    // PARALLEL_SORT_THRESHOLD by default, smaller ones are mostly useful for testing.
+    void set_sort_threads(unsigned int threads);
+    unsigned int sort_threads() const;
+    void set_sort_min_items(std::size_t items);
+    std::size_t sort_min_items() const;
+    static std::size_t const PARALLEL_SORT_THRESHOLD = 1 << 15;
+
+    // Threads used for listing subtrees of more than traversal_min_items() publications
+    // in get_all_references(), 0 for one per hardware thread (the default). The result is
+    // the same with any number of threads. The minimum is PARALLEL_TRAVERSAL_THRESHOLD by
+    // default.
+    void set_traversal_threads(unsigned int threads);
+    unsigned int traversal_threads() const;
+    void set_traversal_min_items(std::size_t items);
+    std::size_t traversal_min_items() const;
+    static std::size_t const PARALLEL_TRAVERSAL_THRESHOLD = 1 << 15;
+
+    // Threads used for committing bulks (end_bulk() and add_bulk()) of at least
+    // ingest_min_items() affiliations or publications, 0 for one per hardware thread (the
+    // default). Callers of add_bulk() use it as the number of partitions. The minimum is
+    // PARALLEL_INGEST_THRESHOLD by default.
+    void set_ingest_threads(unsigned int threads);
+    unsigned int ingest_threads() const;
+    void set_ingest_min_items(std::size_t items);
+    std::size_t ingest_min_items() const;
+    static std::size_t const PARALLEL_INGEST_THRESHOLD = 1 << 15;
+
+    // Thread count of a setting above (0 = hardware threads).
+    static unsigned int worker_threads(unsigned int setting);
+
+    // Estimate of performance: O(n)
+    // Short rationale for estimate: Every affiliation and publication is encoded once
+    // to a buffer which is written to the file with one write.
+    // sequence is the last log sequence number included in the snapshot.
+    bool save_snapshot(std::string const& filename, unsigned long long sequence);
+
+    // Estimate of performance: O(n*log(n))
+    // Short rationale for estimate: Every affiliation and publication is inserted to a map
+    // (logarithmic) and references are resolved with map.find().
+    // Returns false and keeps the current data if the file is missing, truncated or
+    // corrupt (counts larger than the file, ids out of order or repeated, two parents).
+    // An attached change feed gets a clear_all event and then additions of the loaded data.
+    bool load_snapshot(std::string const& filename, unsigned long long& sequence);
+
+
+    // The estimates above as complexity classes ("1", "log n", "n", "n log n", "n^2"),
+    // keyed by perftest command name. The *_ESTIMATE constants are next to the
+    // estimate comments so that they are updated together. perftest fits the measured
+    // times over its N series and warns if they grow faster than the estimate. Estimates
+    // are upper bounds and perftest uses random data, so slower growth is not a warning.
+    inline static std::vector<std::pair<std::string, std::string>> const PERFORMANCE_ESTIMATES = {
+        {"get_affiliation_count", GET_AFFILIATION_COUNT_ESTIMATE},
+        {"get_all_affiliations", GET_ALL_AFFILIATIONS_ESTIMATE},
+        {"affiliation_info", GET_AFFILIATION_NAME_ESTIMATE}, // And GET_AFFILIATION_COORD_ESTIMATE
+        {"get_affiliations_alphabetically", GET_AFFILIATIONS_ALPHABETICALLY_ESTIMATE},
+        {"get_affiliations_distance_increasing", GET_AFFILIATIONS_DISTANCE_INCREASING_ESTIMATE},
+        {"find_affiliation_with_coord", FIND_AFFILIATION_WITH_COORD_ESTIMATE},
+        {"change_affiliation_coord", CHANGE_AFFILIATION_COORD_ESTIMATE},
+        {"get_all_publications", ALL_PUBLICATIONS_ESTIMATE},
+        {"publication_info", GET_PUBLICATION_NAME_ESTIMATE}, // And GET_PUBLICATION_YEAR_ESTIMATE
+        {"get_affiliations", GET_AFFILIATIONS_ESTIMATE},
+        {"get_direct_references", GET_DIRECT_REFERENCES_ESTIMATE},
+        {"add_affiliation_to_publication", ADD_AFFILIATION_TO_PUBLICATION_ESTIMATE},
+        {"get_publications", GET_PUBLICATIONS_ESTIMATE},
+        {"get_parent", GET_PARENT_ESTIMATE},
+        {"get_publications_after", GET_PUBLICATIONS_AFTER_ESTIMATE},
+        {"get_referenced_by_chain", GET_REFERENCED_BY_CHAIN_ESTIMATE},
+        {"get_all_references", GET_ALL_REFERENCES_ESTIMATE},
+        {"get_affiliations_closest_to", GET_AFFILIATIONS_CLOSEST_TO_ESTIMATE},
+        {"remove_affiliation", REMOVE_AFFILIATION_ESTIMATE},
+        {"get_closest_common_parent", GET_CLOSEST_COMMON_PARENT_ESTIMATE},
+        {"remove_publication", REMOVE_PUBLICATION_ESTIMATE},
+        {"publications_info", BATCH_QUERIES_ESTIMATE},
+        {"affiliation_coords", BATCH_QUERIES_ESTIMATE},
+    };
 
 
 private:
@@ -256,14 +512,16 @@ private:
     };
 
     // Map for affiliations.
-    std::map<AffiliationID, Affiliation> affiliationsMap_;
+    ShardedMap<AffiliationID, Affiliation> affiliationsMap_;
 
     //std::map<CoordHash, AffiliationID> sortedCoordinatesMap_;
     //std::map<Name, AffiliationID> sortedNameMap_;
     std::vector<AffiliationID> sortedNameVector_; // Works as "temporary memory".
     std::vector<AffiliationID> sortedCoordVector_; // Works as "temporary memory".
-    bool changedNames_; // False if new information has been added.
-    bool changedCoordinates_; // False if new information has been added.
+    // True if the vectors above have to be rebuilt. Atomic, because in SHARED mode a query
+    // rebuilding a vector publishes it to other queries by clearing the flag.
+    std::atomic<bool> changedNames_;
+    std::atomic<bool> changedCoordinates_;
 
     // Publications and referencenses in a tree structure.
     struct Node
@@ -272,7 +530,7 @@ private:
         Name name;
         Year year;
         std::vector<AffiliationID> affiliations;
-        std::vector<std::shared_ptr<Node>> referencing;
+        std::vector<Node*> referencing; // Publications referencing this one (owned by publicationsMap_).
         Node* parent;
 
         // Node constructor.
@@ -286,20 +544,315 @@ private:
     };
 
     // Map for publication information.
-    std::map<PublicationID, Node> publicationsMap_;
+    ShardedMap<PublicationID, Node> publicationsMap_;
 
     // Has been made constant so that these can only be created once.
     std::vector<AffiliationID> const no_affiliations_vector_ = {NO_AFFILIATION};
     std::vector<PublicationID> const no_publications_vector_ = {NO_PUBLICATION};
     std::vector<std::pair<Year, PublicationID>> const no_year_no_pub_vector = {std::pair<Year, PublicationID>(NO_YEAR, NO_PUBLICATION)};
 
-    // Private function to be able to iterate through tree structure parents recursively.
+    // get_referenced_by_chain() without recording the call (used by other operations).
+    std::vector<PublicationID> referenced_by_chain(PublicationID id);
+
+    // Listings of get_affiliations_alphabetically() and get_affiliations_distance_increasing()
+    // sorted from the data, without the caches (used by them and by SNAPSHOT mode).
+    std::vector<AffiliationID> affiliations_by_name() const;
+    std::vector<AffiliationID> affiliations_by_distance() const;
+
+    // Estimate of performance: O(n)
+    // Short rationale for estimate: One event for each item and link, see load_snapshot().
+    void publish_all_to_feed();
+
+    // clear_all() and next_page() without recording or locking (used by other operations).
+    void clear_data();
+    bool fill_page(Cursor& cursor, std::vector<PublicationID>& page, std::size_t page_size);
+
+    // Private function to iterate through tree structure parents.
     // Estimate of performance: O(n)
-    // Short rationale for estimate: Recursive function. At worst there can be n-1 parents and
-    // has to go through all of those.
+    // Short rationale for estimate: Loops through the parents. At worst there can be n-1 parents
+    // and has to go through all of those.
     std::vector<PublicationID> iterate_parents(std::vector<PublicationID>& vec, Node* parent);
 
-    //std::vector<PublicationID> iterate_references(std::vector<PublicationID>& vec, std::vector<std::shared_ptr<Node>>& referencing);
+    // Staging vectors for bulk insertion, see begin_bulk().
+    struct StagedAffiliation
+    {
+        AffiliationID id;
+        Name name;
+        Coord coordinates;
+        std::size_t order; // Position among staged affiliations.
+        Affiliation* inserted; // Set in commit, nullptr if id existed already.
+    };
+    struct StagedPublication
+    {
+        PublicationID id;
+        Name name;
+        Year year;
+        std::vector<AffiliationID> affiliations;
+        std::size_t order; // Position among staged publications.
+        Node* inserted; // Set in commit, nullptr if id existed already.
+    };
+    struct StagedReference
+    {
+        PublicationID id;
+        PublicationID parentid;
+        std::size_t publications_before; // Publications staged before this operation.
+    };
+    struct StagedConnection
+    {
+        AffiliationID affiliationid;
+        PublicationID publicationid;
+        std::size_t affiliations_before; // Affiliations staged before this operation.
+        std::size_t publications_before;
+    };
+    bool bulk_ = false;
+    std::vector<StagedAffiliation> stagedAffiliations_;
+    std::vector<StagedPublication> stagedPublications_;
+    std::vector<StagedReference> stagedReferences_;
+    std::vector<StagedConnection> stagedConnections_;
+
+    // Estimate of performance: O(k*log(k) + k*log(n))
+    // Short rationale for estimate: See end_bulk().
+    unsigned int commit_staged();
+
+    // Estimate of performance: O(k*log(n)/t)
+    // Short rationale for estimate: Inserted in order with hints, a thread for each group of shards.
+    // Inserts staged affiliations or publications (sorted by id and order) into map. Only the first
+    // of equal ids is inserted. Returns the number of the others and of ids which existed already.
+    template <typename Staged, typename Map, typename MakeValue>
+    unsigned int insert_staged(std::vector<Staged>& staged, Map& map, MakeValue make_value);
+
+    // Estimate of performance: O(m*(log(k) + log(n)))
+    // Short rationale for estimate: See find_for_staged().
+    // Applies staged references and connections after insert_staged(), and empties the staging.
+    unsigned int resolve_staged();
+
+    // Finds an affiliation/publication which existed before the operation staged
+    // as number "before" in the bulk. nullptr if not found.
+    // Estimate of performance: O(log(k) + log(n))
+    // Short rationale for estimate: Binary search from staging vector, map.find() otherwise.
+    Affiliation* find_for_staged(AffiliationID const& id, std::size_t before);
+    Node* find_for_staged(PublicationID id, std::size_t before);
+
+    // Sorts a listing, in parallel if it's large enough (see set_sort_threads()). Both ways
+    // are stable, so equal items keep their order with any number of threads.
+    template <typename Item, typename Compare>
+    void sort_listing(std::vector<Item>& items, Compare comp) const;
+    std::atomic<unsigned int> sort_threads_{0};
+    std::atomic<std::size_t> sort_min_items_{PARALLEL_SORT_THRESHOLD};
+    std::atomic<unsigned int> traversal_threads_{0};
+    std::atomic<std::size_t> traversal_min_items_{PARALLEL_TRAVERSAL_THRESHOLD};
+    std::atomic<unsigned int> ingest_threads_{0};
+    std::atomic<std::size_t> ingest_min_items_{PARALLEL_INGEST_THRESHOLD};
+
+    // Incremented by removals and clear_all(), ends cursors created before.
+    unsigned long long generation_ = 0;
+
+    // Log of mutations, nullptr when logging is not in use.
+    MutationLog* mutation_log_ = nullptr;
+
+    // Feed of mutations, nullptr when not in use.
+    ChangeFeed* change_feed_ = nullptr;
+
+    // Trace of calls, nullptr when tracing is not in use.
+    WorkloadTrace* workload_trace_ = nullptr;
+
+    // Lock of one public operation (shared for queries in SHARED and STRIPED modes), see
+    // set_concurrency(). Nothing is locked when concurrency is NONE.
+    class OperationLock
+    {
+    public:
+        // Locks all data (every stripe in STRIPED mode).
+        OperationLock(Datastructures& ds, bool write);
+        // In STRIPED mode locks only the stripes of the given ids (nullptr if not used),
+        // otherwise all data.
+        OperationLock(Datastructures& ds, bool write, AffiliationID const* affiliation,
+                      PublicationID const* publication, PublicationID const* publication2 = nullptr);
+        // Publishes a new snapshot before unlocking, if data was changed in SNAPSHOT mode.
+        ~OperationLock();
+
+        OperationLock(OperationLock const&) = delete;
+        OperationLock& operator=(OperationLock const&) = delete;
+
+        // Called by mutations when they have changed something. In SNAPSHOT mode the copies
+        // are then copied from all data (used by bulk commits).
+        void changed();
+        // As changed(), but in SNAPSHOT mode the copies get the change by change(copy), which
+        // makes the same call to the copy as was made to the data.
+        template <typename Change>
+        void changed(Change&& change)
+        {
+            changed_ = true;
+            if (ds_.concurrency_ == Concurrency::SNAPSHOT) {
+                ds_.record_snapshot_change(std::forward<Change>(change));
+            }
+        }
+        // Replaces the stripe locks with an exclusive lock of all data (for operations that
+        // find out they have to touch everything, e.g. to commit staged bulk data).
+        void lock_all();
+
+    private:
+        void lock_data(); // data_mutex_, or all stripes in STRIPED mode.
+        void lock(std::shared_mutex& mutex, std::atomic<unsigned int>& waiting_writers);
+        void unlock();
+
+        Datastructures& ds_;
+        bool shared_ = false;
+        bool changed_ = false;
+        bool all_stripes_ = false; // All stripes of STRIPED mode are held.
+        std::shared_mutex* held_[3] = {nullptr, nullptr, nullptr}; // data_mutex_ or the stripes of the ids.
+    };
+
+    // Lock of the staging vectors, for bulk additions to different stripes at the same time.
+    // Locked only in STRIPED mode.
+    std::unique_lock<std::mutex> lock_staging();
+    // Lock of change_feed_, which has a single producer. Locked only in STRIPED mode, where
+    // mutations of different stripes run at the same time.
+    std::unique_lock<std::mutex> lock_feed();
+
+    Concurrency concurrency_ = Concurrency::NONE;
+    std::shared_mutex data_mutex_;
+    std::atomic<unsigned int> waiting_writers_{0}; // New queries wait while a writer is waiting.
+    std::mutex cache_mutex_; // Held by a query while it rebuilds an ordered cache.
+    std::mutex staging_mutex_;
+    std::mutex feed_mutex_;
+
+    // Locks of STRIPED mode, one for each shard of affiliationsMap_ and publicationsMap_.
+    // Taken in order: affiliation stripes by index and then publication stripes by index.
+    struct alignas(64) Stripe
+    {
+        std::shared_mutex mutex;
+        std::atomic<unsigned int> waiting_writers{0}; // As waiting_writers_, for this stripe.
+    };
+    std::unique_ptr<Stripe[]> affiliation_stripes_;
+    std::unique_ptr<Stripe[]> publication_stripes_;
+    void allocate_stripes();
+
+    // Counter of the queries reading a copy of SNAPSHOT mode. Queries are counted in
+    // READER_STRIPES counters by thread, each in its own cache line, so that readers don't
+    // slow each other down.
+    struct alignas(64) ReaderCount
+    {
+        std::atomic<unsigned long> count{0};
+    };
+    static unsigned int const READER_STRIPES = 64;
+    // Counter stripe of the calling thread (threads take them in turns).
+    static unsigned int reader_stripe();
+
+    // One of the two copies of SNAPSHOT mode, see Concurrency.
+    struct SnapshotCopy
+    {
+        ~SnapshotCopy();
+
+        std::unique_ptr<Datastructures> data;
+        // Changes made after data was last updated, applied in order by publish_snapshot().
+        std::vector<std::function<void(Datastructures&)>> changes;
+        bool stale = true; // data has to be copied instead (bulk commits etc.).
+        std::unique_ptr<ReaderCount[]> readers{new ReaderCount[READER_STRIPES]};
+        // Ordered listings of get_affiliations_alphabetically() and
+        // get_affiliations_distance_increasing(), nullptr until a query has made them.
+        // Queries store them with compare-exchange (the first one wins) and writers free
+        // them when the copy changes, so reading them doesn't lock.
+        std::atomic<std::vector<AffiliationID>*> by_name{nullptr};
+        std::atomic<std::vector<AffiliationID>*> by_distance{nullptr};
+    };
+
+    // A query counts itself as a reader of the copy that queries read, and checks that
+    // the copy wasn't switched before it was counted (otherwise it tries again). A writer
+    // changes a copy only when it isn't switched to and its count is zero.
+    class SnapshotReader
+    {
+    public:
+        explicit SnapshotReader(Datastructures& ds);
+        ~SnapshotReader();
+
+        SnapshotReader(SnapshotReader const&) = delete;
+        SnapshotReader& operator=(SnapshotReader const&) = delete;
+
+        Datastructures* operator->() const { return copy_->data.get(); }
+
+        // Listing of the copy, made by make_listing() if no query has made it yet.
+        template <typename MakeListing>
+        std::vector<AffiliationID> listing(std::atomic<std::vector<AffiliationID>*> SnapshotCopy::* cache,
+                                           MakeListing make_listing) const;
+
+    private:
+        SnapshotCopy* copy_;
+        std::atomic<unsigned long>* count_;
+    };
+
+    // Estimate of performance: O(c), O(n*log(n)) after a bulk commit
+    // Short rationale for estimate: The c changes since the last update are applied to the
+    // copy that queries don't read (each as fast as the operation itself). A stale copy
+    // is replaced with a copy of all data instead.
+    // Called by writers (holding the lock) after each change.
+    void publish_snapshot();
+    // Changes waiting for publish_snapshot(). The change is applied to both copies.
+    void record_snapshot_change(std::function<void(Datastructures&)> change);
+    // Waits until no query reads the copy.
+    void wait_for_readers(SnapshotCopy& copy);
+    // Estimate of performance: O(n*log(n))
+    // Short rationale for estimate: Maps are copied (linear) and the reference links of
+    // the copies are redirected with map.find() (logarithmic).
+    void copy_data(SnapshotCopy& snapshot);
+    void free_snapshots();
+
+    SnapshotCopy snapshot_copies_[2];
+    std::atomic<unsigned int> snapshot_index_{0}; // The copy queries read.
+
+    // Identifies snapshot files (and their format version).
+    inline static std::string const SNAPSHOT_MAGIC = "DSSNAP02";
+    // Smallest possible encoded affiliation and publication (empty strings and lists),
+    // for checking the counts of a snapshot against its size.
+    static std::size_t const MIN_SNAPSHOT_AFFILIATION_SIZE = 4 + 4 + 4 + 4 + 4;
+    static std::size_t const MIN_SNAPSHOT_PUBLICATION_SIZE = 8 + 4 + 2 + 4 + 4 + 8;
+
+    //std::vector<PublicationID> iterate_references(std::vector<PublicationID>& vec, std::vector<Node*>& referencing);
+};
+
+class Datastructures::Cursor
+{
+private:
+    friend class Datastructures;
+
+    enum class Kind { ALL_AFFILIATIONS, ALL_PUBLICATIONS, PUBLICATIONS, ALL_REFERENCES };
+
+    Cursor(Kind kind, unsigned long long generation) : kind_(kind), generation_(generation) {}
+
+    Kind kind_;
+    unsigned long long generation_;
+    bool started_ = false;
+    bool done_ = false;
+    AffiliationID affiliation_; // Last one returned, or the one whose publications are listed.
+    PublicationID publication_ = NO_PUBLICATION; // Last one returned.
+    std::size_t offset_ = 0; // Position in the affiliation's publication list.
+    std::vector<std::pair<Node const*, std::size_t>> stack_; // Depth first position: node, next child.
+};
+
+class Datastructures::BulkPartition
+{
+public:
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: Operations are appended to vectors (amortized constant).
+    // Same parameters as the operations of Datastructures. Nothing is checked before add_bulk().
+    void add_affiliation(AffiliationID id, Name const& name, Coord xy);
+    void add_publication(PublicationID id, Name const& name, Year year, std::vector<AffiliationID> const& affiliations);
+    void add_reference(PublicationID id, PublicationID parentid);
+    void add_affiliation_to_publication(AffiliationID affiliationid, PublicationID publicationid);
+
+    // Estimate of performance: O(k*log(k))
+    // Short rationale for estimate: Affiliations and publications are sorted by id.
+    // Sorts the partition into runs in the calling thread (add_bulk() sorts the partitions
+    // which aren't sorted yet).
+    void sort();
+
+private:
+    friend class Datastructures;
+
+    std::vector<StagedAffiliation> affiliations_;
+    std::vector<StagedPublication> publications_;
+    std::vector<StagedReference> references_;
+    std::vector<StagedConnection> connections_;
+    bool sorted_ = true;
 };
 
 #endif // DATASTRUCTURES_HH
@@ -0,0 +1,514 @@
+// Importer.cc
+
+#include "importer.hh"
+
+#include <charconv>
+#include <fstream>
+#include <iterator>
+#include <algorithm>
+#include <thread>
+
+namespace
+{
+
+template <typename Type>
+bool parse_number(std::string const& str, Type& value)
+{
+    auto first = str.data();
+    auto last = str.data() + str.size();
+    while (first != last && *first == ' ') { ++first; }
+    while (last != first && *(last-1) == ' ') { --last; }
+    auto [ptr, ec] = std::from_chars(first, last, value);
+    return ec == std::errc() && ptr == last && first != last;
+}
+
+// Converts a whole column to numbers, fails on the first bad value.
+template <typename Type>
+bool convert_column(std::vector<std::string> const& column, std::vector<Type>& values, std::string const& name, std::string& error)
+{
+    values.resize(column.size());
+    for (std::size_t i = 0; i < column.size(); ++i) { // O(n)
+        if (!parse_number(column[i], values[i])) {
+            error = "Invalid value '" + column[i] + "' in column '" + name + "' on row " + std::to_string(i+1);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Adds rows [0, rows) as one bulk. Each ingest thread stages its own range of rows to a
+// partition of its own (see Datastructures::add_bulk()). Returns the number of rows rejected.
+template <typename AddRow>
+unsigned int add_rows(unsigned long rows, Datastructures& ds, AddRow add_row)
+{
+    unsigned long count = (rows >= ds.ingest_min_items()) ? Datastructures::worker_threads(ds.ingest_threads()) : 1;
+    std::vector<Datastructures::BulkPartition> partitions(count);
+    auto fill = [&](unsigned long p) {
+        for (unsigned long i = rows * p / count; i < rows * (p + 1) / count; ++i) { // O(n/t)
+            add_row(partitions[p], i);
+        }
+        partitions[p].sort();
+    };
+    std::vector<std::thread> workers;
+    for (unsigned long p = 1; p < count; ++p) {
+        workers.emplace_back(fill, p);
+    }
+    fill(0);
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    return ds.add_bulk(partitions);
+}
+
+// Splits "a;b;c" into a list, empty items are dropped.
+std::vector<AffiliationID> split_list(std::string const& str)
+{
+    std::vector<AffiliationID> items;
+    std::string::size_type start = 0;
+    while (start <= str.size()) {
+        auto end = str.find(';', start);
+        if (end == std::string::npos) { end = str.size(); }
+        if (end > start) { items.push_back(str.substr(start, end-start)); }
+        start = end + 1;
+    }
+    return items;
+}
+
+// True if id is a valid affiliation id, the same as the command interpreter accepts
+// (letters, digits and '-').
+bool valid_affiliation_id(std::string const& id)
+{
+    return !id.empty() && std::all_of(id.begin(), id.end(), [](char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-';
+    });
+}
+
+// Checks a whole column of affiliation ids, or of lists of them ("a;b;c") if list is
+// true. Fails on the first bad value.
+bool check_affiliation_ids(std::vector<std::string> const& column, std::string const& name, std::string& error,
+                           bool list = false)
+{
+    for (std::size_t i = 0; i < column.size(); ++i) { // O(n)
+        auto ids = list ? split_list(column[i]) : std::vector<AffiliationID>{column[i]};
+        if (!std::all_of(ids.begin(), ids.end(), valid_affiliation_id)) {
+            error = "Invalid value '" + column[i] + "' in column '" + name + "' on row " + std::to_string(i+1);
+            return false;
+        }
+    }
+    return true;
+}
+
+void skip_space(char const*& pos, char const* end)
+{
+    while (pos != end && (*pos == ' ' || *pos == '\t' || *pos == '\r')) { ++pos; }
+}
+
+void append_utf8(std::string& str, unsigned int code)
+{
+    if (code < 0x80) {
+        str.push_back(static_cast<char>(code));
+    }
+    else if (code < 0x800) {
+        str.push_back(static_cast<char>(0xC0 | (code >> 6)));
+        str.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+    }
+    else if (code < 0x10000) {
+        str.push_back(static_cast<char>(0xE0 | (code >> 12)));
+        str.push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3F)));
+        str.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+    }
+    else {
+        str.push_back(static_cast<char>(0xF0 | (code >> 18)));
+        str.push_back(static_cast<char>(0x80 | ((code >> 12) & 0x3F)));
+        str.push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3F)));
+        str.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+    }
+}
+
+// Parses the four hex digits after "\u", pos is at the 'u'.
+bool parse_json_hex4(char const* pos, char const* end, unsigned int& code)
+{
+    if (end - pos < 5) { return false; }
+    auto [ptr, ec] = std::from_chars(pos+1, pos+5, code, 16);
+    return ec == std::errc() && ptr == pos+5;
+}
+
+// Parses a JSON string starting at the opening quote.
+bool parse_json_string(char const*& pos, char const* end, std::string& value)
+{
+    if (pos == end || *pos != '"') { return false; }
+    ++pos;
+    value.clear();
+    while (pos != end && *pos != '"') {
+        if (*pos == '\\') {
+            if (++pos == end) { return false; }
+            switch (*pos) {
+            case 'n': value.push_back('\n'); break;
+            case 't': value.push_back('\t'); break;
+            case 'r': value.push_back('\r'); break;
+            case 'b': value.push_back('\b'); break;
+            case 'f': value.push_back('\f'); break;
+            case 'u': {
+                unsigned int code = 0;
+                if (!parse_json_hex4(pos, end, code)) { return false; }
+                pos += 4;
+                if (code >= 0xDC00 && code <= 0xDFFF) { return false; } // Low surrogate alone
+                if (code >= 0xD800 && code <= 0xDBFF) {
+                    // Characters outside the BMP are a high and a low surrogate: \uD83D\uDE00
+                    unsigned int low = 0;
+                    if (end - pos < 3 || pos[1] != '\\' || pos[2] != 'u' ||
+                        !parse_json_hex4(pos+2, end, low) || low < 0xDC00 || low > 0xDFFF) {
+                        return false;
+                    }
+                    code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                    pos += 6;
+                }
+                append_utf8(value, code);
+                break;
+            }
+            default: value.push_back(*pos); // \" \\ \/
+            }
+            ++pos;
+        }
+        else {
+            value.push_back(*pos++);
+        }
+    }
+    if (pos == end) { return false; }
+    ++pos; // Closing quote
+    return true;
+}
+
+// Parses a scalar (string, number, true/false/null) or an array of scalars.
+// Array items are joined with ';' to match the CSV list representation. null sets
+// is_null (also when it is an array item), so that the caller can reject it.
+bool parse_json_value(char const*& pos, char const* end, std::string& value, bool& is_null)
+{
+    skip_space(pos, end);
+    if (pos == end) { return false; }
+    if (*pos == '"') {
+        return parse_json_string(pos, end, value);
+    }
+    if (*pos == '[') {
+        ++pos;
+        value.clear();
+        skip_space(pos, end);
+        if (pos != end && *pos == ']') { ++pos; return true; }
+        while (true) {
+            std::string item;
+            if (!parse_json_value(pos, end, item, is_null)) { return false; }
+            if (!value.empty()) { value.push_back(';'); }
+            value += item;
+            skip_space(pos, end);
+            if (pos == end) { return false; }
+            if (*pos == ']') { ++pos; return true; }
+            if (*pos != ',') { return false; }
+            ++pos;
+        }
+    }
+    auto start = pos;
+    while (pos != end && *pos != ',' && *pos != '}' && *pos != ']' && *pos != ' ' && *pos != '\t') { ++pos; }
+    value.assign(start, pos);
+    if (value == "null") {
+        is_null = true;
+    }
+    return !value.empty();
+}
+
+}
+
+std::vector<std::string> const* Importer::Table::column(std::string const& name) const
+{
+    auto iter = std::find(names.begin(), names.end(), name);
+    return (iter != names.end()) ? &columns[iter - names.begin()] : nullptr;
+}
+
+bool Importer::format_from_filename(std::string const& filename, Format& format)
+{
+    auto ends_with = [&filename](std::string const& suffix) {
+        return filename.size() >= suffix.size() && filename.compare(filename.size()-suffix.size(), suffix.size(), suffix) == 0;
+    };
+    if (ends_with(".csv")) {
+        format = Format::CSV;
+        return true;
+    }
+    if (ends_with(".jsonl") || ends_with(".json")) {
+        format = Format::JSONL;
+        return true;
+    }
+    return false;
+}
+
+Importer::Result Importer::import_file(std::string const& filename, Kind kind, Format format, Datastructures& ds)
+{
+    Result result;
+    std::ifstream input(filename, std::ios::binary);
+    if (!input) {
+        result.error = "Cannot open file '" + filename + "'";
+        return result;
+    }
+    std::string data((std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>()); // O(n)
+
+    Table table;
+    bool parsed = (format == Format::CSV) ? parse_csv(data, table, result.error) : parse_jsonl(data, table, result.error);
+    if (!parsed) {
+        return result;
+    }
+
+    switch (kind) {
+    case Kind::AFFILIATIONS: return insert_affiliations(table, ds);
+    case Kind::PUBLICATIONS: return insert_publications(table, ds);
+    case Kind::REFERENCES: return insert_references(table, ds);
+    case Kind::CONNECTIONS: return insert_connections(table, ds);
+    }
+    return result;
+}
+
+bool Importer::parse_csv(std::string const& data, Table& table, std::string& error)
+{
+    table = Table();
+
+    std::vector<std::string> row;
+    std::string field;
+    unsigned long line = 1;
+    bool header = true;
+    auto pos = data.begin();
+    auto end = data.end();
+
+    // Appends the finished row either as the header or to the columns.
+    auto finish_row = [&]() {
+        if (row.size() == 1 && row.front().empty()) { // Empty line
+            row.clear();
+            return true;
+        }
+        if (header) {
+            table.names = row;
+            table.columns.resize(row.size());
+            header = false;
+        }
+        else {
+            if (row.size() != table.names.size()) {
+                error = "Line " + std::to_string(line) + " has " + std::to_string(row.size()) +
+                        " fields, header has " + std::to_string(table.names.size());
+                return false;
+            }
+            for (std::size_t i = 0; i < row.size(); ++i) {
+                table.columns[i].push_back(std::move(row[i]));
+            }
+            ++table.rows;
+        }
+        row.clear();
+        return true;
+    };
+
+    while (pos != end) { // O(n)
+        char c = *pos++;
+        if (c == '"' && field.empty()) {
+            // Quoted field, "" inside it is a quote character
+            while (true) {
+                if (pos == end) {
+                    error = "Unterminated quote on line " + std::to_string(line);
+                    return false;
+                }
+                char q = *pos++;
+                if (q == '"') {
+                    if (pos != end && *pos == '"') { field.push_back('"'); ++pos; }
+                    else { break; }
+                }
+                else {
+                    if (q == '\n') { ++line; }
+                    field.push_back(q);
+                }
+            }
+        }
+        else if (c == ',') {
+            row.push_back(std::move(field));
+            field.clear();
+        }
+        else if (c == '\n') {
+            row.push_back(std::move(field));
+            field.clear();
+            if (!finish_row()) { return false; }
+            ++line;
+        }
+        else if (c != '\r') {
+            field.push_back(c);
+        }
+    }
+    if (!field.empty() || !row.empty()) {
+        row.push_back(std::move(field));
+        if (!finish_row()) { return false; }
+    }
+
+    if (header) {
+        error = "No header row";
+        return false;
+    }
+    return true;
+}
+
+bool Importer::parse_jsonl(std::string const& data, Table& table, std::string& error)
+{
+    table = Table();
+
+    unsigned long line = 0;
+    std::string::size_type start = 0;
+    while (start < data.size()) { // O(n)
+        auto newline = data.find('\n', start);
+        if (newline == std::string::npos) { newline = data.size(); }
+        char const* pos = data.data() + start;
+        char const* end = data.data() + newline;
+        start = newline + 1;
+        ++line;
+
+        skip_space(pos, end);
+        if (pos == end) { continue; } // Empty line
+
+        if (*pos++ != '{') {
+            error = "Line " + std::to_string(line) + " is not a JSON object";
+            return false;
+        }
+        // New row, every column gets a value (empty if the key is missing)
+        for (auto& column : table.columns) { column.emplace_back(); }
+        ++table.rows;
+
+        skip_space(pos, end);
+        bool closed = (pos != end && *pos == '}');
+        while (!closed) {
+            std::string key, value;
+            bool is_null = false;
+            skip_space(pos, end);
+            bool ok = parse_json_string(pos, end, key);
+            skip_space(pos, end);
+            ok = ok && pos != end && *pos++ == ':';
+            ok = ok && parse_json_value(pos, end, value, is_null);
+            skip_space(pos, end);
+            if (!ok || pos == end) {
+                error = "Invalid JSON on line " + std::to_string(line);
+                return false;
+            }
+            if (is_null) {
+                // Would otherwise become the string "null", e.g. as a name.
+                error = "Null value for '" + key + "' on line " + std::to_string(line);
+                return false;
+            }
+
+            auto iter = std::find(table.names.begin(), table.names.end(), key);
+            if (iter == table.names.end()) {
+                // Column appearing for the first time is empty on earlier rows
+                table.names.push_back(key);
+                table.columns.emplace_back(table.rows);
+                iter = table.names.end() - 1;
+            }
+            table.columns[iter - table.names.begin()].back() = std::move(value);
+
+            if (*pos == '}') { closed = true; }
+            else if (*pos++ != ',') {
+                error = "Invalid JSON on line " + std::to_string(line);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+Importer::Result Importer::insert_affiliations(Table const& table, Datastructures& ds)
+{
+    Result result;
+    result.rows = table.rows;
+    auto ids = table.column("id");
+    auto names = table.column("name");
+    auto xs = table.column("x");
+    auto ys = table.column("y");
+    if (!ids || !names || !xs || !ys) {
+        result.error = "Affiliations need columns id, name, x and y";
+        return result;
+    }
+
+    std::vector<int> x, y;
+    if (!check_affiliation_ids(*ids, "id", result.error) ||
+        !convert_column(*xs, x, "x", result.error) || !convert_column(*ys, y, "y", result.error)) {
+        return result;
+    }
+
+    result.inserted = table.rows - add_rows(table.rows, ds, [&](Datastructures::BulkPartition& partition, unsigned long i) { // O(n*log(n))
+        partition.add_affiliation((*ids)[i], (*names)[i], {x[i], y[i]});
+    });
+    result.ok = true;
+    return result;
+}
+
+Importer::Result Importer::insert_publications(Table const& table, Datastructures& ds)
+{
+    Result result;
+    result.rows = table.rows;
+    auto ids = table.column("id");
+    auto names = table.column("name");
+    auto years = table.column("year");
+    auto affiliations = table.column("affiliations"); // Optional
+    if (!ids || !names || !years) {
+        result.error = "Publications need columns id, name and year";
+        return result;
+    }
+
+    std::vector<PublicationID> id;
+    std::vector<Year> year;
+    if (!convert_column(*ids, id, "id", result.error) || !convert_column(*years, year, "year", result.error) ||
+        (affiliations && !check_affiliation_ids(*affiliations, "affiliations", result.error, true))) {
+        return result;
+    }
+
+    result.inserted = table.rows - add_rows(table.rows, ds, [&](Datastructures::BulkPartition& partition, unsigned long i) { // O(n*log(n))
+        auto list = affiliations ? split_list((*affiliations)[i]) : std::vector<AffiliationID>();
+        partition.add_publication(id[i], (*names)[i], year[i], list);
+    });
+    result.ok = true;
+    return result;
+}
+
+Importer::Result Importer::insert_references(Table const& table, Datastructures& ds)
+{
+    Result result;
+    result.rows = table.rows;
+    auto ids = table.column("id");
+    auto parents = table.column("parent");
+    if (!ids || !parents) {
+        result.error = "References need columns id and parent";
+        return result;
+    }
+
+    std::vector<PublicationID> id, parent;
+    if (!convert_column(*ids, id, "id", result.error) || !convert_column(*parents, parent, "parent", result.error)) {
+        return result;
+    }
+
+    result.inserted = table.rows - add_rows(table.rows, ds, [&](Datastructures::BulkPartition& partition, unsigned long i) { // O(n*log(n))
+        partition.add_reference(id[i], parent[i]);
+    });
+    result.ok = true;
+    return result;
+}
+
+Importer::Result Importer::insert_connections(Table const& table, Datastructures& ds)
+{
+    Result result;
+    result.rows = table.rows;
+    auto affiliations = table.column("affiliation");
+    auto publications = table.column("publication");
+    if (!affiliations || !publications) {
+        result.error = "Connections need columns affiliation and publication";
+        return result;
+    }
+
+    std::vector<PublicationID> publication;
+    if (!check_affiliation_ids(*affiliations, "affiliation", result.error) ||
+        !convert_column(*publications, publication, "publication", result.error)) {
+        return result;
+    }
+
+    result.inserted = table.rows - add_rows(table.rows, ds, [&](Datastructures::BulkPartition& partition, unsigned long i) { // O(n*log(n))
+        partition.add_affiliation_to_publication((*affiliations)[i], publication[i]);
+    });
+    result.ok = true;
+    return result;
+}
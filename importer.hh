@@ -0,0 +1,71 @@
+// Importer.hh
+//
+// Native CSV and JSONL importers for affiliations, publications, references and
+// affiliation-publication connections.
+//
+// A file is first parsed column by column into a Table (one vector of strings per
+// column) and the columns are then converted and inserted into Datastructures
+// without going through the command interpreter. Rows are staged by the ingest threads
+// of Datastructures (each its own range of rows) and committed as one bulk.
+//
+// Expected columns (CSV header row or JSON object keys, any order, extra ones ignored):
+//   affiliations: id, name, x, y
+//   publications: id, name, year, [affiliations]  (list separated by ';' in CSV, array in JSONL)
+//   references:   id, parent
+//   connections:  affiliation, publication
+// JSON null values are rejected (leave the key out instead).
+
+#ifndef IMPORTER_HH
+#define IMPORTER_HH
+
+#include <string>
+#include <vector>
+
+#include "datastructures.hh"
+
+class Importer
+{
+public:
+    enum class Kind { AFFILIATIONS, PUBLICATIONS, REFERENCES, CONNECTIONS };
+    enum class Format { CSV, JSONL };
+
+    struct Result
+    {
+        bool ok = false;
+        std::string error; // Reason when ok is false.
+        unsigned long rows = 0;
+        unsigned long inserted = 0; // Rows the Datastructures operation accepted.
+    };
+
+    // Columnar representation of a parsed file.
+    struct Table
+    {
+        std::vector<std::string> names;
+        std::vector<std::vector<std::string>> columns;
+        unsigned long rows = 0;
+
+        // Returns nullptr if there's no column with the name.
+        std::vector<std::string> const* column(std::string const& name) const;
+    };
+
+    // Format is chosen from the file name extension (.csv or .jsonl/.json).
+    static bool format_from_filename(std::string const& filename, Format& format);
+
+    // Estimate of performance: O(n*log(n))
+    // Short rationale for estimate: Parsing is linear in the file size and every row
+    // is inserted with a logarithmic Datastructures operation.
+    static Result import_file(std::string const& filename, Kind kind, Format format, Datastructures& ds);
+
+    // Estimate of performance: O(n)
+    // Short rationale for estimate: Every character of the data is looked at once.
+    static bool parse_csv(std::string const& data, Table& table, std::string& error);
+    static bool parse_jsonl(std::string const& data, Table& table, std::string& error);
+
+private:
+    static Result insert_affiliations(Table const& table, Datastructures& ds);
+    static Result insert_publications(Table const& table, Datastructures& ds);
+    static Result insert_references(Table const& table, Datastructures& ds);
+    static Result insert_connections(Table const& table, Datastructures& ds);
+};
+
+#endif // IMPORTER_HH
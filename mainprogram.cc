@@ -87,6 +87,10 @@ using std::bitset;
 #include <iterator>
 using std::next;
 
+#include <numeric>
+using std::accumulate;
+using std::iota;
+
 #include <ctime>
 using std::time;
 
@@ -109,13 +113,24 @@ using std::transform;
 #include <iterator>
 using std::back_inserter;
 
+#include <thread>
+using std::thread;
+
+#include <atomic>
+using std::atomic;
+
+#include <future>
+using std::future_status;
+
 #include <cstddef>
 #include <cassert>
+#include <charconv>
 
 
 #include "mainprogram.hh"
 
 #include "datastructures.hh"
+#include "importer.hh"
 
 #ifdef GRAPHICAL_GUI
 #include "mainwindow.hh"
@@ -123,6 +138,9 @@ using std::back_inserter;
 
 string const MainProgram::PROMPT = "> ";
 
+thread_local string MainProgram::result_buffer_;
+thread_local string MainProgram::print_buffer_;
+
 void MainProgram::test_get_functions(AffiliationID id)
 {
     ds_.get_affiliation_name(id);
@@ -197,11 +215,19 @@ MainProgram::CmdResult MainProgram::cmd_get_publications_after(std::ostream &out
     {
         output << "Publications from affiliation ";
         print_affiliation_brief(affiliationid, output, false);
-        output << " after year " << setw(4) << setfill('0') << time << ":" << endl;
+        output << " after year " << setw(4) << setfill('0') << time << ":" << '\n';
+        string& buf = result_buffer_;
         for (auto& [deptime, publicationid] : publications)
         {
-            output << " " << publicationid << " at " << setw(4) << setfill('0') << deptime << endl;
+            buf += ' ';
+            append_number(buf, publicationid);
+            buf += " at ";
+            if (deptime < 1000) { buf.append(deptime < 10 ? 3 : deptime < 100 ? 2 : 1, '0'); } // setw(4) with '0' fill
+            append_number(buf, deptime);
+            buf += '\n';
+            if (buf.size() >= RESULT_BUFFER_FLUSH_SIZE) { write_buffer(buf, output); }
         }
+        write_buffer(buf, output);
     }
     else
     {
@@ -433,47 +459,84 @@ void MainProgram::test_remove_affiliation()
 
 void MainProgram::add_random_affiliations_publications(unsigned int size, Coord min, Coord max, const std::vector<Coord> &coordinates)
 {
+    // Random values are drawn first in this thread, in the same order as when adding one
+    // item at a time, so the data doesn't depend on the number of threads
+    auto first_affiliation = random_affiliations_added_;
+    auto first_publication = random_publications_added_;
+
+    vector<Coord> coords;
     if(coordinates.size()!=size){
+        coords.reserve(size);
         for (unsigned int i = 0; i < size; ++i)
         {
-            auto name = n_to_name(random_affiliations_added_);
-            AffiliationID id = n_to_affiliationid(random_affiliations_added_);
-
-            ds_.add_affiliation(id, name, get_random_coords(min, max));
-
-            ++random_affiliations_added_;
+            coords.push_back(get_random_coords(min, max));
         }
     } else {
-        for (unsigned int i = 0; i < size; ++i)
-        {
-            auto name = n_to_name(random_affiliations_added_);
-            AffiliationID id = n_to_affiliationid(random_affiliations_added_);
-
-            ds_.add_affiliation(id, name, coordinates.at(i));
-
-            ++random_affiliations_added_;
-        }
+        coords = coordinates;
     }
+    random_affiliations_added_ += size;
 
-
+    vector<decltype(random_affiliations_added_)> publication_affiliations; // 4 for each publication
+    vector<Year> years;
+    vector<unsigned long int> parents;
+    publication_affiliations.reserve(4 * static_cast<std::size_t>(size));
+    years.reserve(size);
+    parents.reserve(size);
     for (unsigned int i = 0; i< size; ++i) {
-        auto publicationid = n_to_publicationid(random_publications_added_);
-
-        vector<AffiliationID> affiliations;
+        // Uniform even if perftest skews the ids of queries, so the data doesn't depend on it
         for (int j=0; j<4; ++j)
         {
-            affiliations.push_back(random_affiliation());
+            publication_affiliations.push_back(random<decltype(random_affiliations_added_)>(0, random_affiliations_added_));
         }
-        ds_.add_publication(publicationid, convert_to_string(publicationid), get_random_year(), std::move(affiliations));
+        years.push_back(get_random_year());
+
+        // Reference to a parent chosen by the selected topology (a binary tree by default)
+        parents.push_back(random_parent(random_publications_added_));
+        ++random_publications_added_;
+    }
 
-        // Add area as subarea so that we get a binary tree
-        if (random_publications_added_ > 0)
+    // Items are then formatted by the ingest threads, each to a partition of its own, and
+    // added as one bulk, so that index maintenance is done once at the end
+    unsigned long int count = (size >= ds_.ingest_min_items()) ? Datastructures::worker_threads(ds_.ingest_threads()) : 1;
+    vector<Datastructures::BulkPartition> partitions(count);
+    auto fill = [&](unsigned long int p)
+    {
+        auto& partition = partitions[p];
+        auto begin = size * p / count;
+        auto end = size * (p + 1) / count;
+        for (auto i = begin; i < end; ++i)
         {
-            auto parentid = n_to_publicationid(random_publications_added_ / 2);
-            ds_.add_reference(publicationid, parentid);
+            auto n = first_affiliation + i;
+            partition.add_affiliation(n_to_affiliationid(n), n_to_name(n), coords[i]);
         }
-        ++random_publications_added_;
+        for (auto i = begin; i < end; ++i)
+        {
+            auto n = first_publication + i;
+            auto publicationid = n_to_publicationid(n);
+            vector<AffiliationID> affiliations;
+            for (int j=0; j<4; ++j)
+            {
+                affiliations.push_back(n_to_affiliationid(publication_affiliations[4*i + j]));
+            }
+            partition.add_publication(publicationid, std::to_string(publicationid), years[i], affiliations);
+            if (parents[i] != n)
+            {
+                partition.add_reference(publicationid, n_to_publicationid(parents[i]));
+            }
+        }
+        partition.sort();
+    };
+    vector<thread> workers;
+    for (unsigned long int p = 1; p < count; ++p)
+    {
+        workers.emplace_back(fill, p);
+    }
+    fill(0);
+    for (auto& worker : workers)
+    {
+        worker.join();
     }
+    ds_.add_bulk(partitions);
 }
 
 MainProgram::CmdResult MainProgram::cmd_random_affiliations(ostream& output, MatchIter begin, MatchIter end)
@@ -536,6 +599,97 @@ MainProgram::CmdResult MainProgram::cmd_random_affiliations(ostream& output, Mat
     return {};
 }
 
+unsigned long int MainProgram::random_parent(unsigned long int n)
+{
+    switch (topology_)
+    {
+    case Topology::BINARY_TREE:
+        return n / 2; // (0 is its own parent, i.e. the root)
+    case Topology::CHAIN:
+        return (n > 0) ? n - 1 : n;
+    case Topology::STAR:
+        return 0;
+    case Topology::FOREST:
+    {
+        // forest_roots_ binary trees, tree n % roots has nodes n, n + roots, n + 2*roots, ...
+        auto roots = forest_roots_;
+        return (n < roots) ? n : (n / roots / 2) * roots + n % roots;
+    }
+    case Topology::PREFERENTIAL:
+    {
+        // Copying model: half of the time a uniformly random publication, otherwise the
+        // parent of one. A publication is then picked in proportion to its references + 1,
+        // which gives a power-law degree distribution without keeping a list of degrees.
+        unsigned long int parent = n;
+        if (n > 0)
+        {
+            parent = random<unsigned long int>(0, n);
+            if (random<int>(0, 2) == 0 && parent < random_parents_.size()) { parent = random_parents_[parent]; }
+        }
+        random_parents_.push_back(static_cast<unsigned int>(parent));
+        return parent;
+    }
+    }
+    return n;
+}
+
+MainProgram::CmdResult MainProgram::cmd_topology(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string topologystr = *begin++;
+    string rootsstr = *begin++;
+    assert(begin == end && "Invalid number of parameters");
+
+    if (!topologystr.empty())
+    {
+        if (!rootsstr.empty())
+        {
+            auto roots = convert_string_to<unsigned long int>(rootsstr);
+            if (roots == 0)
+            {
+                output << "Forest needs at least 1 root" << endl;
+                return {};
+            }
+            forest_roots_ = roots;
+        }
+        topology_from_name(topologystr, topology_);
+        // Publications added earlier are treated as roots by preferential attachment
+        random_parents_.clear();
+        if (topology_ == Topology::PREFERENTIAL)
+        {
+            random_parents_.resize(random_publications_added_);
+            iota(random_parents_.begin(), random_parents_.end(), 0u);
+        }
+    }
+
+    output << "Reference topology of random publications is " << topology_name(topology_);
+    if (topology_ == Topology::FOREST) { output << " with " << forest_roots_ << " roots"; }
+    output << endl;
+
+    return {};
+}
+
+std::array<std::pair<char const*, MainProgram::Topology>, 5> const MainProgram::topologies_ = {{
+    {"binary", Topology::BINARY_TREE}, {"chain", Topology::CHAIN}, {"star", Topology::STAR},
+    {"preferential", Topology::PREFERENTIAL}, {"forest", Topology::FOREST} }};
+
+char const* MainProgram::topology_name(Topology topology)
+{
+    for (auto const& [name, value] : topologies_)
+    {
+        if (value == topology) { return name; }
+    }
+    return "";
+}
+
+bool MainProgram::topology_from_name(std::string const& name, Topology& topology)
+{
+    for (auto const& [topologyname, value] : topologies_)
+    {
+        if (name == topologyname) { topology = value; return true; }
+    }
+    return false;
+}
+
 void MainProgram::test_random_affiliations()
 {
     add_random_affiliations_publications(1);
@@ -602,6 +756,10 @@ void MainProgram::test_add_affiliation_to_publication()
 
 Coord MainProgram::get_random_coords(const Coord min, const Coord max)
 {
+    if (argument_streams_active_ && min == RANDOM_MIN_COORD && max == RANDOM_MAX_COORD && !coord_stream_.values.empty())
+    {
+        return coord_stream_.next();
+    }
     int x = random<int>(min.x, max.x);
     int y = random<int>(min.y, max.y);
     return {x, y};
@@ -609,6 +767,10 @@ Coord MainProgram::get_random_coords(const Coord min, const Coord max)
 
 Year MainProgram::get_random_year(const Year min, const Year max)
 {
+    if (argument_streams_active_ && min == RANDOM_MIN_YEAR && max == RANDOM_MAX_YEAR && !year_stream_.values.empty())
+    {
+        return year_stream_.next();
+    }
     return random<int>(min, max);
 }
 
@@ -662,10 +824,54 @@ MainProgram::CmdResult MainProgram::cmd_get_affiliation_count(ostream& output, M
     return {};
 }
 
+template <typename ID, typename Cursor, typename Format>
+void MainProgram::stream_pages(Cursor& cursor, std::ostream& output, char const* empty_msg, char const* label, Format format)
+{
+    std::vector<ID> page;
+    std::vector<ID> next;
+    if (!ds_.next_page(cursor, page, page_size_))
+    {
+        output << empty_msg << endl;
+        return;
+    }
+
+    // Numbering (and plural label) is used when there's more than one item, so the next
+    // page is fetched before anything is printed.
+    bool more = ds_.next_page(cursor, next, page_size_);
+    bool numbered = page.size() > 1 || more;
+    output << label << (numbered ? "s:" : ":") << endl;
+
+    string& buf = result_buffer_;
+    unsigned int num = 0;
+    while (!page.empty())
+    {
+        for (ID const& id : page)
+        {
+            ++num;
+            if (numbered) { append_number(buf, num); buf += ". "; }
+            else { buf += "   "; }
+            (this->*format)(id, buf);
+            buf += '\n';
+            if (buf.size() >= RESULT_BUFFER_FLUSH_SIZE) { write_buffer(buf, output); }
+        }
+        page.swap(next);
+        if (!page.empty()) { ds_.next_page(cursor, next, page_size_); }
+    }
+    write_buffer(buf, output);
+}
+
 MainProgram::CmdResult MainProgram::cmd_get_all_affiliations(ostream& output, MatchIter begin, MatchIter end)
 {
     assert( begin == end && "Impossible number of parameters!");
 
+    if (!ui_)
+    {
+        // Without UI the result is not needed afterwards, so it's printed page by page
+        auto cursor = ds_.all_affiliations_cursor();
+        stream_pages<AffiliationID>(cursor, output, "No affiliations!", "Affiliation", &MainProgram::format_affiliation);
+        return {};
+    }
+
     auto affiliations = ds_.get_all_affiliations();
     if (affiliations.empty())
     {
@@ -704,6 +910,13 @@ MainProgram::CmdResult MainProgram::cmd_get_all_publications(std::ostream &outpu
 {
     assert( begin == end && "Impossible number of parameters!");
 
+    if (!ui_)
+    {
+        auto cursor = ds_.all_publications_cursor();
+        stream_pages<PublicationID>(cursor, output, "No publications!", "Publication", &MainProgram::format_publication);
+        return {};
+    }
+
     auto publications = ds_.all_publications();
     if (publications.empty())
     {
@@ -722,6 +935,80 @@ MainProgram::CmdResult MainProgram::cmd_publication_info(std::ostream& /*output*
     return {ResultType::IDLIST, CmdResultIDs{{id}, {}}};
 }
 
+MainProgram::CmdResult MainProgram::cmd_publications_info(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string idsstr = *begin++;
+    assert( begin == end && "Impossible number of parameters!");
+
+    vector<PublicationID> ids;
+    smatch idmatch;
+    auto sbeg = idsstr.cbegin();
+    auto send = idsstr.cend();
+    for ( ; regex_search(sbeg, send, idmatch, affil_regex_); sbeg = idmatch.suffix().first)
+    {
+        ids.push_back(convert_string_to<PublicationID>(idmatch[1]));
+    }
+
+    auto infos = ds_.get_publications_info(ids);
+
+    print_buffer_.clear();
+    for (unsigned int i = 0; i < ids.size(); ++i)
+    {
+        auto const& info = infos[i];
+        if (info.name == NO_NAME)
+        {
+            print_buffer_ += "--NO_PUBLICATION--";
+        }
+        else
+        {
+            print_buffer_ += info.name;
+            print_buffer_ += ": year=";
+            append_number(print_buffer_, info.year);
+            print_buffer_ += ", parent=";
+            if (info.parent == NO_PUBLICATION) { print_buffer_ += "--NO_PUBLICATION--"; }
+            else { append_number(print_buffer_, info.parent); }
+        }
+        print_buffer_ += ", id=";
+        append_number(print_buffer_, ids[i]);
+        print_buffer_ += '\n';
+        if (print_buffer_.size() >= RESULT_BUFFER_FLUSH_SIZE) { write_buffer(print_buffer_, output); }
+    }
+    write_buffer(print_buffer_, output);
+
+    return {};
+}
+
+MainProgram::CmdResult MainProgram::cmd_affiliation_coords(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string idsstr = *begin++;
+    assert( begin == end && "Impossible number of parameters!");
+
+    vector<AffiliationID> ids;
+    smatch idmatch;
+    auto sbeg = idsstr.cbegin();
+    auto send = idsstr.cend();
+    for ( ; regex_search(sbeg, send, idmatch, affil_regex_); sbeg = idmatch.suffix().first)
+    {
+        ids.push_back(idmatch[1]);
+    }
+
+    auto coords = ds_.get_affiliation_coords(ids);
+
+    print_buffer_.clear();
+    for (unsigned int i = 0; i < ids.size(); ++i)
+    {
+        print_buffer_ += "pos=";
+        format_coord(coords[i], print_buffer_);
+        print_buffer_ += ", id=";
+        print_buffer_ += ids[i];
+        print_buffer_ += '\n';
+        if (print_buffer_.size() >= RESULT_BUFFER_FLUSH_SIZE) { write_buffer(print_buffer_, output); }
+    }
+    write_buffer(print_buffer_, output);
+
+    return {};
+}
+
 MainProgram::CmdResult MainProgram::cmd_get_all_references(std::ostream &output, MatchIter begin, MatchIter end)
 {
     PublicationID publicationid = convert_string_to<PublicationID>(*begin++);
@@ -762,6 +1049,15 @@ MainProgram::CmdResult MainProgram::cmd_clear_all(ostream& output, MatchIter beg
 }
 
 string MainProgram::print_affiliation(AffiliationID id, ostream& output, bool nl)
+{
+    print_buffer_.clear();
+    bool ok = format_affiliation(id, print_buffer_);
+    if (nl) { print_buffer_ += '\n'; }
+    write_buffer(print_buffer_, output);
+    return (ok && ui_) ? id : ""; // Label string is needed only by the UI
+}
+
+bool MainProgram::format_affiliation(AffiliationID const& id, string& buf)
 {
     try
     {
@@ -771,38 +1067,46 @@ string MainProgram::print_affiliation(AffiliationID id, ostream& output, bool nl
             auto xy = ds_.get_affiliation_coord(id);
             if (!name.empty())
             {
-                output << name << ": ";
+                buf += name;
+                buf += ": ";
             }
             else
             {
-                output << "*: ";
+                buf += "*: ";
             }
 
-            output << "pos=";
-            print_coord(xy, output, false);
-            output << ", id=" << id;
-            if (nl) { output << endl; }
-
-            ostringstream retstream;
-            retstream << id;
-            return retstream.str();
+            buf += "pos=";
+            format_coord(xy, buf);
+            buf += ", id=";
+            buf += id;
+            return true;
         }
         else
         {
-            output << "--NO_AFFILIATION--";
-            if (nl) { output << endl; }
-            return "";
+            buf += "--NO_AFFILIATION--";
+            return false;
         }
     }
     catch (NotImplemented const& e)
     {
-        output << endl << "NotImplemented while printing affiliation : " << e.what() << endl;
+        buf += "\nNotImplemented while printing affiliation : ";
+        buf += e.what();
+        buf += '\n';
         std::cerr << endl << "NotImplemented while printing affiliation : " << e.what() << endl;
-        return "";
+        return false;
     }
 }
 
 string MainProgram::print_affiliation_brief(AffiliationID id, std::ostream &output, bool nl)
+{
+    print_buffer_.clear();
+    bool ok = format_affiliation_brief(id, print_buffer_);
+    if (nl) { print_buffer_ += '\n'; }
+    write_buffer(print_buffer_, output);
+    return (ok && ui_) ? id : "";
+}
+
+bool MainProgram::format_affiliation_brief(AffiliationID const& id, string& buf)
 {
     try
     {
@@ -811,36 +1115,45 @@ string MainProgram::print_affiliation_brief(AffiliationID id, std::ostream &outp
             auto name = ds_.get_affiliation_name(id);
             if (!name.empty())
             {
-                output << name << " ";
+                buf += name;
+                buf += ' ';
             }
             else
             {
-                output << "* ";
+                buf += "* ";
             }
 
-            output << "(" << id << ")";
-            if (nl) { output << endl; }
-
-            ostringstream retstream;
-            retstream << id;
-            return retstream.str();
+            buf += '(';
+            buf += id;
+            buf += ')';
+            return true;
         }
         else
         {
-            output << "--NO_AFFILIATION--";
-            if (nl) { output << endl; }
-            return "";
+            buf += "--NO_AFFILIATION--";
+            return false;
         }
     }
     catch (NotImplemented const& e)
     {
-        output << endl << "NotImplemented while printing affiliation : " << e.what() << endl;
+        buf += "\nNotImplemented while printing affiliation : ";
+        buf += e.what();
+        buf += '\n';
         std::cerr << endl << "NotImplemented while printing affiliation : " << e.what() << endl;
-        return "";
+        return false;
     }
 }
 
 string MainProgram::print_publication(PublicationID id, std::ostream &output, bool nl)
+{
+    print_buffer_.clear();
+    bool ok = format_publication(id, print_buffer_);
+    if (nl) { print_buffer_ += '\n'; }
+    write_buffer(print_buffer_, output);
+    return (ok && ui_) ? std::to_string(id) : "";
+}
+
+bool MainProgram::format_publication(PublicationID id, string& buf)
 {
     try
     {
@@ -850,37 +1163,36 @@ string MainProgram::print_publication(PublicationID id, std::ostream &output, bo
             auto year = ds_.get_publication_year(id);
             if (!name.empty())
             {
-                output << name << ": ";
+                buf += name;
+                buf += ": ";
             }
             else
             {
-                output << "*: ";
+                buf += "*: ";
             }
-            output << "year=";
+            buf += "year=";
             if (year == NO_YEAR) {
-                output << "--NO_YEAR--";
+                buf += "--NO_YEAR--";
             } else {
-                output << std::to_string(year);
+                append_number(buf, year);
             }
-            output << ", id=" << id;
-            if (nl) { output << endl; }
-
-            ostringstream retstream;
-            retstream << id;
-            return retstream.str();
+            buf += ", id=";
+            append_number(buf, id);
+            return true;
         }
         else
         {
-            output << "--NO_PUBLICATION--";
-            if (nl) { output << endl; }
-            return "";
+            buf += "--NO_PUBLICATION--";
+            return false;
         }
     }
     catch (NotImplemented const& e)
     {
-        output << endl << "NotImplemented while printing publication : " << e.what() << endl;
+        buf += "\nNotImplemented while printing publication : ";
+        buf += e.what();
+        buf += '\n';
         std::cerr << endl << "NotImplemented while printing publication : " << e.what() << endl;
-        return "";
+        return false;
     }
 }
 
@@ -913,16 +1225,30 @@ MainProgram::CmdResult MainProgram::cmd_get_affiliations(std::ostream &output, M
 
 AffiliationID MainProgram::random_affiliation()
 {
+    if (argument_streams_active_ && !affiliation_stream_.values.empty()) { return affiliation_stream_.next(); }
+    if (key_distribution_.skew() > 0) { return n_to_affiliationid(skewed_key(random_affiliations_added_)); }
     return n_to_affiliationid(random<decltype(random_affiliations_added_)>(0, random_affiliations_added_));
 }
 
 PublicationID MainProgram::random_publication()
 {
+    if (argument_streams_active_ && !publication_stream_.values.empty()) { return publication_stream_.next(); }
+    if (key_distribution_.skew() > 0) { return n_to_publicationid(skewed_key(random_publications_added_)); }
     return n_to_publicationid(random<decltype(random_publications_added_)>(0, random_publications_added_));
 }
 
+unsigned long int MainProgram::skewed_key(unsigned long int count)
+{
+    // Popular ranks are spread over the key space instead of being the first keys added
+    // (which are also the roots of the reference trees). The stride is a prime larger
+    // than any count, so the mapping is a permutation.
+    unsigned long long rank = key_distribution_(rand_engine_, count);
+    return static_cast<unsigned long int>((rank * HOT_KEY_STRIDE) % count);
+}
+
 PublicationID MainProgram::random_root_publication()
 {
+    if (argument_streams_active_ && !root_publication_stream_.values.empty()) { return root_publication_stream_.next(); }
     unsigned long end = ROOT_BIAS_MULTIPLIER * random_publications_added_;
     if (end == 0 ) {
         return 0;
@@ -932,6 +1258,7 @@ PublicationID MainProgram::random_root_publication()
 
 PublicationID MainProgram::random_leaf_publication()
 {
+    if (argument_streams_active_ && !leaf_publication_stream_.values.empty()) { return leaf_publication_stream_.next(); }
     unsigned long start = LEAF_BIAS_MULTIPLIER * random_publications_added_;
     if (start == random_publications_added_) {
         start = 0;
@@ -939,11 +1266,112 @@ PublicationID MainProgram::random_leaf_publication()
     return n_to_publicationid(random<decltype(random_publications_added_)>(start, random_publications_added_));
 }
 
+void MainProgram::fill_argument_streams(std::size_t size)
+{
+    clear_argument_streams();
+    if (random_affiliations_added_ > 0)
+    {
+        for (std::size_t i = 0; i < size; ++i) { affiliation_stream_.values.push_back(random_affiliation()); }
+    }
+    if (random_publications_added_ > 0)
+    {
+        for (std::size_t i = 0; i < size; ++i)
+        {
+            publication_stream_.values.push_back(random_publication());
+            root_publication_stream_.values.push_back(random_root_publication());
+            leaf_publication_stream_.values.push_back(random_leaf_publication());
+        }
+    }
+    for (std::size_t i = 0; i < size; ++i)
+    {
+        coord_stream_.values.push_back(get_random_coords());
+        year_stream_.values.push_back(get_random_year());
+    }
+    argument_streams_active_ = true;
+}
+
+void MainProgram::clear_argument_streams()
+{
+    argument_streams_active_ = false;
+    affiliation_stream_ = {};
+    publication_stream_ = {};
+    root_publication_stream_ = {};
+    leaf_publication_stream_ = {};
+    coord_stream_ = {};
+    year_stream_ = {};
+}
+
+void MainProgram::test_nothing()
+{
+}
+
+MainProgram::HarnessOverhead MainProgram::calibrate_harness(unsigned int iterations)
+{
+    // Same steps as a perftest iteration, around a call that does nothing
+    vector<void(MainProgram::*)()> funcs = {&MainProgram::test_nothing};
+    vector<unsigned int> command_order(1024, 0);
+    unsigned int order_pos = 0;
+    vector<LatencyHistogram> latencies(funcs.size());
+    vector<MemoryStats::Allocations> allocs(funcs.size());
+    MemoryStats::Allocations before;
+
+    Stopwatch stopwatch;
+    stopwatch.start();
+    for (unsigned int repeat = 0; repeat < iterations; ++repeat)
+    {
+        auto cmdpos = funcs.begin() + command_order[order_pos];
+        order_pos = (order_pos + 1 == command_order.size()) ? 0 : order_pos + 1;
+
+        before = MemoryStats::allocations();
+        auto callstart = Stopwatch::Clock::now();
+        (this->**cmdpos)();
+        auto callend = Stopwatch::Clock::now();
+        allocs[cmdpos - funcs.begin()] += MemoryStats::allocations() - before;
+        std::uint64_t callns = std::chrono::duration_cast<std::chrono::nanoseconds>(callend - callstart).count();
+        latencies[cmdpos - funcs.begin()].record(callns);
+
+        check_stop();
+        if (repeat % 10 == 0)
+        {
+            stopwatch.stop();
+            stopwatch.start();
+        }
+    }
+    stopwatch.stop();
+
+    HarnessOverhead overhead;
+    overhead.call_ns = latencies.front().percentile(50);
+    overhead.iteration_sec = (iterations > 0) ? stopwatch.elapsed() / iterations : 0;
+    return overhead;
+}
+
 void MainProgram::test_find_affiliation_with_coord()
 {
     ds_.find_affiliation_with_coord(get_random_coords());
 }
 
+void MainProgram::test_publications_info()
+{
+    if (random_publications_added_ > 0)
+    {
+        vector<PublicationID> ids;
+        ids.reserve(BATCH_TEST_SIZE);
+        for (unsigned int i = 0; i < BATCH_TEST_SIZE; ++i) { ids.push_back(random_publication()); }
+        ds_.get_publications_info(ids);
+    }
+}
+
+void MainProgram::test_affiliation_coords()
+{
+    if (random_affiliations_added_ > 0)
+    {
+        vector<AffiliationID> ids;
+        ids.reserve(BATCH_TEST_SIZE);
+        for (unsigned int i = 0; i < BATCH_TEST_SIZE; ++i) { ids.push_back(random_affiliation()); }
+        ds_.get_affiliation_coords(ids);
+    }
+}
+
 void MainProgram::test_publication_info()
 {
     if (random_publications_added_ > 0) // Don't do anything if there's no publications
@@ -969,505 +1397,2145 @@ void MainProgram::test_get_closest_common_parent()
     }
 }
 
-MainProgram::CmdResult MainProgram::cmd_randseed(std::ostream& output, MatchIter begin, MatchIter end)
+MainProgram::CmdResult MainProgram::cmd_page_size(std::ostream& output, MatchIter begin, MatchIter end)
 {
-    string seedstr = *begin++;
+    string sizestr = *begin++;
     assert(begin == end && "Invalid number of parameters");
 
-    unsigned long int seed = convert_string_to<unsigned long int>(seedstr);
-
-    rand_engine_.seed(seed);
-    init_primes();
+    if (!sizestr.empty())
+    {
+        auto size = convert_string_to<std::size_t>(sizestr);
+        if (size == 0)
+        {
+            output << "Page size must be at least 1" << endl;
+            return {};
+        }
+        page_size_ = size;
+    }
 
-    output << "Random seed set to " << seed << endl;
+    output << "Page size is " << page_size_ << endl;
 
     return {};
 }
 
-MainProgram::CmdResult MainProgram::cmd_read(std::ostream& output, MatchIter begin, MatchIter end)
+MainProgram::CmdResult MainProgram::cmd_sort_threads(std::ostream& output, MatchIter begin, MatchIter end)
 {
-    string filename = *begin++;
-    string silentstr =  *begin++;
-    assert( begin == end && "Impossible number of parameters!");
-
-    bool silent = !silentstr.empty();
-    ostream* new_output = &output;
+    string threadstr = *begin++;
+    string minstr = *begin++;
+    assert(begin == end && "Invalid number of parameters");
 
-    ostringstream dummystr; // Given as output if "silent" is specified, the output is discarded
-    if (silent)
+    if (!threadstr.empty())
     {
-        new_output = &dummystr;
+        ds_.set_sort_threads(convert_string_to<unsigned int>(threadstr));
+    }
+    if (!minstr.empty())
+    {
+        ds_.set_sort_min_items(convert_string_to<std::size_t>(minstr));
     }
 
-    ifstream input(filename);
-    if (input)
+    output << "Sort threads: " << ds_.sort_threads();
+    if (ds_.sort_threads() == 0) { output << " (one per hardware thread, " << thread::hardware_concurrency() << ")"; }
+    output << ", used for listings of at least " << ds_.sort_min_items() << " items" << endl;
+
+    return {};
+}
+
+MainProgram::CmdResult MainProgram::cmd_traversal_threads(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string threadstr = *begin++;
+    string minstr = *begin++;
+    assert(begin == end && "Invalid number of parameters");
+
+    if (!threadstr.empty())
     {
-        output << "** Commands from '" << filename << "'" << endl;
-        command_parser(input, *new_output, PromptStyle::NORMAL);
-        if (silent) { output << "...(output discarded in silent mode)..." << endl; }
-        output << "** End of commands from '" << filename << "'" << endl;
+        ds_.set_traversal_threads(convert_string_to<unsigned int>(threadstr));
     }
-    else
+    if (!minstr.empty())
     {
-        output << "Cannot open file '" << filename << "'!" << endl;
+        ds_.set_traversal_min_items(convert_string_to<std::size_t>(minstr));
     }
 
+    output << "Traversal threads: " << ds_.traversal_threads();
+    if (ds_.traversal_threads() == 0) { output << " (one per hardware thread, " << thread::hardware_concurrency() << ")"; }
+    output << ", used for subtrees of more than " << ds_.traversal_min_items() << " publications" << endl;
+
     return {};
 }
 
+MainProgram::CmdResult MainProgram::cmd_ingest_threads(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string threadstr = *begin++;
+    string minstr = *begin++;
+    assert(begin == end && "Invalid number of parameters");
 
-MainProgram::CmdResult MainProgram::cmd_testread(std::ostream& output, MatchIter begin, MatchIter end)
+    if (!threadstr.empty())
+    {
+        ds_.set_ingest_threads(convert_string_to<unsigned int>(threadstr));
+    }
+    if (!minstr.empty())
+    {
+        ds_.set_ingest_min_items(convert_string_to<std::size_t>(minstr));
+    }
+
+    output << "Ingest threads: " << ds_.ingest_threads();
+    if (ds_.ingest_threads() == 0) { output << " (one per hardware thread, " << thread::hardware_concurrency() << ")"; }
+    output << ", used for bulks of at least " << ds_.ingest_min_items() << " items" << endl;
+
+    return {};
+}
+
+MainProgram::CmdResult MainProgram::cmd_concurrency(std::ostream& output, MatchIter begin, MatchIter end)
 {
-    string infilename = *begin++;
-    string outfilename = *begin++;
-    assert( begin == end && "Impossible number of parameters!");
+    string modestr = *begin++;
+    assert(begin == end && "Invalid number of parameters");
 
-    ifstream input(infilename);
-    if (input)
+    static pair<Datastructures::Concurrency, char const*> const modes[] = {
+        {Datastructures::Concurrency::NONE, "none"},
+        {Datastructures::Concurrency::EXCLUSIVE, "mutex"},
+        {Datastructures::Concurrency::SHARED, "shared"},
+        {Datastructures::Concurrency::SNAPSHOT, "snapshot"},
+        {Datastructures::Concurrency::STRIPED, "striped"}};
+    for (auto const& [concurrency, name] : modes)
     {
-        ifstream expected_output(outfilename);
-        if (output)
+        if (modestr == name)
         {
-            stringstream actual_output;
-            command_parser(input, actual_output, PromptStyle::NO_NESTING);
+            ds_.set_concurrency(concurrency);
+            async_set_concurrency_ = false; // Chosen here, so async queries leave it as it is
+        }
+    }
 
-            vector<string> actual_lines;
-            while (actual_output)
-            {
-                string line;
-                getline(actual_output, line);
+    output << "Concurrency: ";
+    for (auto const& [concurrency, name] : modes)
+    {
+        if (ds_.concurrency() == concurrency) { output << name; }
+    }
+    output << endl;
+
+    return {};
+}
+
+MainProgram::CmdResult MainProgram::cmd_shards(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string countstr = *begin++;
+    assert(begin == end && "Invalid number of parameters");
+
+    if (!countstr.empty())
+    {
+        ds_.set_shard_count(std::max(1u, convert_string_to<unsigned int>(countstr)));
+    }
+
+    output << "Shards: " << ds_.shard_count() << endl;
+
+    return {};
+}
+
+MainProgram::CmdResult MainProgram::cmd_async_queries(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string onstr = *begin++;
+    string threadstr = *begin++;
+    string pendingstr = *begin++;
+    string offstr = *begin++;
+    assert(begin == end && "Invalid number of parameters");
+
+    if (!onstr.empty())
+    {
+        unsigned int threads = threadstr.empty() ? 0 : convert_string_to<unsigned int>(threadstr);
+        if (threads == 0) { threads = std::max(1u, thread::hardware_concurrency()); }
+        stop_async_queries();
+        query_executor_ = std::make_unique<QueryExecutor>(threads);
+        async_max_in_flight_ = pendingstr.empty() ? ASYNC_QUERIES_PER_THREAD * threads
+                                                  : std::max(1u, convert_string_to<unsigned int>(pendingstr));
+    }
+    else if (!offstr.empty())
+    {
+        stop_async_queries();
+    }
+
+    if (query_executor_)
+    {
+        output << "Async queries: on, " << query_executor_->threads() << " threads, at most "
+               << async_max_in_flight_ << " pending queries" << endl;
+    }
+    else
+    {
+        output << "Async queries: off" << endl;
+    }
+
+    return {};
+}
+
+MainProgram::CmdResult MainProgram::cmd_change_feed(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string onstr = *begin++;
+    string capacitystr = *begin++;
+    string offstr = *begin++;
+    assert(begin == end && "Invalid number of parameters");
+
+    if (!onstr.empty())
+    {
+        std::size_t capacity = capacitystr.empty() ? ChangeFeed::DEFAULT_CAPACITY : convert_string_to<std::size_t>(capacitystr);
+        ds_.set_change_feed(nullptr);
+        feed_subscription_.reset();
+        change_feed_ = std::make_unique<ChangeFeed>(capacity);
+        feed_subscription_ = std::make_unique<ChangeFeed::Subscription>(change_feed_->subscribe());
+        ds_.set_change_feed(change_feed_.get());
+    }
+    else if (!offstr.empty())
+    {
+        ds_.set_change_feed(nullptr);
+        feed_subscription_.reset();
+        change_feed_.reset();
+    }
+
+    if (change_feed_)
+    {
+        output << "Change feed: on, " << change_feed_->capacity() << " slots, last sequence "
+               << change_feed_->last_sequence() << endl;
+    }
+    else
+    {
+        output << "Change feed: off" << endl;
+    }
+
+    return {};
+}
+
+MainProgram::CmdResult MainProgram::cmd_change_feed_poll(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string maxstr = *begin++;
+    assert(begin == end && "Invalid number of parameters");
+
+    if (!change_feed_)
+    {
+        output << "Change feed is off!" << endl;
+        return {};
+    }
+
+    std::size_t max_events = maxstr.empty() ? std::numeric_limits<std::size_t>::max() : convert_string_to<std::size_t>(maxstr);
+    vector<ChangeFeed::Event> events;
+    auto lost_before = feed_subscription_->lost();
+    feed_subscription_->poll(events, max_events);
+    if (feed_subscription_->lost() != lost_before)
+    {
+        output << "Lost " << feed_subscription_->lost() - lost_before << " events (overwritten), resynchronize!" << endl;
+    }
+
+    for (auto const& event : events)
+    {
+        output << event.sequence << ": ";
+        switch (event.kind)
+        {
+        case ChangeFeed::Kind::ADD_AFFILIATION:
+            output << "add_affiliation " << event.affiliation << " (" << event.coord.x << "," << event.coord.y << ")";
+            break;
+        case ChangeFeed::Kind::ADD_PUBLICATION:
+            output << "add_publication " << event.publication;
+            break;
+        case ChangeFeed::Kind::ADD_REFERENCE:
+            output << "add_reference " << event.publication << " " << event.parent;
+            break;
+        case ChangeFeed::Kind::ADD_AFFILIATION_TO_PUBLICATION:
+            output << "add_affiliation_to_publication " << event.affiliation << " " << event.publication;
+            break;
+        case ChangeFeed::Kind::CHANGE_AFFILIATION_COORD:
+            output << "change_affiliation_coord " << event.affiliation << " (" << event.coord.x << "," << event.coord.y << ")";
+            break;
+        case ChangeFeed::Kind::REMOVE_AFFILIATION:
+            output << "remove_affiliation " << event.affiliation;
+            break;
+        case ChangeFeed::Kind::REMOVE_PUBLICATION:
+            output << "remove_publication " << event.publication;
+            break;
+        case ChangeFeed::Kind::CLEAR_ALL:
+            output << "clear_all";
+            break;
+        }
+        output << endl;
+    }
+    output << events.size() << " events, last sequence " << change_feed_->last_sequence() << endl;
+
+    return {};
+}
+
+void MainProgram::stop_async_queries()
+{
+    assert(async_queries_.empty() && "Commands other than queries wait for pending queries");
+    if (query_executor_)
+    {
+        query_executor_.reset();
+        // Set by submit_async_query(), the program uses Datastructures from one thread again
+        if (async_set_concurrency_ && ds_.concurrency() == Datastructures::Concurrency::SHARED)
+        {
+            ds_.set_concurrency(Datastructures::Concurrency::NONE);
+        }
+        async_set_concurrency_ = false;
+    }
+}
+
+void MainProgram::submit_async_query(CmdInfo const& cmdinfo, std::string params, std::ostream& output)
+{
+    // Admission control: at most async_max_in_flight_ queries are pending, and results
+    // waiting for older queries take at most ASYNC_MAX_BUFFERED_BYTES
+    drain_async_queries(output, false);
+    while (!async_queries_.empty() &&
+           (async_queries_.size() >= async_max_in_flight_ || async_buffered_bytes_.load() >= ASYNC_MAX_BUFFERED_BYTES))
+    {
+        collect_async_query(output);
+    }
+
+    if (ds_.concurrency() == Datastructures::Concurrency::NONE)
+    {
+        // Queries from several threads need locking. Nothing is pending here, because commands
+        // which could change the mode wait for pending queries.
+        ds_.set_concurrency(Datastructures::Concurrency::SHARED);
+        async_set_concurrency_ = true;
+    }
+
+    // cmds_ is static, so cmdinfo stays valid
+    auto future = query_executor_->submit([this, &cmdinfo, params = move(params)]()
+    {
+        AsyncOutput result;
+        ostringstream output;
+        smatch match;
+        regex_match(params, match, cmdinfo.param_regex);
+        try
+        {
+            result.result = (this->*(cmdinfo.func))(output, ++(match.begin()), match.end());
+        }
+        catch (NotImplemented const& e)
+        {
+            output << endl << "NotImplemented from cmd " << cmdinfo.cmd << " : " << e.what() << endl;
+            std::cerr << endl << "NotImplemented from cmd " << cmdinfo.cmd << " : " << e.what() << endl;
+        }
+        print_result(result.result, output);
+        result.text = output.str();
+        async_buffered_bytes_ += result.text.size();
+        return result;
+    });
+    async_queries_.push_back({move(future), {}});
+}
+
+void MainProgram::collect_async_query(std::ostream& output)
+{
+    AsyncQuery query = move(async_queries_.front());
+    async_queries_.pop_front();
+    AsyncOutput result = query.output.get();
+    async_buffered_bytes_ -= result.text.size();
+
+    output << result.text << query.text_after;
+    if (result.result != prev_result)
+    {
+        prev_result = move(result.result);
+        view_dirty = true;
+    }
+}
+
+void MainProgram::drain_async_queries(std::ostream& output, bool wait)
+{
+    while (!async_queries_.empty() &&
+           (wait || async_queries_.front().output.wait_for(std::chrono::seconds(0)) == future_status::ready))
+    {
+        collect_async_query(output);
+    }
+}
+
+void MainProgram::write_ordered(std::string const& text, std::ostream& output)
+{
+    if (async_queries_.empty())
+    {
+        output << text;
+    }
+    else
+    {
+        async_queries_.back().text_after += text;
+    }
+}
+
+MainProgram::CmdResult MainProgram::cmd_randseed(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string seedstr = *begin++;
+    assert(begin == end && "Invalid number of parameters");
+
+    unsigned long int seed = convert_string_to<unsigned long int>(seedstr);
+
+    rand_engine_.seed(seed);
+    init_primes();
+
+    output << "Random seed set to " << seed << endl;
+
+    return {};
+}
+
+MainProgram::CmdResult MainProgram::cmd_read(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string filename = *begin++;
+    string silentstr =  *begin++;
+    assert( begin == end && "Impossible number of parameters!");
+
+    bool silent = !silentstr.empty();
+    ostream* new_output = &output;
+
+    ostringstream dummystr; // Given as output if "silent" is specified, the output is discarded
+    if (silent)
+    {
+        new_output = &dummystr;
+    }
+
+    ifstream input(filename);
+    if (input)
+    {
+        output << "** Commands from '" << filename << "'" << endl;
+        ++script_depth_;
+        command_parser(input, *new_output, PromptStyle::NORMAL);
+        --script_depth_;
+        if (silent) { output << "...(output discarded in silent mode)..." << endl; }
+        output << "** End of commands from '" << filename << "'" << endl;
+    }
+    else
+    {
+        output << "Cannot open file '" << filename << "'!" << endl;
+    }
+
+    return {};
+}
+
+MainProgram::CmdResult MainProgram::cmd_import(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string kindstr = *begin++;
+    string filename = *begin++;
+    assert( begin == end && "Impossible number of parameters!");
+
+    Importer::Format format;
+    if (!Importer::format_from_filename(filename, format))
+    {
+        output << "Unknown file format '" << filename << "' (expected .csv or .jsonl)!" << endl;
+        return {};
+    }
+
+    Importer::Kind kind = Importer::Kind::AFFILIATIONS;
+    if (kindstr == "publications") { kind = Importer::Kind::PUBLICATIONS; }
+    else if (kindstr == "references") { kind = Importer::Kind::REFERENCES; }
+    else if (kindstr == "connections") { kind = Importer::Kind::CONNECTIONS; }
+
+    auto result = Importer::import_file(filename, kind, format, ds_);
+    if (!result.ok)
+    {
+        output << "Import from '" << filename << "' failed: " << result.error << endl;
+        return {};
+    }
+
+    output << "Imported " << result.inserted << " of " << result.rows << " " << kindstr << " from '" << filename << "'" << endl;
+    view_dirty = true;
+    return {};
+}
+
+MainProgram::CmdResult MainProgram::cmd_log_open(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string snapshotname = *begin++;
+    string logname = *begin++;
+    string groupstr = *begin++;
+    assert( begin == end && "Impossible number of parameters!");
+
+    unsigned int group_size = groupstr.empty() ? 1 : convert_string_to<unsigned int>(groupstr);
+
+    ds_.set_mutation_log(nullptr);
+    mutation_log_.close();
+
+    // The log starts from the current state, so that is saved as the first snapshot
+    if (!ds_.save_snapshot(snapshotname, 0))
+    {
+        output << "Cannot write snapshot '" << snapshotname << "'!" << endl;
+        return {};
+    }
+    if (!mutation_log_.open(logname, 1, 0, group_size))
+    {
+        output << "Cannot open log '" << logname << "'!" << endl;
+        return {};
+    }
+    snapshot_filename_ = snapshotname;
+    ds_.set_mutation_log(&mutation_log_);
+
+    output << "Logging mutations to '" << logname << "' (group size " << group_size << ")" << endl;
+    return {};
+}
+
+MainProgram::CmdResult MainProgram::cmd_log_close(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    assert( begin == end && "Impossible number of parameters!");
+
+    if (!mutation_log_.is_open())
+    {
+        output << "No mutation log open!" << endl;
+        return {};
+    }
+
+    ds_.set_mutation_log(nullptr);
+    if (!mutation_log_.sync())
+    {
+        output << "Writing log '" << mutation_log_.filename() << "' failed, records may be missing from it!" << endl;
+    }
+    output << "Closed log '" << mutation_log_.filename() << "' at sequence " << mutation_log_.last_sequence() << endl;
+    mutation_log_.close();
+    return {};
+}
+
+MainProgram::CmdResult MainProgram::cmd_log_checkpoint(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    assert( begin == end && "Impossible number of parameters!");
+
+    if (!mutation_log_.is_open())
+    {
+        output << "No mutation log open!" << endl;
+        return {};
+    }
+
+    // Log is made durable before the snapshot, and truncated only after the snapshot is safely written.
+    // A failed log is not truncated: the snapshot is complete anyway, but the log shows what was lost.
+    bool log_ok = mutation_log_.sync();
+    auto sequence = mutation_log_.last_sequence();
+    if (!ds_.save_snapshot(snapshot_filename_, sequence))
+    {
+        output << "Cannot write snapshot '" << snapshot_filename_ << "'!" << endl;
+        return {};
+    }
+    if (!log_ok || !mutation_log_.truncate())
+    {
+        output << "Writing log '" << mutation_log_.filename() << "' failed, records may be missing from it!" << endl;
+    }
+
+    output << "Checkpoint at sequence " << sequence << " written to '" << snapshot_filename_ << "'" << endl;
+    return {};
+}
+
+MainProgram::CmdResult MainProgram::cmd_log_recover(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string snapshotname = *begin++;
+    string logname = *begin++;
+    string groupstr = *begin++;
+    assert( begin == end && "Impossible number of parameters!");
+
+    unsigned int group_size = groupstr.empty() ? 1 : convert_string_to<unsigned int>(groupstr);
+
+    // A snapshot that can't be read leaves the data as it was, so the open log (if any) is kept
+    // with it. Loading isn't logged, and the log is detached before the replay is.
+    unsigned long long sequence = 0;
+    if (!ds_.load_snapshot(snapshotname, sequence))
+    {
+        output << "Cannot read snapshot '" << snapshotname << "'!" << endl;
+        if (mutation_log_.is_open())
+        {
+            output << "Still logging mutations to '" << mutation_log_.filename() << "'" << endl;
+        }
+        else
+        {
+            output << "Mutations are not logged." << endl;
+        }
+        return {};
+    }
+
+    ds_.set_mutation_log(nullptr);
+    mutation_log_.close();
+
+    MutationLog::ReplayInfo info;
+    if (!MutationLog::replay(logname, ds_, sequence, info))
+    {
+        output << "No log '" << logname << "' found, starting a new one." << endl;
+    }
+    output << "Recovered snapshot at sequence " << sequence << ", replayed " << info.records_applied
+           << " log record(s) up to sequence " << info.last_sequence << endl;
+    if (info.torn_tail)
+    {
+        output << "Incomplete record at the end of the log discarded." << endl;
+    }
+
+    if (!mutation_log_.open(logname, info.last_sequence+1, info.valid_bytes, group_size))
+    {
+        output << "Cannot open log '" << logname << "', mutations are not logged!" << endl;
+        view_dirty = true;
+        return {};
+    }
+    snapshot_filename_ = snapshotname;
+    ds_.set_mutation_log(&mutation_log_);
+
+    view_dirty = true;
+    return {};
+}
+
+MainProgram::CmdResult MainProgram::cmd_trace_start(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string tracename = *begin++;
+    string snapshotname = *begin++;
+    assert( begin == end && "Impossible number of parameters!");
+
+    ds_.set_workload_trace(nullptr);
+    if (workload_trace_.is_open() && !workload_trace_.close())
+    {
+        output << "Writing trace '" << workload_trace_.filename() << "' failed, calls are missing from it!" << endl;
+    }
+
+    // Replay needs the state the trace started from, which can be saved as a snapshot
+    if (!snapshotname.empty() && !ds_.save_snapshot(snapshotname, 0))
+    {
+        output << "Cannot write snapshot '" << snapshotname << "'!" << endl;
+        return {};
+    }
+    if (!workload_trace_.open(tracename))
+    {
+        output << "Cannot open trace '" << tracename << "'!" << endl;
+        return {};
+    }
+    ds_.set_workload_trace(&workload_trace_);
+
+    output << "Tracing Datastructures calls to '" << tracename << "'" << endl;
+    return {};
+}
+
+MainProgram::CmdResult MainProgram::cmd_trace_stop(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    assert( begin == end && "Impossible number of parameters!");
+
+    if (!workload_trace_.is_open())
+    {
+        output << "No trace running!" << endl;
+        return {};
+    }
+
+    ds_.set_workload_trace(nullptr);
+    bool trace_ok = workload_trace_.close();
+    output << "Stopped trace '" << workload_trace_.filename() << "' after " << workload_trace_.records() << " calls" << endl;
+    if (!trace_ok)
+    {
+        output << "Writing trace '" << workload_trace_.filename() << "' failed, calls are missing from it!" << endl;
+    }
+    return {};
+}
+
+MainProgram::CmdResult MainProgram::cmd_replay(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string tracename = *begin++;
+    string modestr = *begin++;
+    string countsstr = *begin++;
+    string snapshotname = *begin++;
+    assert( begin == end && "Impossible number of parameters!");
+
+    bool counts_only = !countsstr.empty();
+    if (workload_trace_.is_open())
+    {
+        output << "Stop the trace before replaying!" << endl;
+        return {};
+    }
+
+    if (!snapshotname.empty())
+    {
+        unsigned long long sequence = 0;
+        if (!ds_.load_snapshot(snapshotname, sequence))
+        {
+            output << "Cannot read snapshot '" << snapshotname << "'!" << endl;
+            return {};
+        }
+    }
+
+    auto mode = (modestr == "fast") ? WorkloadTrace::Mode::FAST : WorkloadTrace::Mode::TIMED;
+    WorkloadTrace::ReplayResult result;
+    string error;
+    if (!WorkloadTrace::replay(tracename, ds_, mode, result, error))
+    {
+        output << error << "!" << endl;
+        return {};
+    }
+    view_dirty = true;
+
+    output << "Replayed " << result.calls << " calls from '" << tracename << "' "
+           << ((mode == WorkloadTrace::Mode::FAST) ? "as fast as possible" : "with recorded timing");
+    if (!counts_only)
+    {
+        output << " in " << result.elapsed_sec << " sec (traced " << result.traced_sec << " sec)";
+        if (result.elapsed_sec > 0) { output << ", " << static_cast<unsigned long>(result.calls / result.elapsed_sec) << " calls/sec"; }
+    }
+    output << endl;
+    if (result.truncated)
+    {
+        output << "Incomplete record at the end of the trace ignored." << endl;
+    }
+    if (result.calls == 0) { return {}; }
+
+    output << setw(40) << "operation" << " , " << setw(10) << "calls";
+    if (!counts_only)
+    {
+        output << " , " << setw(10) << "p50 (us)" << " , " << setw(10) << "p90 (us)"
+               << " , " << setw(10) << "p99 (us)" << " , " << setw(10) << "max (us)";
+    }
+    output << endl;
+    for (unsigned int i = 1; i < WorkloadTrace::OPERATION_COUNT; ++i)
+    {
+        auto const& latencies = result.operation_latencies[i];
+        if (latencies.count() == 0) { continue; }
+        output << setw(40) << WorkloadTrace::operation_name(static_cast<WorkloadTrace::Operation>(i))
+               << " , " << setw(10) << latencies.count();
+        if (!counts_only) { print_latencies(latencies, output); }
+        output << endl;
+    }
+    output << setw(40) << "all" << " , " << setw(10) << result.latencies.count();
+    if (!counts_only) { print_latencies(result.latencies, output); }
+    output << endl;
+    return {};
+}
+
+MainProgram::CmdResult MainProgram::cmd_testread(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string infilename = *begin++;
+    string outfilename = *begin++;
+    assert( begin == end && "Impossible number of parameters!");
+
+    ifstream input(infilename);
+    if (input)
+    {
+        ifstream expected_output(outfilename);
+        if (output)
+        {
+            stringstream actual_output;
+            ++script_depth_;
+            command_parser(input, actual_output, PromptStyle::NO_NESTING);
+            --script_depth_;
+
+            vector<string> actual_lines;
+            while (actual_output)
+            {
+                string line;
+                getline(actual_output, line);
                 if (!actual_output) { break; }
                 actual_lines.push_back(line);
             }
 
-            vector<string> expected_lines;
-            while (expected_output)
+            vector<string> expected_lines;
+            while (expected_output)
+            {
+                string line;
+                getline(expected_output, line);
+                if (!expected_output) { break; }
+                expected_lines.push_back(line);
+            }
+
+            string heading_actual = "Actual output";
+            unsigned int actual_max_length = heading_actual.length();
+            auto actual_max_iter = max_element(actual_lines.cbegin(), actual_lines.cend(),
+                                               [](string s1, string s2){ return s1.length() < s2.length(); });
+            if (actual_max_iter != actual_lines.cend())
+            {
+                actual_max_length = actual_max_iter->length();
+            }
+
+            string heading_expected = "Expected output";
+            unsigned int expected_max_length = heading_expected.length();
+            auto expected_max_iter = std::max_element(expected_lines.cbegin(), expected_lines.cend(),
+                                                      [](string s1, string s2){ return s1.length() < s2.length(); });
+            if (expected_max_iter != expected_lines.cend())
+            {
+                expected_max_length = expected_max_iter->length();
+            }
+
+            auto pos_actual = actual_lines.cbegin();
+            auto pos_expected = expected_lines.cbegin();
+            output << "  " << heading_actual << string(actual_max_length - heading_actual.length(), ' ') << " | " << heading_expected << endl;
+            output << "--" << string(actual_max_length, '-') << "-|-" << string(expected_max_length, '-') << endl;
+
+            bool lines_ok = true;
+            while (pos_expected != expected_lines.cend() || pos_actual != actual_lines.cend())
+            {
+                if (pos_expected != expected_lines.cend())
+                {
+                    if (pos_actual != actual_lines.cend())
+                    {
+                        bool ok = (*pos_expected == *pos_actual);
+                        output << (ok ? ' ' : '?') << ' ' << *pos_actual << string(actual_max_length - pos_actual->length(), ' ')
+                               << " | " << *pos_expected << endl;
+                        lines_ok = lines_ok && ok;
+                        ++pos_actual;
+                    }
+                    else
+                    { // Actual output was too short
+                        output << "? " << string(actual_max_length, ' ')
+                               << " | " << *pos_expected << endl;
+                        lines_ok = false;
+                    }
+                    ++pos_expected;
+                }
+                else
+                { // Actual output was too long
+                    output << "? " << *pos_actual << string(actual_max_length - pos_actual->length(), ' ')
+                           << " | " << endl;
+                    lines_ok = false;
+                    ++pos_actual;
+                }
+            }
+            if (lines_ok)
+            {
+                output << "**No differences in output.**" << endl;
+                if (test_status_ == TestStatus::NOT_RUN)
+                {
+                    test_status_ = TestStatus::NO_DIFFS;
+                }
+            }
+            else
+            {
+                output << "**Differences found! (Lines beginning with '?')**" << endl;
+                test_status_ = TestStatus::DIFFS_FOUND;
+            }
+
+        }
+        else
+        {
+            output << "Cannot open file '" << outfilename << "'!" << endl;
+        }
+    }
+    else
+    {
+        output << "Cannot open file '" << infilename << "'!" << endl;
+    }
+
+    return {};
+}
+
+MainProgram::CmdResult MainProgram::cmd_stopwatch(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string on = *begin++;
+    string off = *begin++;
+    string next = *begin++;
+    assert(begin == end && "Invalid number of parameters");
+
+    if (!on.empty())
+    {
+        stopwatch_mode = StopwatchMode::ON;
+        output << "Stopwatch: on" << endl;
+    }
+    else if (!off.empty())
+    {
+        stopwatch_mode = StopwatchMode::OFF;
+        output << "Stopwatch: off" << endl;
+    }
+    else if (!next.empty())
+    {
+        stopwatch_mode = StopwatchMode::NEXT;
+        output << "Stopwatch: on for the next command" << endl;
+    }
+    else
+    {
+        assert(!"Impossible stopwatch mode!");
+    }
+
+    return {};
+}
+
+std::string MainProgram::print_affiliation_name(AffiliationID id, std::ostream &output, bool nl)
+{
+    try
+    {
+        if (id != NO_AFFILIATION)
+        {
+            auto name = ds_.get_affiliation_name(id);
+            print_buffer_.clear();
+            print_buffer_ += name.empty() ? "*" : name;
+            if (nl) { print_buffer_ += '\n'; }
+            write_buffer(print_buffer_, output);
+            return ui_ ? name : "";
+        }
+        else
+        {
+            output << "--NO_AFFILIATION--";
+            if (nl) { output << '\n'; }
+            return "";
+        }
+    }
+    catch (NotImplemented const& e)
+    {
+        output << endl << "NotImplemented while printing affiliation name : " << e.what() << endl;
+        std::cerr << endl << "NotImplemented while printing affiliation name : " << e.what() << endl;
+        return "";
+    }
+}
+
+std::string MainProgram::print_coord(Coord coord, std::ostream& output, bool nl)
+{
+    print_buffer_.clear();
+    format_coord(coord, print_buffer_);
+    if (nl) { print_buffer_ += '\n'; }
+    write_buffer(print_buffer_, output);
+    if (coord != NO_COORD && ui_)
+    {
+        string label;
+        format_coord(coord, label);
+        return label;
+    }
+    return "";
+}
+
+void MainProgram::format_coord(Coord coord, string& buf)
+{
+    if (coord != NO_COORD)
+    {
+        buf += '(';
+        append_number(buf, coord.x);
+        buf += ',';
+        append_number(buf, coord.y);
+        buf += ')';
+    }
+    else
+    {
+        buf += "(--NO_COORD--)";
+    }
+}
+
+void MainProgram::write_buffer(string& buf, std::ostream& output)
+{
+    output.write(buf.data(), buf.size());
+    buf.clear();
+}
+
+string const affiliationidx = "([a-zA-Z0-9-]+)";
+string const affiliationlistx = "(?:[a-zA-Z0-9-]+)";
+string const publicationidx = "([0-9]+)";
+string const namex = "([ a-zA-Z0-9-]+)";
+string const timex = "([0-9]+)";
+string const numx = "([0-9]+)";
+string const optcoordx = "\\([[:space:]]*[0-9]+[[:space:]]*,[[:space:]]*[0-9]+[[:space:]]*\\)";
+string const coordx = "\\([[:space:]]*([0-9]+)[[:space:]]*,[[:space:]]*([0-9]+)[[:space:]]*\\)";
+string const wsx = "[[:space:]]+";
+
+
+vector<MainProgram::CmdInfo> MainProgram::cmds_ =
+    {
+        {"get_affiliation_count", "", "", &MainProgram::cmd_get_affiliation_count, &MainProgram::test_get_affiliation_count },
+        {"clear_all", "", "", &MainProgram::cmd_clear_all, nullptr }, // clear all probably shouldn't be perftested since it will ... clear everything
+        {"get_all_affiliations", "", "", &MainProgram::cmd_get_all_affiliations, &MainProgram::NoParListTestCmd<&Datastructures::get_all_affiliations>},
+        {"add_affiliation", "AffiliationID \"Name\" (x,y)", affiliationidx+wsx+'"'+namex+'"'+wsx+coordx, &MainProgram::cmd_add_affiliation, nullptr }, // tested within each perftest, separate perftesting not necessary
+        {"affiliation_info", "AffiliationID", affiliationidx, &MainProgram::cmd_affiliation_info, &MainProgram::test_affiliation_info, true },
+        {"get_affiliations_alphabetically", "", "", &MainProgram::NoParListCmd<&Datastructures::get_affiliations_alphabetically>, &MainProgram::NoParListTestCmd<&Datastructures::get_affiliations_alphabetically> },
+        {"get_affiliations_distance_increasing", "", "", &MainProgram::NoParListCmd<&Datastructures::get_affiliations_distance_increasing>,
+         &MainProgram::NoParListTestCmd<&Datastructures::get_affiliations_distance_increasing> },
+        {"find_affiliation_with_coord", "(x,y)", coordx, &MainProgram::cmd_find_affiliation_with_coord, &MainProgram::test_find_affiliation_with_coord, true },
+        {"change_affiliation_coord", "AffiliationID (x,y)", affiliationidx+wsx+coordx, &MainProgram::cmd_change_affiliation_coord, &MainProgram::test_change_affiliation_coord },
+        {"get_publications_after", "AffiliationID Time", affiliationidx+wsx+timex, &MainProgram::cmd_get_publications_after, &MainProgram::test_get_publications_after, true },
+        {"add_publication", "PublicationID \"Name\" Year AffiliationID AffiliationID ...", publicationidx+wsx+'"'+namex+'"'+wsx+timex+"((?:"+wsx+affiliationlistx+")*)", &MainProgram::cmd_add_publication, nullptr }, // tested within each perftest, separate perftesting not necessary
+        {"get_all_publications", "", "", &MainProgram::cmd_get_all_publications, &MainProgram::test_get_all_publications},
+        {"publication_info", "PublicationID", publicationidx, &MainProgram::cmd_publication_info, &MainProgram::test_publication_info, true },
+        {"publications_info", "PublicationID1 PublicationID2 ... (name, year and parent of each as one batch, perftest uses batches of 100)",
+         "([0-9]+(?:"+wsx+"[0-9]+)*)", &MainProgram::cmd_publications_info, &MainProgram::test_publications_info, true },
+        {"affiliation_coords", "AffiliationID1 AffiliationID2 ... (coordinates of each as one batch, perftest uses batches of 100)",
+         "([a-zA-Z0-9-]+(?:"+wsx+"[a-zA-Z0-9-]+)*)", &MainProgram::cmd_affiliation_coords, &MainProgram::test_affiliation_coords, true },
+        {"add_reference", "PublicationID parentPublicationID", publicationidx+wsx+publicationidx, &MainProgram::cmd_add_reference, nullptr },
+        {"add_affiliation_to_publication", "AffiliationID PublicationID", affiliationidx+wsx+publicationidx, &MainProgram::cmd_add_affiliation_to_publication, &MainProgram::test_add_affiliation_to_publication},
+        {"get_publications", "AffiliationID", affiliationidx, &MainProgram::cmd_get_publications, &MainProgram::test_get_publications, true },
+        {"get_all_references", "PublicationID", publicationidx, &MainProgram::cmd_get_all_references, &MainProgram::test_get_all_references, true },
+        {"get_affiliations_closest_to", "(x,y)", coordx, &MainProgram::cmd_get_affiliations_closest_to, &MainProgram::test_affiliations_closest_to, true },
+        {"remove_affiliation", "AffiliationID", affiliationidx, &MainProgram::cmd_remove_affiliation, &MainProgram::test_remove_affiliation },
+        {"get_closest_common_parent", "PublicationID1 PublicationID2", publicationidx+wsx+publicationidx, &MainProgram::cmd_get_closest_common_parent, &MainProgram::test_get_closest_common_parent, true },
+        {"quit", "", "", nullptr, nullptr },
+        {"help", "", "", &MainProgram::help_command, nullptr },
+        {"random_add", "number_of_affiliations_to_add  (minx,miny) (maxx,maxy) (coordinates optional)",
+         numx+"(?:"+wsx+coordx+wsx+coordx+")?", &MainProgram::cmd_random_affiliations, &MainProgram::test_random_affiliations },
+        {"read", "\"in-filename\" [silent]", "\"([-a-zA-Z0-9 ./:_]+)\"(?:"+wsx+"(silent))?", &MainProgram::cmd_read, nullptr },
+        {"testread", "\"in-filename\" \"out-filename\"", "\"([-a-zA-Z0-9 ./:_]+)\""+wsx+"\"([-a-zA-Z0-9 ./:_]+)\"", &MainProgram::cmd_testread, nullptr },
+        {"perftest", "cmd1[:weight1][;cmd2[:weight2]...] timeout repeat_count n1[;n2...] [--zipf s] [--format json|csv [\"out-filename\"]] (parts in [] are optional, alternatives separated by |)",
+         "([0-9a-zA-Z_]+(?::[0-9]+)?(?:;[0-9a-zA-Z_]+(?::[0-9]+)?)*)"+wsx+numx+wsx+numx+wsx+"([0-9]+(?:;[0-9]+)*)"
+         "(?:"+wsx+"--zipf"+wsx+"([0-9]+(?:\\.[0-9]+)?))?"
+         "(?:"+wsx+"--format"+wsx+"(json|csv)(?:"+wsx+"\"([-a-zA-Z0-9 ./:_]+)\")?)?", &MainProgram::cmd_perftest, nullptr },
+        {"perftest_threads", "n repeat_count [write_percent] (queries from 1, 2, 4, 8 and 16 threads at the same time)",
+         numx+wsx+numx+"(?:"+wsx+numx+")?", &MainProgram::cmd_perftest_threads, nullptr },
+        {"perftest_ingest", "n reader_threads (query latency while n more are added, with each locking mode)",
+         numx+wsx+numx, &MainProgram::cmd_perftest_ingest, nullptr },
+        {"perftest_sort", "n1[;n2...] (sorting of the ordered listings with 1, 2, 4, 8 and 16 sort threads)",
+         "([0-9]+(?:;[0-9]+)*)", &MainProgram::cmd_perftest_sort, nullptr },
+        {"perftest_references", "n1[;n2...] (get_all_references of the root with 1, 2, 4, 8 and 16 traversal threads, see topology)",
+         "([0-9]+(?:;[0-9]+)*)", &MainProgram::cmd_perftest_references, nullptr },
+        {"perftest_bulk", "n1[;n2...] (random_add of n items as one bulk with 1, 2, 4, 8 and 16 ingest threads)",
+         "([0-9]+(?:;[0-9]+)*)", &MainProgram::cmd_perftest_bulk, nullptr },
+        {"perfcompare", "\"baseline.json\" [runs]", "\"([-a-zA-Z0-9 ./:_]+)\"(?:"+wsx+numx+")?", &MainProgram::cmd_perfcompare, nullptr },
+        {"import", "affiliations|publications|references|connections \"filename.csv|filename.jsonl\"",
+         "(affiliations|publications|references|connections)"+wsx+"\"([-a-zA-Z0-9 ./:_]+)\"", &MainProgram::cmd_import, nullptr },
+        {"log_open", "\"snapshot-filename\" \"log-filename\" [group_size]", "\"([-a-zA-Z0-9 ./:_]+)\""+wsx+"\"([-a-zA-Z0-9 ./:_]+)\"(?:"+wsx+numx+")?",
+         &MainProgram::cmd_log_open, nullptr },
+        {"log_close", "", "", &MainProgram::cmd_log_close, nullptr },
+        {"log_checkpoint", "", "", &MainProgram::cmd_log_checkpoint, nullptr },
+        {"log_recover", "\"snapshot-filename\" \"log-filename\" [group_size]", "\"([-a-zA-Z0-9 ./:_]+)\""+wsx+"\"([-a-zA-Z0-9 ./:_]+)\"(?:"+wsx+numx+")?",
+         &MainProgram::cmd_log_recover, nullptr },
+        {"stopwatch", "on|off|next (alternatives separated by |)", "(?:(on)|(off)|(next))", &MainProgram::cmd_stopwatch, nullptr },
+        {"perf_events", "all|event1[,event2...] (events: instructions,cycles,l1d,llc,branch,dtlb)", "(all|[a-z0-9]+(?:,[a-z0-9]+)*)",
+         &MainProgram::cmd_perf_events, nullptr },
+        {"memstats", "on|off (allocations and peak RSS in stopwatch and perftest output)", "(?:(on)|(off))", &MainProgram::cmd_memstats, nullptr },
+        {"page_size", "[items_per_page]", "(?:"+numx+")?", &MainProgram::cmd_page_size, nullptr },
+        {"sort_threads", "[threads [min_items]] (0 = one per hardware thread)", "(?:"+numx+"(?:"+wsx+numx+")?)?",
+         &MainProgram::cmd_sort_threads, nullptr },
+        {"traversal_threads", "[threads [min_items]] (0 = one per hardware thread)", "(?:"+numx+"(?:"+wsx+numx+")?)?",
+         &MainProgram::cmd_traversal_threads, nullptr },
+        {"ingest_threads", "[threads [min_items]] (0 = one per hardware thread)", "(?:"+numx+"(?:"+wsx+numx+")?)?",
+         &MainProgram::cmd_ingest_threads, nullptr },
+        {"concurrency", "[none|mutex|shared|snapshot|striped] (locking of Datastructures calls)",
+         "(?:(none|mutex|shared|snapshot|striped))?", &MainProgram::cmd_concurrency, nullptr },
+        {"shards", "[count] (affiliations and publications split by id, and locked separately in striped mode)", "(?:"+numx+")?",
+         &MainProgram::cmd_shards, nullptr },
+        {"async_queries", "[on [threads [max_pending]]|off] (read-only queries of read scripts on a pool of threads, 0 = one per hardware thread)",
+         "(?:(on)(?:"+wsx+numx+"(?:"+wsx+numx+")?)?|(off))?", &MainProgram::cmd_async_queries, nullptr },
+        {"change_feed", "[on [capacity]|off] (mutations published to a ring of capacity slots for subscribers)",
+         "(?:(on)(?:"+wsx+numx+")?|(off))?", &MainProgram::cmd_change_feed, nullptr },
+        {"change_feed_poll", "[max_events] (events after the previous poll)", "(?:"+numx+")?", &MainProgram::cmd_change_feed_poll, nullptr },
+        {"topology", "[binary|chain|star|preferential|forest [roots]] (references of random_add and perftest data)",
+         "(?:(binary|chain|star|preferential|forest)(?:"+wsx+numx+")?)?", &MainProgram::cmd_topology, nullptr },
+        {"trace_start", "\"trace-filename\" [\"snapshot-filename\"]", "\"([-a-zA-Z0-9 ./:_]+)\"(?:"+wsx+"\"([-a-zA-Z0-9 ./:_]+)\")?",
+         &MainProgram::cmd_trace_start, nullptr },
+        {"trace_stop", "", "", &MainProgram::cmd_trace_stop, nullptr },
+        {"replay", "\"trace-filename\" [timed|fast] [counts] [\"snapshot-filename\"] (counts = only call counts, no timing; alternatives separated by |)",
+         "\"([-a-zA-Z0-9 ./:_]+)\"(?:"+wsx+"(timed|fast))?(?:"+wsx+"(counts))?(?:"+wsx+"\"([-a-zA-Z0-9 ./:_]+)\")?", &MainProgram::cmd_replay, nullptr },
+        {"random_seed", "new-random-seed-integer", numx, &MainProgram::cmd_randseed, nullptr },
+        {"#", "comment text", ".*", &MainProgram::cmd_comment, nullptr },
+        {"remove_publication","PublicationID",publicationidx, &MainProgram::cmd_remove_publication, &MainProgram::test_remove_publication},
+        {"get_parent","PublicationID",publicationidx,&MainProgram::cmd_get_parent, &MainProgram::test_get_parent, true},
+        {"get_referenced_by_chain","PublicationID",publicationidx,&MainProgram::cmd_get_referenced_by_chain,&MainProgram::test_get_referenced_by_chain, true},
+        {"get_affiliations", "PublicationID", publicationidx, &MainProgram::cmd_get_affiliations, &MainProgram::test_get_affiliations, true},
+        {"get_direct_references", "PublicationID", publicationidx, &MainProgram::cmd_get_direct_references, &MainProgram::test_get_direct_references, true},
+        };
+
+MainProgram::CmdResult MainProgram::help_command(std::ostream& output, MatchIter /*begin*/, MatchIter /*end*/)
+{
+    output << "Commands:" << endl;
+    for (auto& i : cmds_)
+    {
+        output << "  " << i.cmd << " " << i.info << endl;
+    }
+
+    return {};
+}
+
+#ifdef USE_PERF_EVENT
+// Prints perftest columns for IPC of add and commands, and misses per command call
+static void print_counters(MainProgram::Stopwatch::Counts const& addcounts, MainProgram::Stopwatch::Counts const& cmdcounts,
+                           unsigned long int operations, std::ostream& output)
+{
+    using Stopwatch = MainProgram::Stopwatch;
+    auto ipc = [](Stopwatch::Counts const& counts)
+    {
+        if (counts[Stopwatch::INSTRUCTIONS] < 0 || counts[Stopwatch::CYCLES] <= 0) { return -1.0; }
+        return static_cast<double>(counts[Stopwatch::INSTRUCTIONS]) / counts[Stopwatch::CYCLES];
+    };
+    output << " , " << setw(8) << ipc(addcounts) << " , " << setw(8) << ipc(cmdcounts);
+    for (auto event : {Stopwatch::L1D_MISSES, Stopwatch::LLC_MISSES, Stopwatch::BRANCH_MISSES, Stopwatch::DTLB_MISSES})
+    {
+        output << " , " << setw(12);
+        if (cmdcounts[event] < 0 || operations == 0) { output << -1; }
+        else { output << static_cast<double>(cmdcounts[event]) / operations; }
+    }
+}
+#endif
+
+MainProgram::CmdResult MainProgram::cmd_perftest(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string commandstr = *begin++;
+    unsigned int timeout = convert_string_to<unsigned int>(*begin++);
+    unsigned int repeat_count = convert_string_to<unsigned int>(*begin++);
+    string sizes = *begin++;
+    string zipfstr = *begin++;
+    string format = *begin++;
+    string filename = *begin++;
+    assert(begin == end && "Invalid number of parameters");
+
+    // Workload spec: commands with optional weights (relative frequencies, default 1)
+    vector<string> testcmds;
+    vector<unsigned int> weights;
+    bool weighted = false;
+    smatch scmd;
+    auto cbeg = commandstr.cbegin();
+    auto cend = commandstr.cend();
+    for ( ; regex_search(cbeg, cend, scmd, commands_regex_); cbeg = scmd.suffix().first)
+    {
+        testcmds.push_back(scmd[1]);
+        weights.push_back(scmd[2].matched ? convert_string_to<unsigned int>(scmd[2]) : 1);
+        if (scmd[2].matched) { weighted = true; }
+    }
+    if (!weighted) { weights.clear(); } // Uniform choice, as without a spec
+
+    double zipf = zipfstr.empty() ? 0 : convert_string_to<double>(zipfstr);
+
+    vector<unsigned int> init_ns;
+    smatch size;
+    auto sbeg = sizes.cbegin();
+    auto send = sizes.cend();
+    for ( ; regex_search(sbeg, send, size, sizes_regex_); sbeg = size.suffix().first)
+    {
+        init_ns.push_back(convert_string_to<unsigned int>(size[1]));
+    }
+
+    PerfReport report;
+    if (format.empty())
+    {
+        run_perftest(output, testcmds, weights, zipf, timeout, repeat_count, init_ns, report);
+        return {};
+    }
+
+    // Machine-readable output. The normal table is shown only if the report goes to a file.
+    if (filename.empty())
+    {
+        std::ostream ignored(nullptr); // Discards the table (and isn't flushed to the GUI)
+        run_perftest(ignored, testcmds, weights, zipf, timeout, repeat_count, init_ns, report);
+        if (format == "json") { report.write_json(output); }
+        else { report.write_csv(output); }
+        return {};
+    }
+
+    run_perftest(output, testcmds, weights, zipf, timeout, repeat_count, init_ns, report);
+    std::ofstream file(filename);
+    if (format == "json") { report.write_json(file); }
+    else { report.write_csv(file); }
+    if (!file)
+    {
+        output << "Cannot write file '" << filename << "'!" << endl;
+        return {};
+    }
+    output << "Results written to '" << filename << "'" << endl;
+
+    return {};
+}
+
+void MainProgram::run_perftest(std::ostream& output, std::vector<std::string> const& testcmds,
+                               std::vector<unsigned int> const& weights, double zipf, unsigned int timeout,
+                               unsigned int repeat_count, std::vector<unsigned int> const& init_ns, PerfReport& report)
+{
+#ifdef _GLIBCXX_DEBUG
+    output << "WARNING: Debug STL enabled, performance will be worse than expected (maybe also asymptotically)!" << endl;
+#endif // _GLIBCXX_DEBUG
+
+    try {
+        // Note: everything below is indented too little by one indentation level! (because of try block above)
+
+        output << "Timeout for each N is " << timeout << " sec. " << endl;
+        output << "For each N perform " << repeat_count << " random command(s) from:" << endl;
+
+        // Initialize test functions
+        vector<void(MainProgram::*)()> testfuncs;
+        vector<string> testnames;
+        vector<unsigned int> testweights;
+
+        for (unsigned int c = 0; c < testcmds.size(); ++c)
+        {
+            auto& i = testcmds[c];
+            auto pos = find_if(cmds_.begin(), cmds_.end(), [&i](auto const& cmd){ return cmd.cmd == i; });
+            if (pos != cmds_.end() && pos->testfunc)
+            {
+                output << i << " ";
+                if (!weights.empty()) { output << "(weight " << weights[c] << ") "; }
+                testfuncs.push_back(pos->testfunc);
+                testnames.push_back(i);
+                if (!weights.empty()) { testweights.push_back(weights[c]); }
+            }
+            else
+            {
+                output << "(cannot test " << i << ") ";
+            }
+        }
+
+        output << endl;
+        if (zipf > 0) { output << "Affiliation and publication IDs are Zipf distributed with s=" << zipf << endl; }
+        if (topology_ != Topology::BINARY_TREE)
+        {
+            output << "References form a " << topology_name(topology_) << " topology";
+            if (topology_ == Topology::FOREST) { output << " with " << forest_roots_ << " roots"; }
+            output << endl;
+        }
+        output << endl;
+
+        if (testfuncs.empty() || (!testweights.empty() && accumulate(testweights.begin(), testweights.end(), 0ull) == 0))
+        {
+            output << "No commands to test!" << endl;
+            report.stopped = "No commands to test!";
+            return;
+        }
+
+        // Commands are picked with probabilities proportional to the weights, if given
+        std::discrete_distribution<unsigned int> pick_command(testweights.begin(), testweights.end());
+        key_distribution_ = ZipfDistribution(zipf);
+
+        report.commands = testnames;
+        report.weights = testweights;
+        report.zipf = key_distribution_.skew();
+        report.topology = topology_name(topology_);
+        report.forest_roots = forest_roots_;
+        report.timeout = timeout;
+        report.repeat_count = repeat_count;
+        report.sizes = init_ns;
+
+        // The loop around the calls (clock reads, allocation counting, bookkeeping) is timed
+        // against an empty call and subtracted from the results
+        HarnessOverhead overhead = calibrate_harness(HARNESS_CALIBRATION_ITERATIONS);
+        output << "Harness overhead " << overhead.call_ns << " ns per call and "
+               << static_cast<std::uint64_t>(overhead.iteration_sec * 1e9) << " ns per iteration (subtracted)" << endl;
+        report.overhead_ns = overhead.call_ns;
+
+#ifdef USE_PERF_EVENT
+        output << setw(7) << "N" << " , " << setw(12) << "add (sec)" << " , " << setw(12) << "add (count)" << " , ";
+        if (memory_stats_) { output << setw(12) << "add (allocs)" << " , " << setw(12) << "add (MB)" << " , "; }
+        output << setw(12) << "cmds (sec)" << " , " << setw(12) << "cmds (count)"  << " , ";
+        if (memory_stats_) { output << setw(12) << "cmds (allocs)" << " , " << setw(12) << "cmds (MB)" << " , "; }
+        output << setw(12) << "total (sec)" << " , " << setw(12) << "total (count)";
+#else
+        output << setw(7) << "N" << " , " << setw(12) << "add (sec)" << " , ";
+        if (memory_stats_) { output << setw(12) << "add (allocs)" << " , " << setw(12) << "add (MB)" << " , "; }
+        output << setw(12) << "cmds (sec)" << " , ";
+        if (memory_stats_) { output << setw(12) << "cmds (allocs)" << " , " << setw(12) << "cmds (MB)" << " , "; }
+        output << setw(12) << "total (sec)";
+#endif
+        if (memory_stats_) { output << " , " << setw(14) << "peak RSS (MB)"; }
+        // Latency percentiles of individual command calls, in microseconds
+        output << " , " << setw(10) << "p50 (us)" << " , " << setw(10) << "p90 (us)" << " , " << setw(10) << "p99 (us)"
+               << " , " << setw(10) << "max (us)";
+#ifdef USE_PERF_EVENT
+        // Hardware event columns: instructions per cycle and misses per command call
+        bool counters_available = Stopwatch(true).counters_available();
+        if (counters_available)
+        {
+            output << " , " << setw(8) << "add IPC" << " , " << setw(8) << "cmds IPC";
+            for (auto event : {Stopwatch::L1D_MISSES, Stopwatch::LLC_MISSES, Stopwatch::BRANCH_MISSES, Stopwatch::DTLB_MISSES})
             {
-                string line;
-                getline(expected_output, line);
-                if (!expected_output) { break; }
-                expected_lines.push_back(line);
+                output << " , " << setw(12) << (string(Stopwatch::event_name(event)) + " miss/op");
             }
+        }
+        output << endl;
+        if (!counters_available) { output << "(Perf events not available, count columns show -1)" << endl; }
+#else
+        output << endl;
+#endif
+        flush_output(output);
 
-            string heading_actual = "Actual output";
-            unsigned int actual_max_length = heading_actual.length();
-            auto actual_max_iter = max_element(actual_lines.cbegin(), actual_lines.cend(),
-                                               [](string s1, string s2){ return s1.length() < s2.length(); });
-            if (actual_max_iter != actual_lines.cend())
+        // Growth of time per operation over N, compared to Datastructures::PERFORMANCE_ESTIMATES
+        ComplexityFit addfit;
+        vector<ComplexityFit> cmdfits(testfuncs.size());
+
+        auto stop = false;
+        for (unsigned int n : init_ns)
+        {
+            if (stop) { break; }
+
+            output << setw(7) << n << " , " << flush;
+
+            ds_.clear_all();
+            init_primes();
+
+            Stopwatch stopwatch(true); // Use also instruction counting, if enabled
+            // Allocations are counted only around the measured calls, like time
+            MemoryStats::Allocations addallocs;
+            MemoryStats::Allocations before;
+            if (memory_stats_) { MemoryStats::reset_peak_resident_set(); }
+            std::unordered_set<Coord,CoordHash> exclude_list;
+            std::vector<Coord> unique_coords = get_unique_coords(n,exclude_list,RANDOM_MIN_COORD,RANDOM_MAX_COORD);
+            // Add random affiliations
+            std::vector<Coord>::iterator start_of_range=unique_coords.begin();
+            for (unsigned int i = 0; i < n / 1000; ++i,std::advance(start_of_range,1000))
             {
-                actual_max_length = actual_max_iter->length();
+                std::vector<Coord> vector_slice(start_of_range,std::next(start_of_range,1000));
+                before = MemoryStats::allocations();
+                stopwatch.start();
+                add_random_affiliations_publications(1000,RANDOM_MIN_COORD,RANDOM_MAX_COORD,vector_slice);
+                stopwatch.stop();
+                addallocs += MemoryStats::allocations() - before;
+
+                if (stopwatch.elapsed() >= timeout)
+                {
+                    output << "ADD Timeout!" << endl;
+                    report.stopped = "ADD Timeout!";
+                    stop = true;
+                    break;
+                }
+                if (check_stop())
+                {
+                    output << "Stopped!" << endl;
+                    report.stopped = "Stopped!";
+                    stop = true;
+                    break;
+                }
+            }
+            if (stop) { break; }
+
+            if (n % 1000 != 0)
+            {
+                std::vector<Coord> vector_slice(start_of_range,unique_coords.end());
+                before = MemoryStats::allocations();
+                stopwatch.start();
+                add_random_affiliations_publications(n % 1000,RANDOM_MIN_COORD,RANDOM_MAX_COORD,vector_slice);
+                stopwatch.stop();
+                addallocs += MemoryStats::allocations() - before;
+            }
+
+#ifdef USE_PERF_EVENT
+            auto addcounts = stopwatch.counts();
+            auto addcount = addcounts[Stopwatch::INSTRUCTIONS];
+#endif
+            auto addsec = stopwatch.elapsed();
+
+#ifdef USE_PERF_EVENT
+            output << setw(12) << addsec << " , " << setw(12) << addcount << " , " << flush;
+#else
+            output << setw(12) << addsec << " , " << flush;
+#endif
+            if (memory_stats_) { print_allocations(addallocs, output); }
+
+            if (addsec >= timeout)
+            {
+                output << "ADD Timeout!" << endl;
+                report.stopped = "ADD Timeout!";
+                stop = true;
+                break;
+            }
+
+            // Every call is also timed separately, so that occasional slow calls (e.g. cache
+            // rebuilds) show up in the tail percentiles instead of disappearing into the total
+            vector<LatencyHistogram> latencies(testfuncs.size());
+            vector<MemoryStats::Allocations> cmdallocs(testfuncs.size());
+
+            // Commands and their arguments are generated before timing, so random number
+            // generation and id formatting are not counted as command time
+            std::size_t stream_size = std::max<std::size_t>(1, std::min<std::size_t>(repeat_count, MAX_ARGUMENT_STREAM_SIZE));
+            vector<unsigned int> command_order(stream_size);
+            for (auto& command : command_order)
+            {
+                command = testweights.empty() ? random<unsigned int>(0, testfuncs.size()) : pick_command(rand_engine_);
+            }
+            fill_argument_streams(stream_size);
+            unsigned int order_pos = 0;
+
+            stopwatch.start();
+            for (unsigned int repeat = 0; repeat < repeat_count; ++repeat)
+            {
+                auto cmdpos = testfuncs.begin() + command_order[order_pos];
+                order_pos = (order_pos + 1 == command_order.size()) ? 0 : order_pos + 1;
+
+                before = MemoryStats::allocations();
+                auto callstart = Stopwatch::Clock::now();
+                (this->**cmdpos)();
+                auto callend = Stopwatch::Clock::now();
+                cmdallocs[cmdpos - testfuncs.begin()] += MemoryStats::allocations() - before;
+                std::uint64_t callns = std::chrono::duration_cast<std::chrono::nanoseconds>(callend - callstart).count();
+                latencies[cmdpos - testfuncs.begin()].record(callns > overhead.call_ns ? callns - overhead.call_ns : 0);
+
+                // Stop request is a single atomic load, so it is checked on every repeat
+                // (calibrate_harness() does the same, so its cost is subtracted)
+                if (check_stop())
+                {
+                    output << "Stopped!" << endl;
+                    report.stopped = "Stopped!";
+                    stop = true;
+                    break;
+                }
+                if (repeat % 10 == 0)
+                {
+                    stopwatch.stop();
+                    if (stopwatch.elapsed() >= timeout)
+                    {
+                        output << "Timeout!" << endl;
+                        report.stopped = "Timeout!";
+                        stop = true;
+                        break;
+                    }
+                    stopwatch.start();
+                }
             }
+            stopwatch.stop();
+            clear_argument_streams();
+            if (stop) { break; }
 
-            string heading_expected = "Expected output";
-            unsigned int expected_max_length = heading_expected.length();
-            auto expected_max_iter = std::max_element(expected_lines.cbegin(), expected_lines.cend(),
-                                                      [](string s1, string s2){ return s1.length() < s2.length(); });
-            if (expected_max_iter != expected_lines.cend())
+#ifdef USE_PERF_EVENT
+            auto totalcounts = stopwatch.counts();
+            auto totalcount = totalcounts[Stopwatch::INSTRUCTIONS];
+#endif
+            auto totalsec = stopwatch.elapsed() - std::min(stopwatch.elapsed() - addsec, repeat_count * overhead.iteration_sec);
+
+            MemoryStats::Allocations allcmdallocs;
+            for (auto const& allocs : cmdallocs) { allcmdallocs += allocs; }
+
+#ifdef USE_PERF_EVENT
+            output << setw(12) << totalsec-addsec << " , " << setw(12) << (totalcount < 0 ? -1 : totalcount-addcount) << " , ";
+            if (memory_stats_) { print_allocations(allcmdallocs, output); }
+            output << setw(12) << totalsec << " , " << setw(12) << totalcount;
+#else
+            output << setw(12) << totalsec-addsec << " , ";
+            if (memory_stats_) { print_allocations(allcmdallocs, output); }
+            output << setw(12) << totalsec;
+#endif
+            std::uint64_t rss = 0;
+            std::uint64_t peak_rss = 0;
+            if (memory_stats_)
             {
-                expected_max_length = expected_max_iter->length();
+                output << " , " << setw(14);
+                if (MemoryStats::resident_set(rss, peak_rss)) { output << peak_rss / (1024.0*1024.0); }
+                else { output << "-"; }
             }
 
-            auto pos_actual = actual_lines.cbegin();
-            auto pos_expected = expected_lines.cbegin();
-            output << "  " << heading_actual << string(actual_max_length - heading_actual.length(), ' ') << " | " << heading_expected << endl;
-            output << "--" << string(actual_max_length, '-') << "-|-" << string(expected_max_length, '-') << endl;
+            report.size_results.push_back({n, addsec, totalsec-addsec, totalsec});
+            for (unsigned int i = 0; i < testfuncs.size(); ++i) { report.add_command_result(testnames[i], n, latencies[i]); }
 
-            bool lines_ok = true;
-            while (pos_expected != expected_lines.cend() || pos_actual != actual_lines.cend())
+            addfit.add(n, addsec / n);
+            for (unsigned int i = 0; i < testfuncs.size(); ++i) { cmdfits[i].add(n, latencies[i].mean()); }
+
+            LatencyHistogram all_latencies;
+            for (auto const& latency : latencies) { all_latencies.merge(latency); }
+            print_latencies(all_latencies, output);
+#ifdef USE_PERF_EVENT
+            if (counters_available)
             {
-                if (pos_expected != expected_lines.cend())
+                Stopwatch::Counts cmdcounts;
+                for (unsigned int i = 0; i < Stopwatch::EVENT_COUNT; ++i)
                 {
-                    if (pos_actual != actual_lines.cend())
-                    {
-                        bool ok = (*pos_expected == *pos_actual);
-                        output << (ok ? ' ' : '?') << ' ' << *pos_actual << string(actual_max_length - pos_actual->length(), ' ')
-                               << " | " << *pos_expected << endl;
-                        lines_ok = lines_ok && ok;
-                        ++pos_actual;
-                    }
-                    else
-                    { // Actual output was too short
-                        output << "? " << string(actual_max_length, ' ')
-                               << " | " << *pos_expected << endl;
-                        lines_ok = false;
-                    }
-                    ++pos_expected;
-                }
-                else
-                { // Actual output was too long
-                    output << "? " << *pos_actual << string(actual_max_length - pos_actual->length(), ' ')
-                           << " | " << endl;
-                    lines_ok = false;
-                    ++pos_actual;
+                    cmdcounts[i] = (totalcounts[i] < 0) ? -1 : totalcounts[i] - addcounts[i];
                 }
+                print_counters(addcounts, cmdcounts, all_latencies.count(), output);
             }
-            if (lines_ok)
+#endif
+            output << endl;
+
+            // Separate percentiles for each command, if there are several
+            if (testfuncs.size() > 1)
             {
-                output << "**No differences in output.**" << endl;
-                if (test_status_ == TestStatus::NOT_RUN)
+                for (unsigned int i = 0; i < testfuncs.size(); ++i)
                 {
-                    test_status_ = TestStatus::NO_DIFFS;
+                    output << setw(7) << "" << "   " << setw(40) << testnames[i];
+                    print_latencies(latencies[i], output);
+                    output << " (" << latencies[i].count() << " calls";
+                    if (memory_stats_ && latencies[i].count() > 0)
+                    {
+                        output << ", " << cmdallocs[i].count / latencies[i].count() << " allocs and "
+                               << cmdallocs[i].bytes / latencies[i].count() << " bytes per call";
+                    }
+                    output << ")" << endl;
                 }
             }
-            else
-            {
-                output << "**Differences found! (Lines beginning with '?')**" << endl;
-                test_status_ = TestStatus::DIFFS_FOUND;
-            }
-
-        }
-        else
-        {
-            output << "Cannot open file '" << outfilename << "'!" << endl;
+            flush_output(output);
         }
+
+        print_complexity_fits(addfit, cmdfits, testnames, output);
+
+        clear_argument_streams();
+        ds_.clear_all();
+        init_primes();
+        key_distribution_ = ZipfDistribution();
+
     }
-    else
+    catch (NotImplemented const&)
     {
-        output << "Cannot open file '" << infilename << "'!" << endl;
+        // Clean up after NotImplemented
+        clear_argument_streams();
+        ds_.clear_all();
+        init_primes();
+        key_distribution_ = ZipfDistribution();
+        throw;
     }
 
-    return {};
+#ifdef _GLIBCXX_DEBUG
+    output << "WARNING: Debug STL enabled, performance will be worse than expected (maybe also asymptotically)!" << endl;
+#endif // _GLIBCXX_DEBUG
 }
 
-MainProgram::CmdResult MainProgram::cmd_stopwatch(std::ostream& output, MatchIter begin, MatchIter end)
+struct MainProgram::ThreadCall
 {
-    string on = *begin++;
-    string off = *begin++;
-    string next = *begin++;
-    assert(begin == end && "Invalid number of parameters");
+    enum Kind { AFFILIATION_NAME, AFFILIATION_COORD, PUBLICATION_NAME, PUBLICATION_YEAR, AFFILIATIONS, PUBLICATIONS,
+                PARENT, DIRECT_REFERENCES, REFERENCED_BY_CHAIN, PUBLICATIONS_AFTER, AFFILIATIONS_ALPHABETICALLY,
+                READ_KINDS, CHANGE_AFFILIATION_COORD = READ_KINDS };
+    Kind kind;
+    AffiliationID affiliation;
+    PublicationID publication;
+    Coord xy;
+    Year year;
+};
 
-    if (!on.empty())
+std::size_t MainProgram::run_thread_call(Datastructures& ds, ThreadCall const& call)
+{
+    switch (call.kind)
     {
-        stopwatch_mode = StopwatchMode::ON;
-        output << "Stopwatch: on" << endl;
-    }
-    else if (!off.empty())
+    case ThreadCall::AFFILIATION_NAME: return ds.get_affiliation_name(call.affiliation).size();
+    case ThreadCall::AFFILIATION_COORD: return ds.get_affiliation_coord(call.affiliation).x;
+    case ThreadCall::PUBLICATION_NAME: return ds.get_publication_name(call.publication).size();
+    case ThreadCall::PUBLICATION_YEAR: return ds.get_publication_year(call.publication);
+    case ThreadCall::AFFILIATIONS: return ds.get_affiliations(call.publication).size();
+    case ThreadCall::PUBLICATIONS: return ds.get_publications(call.affiliation).size();
+    case ThreadCall::PARENT: return ds.get_parent(call.publication);
+    case ThreadCall::DIRECT_REFERENCES: return ds.get_direct_references(call.publication).size();
+    case ThreadCall::REFERENCED_BY_CHAIN: return ds.get_referenced_by_chain(call.publication).size();
+    case ThreadCall::PUBLICATIONS_AFTER: return ds.get_publications_after(call.affiliation, call.year).size();
+    case ThreadCall::AFFILIATIONS_ALPHABETICALLY: return ds.get_affiliations_alphabetically().size();
+    case ThreadCall::CHANGE_AFFILIATION_COORD: return ds.change_affiliation_coord(call.affiliation, call.xy);
+    }
+    return 0;
+}
+
+std::vector<std::vector<MainProgram::ThreadCall>> MainProgram::generate_thread_calls(unsigned int threads, unsigned int count,
+                                                                                    unsigned int write_percent)
+{
+    std::size_t calls_per_thread = std::max(1u, std::min(count, MAX_THREAD_CALLS));
+    vector<vector<ThreadCall>> calls(threads);
+    for (auto& thread_calls : calls)
     {
-        stopwatch_mode = StopwatchMode::OFF;
-        output << "Stopwatch: off" << endl;
+        thread_calls.reserve(calls_per_thread);
+        for (std::size_t i = 0; i < calls_per_thread; ++i)
+        {
+            auto kind = (random<unsigned int>(0, 100) < write_percent)
+                    ? ThreadCall::CHANGE_AFFILIATION_COORD
+                    : static_cast<ThreadCall::Kind>(random<unsigned int>(0, ThreadCall::READ_KINDS));
+            thread_calls.push_back({kind, random_affiliation(), random_publication(), get_random_coords(), get_random_year()});
+        }
     }
-    else if (!next.empty())
+    return calls;
+}
+
+MainProgram::CmdResult MainProgram::cmd_perftest_threads(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string nstr = *begin++;
+    string repeatstr = *begin++;
+    string writestr = *begin++;
+    assert(begin == end && "Impossible number of parameters!");
+
+    unsigned int n = convert_string_to<unsigned int>(nstr);
+    unsigned int repeat_count = convert_string_to<unsigned int>(repeatstr);
+    unsigned int write_percent = writestr.empty() ? 0 : convert_string_to<unsigned int>(writestr);
+    if (write_percent > 100)
     {
-        stopwatch_mode = StopwatchMode::NEXT;
-        output << "Stopwatch: on for the next command" << endl;
+        output << "Write percentage must be at most 100!" << endl;
+        return {};
     }
-    else
+
+    output << "Each thread performs " << repeat_count << " random queries";
+    if (write_percent > 0) { output << " and change_affiliation_coord calls (" << write_percent << "% of calls)"; }
+    output << " on " << n << " affiliations and publications" << endl;
+    output << "Locking: mutex = every call exclusive (Concurrency::EXCLUSIVE), shared = reader-writer (Concurrency::SHARED),"
+              " snapshot = lock-free queries of published copies (Concurrency::SNAPSHOT),"
+              " striped = reader-writer lock per shard with " << STRIPED_SHARD_COUNT << " shards (Concurrency::STRIPED)" << endl;
+    output << "Hardware threads available: " << thread::hardware_concurrency() << endl << endl;
+
+    ds_.clear_all();
+    init_primes();
+    std::unordered_set<Coord,CoordHash> exclude_list;
+    add_random_affiliations_publications(n, RANDOM_MIN_COORD, RANDOM_MAX_COORD,
+                                         get_unique_coords(n, exclude_list, RANDOM_MIN_COORD, RANDOM_MAX_COORD));
+
+    static unsigned int const thread_counts[] = {1, 2, 4, 8, 16};
+    unsigned int const max_threads = thread_counts[std::size(thread_counts) - 1];
+    auto calls = generate_thread_calls(max_threads, repeat_count, write_percent);
+
+    static pair<Datastructures::Concurrency, string> const modes[] = {
+        {Datastructures::Concurrency::EXCLUSIVE, "mutex (calls/s)"},
+        {Datastructures::Concurrency::SHARED, "shared (calls/s)"},
+        {Datastructures::Concurrency::SNAPSHOT, "snapshot (calls/s)"},
+        {Datastructures::Concurrency::STRIPED, "striped (calls/s)"}};
+    output << setw(7) << "threads";
+    for (auto const& mode : modes) { output << " , " << setw(16) << mode.second << " , " << setw(8) << "speedup"; }
+    output << " , " << setw(10) << "p50 (us)" << " , " << setw(10) << "p90 (us)" << " , " << setw(10) << "p99 (us)"
+           << " , " << setw(10) << "max (us)" << endl;
+    flush_output(output);
+
+    // Throughput of one thread in each mode
+    double bases[std::size(modes)] = {};
+    std::size_t sink = 0;
+    for (unsigned int threads : thread_counts)
     {
-        assert(!"Impossible stopwatch mode!");
+        if (check_stop())
+        {
+            output << "Stopped!" << endl;
+            break;
+        }
+
+        output << setw(7) << threads << flush;
+        LatencyHistogram shared_latencies; // Latencies are shown for the reader-writer mode
+        for (unsigned int mode = 0; mode < std::size(modes); ++mode)
+        {
+            auto concurrency = modes[mode].first;
+            ds_.set_concurrency(concurrency);
+            ds_.set_shard_count((concurrency == Datastructures::Concurrency::STRIPED) ? STRIPED_SHARD_COUNT : 1);
+            vector<LatencyHistogram> latencies(threads);
+            vector<std::size_t> sinks(threads, 0);
+            atomic<unsigned int> ready{0};
+            atomic<bool> go{false};
+
+            vector<thread> workers;
+            for (unsigned int t = 0; t < threads; ++t)
+            {
+                workers.emplace_back([this, t, repeat_count, &calls, &latencies, &sinks, &ready, &go]()
+                {
+                    auto const& thread_calls = calls[t];
+                    std::size_t pos = 0;
+                    std::size_t thread_sink = 0;
+                    ready.fetch_add(1);
+                    while (!go.load(std::memory_order_acquire)) { std::this_thread::yield(); }
+                    for (unsigned int repeat = 0; repeat < repeat_count; ++repeat)
+                    {
+                        auto callstart = Stopwatch::Clock::now();
+                        thread_sink += run_thread_call(ds_, thread_calls[pos]);
+                        auto callend = Stopwatch::Clock::now();
+                        latencies[t].record(std::chrono::duration_cast<std::chrono::nanoseconds>(callend - callstart).count());
+                        pos = (pos + 1 == thread_calls.size()) ? 0 : pos + 1;
+                    }
+                    sinks[t] = thread_sink;
+                });
+            }
+
+            while (ready.load() != threads) { std::this_thread::yield(); }
+            auto start = Stopwatch::Clock::now();
+            go.store(true, std::memory_order_release);
+            for (auto& worker : workers) { worker.join(); }
+            auto elapsed = std::chrono::duration<double>(Stopwatch::Clock::now() - start).count();
+
+            for (auto value : sinks) { sink += value; }
+            double rate = (elapsed > 0) ? static_cast<double>(threads) * repeat_count / elapsed : 0;
+            double& base = bases[mode];
+            if (threads == 1) { base = rate; }
+            auto old_precision = output.precision(2);
+            auto old_flags = output.setf(std::ios::fixed, std::ios::floatfield);
+            output << " , " << setw(std::max<std::size_t>(16, modes[mode].second.size())) << static_cast<unsigned long long>(rate)
+                   << " , " << setw(8) << ((base > 0) ? rate / base : 0) << flush;
+            output.precision(old_precision);
+            output.flags(old_flags);
+
+            if (concurrency == Datastructures::Concurrency::SHARED)
+            {
+                for (auto const& latency : latencies) { shared_latencies.merge(latency); }
+            }
+        }
+        print_latencies(shared_latencies, output);
+        output << endl;
+        flush_output(output);
     }
 
+    ds_.set_concurrency(Datastructures::Concurrency::NONE);
+    ds_.set_shard_count(1);
+    ds_.clear_all();
+    init_primes();
+    if (sink == 0) { output << endl; } // Keeps the results used
+
     return {};
 }
 
-std::string MainProgram::print_affiliation_name(AffiliationID id, std::ostream &output, bool nl)
+MainProgram::CmdResult MainProgram::cmd_perftest_sort(std::ostream& output, MatchIter begin, MatchIter end)
 {
-    try
+    string sizes = *begin++;
+    assert(begin == end && "Impossible number of parameters!");
+
+    vector<unsigned int> init_ns;
+    smatch size;
+    auto sbeg = sizes.cbegin();
+    auto send = sizes.cend();
+    for ( ; regex_search(sbeg, send, size, sizes_regex_); sbeg = size.suffix().first)
     {
-        if (id != NO_AFFILIATION)
+        init_ns.push_back(convert_string_to<unsigned int>(size[1]));
+    }
+
+    output << "Time of each listing with cold caches, with n affiliations and publications (all publications"
+              " also in one affiliation for get_publications_after)" << endl;
+    output << "Listings of at least " << ds_.sort_min_items() << " items are sorted in parallel" << endl;
+    output << "Hardware threads available: " << thread::hardware_concurrency() << endl << endl;
+    output << setw(9) << "n" << " , " << setw(7) << "threads"
+           << " , " << setw(20) << "alphabetically (sec)" << " , " << setw(8) << "speedup"
+           << " , " << setw(14) << "distance (sec)" << " , " << setw(8) << "speedup"
+           << " , " << setw(24) << "publications_after (sec)" << " , " << setw(8) << "speedup" << endl;
+    flush_output(output);
+
+    auto old_sort_threads = ds_.sort_threads();
+    std::size_t sink = 0;
+    for (unsigned int n : init_ns)
+    {
+        if (check_stop())
         {
-            auto name = ds_.get_affiliation_name(id);
-            if (!name.empty())
-            {
-                output << name;
-            }
-            else
+            output << "Stopped!" << endl;
+            break;
+        }
+
+        ds_.clear_all();
+        init_primes();
+        std::unordered_set<Coord,CoordHash> exclude_list;
+        add_random_affiliations_publications(n, RANDOM_MIN_COORD, RANDOM_MAX_COORD,
+                                             get_unique_coords(n, exclude_list, RANDOM_MIN_COORD, RANDOM_MAX_COORD));
+        AffiliationID all_publications = n_to_affiliationid(random_affiliations_added_++);
+        ds_.begin_bulk();
+        ds_.add_affiliation(all_publications, "All publications", get_random_coords());
+        for (unsigned int i = 0; i < n; ++i) { ds_.add_affiliation_to_publication(all_publications, n_to_publicationid(i)); }
+        ds_.end_bulk();
+
+        double bases[3] = {0, 0, 0};
+        for (unsigned int threads : {1, 2, 4, 8, 16})
+        {
+            ds_.set_sort_threads(threads);
+            // Adding an affiliation makes both ordered caches out of date
+            auto added = random_affiliations_added_++;
+            ds_.add_affiliation(n_to_affiliationid(added), n_to_name(added), get_random_coords());
+
+            double secs[3];
+            auto start = Stopwatch::Clock::now();
+            sink += ds_.get_affiliations_alphabetically().size();
+            auto middle1 = Stopwatch::Clock::now();
+            sink += ds_.get_affiliations_distance_increasing().size();
+            auto middle2 = Stopwatch::Clock::now();
+            sink += ds_.get_publications_after(all_publications, 0).size();
+            auto stop = Stopwatch::Clock::now();
+            secs[0] = std::chrono::duration<double>(middle1 - start).count();
+            secs[1] = std::chrono::duration<double>(middle2 - middle1).count();
+            secs[2] = std::chrono::duration<double>(stop - middle2).count();
+
+            output << setw(9) << n << " , " << setw(7) << threads;
+            auto old_precision = output.precision(4);
+            auto old_flags = output.setf(std::ios::fixed, std::ios::floatfield);
+            static unsigned int const widths[3] = {20, 14, 24};
+            for (unsigned int i = 0; i < 3; ++i)
             {
-                output << "*";
+                if (threads == 1) { bases[i] = secs[i]; }
+                output << " , " << setw(widths[i]) << secs[i] << " , " << setw(8) << ((secs[i] > 0) ? bases[i] / secs[i] : 0);
             }
+            output.precision(old_precision);
+            output.flags(old_flags);
+            output << endl;
+            flush_output(output);
+        }
+    }
+
+    ds_.set_sort_threads(old_sort_threads);
+    ds_.clear_all();
+    init_primes();
+    if (sink == 0) { output << endl; } // Keeps the results used
+
+    return {};
+}
+
+MainProgram::CmdResult MainProgram::cmd_perftest_references(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string sizes = *begin++;
+    assert(begin == end && "Impossible number of parameters!");
+
+    vector<unsigned int> init_ns;
+    smatch size;
+    auto sbeg = sizes.cbegin();
+    auto send = sizes.cend();
+    for ( ; regex_search(sbeg, send, size, sizes_regex_); sbeg = size.suffix().first)
+    {
+        init_ns.push_back(convert_string_to<unsigned int>(size[1]));
+    }
 
-            ostringstream retstream;
-            retstream << name;
-            if (nl) { output << endl; }
-            return retstream.str();
+    output << "Time of get_all_references from the first publication, with n affiliations and publications" << endl;
+    output << "Subtrees of more than " << ds_.traversal_min_items() << " publications are walked in parallel" << endl;
+    output << "Hardware threads available: " << thread::hardware_concurrency() << endl << endl;
+    output << setw(9) << "n" << " , " << setw(7) << "threads" << " , " << setw(10) << "references"
+           << " , " << setw(10) << "time (sec)" << " , " << setw(8) << "speedup" << endl;
+    flush_output(output);
+
+    auto old_traversal_threads = ds_.traversal_threads();
+    for (unsigned int n : init_ns)
+    {
+        if (check_stop())
+        {
+            output << "Stopped!" << endl;
+            break;
         }
-        else
+
+        ds_.clear_all();
+        init_primes();
+        std::unordered_set<Coord,CoordHash> exclude_list;
+        add_random_affiliations_publications(n, RANDOM_MIN_COORD, RANDOM_MAX_COORD,
+                                             get_unique_coords(n, exclude_list, RANDOM_MIN_COORD, RANDOM_MAX_COORD));
+
+        double base = 0;
+        for (unsigned int threads : {1, 2, 4, 8, 16})
         {
-            output << "--NO_AFFILIATION--";
-            if (nl) { output << endl; }
-            return "";
+            ds_.set_traversal_threads(threads);
+            auto start = Stopwatch::Clock::now();
+            auto references = ds_.get_all_references(n_to_publicationid(0)).size();
+            auto secs = std::chrono::duration<double>(Stopwatch::Clock::now() - start).count();
+            if (threads == 1) { base = secs; }
+
+            output << setw(9) << n << " , " << setw(7) << threads << " , " << setw(10) << references;
+            auto old_precision = output.precision(4);
+            auto old_flags = output.setf(std::ios::fixed, std::ios::floatfield);
+            output << " , " << setw(10) << secs << " , " << setw(8) << ((secs > 0) ? base / secs : 0) << endl;
+            output.precision(old_precision);
+            output.flags(old_flags);
+            flush_output(output);
         }
     }
-    catch (NotImplemented const& e)
-    {
-        output << endl << "NotImplemented while printing affiliation name : " << e.what() << endl;
-        std::cerr << endl << "NotImplemented while printing affiliation name : " << e.what() << endl;
-        return "";
-    }
+
+    ds_.set_traversal_threads(old_traversal_threads);
+    ds_.clear_all();
+    init_primes();
+
+    return {};
 }
 
-std::string MainProgram::print_coord(Coord coord, std::ostream& output, bool nl)
+MainProgram::CmdResult MainProgram::cmd_perftest_bulk(std::ostream& output, MatchIter begin, MatchIter end)
 {
-    if (coord != NO_COORD)
+    string sizes = *begin++;
+    assert(begin == end && "Impossible number of parameters!");
+
+    vector<unsigned int> init_ns;
+    smatch size;
+    auto sbeg = sizes.cbegin();
+    auto send = sizes.cend();
+    for ( ; regex_search(sbeg, send, size, sizes_regex_); sbeg = size.suffix().first)
     {
-        output << "(" << coord.x << "," << coord.y << ")";
-        ostringstream retstream;
-        retstream << "(" << coord.x << "," << coord.y << ")";
-        if (nl) { output << endl; }
-        return retstream.str();
+        init_ns.push_back(convert_string_to<unsigned int>(size[1]));
     }
-    else
+
+    output << "Time of adding n random affiliations and publications as one bulk" << endl;
+    output << "Bulks of at least " << ds_.ingest_min_items() << " items are staged, sorted and inserted in parallel"
+           << " (maps split into one shard per thread)" << endl;
+    output << "Hardware threads available: " << thread::hardware_concurrency() << endl << endl;
+    output << setw(9) << "n" << " , " << setw(7) << "threads" << " , " << setw(10) << "time (sec)" << " , " << setw(8) << "speedup" << endl;
+    flush_output(output);
+
+    auto old_ingest_threads = ds_.ingest_threads();
+    auto old_shard_count = ds_.shard_count();
+    for (unsigned int n : init_ns)
     {
-        output << "(--NO_COORD--)";
-        if (nl) { output << endl; }
-        return "";
+        double base = 0;
+        for (unsigned int threads : {1, 2, 4, 8, 16})
+        {
+            if (check_stop())
+            {
+                output << "Stopped!" << endl;
+                break;
+            }
+
+            ds_.clear_all();
+            init_primes();
+            ds_.set_ingest_threads(threads);
+            ds_.set_shard_count(threads);
+            auto start = Stopwatch::Clock::now();
+            add_random_affiliations_publications(n);
+            auto secs = std::chrono::duration<double>(Stopwatch::Clock::now() - start).count();
+            if (threads == 1) { base = secs; }
+
+            output << setw(9) << n << " , " << setw(7) << threads;
+            auto old_precision = output.precision(4);
+            auto old_flags = output.setf(std::ios::fixed, std::ios::floatfield);
+            output << " , " << setw(10) << secs << " , " << setw(8) << ((secs > 0) ? base / secs : 0) << endl;
+            output.precision(old_precision);
+            output.flags(old_flags);
+            flush_output(output);
+        }
     }
-}
 
-string const affiliationidx = "([a-zA-Z0-9-]+)";
-string const affiliationlistx = "(?:[a-zA-Z0-9-]+)";
-string const publicationidx = "([0-9]+)";
-string const namex = "([ a-zA-Z0-9-]+)";
-string const timex = "([0-9]+)";
-string const numx = "([0-9]+)";
-string const optcoordx = "\\([[:space:]]*[0-9]+[[:space:]]*,[[:space:]]*[0-9]+[[:space:]]*\\)";
-string const coordx = "\\([[:space:]]*([0-9]+)[[:space:]]*,[[:space:]]*([0-9]+)[[:space:]]*\\)";
-string const wsx = "[[:space:]]+";
+    ds_.clear_all();
+    ds_.set_shard_count(old_shard_count);
+    ds_.set_ingest_threads(old_ingest_threads);
+    init_primes();
+
+    return {};
+}
 
+MainProgram::CmdResult MainProgram::cmd_perftest_ingest(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string nstr = *begin++;
+    string threadstr = *begin++;
+    assert(begin == end && "Impossible number of parameters!");
 
-vector<MainProgram::CmdInfo> MainProgram::cmds_ =
+    unsigned int n = convert_string_to<unsigned int>(nstr);
+    unsigned int readers = convert_string_to<unsigned int>(threadstr);
+    if (readers == 0)
     {
-        {"get_affiliation_count", "", "", &MainProgram::cmd_get_affiliation_count, &MainProgram::test_get_affiliation_count },
-        {"clear_all", "", "", &MainProgram::cmd_clear_all, nullptr }, // clear all probably shouldn't be perftested since it will ... clear everything
-        {"get_all_affiliations", "", "", &MainProgram::cmd_get_all_affiliations, &MainProgram::NoParListTestCmd<&Datastructures::get_all_affiliations>},
-        {"add_affiliation", "AffiliationID \"Name\" (x,y)", affiliationidx+wsx+'"'+namex+'"'+wsx+coordx, &MainProgram::cmd_add_affiliation, nullptr }, // tested within each perftest, separate perftesting not necessary
-        {"affiliation_info", "AffiliationID", affiliationidx, &MainProgram::cmd_affiliation_info, &MainProgram::test_affiliation_info },
-        {"get_affiliations_alphabetically", "", "", &MainProgram::NoParListCmd<&Datastructures::get_affiliations_alphabetically>, &MainProgram::NoParListTestCmd<&Datastructures::get_affiliations_alphabetically> },
-        {"get_affiliations_distance_increasing", "", "", &MainProgram::NoParListCmd<&Datastructures::get_affiliations_distance_increasing>,
-         &MainProgram::NoParListTestCmd<&Datastructures::get_affiliations_distance_increasing> },
-        {"find_affiliation_with_coord", "(x,y)", coordx, &MainProgram::cmd_find_affiliation_with_coord, &MainProgram::test_find_affiliation_with_coord },
-        {"change_affiliation_coord", "AffiliationID (x,y)", affiliationidx+wsx+coordx, &MainProgram::cmd_change_affiliation_coord, &MainProgram::test_change_affiliation_coord },
-        {"get_publications_after", "AffiliationID Time", affiliationidx+wsx+timex, &MainProgram::cmd_get_publications_after, &MainProgram::test_get_publications_after },
-        {"add_publication", "PublicationID \"Name\" Year AffiliationID AffiliationID ...", publicationidx+wsx+'"'+namex+'"'+wsx+timex+"((?:"+wsx+affiliationlistx+")*)", &MainProgram::cmd_add_publication, nullptr }, // tested within each perftest, separate perftesting not necessary
-        {"get_all_publications", "", "", &MainProgram::cmd_get_all_publications, &MainProgram::test_get_all_publications},
-        {"publication_info", "PublicationID", publicationidx, &MainProgram::cmd_publication_info, &MainProgram::test_publication_info },
-        {"add_reference", "PublicationID parentPublicationID", publicationidx+wsx+publicationidx, &MainProgram::cmd_add_reference, nullptr },
-        {"add_affiliation_to_publication", "AffiliationID PublicationID", affiliationidx+wsx+publicationidx, &MainProgram::cmd_add_affiliation_to_publication, &MainProgram::test_add_affiliation_to_publication},
-        {"get_publications", "AffiliationID", affiliationidx, &MainProgram::cmd_get_publications, &MainProgram::test_get_publications },
-        {"get_all_references", "PublicationID", publicationidx, &MainProgram::cmd_get_all_references, &MainProgram::test_get_all_references },
-        {"get_affiliations_closest_to", "(x,y)", coordx, &MainProgram::cmd_get_affiliations_closest_to, &MainProgram::test_affiliations_closest_to },
-        {"remove_affiliation", "AffiliationID", affiliationidx, &MainProgram::cmd_remove_affiliation, &MainProgram::test_remove_affiliation },
-        {"get_closest_common_parent", "PublicationID1 PublicationID2", publicationidx+wsx+publicationidx, &MainProgram::cmd_get_closest_common_parent, &MainProgram::test_get_closest_common_parent },
-        {"quit", "", "", nullptr, nullptr },
-        {"help", "", "", &MainProgram::help_command, nullptr },
-        {"random_add", "number_of_affiliations_to_add  (minx,miny) (maxx,maxy) (coordinates optional)",
-         numx+"(?:"+wsx+coordx+wsx+coordx+")?", &MainProgram::cmd_random_affiliations, &MainProgram::test_random_affiliations },
-        {"read", "\"in-filename\" [silent]", "\"([-a-zA-Z0-9 ./:_]+)\"(?:"+wsx+"(silent))?", &MainProgram::cmd_read, nullptr },
-        {"testread", "\"in-filename\" \"out-filename\"", "\"([-a-zA-Z0-9 ./:_]+)\""+wsx+"\"([-a-zA-Z0-9 ./:_]+)\"", &MainProgram::cmd_testread, nullptr },
-        {"perftest", "cmd1[;cmd2...] timeout repeat_count n1[;n2...] (parts in [] are optional, alternatives separated by |)",
-         "([0-9a-zA-Z_]+(?:;[0-9a-zA-Z_]+)*)"+wsx+numx+wsx+numx+wsx+"([0-9]+(?:;[0-9]+)*)", &MainProgram::cmd_perftest, nullptr },
-        {"stopwatch", "on|off|next (alternatives separated by |)", "(?:(on)|(off)|(next))", &MainProgram::cmd_stopwatch, nullptr },
-        {"random_seed", "new-random-seed-integer", numx, &MainProgram::cmd_randseed, nullptr },
-        {"#", "comment text", ".*", &MainProgram::cmd_comment, nullptr },
-        {"remove_publication","PublicationID",publicationidx, &MainProgram::cmd_remove_publication, &MainProgram::test_remove_publication},
-        {"get_parent","PublicationID",publicationidx,&MainProgram::cmd_get_parent, &MainProgram::test_get_parent},
-        {"get_referenced_by_chain","PublicationID",publicationidx,&MainProgram::cmd_get_referenced_by_chain,&MainProgram::test_get_referenced_by_chain},
-        {"get_affiliations", "PublicationID", publicationidx, &MainProgram::cmd_get_affiliations, &MainProgram::test_get_affiliations},
-        {"get_direct_references", "PublicationID", publicationidx, &MainProgram::cmd_get_direct_references, &MainProgram::test_get_direct_references},
-        };
+        output << "At least one reader thread is needed!" << endl;
+        return {};
+    }
 
-MainProgram::CmdResult MainProgram::help_command(std::ostream& output, MatchIter /*begin*/, MatchIter /*end*/)
-{
-    output << "Commands:" << endl;
-    for (auto& i : cmds_)
+    output << readers << " thread(s) query " << n << " affiliations and publications while "
+           << n << " more are added in bulks of " << INGEST_BULK_SIZE << endl;
+    output << "Hardware threads available: " << thread::hardware_concurrency() << endl << endl;
+    output << setw(8) << "mode" << " , " << setw(12) << "add (sec)" << " , " << setw(12) << "queries";
+    output << " , " << setw(10) << "p50 (us)" << " , " << setw(10) << "p90 (us)" << " , " << setw(10) << "p99 (us)"
+           << " , " << setw(10) << "max (us)" << endl;
+    flush_output(output);
+
+    std::size_t sink = 0;
+    static pair<Datastructures::Concurrency, char const*> const modes[] = {
+        {Datastructures::Concurrency::EXCLUSIVE, "mutex"},
+        {Datastructures::Concurrency::SHARED, "shared"},
+        {Datastructures::Concurrency::SNAPSHOT, "snapshot"},
+        {Datastructures::Concurrency::STRIPED, "striped"}};
+    for (auto const& [concurrency, name] : modes)
     {
-        output << "  " << i.cmd << " " << i.info << endl;
+        if (check_stop())
+        {
+            output << "Stopped!" << endl;
+            break;
+        }
+
+        // Same amount of data before and during the ingest
+        ds_.set_concurrency(Datastructures::Concurrency::NONE);
+        ds_.clear_all();
+        init_primes();
+        std::unordered_set<Coord,CoordHash> exclude_list;
+        auto coords = get_unique_coords(2 * n, exclude_list, RANDOM_MIN_COORD, RANDOM_MAX_COORD);
+        add_random_affiliations_publications(n, RANDOM_MIN_COORD, RANDOM_MAX_COORD, vector<Coord>(coords.begin(), coords.begin() + n));
+        auto calls = generate_thread_calls(readers, MAX_THREAD_CALLS, 0);
+        ds_.set_shard_count((concurrency == Datastructures::Concurrency::STRIPED) ? STRIPED_SHARD_COUNT : 1);
+        ds_.set_concurrency(concurrency);
+
+        output << setw(8) << name << " , " << flush;
+
+        vector<LatencyHistogram> latencies(readers);
+        vector<std::size_t> sinks(readers, 0);
+        atomic<unsigned int> ready{0};
+        atomic<bool> done{false};
+        vector<thread> workers;
+        for (unsigned int t = 0; t < readers; ++t)
+        {
+            workers.emplace_back([this, t, &calls, &latencies, &sinks, &ready, &done]()
+            {
+                auto const& thread_calls = calls[t];
+                std::size_t pos = 0;
+                std::size_t thread_sink = 0;
+                ready.fetch_add(1);
+                while (!done.load(std::memory_order_relaxed))
+                {
+                    auto callstart = Stopwatch::Clock::now();
+                    thread_sink += run_thread_call(ds_, thread_calls[pos]);
+                    auto callend = Stopwatch::Clock::now();
+                    latencies[t].record(std::chrono::duration_cast<std::chrono::nanoseconds>(callend - callstart).count());
+                    pos = (pos + 1 == thread_calls.size()) ? 0 : pos + 1;
+                }
+                sinks[t] = thread_sink;
+            });
+        }
+        while (ready.load() != readers) { std::this_thread::yield(); }
+
+        Stopwatch stopwatch;
+        stopwatch.start();
+        for (unsigned int added = 0; added < n; added += INGEST_BULK_SIZE)
+        {
+            auto size = std::min(INGEST_BULK_SIZE, n - added);
+            add_random_affiliations_publications(size, RANDOM_MIN_COORD, RANDOM_MAX_COORD,
+                                                 vector<Coord>(coords.begin() + n + added, coords.begin() + n + added + size));
+        }
+        stopwatch.stop();
+        done.store(true);
+        for (auto& worker : workers) { worker.join(); }
+
+        LatencyHistogram all_latencies;
+        for (auto const& latency : latencies) { all_latencies.merge(latency); }
+        for (auto value : sinks) { sink += value; }
+        output << setw(12) << stopwatch.elapsed() << " , " << setw(12) << all_latencies.count();
+        print_latencies(all_latencies, output);
+        output << endl;
+        flush_output(output);
     }
 
+    ds_.set_concurrency(Datastructures::Concurrency::NONE);
+    ds_.set_shard_count(1);
+    ds_.clear_all();
+    init_primes();
+    if (sink == 0) { output << endl; } // Keeps the results used
+
     return {};
 }
 
-MainProgram::CmdResult MainProgram::cmd_perftest(std::ostream& output, MatchIter begin, MatchIter end)
+void MainProgram::print_latencies(LatencyHistogram const& latencies, std::ostream& output)
 {
-#ifdef _GLIBCXX_DEBUG
-    output << "WARNING: Debug STL enabled, performance will be worse than expected (maybe also asymptotically)!" << endl;
-#endif // _GLIBCXX_DEBUG
+    auto old_precision = output.precision(3);
+    auto old_flags = output.setf(std::ios::fixed, std::ios::floatfield);
+    for (double percent : {50.0, 90.0, 99.0})
+    {
+        output << " , " << setw(10) << latencies.percentile(percent) / 1000.0;
+    }
+    output << " , " << setw(10) << latencies.max() / 1000.0;
+    output.precision(old_precision);
+    output.flags(old_flags);
+}
 
-    try {
-        // Note: everything below is indented too little by one indentation level! (because of try block above)
+void MainProgram::print_allocations(MemoryStats::Allocations const& allocations, std::ostream& output)
+{
+    output << setw(12) << allocations.count << " , " << setw(12) << allocations.bytes / (1024.0*1024.0) << " , ";
+}
 
-        string commandstr = *begin++;
-        unsigned int timeout = convert_string_to<unsigned int>(*begin++);
-        unsigned int repeat_count = convert_string_to<unsigned int>(*begin++);
-        string sizes = *begin++;
-        assert(begin == end && "Invalid number of parameters");
+void MainProgram::print_complexity_fits(ComplexityFit const& addfit, std::vector<ComplexityFit> const& cmdfits,
+                                        std::vector<std::string> const& names, std::ostream& output)
+{
+    double exponent = 0;
+    if (!addfit.exponent(exponent)) { return; } // Needs at least two N
 
-        vector<string> testcmds;
-        smatch scmd;
-        auto cbeg = commandstr.cbegin();
-        auto cend = commandstr.cend();
-        for ( ; regex_search(cbeg, cend, scmd, commands_regex_); cbeg = scmd.suffix().first)
-        {
-            testcmds.push_back(scmd[1]);
-        }
+    auto old_precision = output.precision(2);
+    auto old_flags = output.setf(std::ios::fixed, std::ios::floatfield);
 
+    output << endl << "Complexity (log-log fit of time per operation over N):" << endl;
+    output << setw(40) << "add (per element)" << " : exponent " << setw(5) << exponent
+           << ", best match " << ComplexityFit::class_name(addfit.best_class()) << endl;
 
-        vector<unsigned int> init_ns;
-        smatch size;
-        auto sbeg = sizes.cbegin();
-        auto send = sizes.cend();
-        for ( ; regex_search(sbeg, send, size, sizes_regex_); sbeg = size.suffix().first)
+    vector<string> warnings;
+    for (unsigned int i = 0; i < cmdfits.size(); ++i)
+    {
+        output << setw(40) << names[i] << " : ";
+        if (!cmdfits[i].exponent(exponent))
         {
-            init_ns.push_back(convert_string_to<unsigned int>(size[1]));
+            output << "not enough measurements" << endl;
+            continue;
         }
+        auto best = cmdfits[i].best_class();
+        output << "exponent " << setw(5) << exponent << ", best match " << ComplexityFit::class_name(best);
 
-        output << "Timeout for each N is " << timeout << " sec. " << endl;
-        output << "For each N perform " << repeat_count << " random command(s) from:" << endl;
-
-        // Initialize test functions
-        vector<void(MainProgram::*)()> testfuncs;
-
-        for (auto& i : testcmds)
+        auto estimate = find_if(Datastructures::PERFORMANCE_ESTIMATES.begin(), Datastructures::PERFORMANCE_ESTIMATES.end(),
+                                [&](auto const& e){ return e.first == names[i]; });
+        if (estimate != Datastructures::PERFORMANCE_ESTIMATES.end())
         {
-            auto pos = find_if(cmds_.begin(), cmds_.end(), [&i](auto const& cmd){ return cmd.cmd == i; });
-            if (pos != cmds_.end() && pos->testfunc)
-            {
-                output << i << " ";
-                testfuncs.push_back(pos->testfunc);
-            }
-            else
+            auto expected = ComplexityFit::class_from_name(estimate->second);
+            output << ", expected " << estimate->second;
+            if (cmdfits[i].disagrees(expected))
             {
-                output << "(cannot test " << i << ") ";
+                std::ostringstream warning;
+                warning.precision(2);
+                warning.setf(std::ios::fixed, std::ios::floatfield);
+                warning << "WARNING: " << names[i] << " has exponent " << exponent << " (best match "
+                        << ComplexityFit::class_name(best) << "), but estimate " << estimate->second
+                        << " would give about " << cmdfits[i].class_slope(expected);
+                warnings.push_back(warning.str());
             }
         }
+        output << endl;
+    }
+    for (auto const& warning : warnings) { output << warning << endl; }
 
-        output << endl << endl;
+    output.precision(old_precision);
+    output.flags(old_flags);
+}
 
-        if (testfuncs.empty())
-        {
-            output << "No commands to test!" << endl;
-            return {};
-        }
+MainProgram::CmdResult MainProgram::cmd_perf_events(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string eventsstr = *begin++;
+    assert(begin == end && "Invalid number of parameters");
 
 #ifdef USE_PERF_EVENT
-        output << setw(7) << "N" << " , " << setw(12) << "add (sec)" << " , " << setw(12) << "add (count)" << " , " << setw(12) << "cmds (sec)" << " , "
-               << setw(12) << "cmds (count)"  << " , " << setw(12) << "total (sec)" << " , " << setw(12) << "total (count)" << endl;
-#else
-        output << setw(7) << "N" << " , " << setw(12) << "add (sec)" << " , " << setw(12) << "cmds (sec)" << " , "
-               << setw(12) << "total (sec)" << endl;
-#endif
-        flush_output(output);
-
-        auto stop = false;
-        for (unsigned int n : init_ns)
+    Stopwatch::Events events;
+    if (eventsstr == "all") { events.set(); }
+    else
+    {
+        std::istringstream eventstream(eventsstr);
+        string name;
+        while (std::getline(eventstream, name, ','))
         {
-            if (stop) { break; }
-
-            output << setw(7) << n << " , " << flush;
-
-            ds_.clear_all();
-            init_primes();
-
-            Stopwatch stopwatch(true); // Use also instruction counting, if enabled
-            std::unordered_set<Coord,CoordHash> exclude_list;
-            std::vector<Coord> unique_coords = get_unique_coords(n,exclude_list,RANDOM_MIN_COORD,RANDOM_MAX_COORD);
-            // Add random affiliations
-            std::vector<Coord>::iterator start_of_range=unique_coords.begin();
-            for (unsigned int i = 0; i < n / 1000; ++i,std::advance(start_of_range,1000))
-            {
-                std::vector<Coord> vector_slice(start_of_range,std::next(start_of_range,1000));
-                stopwatch.start();
-                add_random_affiliations_publications(1000,RANDOM_MIN_COORD,RANDOM_MAX_COORD,vector_slice);
-                stopwatch.stop();
-
-                if (stopwatch.elapsed() >= timeout)
-                {
-                    output << "ADD Timeout!" << endl;
-                    stop = true;
-                    break;
-                }
-                if (check_stop())
-                {
-                    output << "Stopped!" << endl;
-                    stop = true;
-                    break;
-                }
-            }
-            if (stop) { break; }
-
-            if (n % 1000 != 0)
+            unsigned int i = 0;
+            while (i < Stopwatch::EVENT_COUNT && name != Stopwatch::event_name(static_cast<Stopwatch::Event>(i))) { ++i; }
+            if (i == Stopwatch::EVENT_COUNT)
             {
-                std::vector<Coord> vector_slice(start_of_range,unique_coords.end());
-                stopwatch.start();
-                add_random_affiliations_publications(n % 1000,RANDOM_MIN_COORD,RANDOM_MAX_COORD,vector_slice);
-                stopwatch.stop();
+                output << "Unknown perf event '" << name << "'" << endl;
+                return {};
             }
+            events.set(i);
+        }
+    }
+    Stopwatch::set_events(events);
 
-#ifdef USE_PERF_EVENT
-            auto addcount = stopwatch.count();
-#endif
-            auto addsec = stopwatch.elapsed();
-
-#ifdef USE_PERF_EVENT
-            output << setw(12) << addsec << " , " << setw(12) << addcount << " , " << flush;
+    // Report which of the requested events can actually be counted here
+    Stopwatch probe(true);
+    output << "Perf events:";
+    for (unsigned int i = 0; i < Stopwatch::EVENT_COUNT; ++i)
+    {
+        auto event = static_cast<Stopwatch::Event>(i);
+        if (events[i]) { output << " " << Stopwatch::event_name(event) << (probe.event_available(event) ? "" : " (not available)"); }
+    }
+    output << endl;
 #else
-            output << setw(12) << addsec << " , " << flush;
+    (void)eventsstr;
+    output << "Perf events are not compiled in (compile with -DUSE_PERF_EVENT)" << endl;
 #endif
 
-            if (addsec >= timeout)
-            {
-                output << "ADD Timeout!" << endl;
-                stop = true;
-                break;
-            }
-
-            stopwatch.start();
-            for (unsigned int repeat = 0; repeat < repeat_count; ++repeat)
-            {
-                auto cmdpos = random(testfuncs.begin(), testfuncs.end());
-
-                (this->**cmdpos)();
+    return {};
+}
 
-                if (repeat % 10 == 0)
-                {
-                    stopwatch.stop();
-                    if (stopwatch.elapsed() >= timeout)
-                    {
-                        output << "Timeout!" << endl;
-                        stop = true;
-                        break;
-                    }
-                    if (check_stop())
-                    {
-                        output << "Stopped!" << endl;
-                        stop = true;
-                        break;
-                    }
-                    stopwatch.start();
-                }
-            }
-            stopwatch.stop();
-            if (stop) { break; }
+MainProgram::CmdResult MainProgram::cmd_memstats(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string on = *begin++;
+    string off = *begin++;
+    assert(begin == end && "Invalid number of parameters");
 
-#ifdef USE_PERF_EVENT
-            auto totalcount = stopwatch.count();
-#endif
-            auto totalsec = stopwatch.elapsed();
+    memory_stats_ = !on.empty();
+    assert((memory_stats_ || !off.empty()) && "Impossible memstats mode!");
+    MemoryStats::set_counting(memory_stats_);
+    output << "Memory statistics: " << (memory_stats_ ? "on" : "off") << endl;
 
-#ifdef USE_PERF_EVENT
-            output << setw(12) << totalsec-addsec << " , " << setw(12) << totalcount-addcount << " , " << setw(12) << totalsec << " , " << setw(12) << totalcount;
-#else
-            output << setw(12) << totalsec-addsec << " , " << setw(12) << totalsec;
-#endif
+    return {};
+}
 
-            output << endl;
-            flush_output(output);
-        }
+MainProgram::CmdResult MainProgram::cmd_perfcompare(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string filename = *begin++;
+    string runsstr = *begin++;
+    assert(begin == end && "Invalid number of parameters");
 
-        ds_.clear_all();
-        init_primes();
+    unsigned int runs = runsstr.empty() ? 3 : std::max(convert_string_to<unsigned int>(runsstr), 1u);
 
+    ifstream file(filename);
+    if (!file)
+    {
+        output << "Cannot open file '" << filename << "'!" << endl;
+        return {};
     }
-    catch (NotImplemented const&)
+    string data{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+    PerfReport baseline;
+    string error;
+    if (!PerfReport::read_json(data, baseline, error))
     {
-        // Clean up after NotImplemented
-        ds_.clear_all();
-        init_primes();
-        throw;
+        output << "Cannot read baseline '" << filename << "': " << error << endl;
+        return {};
     }
 
-#ifdef _GLIBCXX_DEBUG
-    output << "WARNING: Debug STL enabled, performance will be worse than expected (maybe also asymptotically)!" << endl;
-#endif // _GLIBCXX_DEBUG
+    output << "Comparing to baseline '" << filename << "' with " << runs << " run(s) of perftest ";
+    for (unsigned int i = 0; i < baseline.commands.size(); ++i)
+    {
+        output << (i > 0 ? ";" : "") << baseline.commands[i];
+        if (i < baseline.weights.size()) { output << ":" << baseline.weights[i]; }
+    }
+    output << " " << baseline.timeout << " " << baseline.repeat_count << " ";
+    for (unsigned int i = 0; i < baseline.sizes.size(); ++i) { output << (i > 0 ? ";" : "") << baseline.sizes[i]; }
+    if (baseline.zipf > 0) { output << " --zipf " << baseline.zipf; }
+    output << endl << endl;
+    flush_output(output);
+
+    // Data is generated with the baseline's topology (older baselines have none: binary tree)
+    auto old_topology = topology_;
+    auto old_roots = forest_roots_;
+    if (!topology_from_name(baseline.topology, topology_)) { topology_ = Topology::BINARY_TREE; }
+    if (baseline.forest_roots > 0) { forest_roots_ = baseline.forest_roots; }
+
+    // Each run is one sample, so the confidence intervals get narrower with more runs
+    PerfReport current;
+    for (unsigned int run = 0; run < runs && !check_stop(); ++run)
+    {
+        PerfReport runreport;
+        std::ostream ignored(nullptr); // Discards the tables (and isn't flushed to the GUI)
+        run_perftest(ignored, baseline.commands, baseline.weights, baseline.zipf, baseline.timeout, baseline.repeat_count,
+                     baseline.sizes, runreport);
+        current.merge_run(runreport);
+    }
+    topology_ = old_topology;
+    forest_roots_ = old_roots;
+    if (!current.stopped.empty()) { output << "Note: perftest was stopped early (" << current.stopped << ")" << endl; }
+
+    auto comparisons = PerfReport::compare(baseline, current);
+
+    auto old_precision = output.precision(3);
+    auto old_flags = output.setf(std::ios::fixed, std::ios::floatfield);
+    output << setw(40) << "command" << " , " << setw(7) << "N" << " , " << setw(13) << "baseline (us)" << " , "
+           << setw(12) << "current (us)" << " , " << setw(10) << "change (%)" << " , " << setw(28) << "95% CI of change (us)"
+           << " , " << "result" << endl;
+    unsigned int slower = 0;
+    for (auto const& c : comparisons)
+    {
+        std::ostringstream interval;
+        interval.precision(3);
+        interval.setf(std::ios::fixed, std::ios::floatfield);
+        if (c.has_interval) { interval << "[" << c.ci_low_us << ", " << c.ci_high_us << "]"; }
+        else { interval << "- (too few runs)"; }
+        output << setw(40) << c.command << " , " << setw(7) << c.n << " , " << setw(13) << c.baseline_us << " , "
+               << setw(12) << c.current_us << " , " << setw(10) << c.change_percent << " , " << setw(28) << interval.str()
+               << " , " << (c.slower ? "SLOWER" : (c.faster ? "faster" : "same")) << endl;
+        if (c.slower) { ++slower; }
+    }
+    output.precision(old_precision);
+    output.flags(old_flags);
+
+    if (slower > 0)
+    {
+        output << slower << " significant slowdown(s) found!" << endl;
+        perf_regression_found_ = true;
+    }
+    else
+    {
+        output << "No significant slowdowns." << endl;
+    }
 
     return {};
 }
@@ -1478,6 +3546,78 @@ MainProgram::CmdResult MainProgram::cmd_comment(std::ostream& /*output*/, MatchI
 }
 
 
+void MainProgram::print_result(CmdResult const& result, std::ostream& output)
+{
+    switch (result.first)
+    {
+    case ResultType::NOTHING:
+    {
+        break;
+    }
+    case ResultType::IDLIST:
+    {
+        auto const& [publications, affiliations] = std::get<CmdResultIDs>(result.second);
+        if (affiliations.size() == 1 && affiliations.front() == NO_AFFILIATION)
+        {
+            output << "Failed (NO_AFFILIATION returned)!" << std::endl;
+        }
+        else
+        {
+            if (!affiliations.empty())
+            {
+                if (affiliations.size() == 1) { output << "Affiliation:" << std::endl; }
+                else { output << "Affiliations:" << std::endl; }
+
+                // Formatted into one buffer which is written in large pieces
+                string& buf = result_buffer_;
+                unsigned int num = 0;
+                for (AffiliationID const& id : affiliations)
+                {
+                    ++num;
+                    if (affiliations.size() > 1) { append_number(buf, num); buf += ". "; }
+                    else { buf += "   "; }
+                    format_affiliation(id, buf);
+                    buf += '\n';
+                    if (buf.size() >= RESULT_BUFFER_FLUSH_SIZE) { write_buffer(buf, output); }
+                }
+                write_buffer(buf, output);
+            }
+        }
+
+        if (publications.size() == 1 && publications.front() == NO_PUBLICATION)
+        {
+            output << "Failed (NO_PUBLICATION returned)!" << std::endl;
+        }
+        else
+        {
+            if (!publications.empty())
+            {
+                if (publications.size() == 1) { output << "Publication:" << std::endl; }
+                else { output << "Publications:" << std::endl; }
+
+                string& buf = result_buffer_;
+                unsigned int num = 0;
+                for (PublicationID id : publications)
+                {
+                    ++num;
+                    if (publications.size() > 1) { append_number(buf, num); buf += ". "; }
+                    else { buf += "   "; }
+                    format_publication(id, buf);
+                    buf += '\n';
+                    if (buf.size() >= RESULT_BUFFER_FLUSH_SIZE) { write_buffer(buf, output); }
+                }
+                write_buffer(buf, output);
+            }
+        }
+        break;
+    }
+    default:
+    {
+        assert(false && "Unsupported result type!");
+    }
+    }
+}
+
 bool MainProgram::command_parse_line(string inputline, ostream& output)
 {
 
@@ -1496,6 +3636,14 @@ bool MainProgram::command_parse_line(string inputline, ostream& output)
 
         smatch match2;
         bool matched2 = regex_match(params, match2, pos->param_regex);
+        if (matched2 && pos->async && query_executor_ && script_depth_ > 0 && stopwatch_mode == StopwatchMode::OFF)
+        {
+            submit_async_query(*pos, move(params), output);
+            return true;
+        }
+        // Other commands run after the pending queries, and print after their output
+        drain_async_queries(output, true);
+
         if (matched2)
         {
             if (pos->func)
@@ -1510,8 +3658,14 @@ bool MainProgram::command_parse_line(string inputline, ostream& output)
                 TestStatus initial_status = test_status_;
                 test_status_ = TestStatus::NOT_RUN;
 
+                MemoryStats::Allocations allocs_before;
                 if (use_stopwatch)
                 {
+                    if (memory_stats_)
+                    {
+                        MemoryStats::reset_peak_resident_set();
+                        allocs_before = MemoryStats::allocations();
+                    }
                     stopwatch.start();
                 }
 
@@ -1531,65 +3685,7 @@ bool MainProgram::command_parse_line(string inputline, ostream& output)
                     stopwatch.stop();
                 }
 
-                switch (result.first)
-                {
-                case ResultType::NOTHING:
-                {
-                    break;
-                }
-                case ResultType::IDLIST:
-                {
-                    auto& [publications, affiliations] = std::get<CmdResultIDs>(result.second);
-                    if (affiliations.size() == 1 && affiliations.front() == NO_AFFILIATION)
-                    {
-                        output << "Failed (NO_AFFILIATION returned)!" << std::endl;
-                    }
-                    else
-                    {
-                        if (!affiliations.empty())
-                        {
-                            if (affiliations.size() == 1) { output << "Affiliation:" << std::endl; }
-                            else { output << "Affiliations:" << std::endl; }
-
-                            unsigned int num = 0;
-                            for (AffiliationID& id : affiliations)
-                            {
-                                ++num;
-                                if (affiliations.size() > 1) { output << num << ". "; }
-                                else { output << "   "; }
-                                print_affiliation(id, output);
-                            }
-                        }
-                    }
-
-                    if (publications.size() == 1 && publications.front() == NO_PUBLICATION)
-                    {
-                        output << "Failed (NO_PUBLICATION returned)!" << std::endl;
-                    }
-                    else
-                    {
-                        if (!publications.empty())
-                        {
-                            if (publications.size() == 1) { output << "Publication:" << std::endl; }
-                            else { output << "Publications:" << std::endl; }
-
-                            unsigned int num = 0;
-                            for (PublicationID id : publications)
-                            {
-                                ++num;
-                                if (publications.size() > 1) { output << num << ". "; }
-                                else { output << "   "; }
-                                print_publication(id, output);
-                            }
-                        }
-                    }
-                    break;
-                }
-                default:
-                {
-                    assert(false && "Unsupported result type!");
-                }
-                }
+                print_result(result, output);
 
                 if (result != prev_result)
                 {
@@ -1601,9 +3697,28 @@ bool MainProgram::command_parse_line(string inputline, ostream& output)
                 {
                     output << "Command '" << cmd << "': " << stopwatch.elapsed() << " sec";
 #ifdef USE_PERF_EVENT
-                    auto totalcount = stopwatch.count();
-                    output << ", cmds (count): " << totalcount;
+                    if (stopwatch.counters_available())
+                    {
+                        auto counts = stopwatch.counts();
+                        output << ", cmds (count): " << counts[Stopwatch::INSTRUCTIONS];
+                        if (counts[Stopwatch::CYCLES] > 0 && counts[Stopwatch::INSTRUCTIONS] >= 0)
+                        {
+                            output << ", IPC: " << static_cast<double>(counts[Stopwatch::INSTRUCTIONS]) / counts[Stopwatch::CYCLES];
+                        }
+                        for (auto event : {Stopwatch::L1D_MISSES, Stopwatch::LLC_MISSES, Stopwatch::BRANCH_MISSES, Stopwatch::DTLB_MISSES})
+                        {
+                            if (counts[event] >= 0) { output << ", " << Stopwatch::event_name(event) << " misses: " << counts[event]; }
+                        }
+                    }
 #endif
+                    if (memory_stats_)
+                    {
+                        auto allocs = MemoryStats::allocations() - allocs_before;
+                        output << ", allocs: " << allocs.count << ", allocated: " << allocs.bytes << " bytes";
+                        std::uint64_t rss = 0;
+                        std::uint64_t peak_rss = 0;
+                        if (MemoryStats::resident_set(rss, peak_rss)) { output << ", peak RSS: " << peak_rss << " bytes"; }
+                    }
                     output << endl;
                 }
 
@@ -1628,6 +3743,7 @@ bool MainProgram::command_parse_line(string inputline, ostream& output)
     }
     else
     {
+        drain_async_queries(output, true);
         output << "Unknown command!" << endl;
     }
 
@@ -1639,12 +3755,12 @@ void MainProgram::command_parser(istream& input, ostream& output, PromptStyle pr
     string line;
     do
     {
-        output << PROMPT;
+        write_ordered(PROMPT, output);
         getline(input, line, '\n');
 
         if (promptstyle != PromptStyle::NO_ECHO)
         {
-            output << line << endl;
+            write_ordered(line + '\n', output);
         }
 
         if (!input) { break; }
@@ -1655,6 +3771,7 @@ void MainProgram::command_parser(istream& input, ostream& output, PromptStyle pr
     }
     while (input);
 
+    drain_async_queries(output, true);
     view_dirty = true; // To be safe, assume that results have been changed
 }
 
@@ -1670,7 +3787,7 @@ void MainProgram::flush_output(std::ostream& output)
     {
         if (auto soutput = dynamic_cast<ostringstream*>(&output))
         {
-            ui_->output_text(*soutput);
+            ui_->queue_output(*soutput);
         }
     }
 }
@@ -1682,13 +3799,17 @@ void MainProgram::flush_output(std::ostream& /*output*/)
 
 bool MainProgram::check_stop() const
 {
-#ifdef GRAPHICAL_GUI
-    if (ui_)
-    {
-        return ui_->check_stop_pressed();
-    }
-#endif
-    return false;
+    return stop_requested_.load(std::memory_order_relaxed);
+}
+
+void MainProgram::request_stop()
+{
+    stop_requested_.store(true, std::memory_order_relaxed);
+}
+
+void MainProgram::clear_stop()
+{
+    stop_requested_.store(false, std::memory_order_relaxed);
 }
 
 std::array<unsigned long int, 20> const MainProgram::primes1{4943,   4951,   4957,   4967,   4969,   4973,   4987,   4993,   4999,   5003,
@@ -1714,6 +3835,9 @@ int MainProgram::mainprogram(int argc, char* argv[])
         return EXIT_FAILURE;
     }
 
+    // Only C++ streams are used, so they don't need to be synchronized with C stdio
+    std::ios::sync_with_stdio(false);
+
     MainProgram mainprg;
 
     if (args.size() == 2 && args[1] != "--console")
@@ -1735,7 +3859,7 @@ int MainProgram::mainprogram(int argc, char* argv[])
     }
 
     cerr << "Program ended normally." << endl;
-    if (mainprg.test_status_ == TestStatus::DIFFS_FOUND)
+    if (mainprg.test_status_ == TestStatus::DIFFS_FOUND || mainprg.perf_regression_found_)
     {
         return EXIT_FAILURE;
     }
@@ -1752,6 +3876,7 @@ void MainProgram::init_primes()
     prime2_ = primes2[random<int>(0, primes2.size())];
     random_affiliations_added_ = 0;
     random_publications_added_ = 0;
+    random_parents_.clear();
 }
 
 Name MainProgram::n_to_name(unsigned long n)
@@ -1771,9 +3896,8 @@ Name MainProgram::n_to_name(unsigned long n)
 
 AffiliationID MainProgram::n_to_affiliationid(unsigned long n)
 {
-    std::ostringstream ostr;
-    ostr << "A" << n;
-    return ostr.str();
+    // Same as "A" << n through a stream, without the stream (called for every generated item)
+    return "A" + std::to_string(n);
 }
 
 PublicationID MainProgram::n_to_publicationid(unsigned long n)
@@ -1806,6 +3930,6 @@ void MainProgram::init_regexs()
     coords_regex_ = regex(coordx+"[[:space:]]?", std::regex_constants::ECMAScript | std::regex_constants::optimize);
     affil_regex_ = regex(affiliationidx+"[[:space:]]?", std::regex_constants::ECMAScript | std::regex_constants::optimize); // TODO test this one more intensively
     times_regex_ = regex(wsx+"([0-9][0-9]):([0-9][0-9]):([0-9][0-9])", std::regex_constants::ECMAScript | std::regex_constants::optimize);
-    commands_regex_ = regex("([0-9a-zA-Z_]+);?", std::regex_constants::ECMAScript | std::regex_constants::optimize);
+    commands_regex_ = regex("([0-9a-zA-Z_]+)(?::([0-9]+))?;?", std::regex_constants::ECMAScript | std::regex_constants::optimize);
     sizes_regex_ = regex(numx+";?", std::regex_constants::ECMAScript | std::regex_constants::optimize);
 }
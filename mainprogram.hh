@@ -32,8 +32,19 @@
 #include <cassert>
 #include <cstring>
 #include <unordered_set>
+#include <charconv>
+#include <deque>
+#include <future>
+#include <memory>
+#include <atomic>
 
 #include "datastructures.hh"
+#include "mutationlog.hh"
+#include "perfstats.hh"
+#include "perfreport.hh"
+#include "workloadtrace.hh"
+#include "queryexecutor.hh"
+#include "changefeed.hh"
 
 // default max and min values for perftesting and random add, may be subject to change
 
@@ -65,12 +76,24 @@ public:
 
     void flush_output(std::ostream& output);
     bool check_stop() const;
+    // Asks a running command (on another thread) to stop at its next check_stop().
+    void request_stop();
+    void clear_stop();
 
     static int mainprogram(int argc, char* argv[]);
 
 private:
     Datastructures ds_;
     MainWindow* ui_ = nullptr;
+    std::atomic<bool> stop_requested_{false}; // Set from the GUI thread, checked on every perftest repeat
+
+    MutationLog mutation_log_;
+    std::string snapshot_filename_; // Snapshot belonging to the open mutation log
+
+    WorkloadTrace workload_trace_;
+
+    std::unique_ptr<ChangeFeed> change_feed_; // nullptr when the feed is off
+    std::unique_ptr<ChangeFeed::Subscription> feed_subscription_; // Read by change_feed_poll
 
     static std::string const PROMPT;
 
@@ -109,6 +132,7 @@ private:
         std::string param_regex_str;
         CmdResult(MainProgram::*func)(std::ostream& output, MatchIter begin, MatchIter end);
         void(MainProgram::*testfunc)();
+        bool async = false; // Read-only query which can run on the query pool (see async_queries)
         std::regex param_regex = {};
     };
     static std::vector<CmdInfo> cmds_;
@@ -133,6 +157,9 @@ private:
     CmdResult cmd_add_publication(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_get_all_publications(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_publication_info(std::ostream& output, MatchIter begin, MatchIter end);
+    // Batch queries of a list of ids
+    CmdResult cmd_publications_info(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_affiliation_coords(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_add_reference(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_add_affiliation_to_publication(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_get_publications(std::ostream& output, MatchIter begin, MatchIter end);
@@ -152,17 +179,154 @@ private:
     CmdResult cmd_testread(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_stopwatch(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_perftest(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_perfcompare(std::ostream& output, MatchIter begin, MatchIter end);
+    // Throughput of queries from several threads, with Datastructures locked as a whole, with
+    // reader-writer locking and with snapshots
+    CmdResult cmd_perftest_threads(std::ostream& output, MatchIter begin, MatchIter end);
+    // Latency of queries from reader threads while the main thread adds data, in each
+    // concurrency mode
+    CmdResult cmd_perftest_ingest(std::ostream& output, MatchIter begin, MatchIter end);
+    // Time of sorting the large listings with different numbers of sort threads
+    CmdResult cmd_perftest_sort(std::ostream& output, MatchIter begin, MatchIter end);
+    // Time of get_all_references() from the root of the generated data with different numbers
+    // of traversal threads
+    CmdResult cmd_perftest_references(std::ostream& output, MatchIter begin, MatchIter end);
+    // Time of adding random data as one bulk with different numbers of ingest threads
+    CmdResult cmd_perftest_bulk(std::ostream& output, MatchIter begin, MatchIter end);
+    // One Datastructures call of the multi-threaded tests, with arguments generated beforehand
+    struct ThreadCall;
+    // Calls for each thread (generated here, because random generation isn't thread safe).
+    // Threads go through their list cyclically.
+    std::vector<std::vector<ThreadCall>> generate_thread_calls(unsigned int threads, unsigned int count,
+                                                               unsigned int write_percent);
+    static constexpr unsigned int MAX_THREAD_CALLS = 1 << 14;
+    static constexpr unsigned int INGEST_BULK_SIZE = 1000;
+    static constexpr unsigned int STRIPED_SHARD_COUNT = 16; // Shards used when testing Concurrency::STRIPED
+    // Makes the call and returns something depending on the result, so it can't be optimized away
+    static std::size_t run_thread_call(Datastructures& ds, ThreadCall const& call);
+    // Runs the perftest suite, printing the table to output and filling report
+    // (weights are relative frequencies of testcmds, empty for uniform choice, and zipf the
+    // skew of the IDs given to the commands, 0 for uniform)
+    void run_perftest(std::ostream& output, std::vector<std::string> const& testcmds,
+                      std::vector<unsigned int> const& weights, double zipf, unsigned int timeout,
+                      unsigned int repeat_count, std::vector<unsigned int> const& init_ns, PerfReport& report);
+    bool perf_regression_found_ = false; // perfcompare found slowdowns, program exits with failure
     CmdResult cmd_comment(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_get_affiliations(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_log_open(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_log_close(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_log_checkpoint(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_log_recover(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_import(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_page_size(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_sort_threads(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_traversal_threads(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_ingest_threads(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_topology(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_trace_start(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_trace_stop(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_replay(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_concurrency(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_shards(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_async_queries(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_change_feed(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_change_feed_poll(std::ostream& output, MatchIter begin, MatchIter end);
+
+    // Asynchronous queries: in read and testread scripts, commands marked async are run on
+    // a pool of threads while the script goes on. Their output (and the prompts and lines
+    // echoed after them) is written in submission order when they are done. Any other
+    // command first waits for all pending queries, so queries never run at the same time
+    // as changes, and the output is the same as without the pool.
+    struct AsyncOutput
+    {
+        std::string text;
+        CmdResult result;
+    };
+    struct AsyncQuery
+    {
+        std::future<AsyncOutput> output;
+        std::string text_after; // Output of the script after the query, until the next query
+    };
+    std::atomic<std::size_t> async_buffered_bytes_{0}; // Output of finished queries not written yet
+    std::deque<AsyncQuery> async_queries_; // Pending, in submission order
+    std::size_t async_max_in_flight_ = 0;
+    std::unique_ptr<QueryExecutor> query_executor_; // nullptr when async queries are off (destroyed first)
+    bool async_set_concurrency_ = false; // SHARED was set for async queries, not with the concurrency command
+    static constexpr std::size_t ASYNC_MAX_BUFFERED_BYTES = 16 << 20;
+    static constexpr unsigned int ASYNC_QUERIES_PER_THREAD = 4; // Default limit of pending queries
+    unsigned int script_depth_ = 0; // Nesting of read and testread, queries are async only in scripts
+    // Runs the command on the pool. Waits for the oldest pending queries first while the limit
+    // of pending queries or buffered output is reached.
+    void submit_async_query(CmdInfo const& cmdinfo, std::string params, std::ostream& output);
+    // Waits for the oldest pending query and writes its output
+    void collect_async_query(std::ostream& output);
+    // Writes the output of pending queries which are done (all of them if wait is true)
+    void drain_async_queries(std::ostream& output, bool wait);
+    // Writes text to output after the output of pending queries
+    void write_ordered(std::string const& text, std::ostream& output);
+    void stop_async_queries();
+
+    // Prints p50, p90, p99 and max of call latencies (in microseconds) as perftest columns
+    void print_latencies(LatencyHistogram const& latencies, std::ostream& output);
+    // Prints allocation count and megabytes allocated as perftest columns
+    void print_allocations(MemoryStats::Allocations const& allocations, std::ostream& output);
+    CmdResult cmd_memstats(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_perf_events(std::ostream& output, MatchIter begin, MatchIter end);
+    // Prints measured exponents and warns about commands not matching their estimate
+    void print_complexity_fits(ComplexityFit const& addfit, std::vector<ComplexityFit> const& cmdfits,
+                               std::vector<std::string> const& names, std::ostream& output);
+    bool memory_stats_ = false;
 
     // random ids for perftest
     AffiliationID random_affiliation();
     PublicationID random_publication();
+    // Zipf distributed index in [0, count) when perftest is given a skew
+    unsigned long int skewed_key(unsigned long int count);
+    ZipfDistribution key_distribution_;
+    static unsigned long long const HOT_KEY_STRIDE = 2654435761ull;
 
     // biased random ids for some perftest
     PublicationID random_root_publication();
     PublicationID random_leaf_publication();
 
+    // Arguments of perftest commands, generated before the timed loop so that random number
+    // generation and id formatting are not timed. The random_* functions (and random coords
+    // and years with the default range) return these when streams are active. Values are
+    // used cyclically.
+    template <typename Type>
+    struct ArgumentStream
+    {
+        std::vector<Type> values;
+        std::size_t pos = 0;
+
+        Type const& next()
+        {
+            if (pos == values.size()) { pos = 0; }
+            return values[pos++];
+        }
+    };
+    bool argument_streams_active_ = false;
+    ArgumentStream<AffiliationID> affiliation_stream_;
+    ArgumentStream<PublicationID> publication_stream_;
+    ArgumentStream<PublicationID> root_publication_stream_;
+    ArgumentStream<PublicationID> leaf_publication_stream_;
+    ArgumentStream<Coord> coord_stream_;
+    ArgumentStream<Year> year_stream_;
+    // Generates size values to each stream (from the current random state and data size)
+    void fill_argument_streams(std::size_t size);
+    void clear_argument_streams();
+
+    // Time that the perftest loop itself takes, measured with an empty test function
+    struct HarnessOverhead
+    {
+        std::uint64_t call_ns = 0; // Median time between the clock reads around a call
+        double iteration_sec = 0; // Time of one loop iteration, outside the call too
+    };
+    HarnessOverhead calibrate_harness(unsigned int iterations);
+    static constexpr unsigned int HARNESS_CALIBRATION_ITERATIONS = 100000;
+    static constexpr std::size_t MAX_ARGUMENT_STREAM_SIZE = 1 << 18;
+    void test_nothing();
+
     void test_get_functions(AffiliationID id);
     void test_affiliation_info();
     void test_find_affiliation_with_coord();
@@ -181,6 +345,9 @@ private:
     void test_get_direct_references();
     void test_get_affiliations();
     void test_get_affiliation_count();
+    void test_publications_info();
+    void test_affiliation_coords();
+    static constexpr unsigned int BATCH_TEST_SIZE = 100; // Ids per call when perftesting batch queries
     void test_get_all_publications();
     void test_add_affiliation_to_publication();
 
@@ -189,6 +356,17 @@ private:
     inline Year get_random_year(const Year min = RANDOM_MIN_YEAR, const Year max = RANDOM_MAX_YEAR);
     std::vector<Coord> get_unique_coords(const unsigned int n,const std::unordered_set<Coord,CoordHash>& exclude_list,const Coord min=RANDOM_MIN_COORD,const Coord max=RANDOM_MAX_COORD);
     void add_random_affiliations_publications(unsigned int size, Coord min = RANDOM_MIN_COORD, Coord max = RANDOM_MAX_COORD,const std::vector<Coord>& coordinates={});
+
+    // Shape of the reference forest of random publications
+    enum class Topology { BINARY_TREE, CHAIN, STAR, PREFERENTIAL, FOREST };
+    Topology topology_ = Topology::BINARY_TREE;
+    unsigned long int forest_roots_ = 1000;
+    std::vector<unsigned int> random_parents_; // Parent index of each random publication (preferential)
+    // Index of the parent of random publication n, n itself if it is a root
+    unsigned long int random_parent(unsigned long int n);
+    static std::array<std::pair<char const*, Topology>, 5> const topologies_;
+    static char const* topology_name(Topology topology);
+    static bool topology_from_name(std::string const& name, Topology& topology);
     Distance calc_distance(Coord c1, Coord c2);
     std::string print_affiliation(AffiliationID id, std::ostream& output, bool nl = true);
     std::string print_affiliation_brief(AffiliationID id, std::ostream& output, bool nl = true);
@@ -196,6 +374,29 @@ private:
     std::string print_affiliation_name(AffiliationID id, std::ostream& output, bool nl = true);
     std::string print_coord(Coord coord, std::ostream& output, bool nl = true);
 
+    // Result serialization: values are formatted to the end of a reusable buffer which is
+    // then written to the output stream with one write. print_* functions return the
+    // label string (for the UI) only when a UI is attached.
+    bool format_affiliation(AffiliationID const& id, std::string& buf);
+    bool format_affiliation_brief(AffiliationID const& id, std::string& buf);
+    bool format_publication(PublicationID id, std::string& buf);
+    void format_coord(Coord coord, std::string& buf);
+    static void write_buffer(std::string& buf, std::ostream& output);
+    template <typename Number>
+    static void append_number(std::string& buf, Number number);
+    static std::size_t const RESULT_BUFFER_FLUSH_SIZE = 1 << 16;
+    // (Buffers are per thread, so that queries can be formatted on the query pool.)
+    static thread_local std::string result_buffer_; // Reused for printing result lists
+    static thread_local std::string print_buffer_; // Reused for single print_* calls
+    // Prints an IDLIST result of a command
+    void print_result(CmdResult const& result, std::ostream& output);
+
+    // Prints the items of a Datastructures cursor in the same format as an IDLIST result,
+    // holding only two pages of ids at a time.
+    template <typename ID, typename Cursor, typename Format>
+    void stream_pages(Cursor& cursor, std::ostream& output, char const* empty_msg, char const* label, Format format);
+    std::size_t page_size_ = 4096;
+
     template <typename Type>
     Type random(Type start, Type end);
     template <typename To>
@@ -229,6 +430,14 @@ Type MainProgram::random(Type start, Type end)
     return static_cast<Type>(start+num);
 }
 
+template <typename Number>
+void MainProgram::append_number(std::string& buf, Number number)
+{
+    char digits[24];
+    auto result = std::to_chars(digits, digits + sizeof(digits), number);
+    buf.append(digits, result.ptr);
+}
+
 template <typename To>
 To MainProgram::convert_string_to(std::string from)
 {
@@ -307,23 +516,33 @@ class MainProgram::Stopwatch
 public:
     using Clock = std::chrono::high_resolution_clock;
 
+    // Hardware events counted as one perf_event group (with USE_PERF_EVENT), so that
+    // all of them are measured over exactly the same instructions and read atomically.
+    enum Event { INSTRUCTIONS, CYCLES, L1D_MISSES, LLC_MISSES, BRANCH_MISSES, DTLB_MISSES, EVENT_COUNT };
+    using Events = std::bitset<EVENT_COUNT>;
+    using Counts = std::array<long long, EVENT_COUNT>;
+
+    static char const* event_name(Event event)
+    {
+        static char const* const names[EVENT_COUNT] = {"instructions", "cycles", "l1d", "llc", "branch", "dtlb"};
+        return names[event];
+    }
+
+    // Events opened by Stopwatches created after this call (default: all).
+    static void set_events(Events events) { enabled_events() = events; }
+    static Events& enabled_events()
+    {
+        static Events events = Events().set();
+        return events;
+    }
+
     Stopwatch(bool use_counter = false) : use_counter_(use_counter)
     {
 #ifdef USE_PERF_EVENT
+        fds_.fill(-1);
         if (use_counter_)
         {
-            memset(&pe_, 0, sizeof(pe_));
-            pe_.type = PERF_TYPE_HARDWARE;
-            pe_.size = sizeof(pe_);
-            pe_.config = PERF_COUNT_HW_INSTRUCTIONS;
-            pe_.disabled = 1;
-            pe_.exclude_kernel = 1;
-            pe_.exclude_hv = 1;
-
-            fd_ = perf_event_open(&pe_, 0, -1, -1, 0);
-            if (fd_ == -1) {
-                throw "Couldn't open perf events!";
-            }
+            open_group();
         }
 #endif
         reset();
@@ -332,23 +551,26 @@ public:
     ~Stopwatch()
     {
 #ifdef USE_PERF_EVENT
-        if (use_counter_)
+        for (int fd : fds_)
         {
-            close(fd_);
+            if (fd != -1) { close(fd); }
         }
 #endif
     }
 
+    Stopwatch(Stopwatch const&) = delete;
+    Stopwatch& operator=(Stopwatch const&) = delete;
+
     void start()
     {
         running_ = true;
         starttime_ = Clock::now();
 #ifdef USE_PERF_EVENT
-        if (use_counter_)
+        if (leader_ != -1)
         {
-            ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
-            read(fd_, &startcount_, sizeof(startcount_));
-            ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+            ioctl(leader_, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+            read_group(start_);
+            ioctl(leader_, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
         }
 #endif
     }
@@ -357,11 +579,11 @@ public:
     {
         running_ = false;
 #ifdef USE_PERF_EVENT
-        if (use_counter_)
+        if (leader_ != -1)
         {
-            ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
-            long long c; read(fd_, &c, sizeof(c));
-            counter_ += (c - startcount_);
+            ioctl(leader_, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+            GroupReading end; read_group(end);
+            add_interval(counters_, start_, end);
         }
 #endif
         elapsed_ += (Clock::now() - starttime_);
@@ -371,12 +593,12 @@ public:
     {
         running_ = false;
 #ifdef USE_PERF_EVENT
-        if (use_counter_)
+        if (leader_ != -1)
         {
-            ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
-            ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
-            counter_ = 0;
+            ioctl(leader_, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+            ioctl(leader_, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
         }
+        counters_.fill(0);
 #endif
         elapsed_ = elapsed_.zero();
     }
@@ -395,39 +617,139 @@ public:
     }
 
 #ifdef USE_PERF_EVENT
+    // True if at least one event could be opened. Perf events are often unavailable
+    // (virtual machines, containers, perf_event_paranoid), and then only time is measured.
+    bool counters_available() const { return leader_ != -1; }
+    bool event_available(Event event) const { return fds_[event] != -1; }
+
+    // Counts of all events, -1 for events that are not available.
+    Counts counts()
+    {
+        Counts result = counters_;
+        if (running_ && leader_ != -1)
+        {
+            GroupReading end; read_group(end);
+            add_interval(result, start_, end);
+        }
+        for (unsigned int i = 0; i < EVENT_COUNT; ++i)
+        {
+            if (fds_[i] == -1) { result[i] = -1; }
+        }
+        return result;
+    }
+
+    // Number of instructions (-1 if not available).
     long long count()
     {
         if (use_counter_)
         {
-            if (!running_)
-            {
-                return counter_;
-            }
-            else
-            {
-                long long c;
-                read(fd_, &c, sizeof(c));
-                return counter_ + (c - startcount_);
-            }
+            return counts()[INSTRUCTIONS];
         }
         else
         {
             assert(!"perf_event not enabled during StopWatch creation!");
+            return -1;
         }
     }
 #endif
 
 private:
+#ifdef USE_PERF_EVENT
+    void open_group()
+    {
+        static std::array<std::pair<std::uint32_t, std::uint64_t>, EVENT_COUNT> const configs = {{
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+            {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+            {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+        }};
+
+        Events events = enabled_events();
+        for (unsigned int i = 0; i < EVENT_COUNT; ++i)
+        {
+            if (!events[i]) { continue; }
+
+            struct perf_event_attr pe;
+            memset(&pe, 0, sizeof(pe));
+            pe.type = configs[i].first;
+            pe.size = sizeof(pe);
+            pe.config = configs[i].second;
+            pe.disabled = (leader_ == -1) ? 1 : 0; // Members follow the leader
+            pe.exclude_kernel = 1;
+            pe.exclude_hv = 1;
+            pe.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_ID | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+            // Events the hardware doesn't support are just left out
+            int fd = perf_event_open(&pe, 0, -1, leader_, 0);
+            if (fd == -1) { continue; }
+
+            std::uint64_t id = 0;
+            if (ioctl(fd, PERF_EVENT_IOC_ID, &id) == -1) { close(fd); continue; }
+
+            fds_[i] = fd;
+            ids_[i] = id;
+            if (leader_ == -1) { leader_ = fd; }
+        }
+    }
+
+    // Raw values of the group and the times it was enabled and running. The times are
+    // not reset by PERF_EVENT_IOC_RESET, so they are cumulative over all intervals.
+    struct GroupReading
+    {
+        Counts values = {};
+        std::uint64_t time_enabled = 0;
+        std::uint64_t time_running = 0;
+    };
+
+    // Reads all events of the group with one read.
+    void read_group(GroupReading& reading)
+    {
+        reading = GroupReading();
+        struct { std::uint64_t nr, time_enabled, time_running; struct { std::uint64_t value, id; } values[EVENT_COUNT]; } data;
+        if (::read(leader_, &data, sizeof(data)) <= 0) { return; }
+
+        reading.time_enabled = data.time_enabled;
+        reading.time_running = data.time_running;
+        for (std::uint64_t v = 0; v < data.nr && v < EVENT_COUNT; ++v)
+        {
+            for (unsigned int i = 0; i < EVENT_COUNT; ++i)
+            {
+                if (fds_[i] != -1 && ids_[i] == data.values[v].id)
+                {
+                    reading.values[i] = static_cast<long long>(data.values[v].value);
+                }
+            }
+        }
+    }
+
+    // Adds the counts between two readings to counts. If the group had to share the
+    // hardware counters with others (multiplexing) during the interval, they are scaled
+    // by the interval's own enabled and running times, not by the totals since opening.
+    static void add_interval(Counts& counts, GroupReading const& start, GroupReading const& end)
+    {
+        std::uint64_t enabled = end.time_enabled - start.time_enabled;
+        std::uint64_t running = end.time_running - start.time_running;
+        double scale = (running > 0 && running < enabled) ? static_cast<double>(enabled) / running : 1.0;
+        for (unsigned int i = 0; i < EVENT_COUNT; ++i)
+        {
+            counts[i] += static_cast<long long>((end.values[i] - start.values[i]) * scale);
+        }
+    }
+#endif
+
     std::chrono::time_point<Clock> starttime_;
     Clock::duration elapsed_ = Clock::duration::zero();
     bool running_ = false;
 
     bool use_counter_;
 #ifdef USE_PERF_EVENT
-    struct perf_event_attr pe_;
-    long long startcount_ = 0;
-    long long counter_ = 0;
-    int fd_ = 0;
+    std::array<int, EVENT_COUNT> fds_;
+    std::array<std::uint64_t, EVENT_COUNT> ids_ = {};
+    int leader_ = -1;
+    GroupReading start_;
+    Counts counters_ = {};
 #endif
 };
 
@@ -11,7 +11,6 @@
 // Qt generated main window code
 
 #ifdef GRAPHICAL_GUI
-#include <QCoreApplication>
 #include <QFileDialog>
 #include <QDir>
 #include <QFont>
@@ -132,7 +131,12 @@ MainWindow::MainWindow(QWidget *parent) :
     connect(ui->clear_input_button, &QPushButton::clicked, this, &MainWindow::clear_input_line);
 
     // Stop button
-    connect(ui->stop_button, &QPushButton::clicked, this, [this](){ this->stop_pressed_ = true; });
+    connect(ui->stop_button, &QPushButton::clicked, this, [this](){ this->mainprg_.request_stop(); });
+
+    // Output of a running command is moved to the output box by a timer (in milliseconds)
+    poll_timer_ = new QTimer(this);
+    poll_timer_->setInterval(50);
+    connect(poll_timer_, &QTimer::timeout, this, &MainWindow::poll_command);
 
     // disable the worldmap checkbox if no worldmap data exists
 #ifndef WORLDMAP_HH
@@ -144,11 +148,18 @@ MainWindow::MainWindow(QWidget *parent) :
 
 MainWindow::~MainWindow()
 {
+    if (command_running())
+    {
+        mainprg_.request_stop();
+        command_thread_.join();
+    }
     delete ui;
 }
 
 void MainWindow::update_view()
 {
+    if (command_running()) { return; } // The command may be changing the data, view is updated when it ends
+
     std::unordered_set<std::string> errorset;
     try
     {
@@ -411,15 +422,7 @@ void MainWindow::update_view()
 
 void MainWindow::output_text(ostringstream& output)
 {
-    string outstr = output.str();
-    if (!outstr.empty())
-    {
-        if (outstr.back() == '\n') { outstr.pop_back(); } // Remove trailing newline
-        ui->output->appendPlainText(QString::fromStdString(outstr));
-        ui->output->ensureCursorVisible();
-        ui->output->repaint();
-    }
-
+    append_output(output.str(), true);
     output.str(""); // Clear the stream, because it has already been output
 }
 
@@ -427,40 +430,92 @@ void MainWindow::output_text_end()
 {
     ui->output->moveCursor(QTextCursor::End);
     ui->output->ensureCursorVisible();
-    ui->output->repaint();
 }
 
-bool MainWindow::check_stop_pressed() const
+void MainWindow::queue_output(ostringstream& output)
+{
+    output_queue_.push(output.str());
+    output.str(""); // Clear the stream, because it has already been output
+}
+
+void MainWindow::append_output(string const& text, bool end)
+{
+    // appendPlainText() always starts a new paragraph, so only complete lines are
+    // appended until the command ends
+    partial_line_ += text;
+    string lines;
+    auto last_newline = partial_line_.rfind('\n');
+    if (end)
+    {
+        lines.swap(partial_line_);
+    }
+    else if (last_newline != string::npos)
+    {
+        lines = partial_line_.substr(0, last_newline + 1);
+        partial_line_.erase(0, last_newline + 1);
+    }
+
+    if (!lines.empty())
+    {
+        if (lines.back() == '\n') { lines.pop_back(); } // Remove trailing newline
+        ui->output->appendPlainText(QString::fromStdString(lines));
+        ui->output->ensureCursorVisible();
+    }
+}
+
+bool MainWindow::command_running() const
 {
-    QCoreApplication::processEvents();
-    return stop_pressed_;
+    return command_thread_.joinable();
 }
 
 void MainWindow::execute_line()
 {
+    if (command_running()) { return; } // Return pressed in the line edit while a command runs
+
     auto line = ui->lineEdit->text();
     clear_input_line();
     ui->output->appendPlainText(QString::fromStdString(MainProgram::PROMPT)+line);
 
     ui->execute_button->setEnabled(false);
     ui->stop_button->setEnabled(true);
-    stop_pressed_ = false;
+    mainprg_.clear_stop();
 
-    ostringstream output;
-    bool cont = mainprg_.command_parse_line(line.toStdString(), output);
-    ui->lineEdit->clear();
-    output_text(output);
+    // The command runs on its own thread and streams its output through output_queue_
+    // (MainProgram::flush_output()), so the GUI thread only repaints and reacts to the
+    // stop button, and none of that is timed as part of the command
+    command_done_.store(false, std::memory_order_relaxed);
+    command_thread_ = std::thread([this, line = line.toStdString()]()
+    {
+        ostringstream output;
+        command_cont_ = mainprg_.command_parse_line(line, output);
+        queue_output(output);
+        command_done_.store(true, std::memory_order_release);
+    });
+    poll_timer_->start();
+}
+
+void MainWindow::poll_command()
+{
+    // Read before taking the output, so that nothing queued before the end is left behind
+    bool done = command_done_.load(std::memory_order_acquire);
+    string text;
+    output_queue_.take_all(text);
+    append_output(text, done);
+    if (!done) { return; }
+
+    poll_timer_->stop();
+    command_thread_.join();
     output_text_end();
 
     ui->stop_button->setEnabled(false);
     ui->execute_button->setEnabled(true);
-    stop_pressed_ = false;
+    mainprg_.clear_stop();
 
     ui->lineEdit->setFocus();
 
     update_view();
 
-    if (!cont)
+    if (!command_cont_)
     {
         close();
     }
@@ -518,7 +573,7 @@ void MainWindow::scene_selection_change()
         for (auto i : items)
         {
             auto data = i->data(0);
-            if (!selection_clear_in_progress)
+            if (!selection_clear_in_progress && !command_running())
             {
                 ostringstream output;
                 output << "*click* ";
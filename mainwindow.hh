@@ -10,9 +10,15 @@
 #define MAINWINDOW_HH
 
 #include "mainprogram.hh"
+#include "outputqueue.hh"
 
 #include <QMainWindow>
 #include <QGraphicsScene>
+#include <QTimer>
+
+#include <atomic>
+#include <string>
+#include <thread>
 
 namespace Ui {
 class MainWindow;
@@ -30,7 +36,8 @@ public:
     void output_text(std::ostringstream &output);
     void output_text_end();
 
-    bool check_stop_pressed() const;
+    // Called by the command thread: moves the text to output_queue_ and clears the stream.
+    void queue_output(std::ostringstream &output);
 
 public slots:
     void execute_line();
@@ -41,15 +48,27 @@ public slots:
     void fit_view();
     void scene_selection_change();
     void clear_selection();
+    void poll_command();
 
 private:
+    bool command_running() const;
+    void append_output(std::string const& text, bool end);
+
     Ui::MainWindow *ui = nullptr;
 
     QGraphicsScene* gscene_ = nullptr;
 
     MainProgram mainprg_;
 
-    bool stop_pressed_ = false;
+    // Commands run on command_thread_, so that the window stays responsive and the stop
+    // button works. Their output comes through output_queue_, and poll_timer_ moves it to
+    // the output box. mainprg_ is touched only by command_thread_ while it runs.
+    std::thread command_thread_;
+    std::atomic<bool> command_done_{false};
+    bool command_cont_ = true; // Result of command_parse_line(), read after command_done_
+    OutputQueue output_queue_;
+    std::string partial_line_; // Output after the last newline, shown when the line is complete
+    QTimer* poll_timer_ = nullptr;
 
     bool selection_clear_in_progress = false;
 };
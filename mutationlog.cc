@@ -0,0 +1,497 @@
+// Mutationlog.cc
+
+#include "mutationlog.hh"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+extern "C"
+{
+#include <fcntl.h>
+#include <unistd.h>
+}
+
+namespace
+{
+// Payload length + checksum.
+std::size_t const RECORD_HEADER_SIZE = 2 * sizeof(std::uint32_t);
+
+// Sanity limit for a single record, anything longer is treated as garbage.
+std::uint32_t const MAX_RECORD_SIZE = 64 * 1024 * 1024;
+
+// Writes all of data, retrying after signals. Returns the number of bytes written, less
+// than size if writing failed.
+std::size_t write_all(int fd, char const* data, std::size_t size)
+{
+    std::size_t written = 0;
+    while (written < size) {
+        auto result = ::write(fd, data + written, size - written);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            break;
+        }
+        written += result;
+    }
+    return written;
+}
+
+bool fsync_retry(int fd)
+{
+    int result = 0;
+    do {
+        result = ::fsync(fd);
+    } while (result != 0 && errno == EINTR);
+    return result == 0;
+}
+
+// Makes a rename (or creation) of a file in the directory durable.
+bool fsync_directory(std::string const& filename)
+{
+    auto slash = filename.rfind('/');
+    std::string directory = (slash == std::string::npos) ? "." : (slash == 0) ? "/" : filename.substr(0, slash);
+    int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+        return false;
+    }
+    bool ok = fsync_retry(fd);
+    ::close(fd);
+    return ok;
+}
+}
+
+MutationLog::MutationLog()
+{
+}
+
+MutationLog::~MutationLog()
+{
+    close();
+}
+
+bool MutationLog::open(std::string const& filename, unsigned long long next_sequence,
+                       unsigned long long valid_bytes, unsigned int group_size)
+{
+    close();
+
+    fd_ = ::open(filename.c_str(), O_WRONLY | O_CREAT, 0644);
+    if (fd_ == -1) {
+        return false;
+    }
+
+    // Cutting away possible torn tail so that new records follow the last valid one.
+    if (::ftruncate(fd_, static_cast<off_t>(valid_bytes)) != 0 ||
+        ::lseek(fd_, 0, SEEK_END) == static_cast<off_t>(-1)) {
+        ::close(fd_);
+        fd_ = -1;
+        return false;
+    }
+
+    std::lock_guard<std::mutex> guard(mutex_);
+    filename_ = filename;
+    next_sequence_ = next_sequence;
+    group_size_ = (group_size > 0) ? group_size : 1;
+    pending_records_ = 0;
+    buffer_.clear();
+    failed_ = false;
+    return true;
+}
+
+void MutationLog::close()
+{
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (fd_ != -1) {
+        sync_locked();
+        ::close(fd_);
+        fd_ = -1;
+    }
+    filename_.clear();
+    buffer_.clear(); // Records that could not be written are lost here, see failed().
+    pending_records_ = 0;
+}
+
+bool MutationLog::is_open() const
+{
+    return fd_ != -1;
+}
+
+std::string const& MutationLog::filename() const
+{
+    return filename_;
+}
+
+bool MutationLog::sync()
+{
+    std::lock_guard<std::mutex> guard(mutex_);
+    return sync_locked();
+}
+
+bool MutationLog::truncate()
+{
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (fd_ == -1) {
+        return !failed_;
+    }
+    if (!write_buffer()) {
+        return false; // Log is kept, so that the records are not lost with it.
+    }
+    if (::ftruncate(fd_, 0) != 0 || ::lseek(fd_, 0, SEEK_SET) == static_cast<off_t>(-1) || !fsync_retry(fd_)) {
+        failed_ = true;
+    }
+    return !failed_;
+}
+
+bool MutationLog::failed() const
+{
+    std::lock_guard<std::mutex> guard(mutex_);
+    return failed_;
+}
+
+unsigned long long MutationLog::last_sequence() const
+{
+    std::lock_guard<std::mutex> guard(mutex_);
+    return next_sequence_ - 1;
+}
+
+template <typename EncodeFields>
+void MutationLog::write_record(Operation operation, EncodeFields encode_fields)
+{
+    // Writers of different stripes may log at the same time.
+    std::lock_guard<std::mutex> guard(mutex_);
+    std::size_t record_start = buffer_.size();
+    try {
+        buffer_.append(RECORD_HEADER_SIZE, '\0'); // Filled in below.
+        put_u8(buffer_, static_cast<std::uint8_t>(operation));
+        put_u64(buffer_, next_sequence_);
+        encode_fields(buffer_);
+    }
+    catch (...) {
+        buffer_.resize(record_start); // No half record is left in the buffer.
+        throw;
+    }
+    ++next_sequence_;
+
+    std::uint32_t length = buffer_.size() - record_start - RECORD_HEADER_SIZE;
+    std::uint32_t sum = checksum(buffer_.data() + record_start + RECORD_HEADER_SIZE, length);
+    std::memcpy(&buffer_[record_start], &length, sizeof(length));
+    std::memcpy(&buffer_[record_start + sizeof(length)], &sum, sizeof(sum));
+
+    // Group commit: one write and fsync per group_size_ records.
+    if (++pending_records_ >= group_size_) {
+        sync_locked();
+    }
+}
+
+void MutationLog::log_add_affiliation(AffiliationID const& id, Name const& name, Coord xy)
+{
+    write_record(Operation::ADD_AFFILIATION, [&](std::string& buf) {
+        put_string(buf, id);
+        put_string(buf, name);
+        put_i32(buf, xy.x);
+        put_i32(buf, xy.y);
+    });
+}
+
+void MutationLog::log_add_publication(PublicationID id, Name const& name, Year year, std::vector<AffiliationID> const& affiliations)
+{
+    write_record(Operation::ADD_PUBLICATION, [&](std::string& buf) {
+        put_u64(buf, id);
+        put_string(buf, name);
+        put_u16(buf, year);
+        put_u32(buf, affiliations.size());
+        for (auto const& affiliation : affiliations) { // O(k)
+            put_string(buf, affiliation);
+        }
+    });
+}
+
+void MutationLog::log_add_reference(PublicationID id, PublicationID parentid)
+{
+    write_record(Operation::ADD_REFERENCE, [&](std::string& buf) {
+        put_u64(buf, id);
+        put_u64(buf, parentid);
+    });
+}
+
+void MutationLog::log_add_affiliation_to_publication(AffiliationID const& affiliationid, PublicationID publicationid)
+{
+    write_record(Operation::ADD_AFFILIATION_TO_PUBLICATION, [&](std::string& buf) {
+        put_string(buf, affiliationid);
+        put_u64(buf, publicationid);
+    });
+}
+
+void MutationLog::log_change_affiliation_coord(AffiliationID const& id, Coord newcoord)
+{
+    write_record(Operation::CHANGE_AFFILIATION_COORD, [&](std::string& buf) {
+        put_string(buf, id);
+        put_i32(buf, newcoord.x);
+        put_i32(buf, newcoord.y);
+    });
+}
+
+void MutationLog::log_remove_affiliation(AffiliationID const& id)
+{
+    write_record(Operation::REMOVE_AFFILIATION, [&](std::string& buf) {
+        put_string(buf, id);
+    });
+}
+
+void MutationLog::log_remove_publication(PublicationID id)
+{
+    write_record(Operation::REMOVE_PUBLICATION, [&](std::string& buf) {
+        put_u64(buf, id);
+    });
+}
+
+void MutationLog::log_clear_all()
+{
+    write_record(Operation::CLEAR_ALL, [](std::string&) {});
+}
+
+bool MutationLog::replay(std::string const& filename, Datastructures& ds,
+                         unsigned long long after_sequence, ReplayInfo& info)
+{
+    info = ReplayInfo();
+    info.last_sequence = after_sequence;
+
+    std::ifstream input(filename, std::ios::binary);
+    if (!input) {
+        return false;
+    }
+    std::string data((std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>()); // O(file size)
+
+    Reader file{data.data(), data.data() + data.size()};
+    while (file.pos != file.end) {
+        std::uint32_t length = 0;
+        std::uint32_t sum = 0;
+        if (!file.get_u32(length) || !file.get_u32(sum) || length > MAX_RECORD_SIZE ||
+            static_cast<std::size_t>(file.end - file.pos) < length || checksum(file.pos, length) != sum) {
+            info.torn_tail = true;
+            break;
+        }
+
+        Reader record{file.pos, file.pos + length};
+        file.pos += length;
+
+        std::uint8_t op = 0;
+        std::uint64_t sequence = 0;
+        if (!record.get_u8(op) || !record.get_u64(sequence)) {
+            info.torn_tail = true;
+            break;
+        }
+
+        // Records already included in the snapshot are skipped.
+        if (sequence <= after_sequence) {
+            ++info.records_skipped;
+            info.valid_bytes = file.pos - data.data();
+            continue;
+        }
+
+        bool ok = true;
+        switch (static_cast<Operation>(op)) {
+        case Operation::ADD_AFFILIATION: {
+            std::string id, name;
+            std::int32_t x = 0, y = 0;
+            ok = record.get_string(id) && record.get_string(name) && record.get_i32(x) && record.get_i32(y);
+            if (ok) { ds.add_affiliation(id, name, {x, y}); }
+            break;
+        }
+        case Operation::ADD_PUBLICATION: {
+            std::uint64_t id = 0;
+            std::string name;
+            std::uint16_t year = 0;
+            std::uint32_t count = 0;
+            ok = record.get_u64(id) && record.get_string(name) && record.get_u16(year) && record.get_u32(count);
+            std::vector<AffiliationID> affiliations;
+            for (std::uint32_t i = 0; ok && i < count; ++i) {
+                std::string affiliation;
+                ok = record.get_string(affiliation);
+                affiliations.push_back(affiliation);
+            }
+            if (ok) { ds.add_publication(id, name, year, affiliations); }
+            break;
+        }
+        case Operation::ADD_REFERENCE: {
+            std::uint64_t id = 0, parentid = 0;
+            ok = record.get_u64(id) && record.get_u64(parentid);
+            if (ok) { ds.add_reference(id, parentid); }
+            break;
+        }
+        case Operation::ADD_AFFILIATION_TO_PUBLICATION: {
+            std::string affiliationid;
+            std::uint64_t publicationid = 0;
+            ok = record.get_string(affiliationid) && record.get_u64(publicationid);
+            if (ok) { ds.add_affiliation_to_publication(affiliationid, publicationid); }
+            break;
+        }
+        case Operation::CHANGE_AFFILIATION_COORD: {
+            std::string id;
+            std::int32_t x = 0, y = 0;
+            ok = record.get_string(id) && record.get_i32(x) && record.get_i32(y);
+            if (ok) { ds.change_affiliation_coord(id, {x, y}); }
+            break;
+        }
+        case Operation::REMOVE_AFFILIATION: {
+            std::string id;
+            ok = record.get_string(id);
+            if (ok) { ds.remove_affiliation(id); }
+            break;
+        }
+        case Operation::REMOVE_PUBLICATION: {
+            std::uint64_t id = 0;
+            ok = record.get_u64(id);
+            if (ok) { ds.remove_publication(id); }
+            break;
+        }
+        case Operation::CLEAR_ALL: {
+            ds.clear_all();
+            break;
+        }
+        default:
+            ok = false;
+        }
+
+        if (!ok) {
+            // Checksum matched but content didn't, handled like a torn record.
+            info.torn_tail = true;
+            break;
+        }
+        ++info.records_applied;
+        info.last_sequence = sequence;
+        info.valid_bytes = file.pos - data.data();
+    }
+
+    return true;
+}
+
+void MutationLog::put_u8(std::string& buf, std::uint8_t value)
+{
+    buf.push_back(static_cast<char>(value));
+}
+
+void MutationLog::put_u16(std::string& buf, std::uint16_t value)
+{
+    buf.append(reinterpret_cast<char const*>(&value), sizeof(value));
+}
+
+void MutationLog::put_u32(std::string& buf, std::uint32_t value)
+{
+    buf.append(reinterpret_cast<char const*>(&value), sizeof(value));
+}
+
+void MutationLog::put_u64(std::string& buf, std::uint64_t value)
+{
+    buf.append(reinterpret_cast<char const*>(&value), sizeof(value));
+}
+
+void MutationLog::put_i32(std::string& buf, std::int32_t value)
+{
+    buf.append(reinterpret_cast<char const*>(&value), sizeof(value));
+}
+
+void MutationLog::put_string(std::string& buf, std::string const& value)
+{
+    put_u32(buf, value.size());
+    buf.append(value);
+}
+
+bool MutationLog::Reader::get_u8(std::uint8_t& value)
+{
+    if (end - pos < 1) { return false; }
+    value = static_cast<std::uint8_t>(*pos++);
+    return true;
+}
+
+bool MutationLog::Reader::get_u16(std::uint16_t& value)
+{
+    if (end - pos < static_cast<long>(sizeof(value))) { return false; }
+    std::memcpy(&value, pos, sizeof(value));
+    pos += sizeof(value);
+    return true;
+}
+
+bool MutationLog::Reader::get_u32(std::uint32_t& value)
+{
+    if (end - pos < static_cast<long>(sizeof(value))) { return false; }
+    std::memcpy(&value, pos, sizeof(value));
+    pos += sizeof(value);
+    return true;
+}
+
+bool MutationLog::Reader::get_u64(std::uint64_t& value)
+{
+    if (end - pos < static_cast<long>(sizeof(value))) { return false; }
+    std::memcpy(&value, pos, sizeof(value));
+    pos += sizeof(value);
+    return true;
+}
+
+bool MutationLog::Reader::get_i32(std::int32_t& value)
+{
+    if (end - pos < static_cast<long>(sizeof(value))) { return false; }
+    std::memcpy(&value, pos, sizeof(value));
+    pos += sizeof(value);
+    return true;
+}
+
+bool MutationLog::Reader::get_string(std::string& value)
+{
+    std::uint32_t length = 0;
+    if (!get_u32(length) || end - pos < static_cast<long>(length)) { return false; }
+    value.assign(pos, length);
+    pos += length;
+    return true;
+}
+
+// FNV-1a, enough for detecting torn and partially written records.
+std::uint32_t MutationLog::checksum(char const* data, std::size_t length)
+{
+    std::uint32_t hash = 2166136261u;
+    for (std::size_t i = 0; i < length; ++i) { // O(n)
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+bool MutationLog::write_file_durably(std::string const& filename, std::string const& data)
+{
+    std::string tmpname = filename + ".tmp";
+    int fd = ::open(tmpname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        return false;
+    }
+
+    bool ok = write_all(fd, data.data(), data.size()) == data.size() && fsync_retry(fd);
+    ok = (::close(fd) == 0) && ok;
+
+    return ok && std::rename(tmpname.c_str(), filename.c_str()) == 0 && fsync_directory(filename);
+}
+
+bool MutationLog::sync_locked()
+{
+    if (fd_ == -1) {
+        return !failed_;
+    }
+    if (write_buffer() && !fsync_retry(fd_)) {
+        failed_ = true;
+    }
+    return !failed_;
+}
+
+bool MutationLog::write_buffer()
+{
+    auto written = write_all(fd_, buffer_.data(), buffer_.size());
+    buffer_.erase(0, written);
+    if (!buffer_.empty()) {
+        failed_ = true; // The rest stays buffered for the next attempt.
+        return false;
+    }
+    pending_records_ = 0;
+    return true;
+}
@@ -0,0 +1,149 @@
+// Mutationlog.hh
+//
+// Append-only binary write-ahead log of Datastructures mutations.
+//
+// Every successful mutation of Datastructures is appended as one record. Records
+// are buffered in memory and written + fsync'ed in groups ("group commit"), so
+// the cost of fsync is shared between group_size records. On startup the latest
+// snapshot is loaded (Datastructures::load_snapshot) and only the log records
+// newer than the snapshot are replayed, so recovery time depends on the number
+// of mutations since the last checkpoint, not on the size of the dataset.
+//
+// Record layout (host byte order):
+//   u32 payload length, u32 checksum of payload, payload
+//   payload = u8 operation, u64 sequence number, operation specific fields
+// A record with a bad length or checksum ends the replay (torn write at crash).
+
+#ifndef MUTATIONLOG_HH
+#define MUTATIONLOG_HH
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <mutex>
+
+#include "datastructures.hh"
+
+class MutationLog
+{
+public:
+    enum class Operation : unsigned char
+    {
+        ADD_AFFILIATION = 1,
+        ADD_PUBLICATION,
+        ADD_REFERENCE,
+        ADD_AFFILIATION_TO_PUBLICATION,
+        CHANGE_AFFILIATION_COORD,
+        REMOVE_AFFILIATION,
+        REMOVE_PUBLICATION,
+        CLEAR_ALL
+    };
+
+    // Result of a replay.
+    struct ReplayInfo
+    {
+        unsigned long long records_applied = 0;
+        unsigned long long records_skipped = 0; // Already included in the snapshot.
+        unsigned long long last_sequence = 0;
+        unsigned long long valid_bytes = 0; // Length of the intact part of the log.
+        bool torn_tail = false;
+    };
+
+    MutationLog();
+    ~MutationLog();
+
+    MutationLog(MutationLog const&) = delete;
+    MutationLog& operator=(MutationLog const&) = delete;
+
+    // Opens (or creates) the log file for appending. New records get sequence numbers
+    // after next_sequence-1. Bytes after valid_bytes (torn tail) are truncated away.
+    // group_size is the number of records written with a single write+fsync.
+    bool open(std::string const& filename, unsigned long long next_sequence,
+              unsigned long long valid_bytes, unsigned int group_size);
+    // Syncs the file first, see sync().
+    void close();
+    bool is_open() const;
+    std::string const& filename() const;
+
+    // Writes buffered records and fsyncs the file. Returns false if this or any earlier
+    // write or fsync since open() failed (see failed()). Records that could not be written
+    // stay buffered and are written by the next sync().
+    bool sync();
+    // Discards the whole log file contents (used after a checkpoint). Returns false like sync().
+    bool truncate();
+
+    // A write or fsync has failed since open(), so records may be missing from the file.
+    bool failed() const;
+
+    unsigned long long last_sequence() const;
+
+    // Estimate of performance: amortized O(k), k being the size of the record.
+    // Short rationale for estimate: Record is encoded to the end of a buffer. The buffer
+    // is written once per group_size records.
+    void log_add_affiliation(AffiliationID const& id, Name const& name, Coord xy);
+    void log_add_publication(PublicationID id, Name const& name, Year year, std::vector<AffiliationID> const& affiliations);
+    void log_add_reference(PublicationID id, PublicationID parentid);
+    void log_add_affiliation_to_publication(AffiliationID const& affiliationid, PublicationID publicationid);
+    void log_change_affiliation_coord(AffiliationID const& id, Coord newcoord);
+    void log_remove_affiliation(AffiliationID const& id);
+    void log_remove_publication(PublicationID id);
+    void log_clear_all();
+
+    // Estimate of performance: O(r*log(n))
+    // Short rationale for estimate: Every record r newer than after_sequence is applied
+    // with the corresponding (logarithmic) Datastructures operation.
+    // Datastructures must not have a log attached while replaying.
+    static bool replay(std::string const& filename, Datastructures& ds,
+                       unsigned long long after_sequence, ReplayInfo& info);
+
+    // Encoding helpers shared with the snapshot format.
+    static void put_u8(std::string& buf, std::uint8_t value);
+    static void put_u16(std::string& buf, std::uint16_t value);
+    static void put_u32(std::string& buf, std::uint32_t value);
+    static void put_u64(std::string& buf, std::uint64_t value);
+    static void put_i32(std::string& buf, std::int32_t value);
+    static void put_string(std::string& buf, std::string const& value);
+
+    // Decoding helpers. Return false if there is not enough data left.
+    struct Reader
+    {
+        char const* pos;
+        char const* end;
+
+        bool get_u8(std::uint8_t& value);
+        bool get_u16(std::uint16_t& value);
+        bool get_u32(std::uint32_t& value);
+        bool get_u64(std::uint64_t& value);
+        bool get_i32(std::int32_t& value);
+        bool get_string(std::string& value);
+    };
+
+    static std::uint32_t checksum(char const* data, std::size_t length);
+
+    // Writes data to a temporary file, fsyncs it and renames it over filename, so that
+    // a crash leaves either the old or the new file but never a half written one. The
+    // directory is fsynced after the rename, so that the new file survives a crash too.
+    static bool write_file_durably(std::string const& filename, std::string const& data);
+
+private:
+    // Appends a record to the buffer under mutex_: the header, then the fields appended by
+    // encode_fields(buffer). If encoding throws, the buffer is left as it was.
+    template <typename EncodeFields>
+    void write_record(Operation operation, EncodeFields encode_fields);
+
+    // The following are called with mutex_ held.
+    bool sync_locked();
+    // Writes as much of the buffer as possible and removes the written part.
+    bool write_buffer();
+
+    std::string filename_;
+    int fd_ = -1;
+    std::string buffer_;
+    unsigned int group_size_ = 1;
+    unsigned int pending_records_ = 0;
+    unsigned long long next_sequence_ = 1;
+    bool failed_ = false;
+    mutable std::mutex mutex_; // See Datastructures::Concurrency::STRIPED.
+};
+
+#endif // MUTATIONLOG_HH
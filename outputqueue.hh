@@ -0,0 +1,77 @@
+// Outputqueue.hh
+//
+// Lock-free queue of output text from one producer thread to one consumer thread. The
+// graphical UI runs commands on a worker thread, which pushes its output here
+// (MainProgram::flush_output), and the GUI thread takes it out on a timer. So the worker
+// never waits for the GUI (e.g. for repainting) and the GUI never blocks on the worker.
+//
+// The queue is a linked list with a dummy head node (Vyukov's unbounded SPSC queue).
+// push() is called only by the producer and take_all() only by the consumer. The
+// producer never blocks: a full queue would make a timed command wait for the GUI.
+
+#ifndef OUTPUTQUEUE_HH
+#define OUTPUTQUEUE_HH
+
+#include <atomic>
+#include <string>
+
+class OutputQueue
+{
+public:
+    OutputQueue() : head_(new Node), tail_(head_) {}
+    ~OutputQueue()
+    {
+        while (head_) {
+            Node* next = head_->next.load(std::memory_order_relaxed);
+            delete head_;
+            head_ = next;
+        }
+    }
+
+    OutputQueue(OutputQueue const&) = delete;
+    OutputQueue& operator=(OutputQueue const&) = delete;
+
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: One node is allocated and linked after the tail.
+    // Producer thread only.
+    void push(std::string text)
+    {
+        if (text.empty()) { return; }
+        Node* node = new Node;
+        node->text = std::move(text);
+        tail_->next.store(node, std::memory_order_release); // Publishes the text too.
+        tail_ = node;
+    }
+
+    // Estimate of performance: O(n), n = total length of the texts
+    // Short rationale for estimate: Every queued text is appended to result once.
+    // Consumer thread only. Returns false if nothing was queued.
+    bool take_all(std::string& result)
+    {
+        bool taken = false;
+        for (Node* next = head_->next.load(std::memory_order_acquire); next;
+             next = head_->next.load(std::memory_order_acquire)) {
+            // The producer doesn't touch a node after linking the next one, so the old
+            // dummy can be deleted and next becomes the new dummy.
+            result += next->text;
+            std::string().swap(next->text);
+            delete head_;
+            head_ = next;
+            taken = true;
+        }
+        return taken;
+    }
+
+private:
+    struct Node
+    {
+        std::string text;
+        std::atomic<Node*> next{nullptr};
+    };
+
+    // On separate cache lines, because the threads update them independently.
+    alignas(64) Node* head_; // Consumer's dummy node, its text already taken.
+    alignas(64) Node* tail_; // Producer's last node.
+};
+
+#endif // OUTPUTQUEUE_HH
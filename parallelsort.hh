@@ -0,0 +1,153 @@
+// Parallelsort.hh
+//
+// Parallel merge sort for the large listings of Datastructures. The range is split into
+// one chunk per thread and the chunks are sorted at the same time. Sorted chunks are then
+// merged pairwise in rounds. Every merge is split between the threads by co-rank (binary
+// search of where each thread's part of the output starts), so the rounds keep all
+// threads busy, also the last one which merges two halves.
+//
+// Chunks are sorted with std::stable_sort and merges keep the earlier chunk first, so the
+// result is the same as std::stable_sort's with any number of threads.
+//
+// parallel_merge_runs() does the merge rounds alone, for runs sorted by the caller (the
+// partitions of Datastructures::add_bulk()).
+//
+// Plain std::threads are used, because std::execution::par needs TBB with GCC.
+
+#ifndef PARALLELSORT_HH
+#define PARALLELSORT_HH
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace parallelsort_detail
+{
+
+// Number of items of a taken from the first k items of the stable merge of a and b.
+template <typename Iterator, typename Compare>
+std::size_t co_rank(std::size_t k, Iterator a, std::size_t a_size, Iterator b, std::size_t b_size, Compare& comp)
+{
+    std::size_t low = (k > b_size) ? k - b_size : 0;
+    std::size_t high = std::min(k, a_size);
+    while (low < high) {
+        auto i = low + (high - low) / 2;
+        if (!comp(b[k - i - 1], a[i])) { // a[i] is merged before b[k-i-1], so more of a is needed.
+            low = i + 1;
+        }
+        else {
+            high = i;
+        }
+    }
+    return low;
+}
+
+// Merges runs [bounds[i], bounds[i+1]) of from pairwise into to, with the given number of threads.
+// Returns the bounds of the merged runs.
+template <typename Iterator, typename OutIterator, typename Compare>
+std::vector<std::size_t> merge_round(Iterator from, OutIterator to, std::vector<std::size_t> const& bounds,
+                                     unsigned int threads, Compare& comp)
+{
+    std::size_t runs = bounds.size() - 1;
+    std::size_t total = bounds.back() - bounds.front();
+    std::vector<std::thread> workers;
+    std::vector<std::size_t> merged_bounds{bounds.front()};
+    for (std::size_t r = 0; r < runs; r += 2) {
+        auto begin = bounds[r];
+        auto middle = bounds[r + 1];
+        auto end = bounds[std::min(r + 2, runs)]; // Odd run out is merged with nothing, i.e. moved.
+        merged_bounds.push_back(end);
+
+        // Threads in proportion to the size of this merge.
+        auto size = end - begin;
+        auto parts = std::max<std::size_t>(1, (total > 0) ? threads * size / total : 1);
+        auto a = from + begin;
+        auto b = from + middle;
+        // Split points are found before any thread starts moving items out of the runs.
+        std::vector<std::size_t> splits;
+        for (std::size_t part = 0; part <= parts; ++part) {
+            splits.push_back(co_rank(size * part / parts, a, middle - begin, b, end - middle, comp)); // O(log(n))
+        }
+        for (std::size_t part = 0; part < parts; ++part) {
+            auto out_begin = size * part / parts;
+            auto out_end = size * (part + 1) / parts;
+            auto i1 = splits[part];
+            auto i2 = splits[part + 1];
+            workers.emplace_back([=, &comp]() {
+                std::merge(std::make_move_iterator(a + i1), std::make_move_iterator(a + i2),
+                           std::make_move_iterator(b + (out_begin - i1)), std::make_move_iterator(b + (out_end - i2)),
+                           to + begin + out_begin, comp);
+            });
+        }
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    return merged_bounds;
+}
+
+} // namespace parallelsort_detail
+
+// Estimate of performance: O(n*log(r)/t + r*log(n))
+// Short rationale for estimate: log(r) merge rounds each move all n items split between
+// t threads, and the split points of each round are searched with binary search.
+// Merges r sorted runs [first+bounds[i], first+bounds[i+1]) of the range (bounds start from 0
+// and end at last-first). Equal items of earlier runs stay first.
+template <typename RandomIt, typename Compare>
+void parallel_merge_runs(RandomIt first, RandomIt last, std::vector<std::size_t> bounds, Compare comp,
+                         unsigned int threads)
+{
+    threads = std::max(threads, 1u);
+    std::size_t size = last - first;
+    if (bounds.size() <= 2) {
+        return;
+    }
+
+    // Merging back and forth between the range and a buffer.
+    std::vector<typename std::iterator_traits<RandomIt>::value_type> buffer(size);
+    bool in_buffer = false;
+    while (bounds.size() > 2) {
+        bounds = in_buffer ? parallelsort_detail::merge_round(buffer.begin(), first, bounds, threads, comp)
+                           : parallelsort_detail::merge_round(first, buffer.begin(), bounds, threads, comp);
+        in_buffer = !in_buffer;
+    }
+    if (in_buffer) {
+        std::move(buffer.begin(), buffer.end(), first);
+    }
+}
+
+// Estimate of performance: O(n*log(n)/t + n*log(t))
+// Short rationale for estimate: Each thread sorts n/t items, and log(t) merge rounds each
+// move all n items split between t threads.
+template <typename RandomIt, typename Compare>
+void parallel_sort(RandomIt first, RandomIt last, Compare comp, unsigned int threads)
+{
+    std::size_t size = last - first;
+    threads = static_cast<unsigned int>(std::min<std::size_t>(std::max(threads, 1u), size));
+    if (threads <= 1) {
+        std::stable_sort(first, last, comp);
+        return;
+    }
+
+    std::vector<std::size_t> bounds;
+    for (unsigned int t = 0; t <= threads; ++t) {
+        bounds.push_back(size * t / threads);
+    }
+    {
+        std::vector<std::thread> workers;
+        for (unsigned int t = 0; t < threads; ++t) {
+            workers.emplace_back([&, t]() {
+                std::stable_sort(first + bounds[t], first + bounds[t + 1], comp);
+            });
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+    parallel_merge_runs(first, last, std::move(bounds), comp, threads);
+}
+
+#endif // PARALLELSORT_HH
@@ -0,0 +1,226 @@
+// Parallelwalk.hh
+//
+// Depth first (pre-order) walk of a large tree with a work-stealing pool of threads, for
+// queries which list a whole subtree (Datastructures::get_all_references()).
+//
+// The walk starts in the calling thread and goes parallel only if the subtree has more
+// than sequential_limit nodes. Each thread walks its own part with an explicit stack.
+// When another thread is out of work, the walking thread splits the remaining children of
+// its current node in half and offers the second half as a task. Owners take tasks from
+// the back of their own queue and idle threads steal from the front of others' queues,
+// which hold the largest parts (nearest to the root). Nodes with many children (the hubs
+// of preferential attachment trees) are split repeatedly, so the work spreads evenly.
+//
+// Every thread collects ids to its own segments. A split inserts the segment of the new
+// task (and, the first time at a node, a segment where the splitting thread continues
+// after the node) into a linked list, so that the list stays in pre-order. The segments
+// are concatenated along the list at the end, which gives the same order as a sequential
+// walk, with any number of threads.
+
+#ifndef PARALLELWALK_HH
+#define PARALLELWALK_HH
+
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+template <typename Node, typename Item, typename ChildrenFn, typename ItemFn>
+class ParallelWalk
+{
+public:
+    // children(node) gives the children of a node as a vector of pointers, item(node) what is listed of it.
+    ParallelWalk(ChildrenFn children, ItemFn item, unsigned int threads, std::size_t sequential_limit)
+        : children_(children), item_(item), threads_(threads > 0 ? threads : 1), sequential_limit_(sequential_limit)
+    {
+    }
+
+    // Estimate of performance: O(n/t + t)
+    // Short rationale for estimate: Every node of the subtree is visited once by one of the
+    // t threads. Splits are constant time, and the result is copied once.
+    // Lists all descendants of root (not root itself) in pre-order.
+    std::vector<Item> run(Node const* root)
+    {
+        Segment head;
+        Segment* current = &head;
+        std::vector<Frame> stack{{root, 0, children_(root).size(), nullptr}};
+        if (walk(nullptr, stack, current, (threads_ == 1) ? 0 : sequential_limit_)) {
+            return std::move(head.items);
+        }
+
+        // The calling thread is worker 0 and continues its walk, the others start out of work.
+        workers_ = std::make_unique<Worker[]>(threads_);
+        pending_ = 1;
+        std::vector<std::thread> helpers;
+        for (unsigned int w = 1; w < threads_; ++w) {
+            helpers.emplace_back([this, w]() { work(workers_[w]); });
+        }
+        walk(&workers_[0], stack, current, 0);
+        pending_.fetch_sub(1);
+        work(workers_[0]);
+        for (auto& helper : helpers) {
+            helper.join();
+        }
+
+        std::size_t total = 0;
+        for (Segment const* segment = &head; segment != nullptr; segment = segment->next) {
+            total += segment->items.size();
+        }
+        std::vector<Item> result;
+        result.reserve(total);
+        for (Segment const* segment = &head; segment != nullptr; segment = segment->next) { // O(n)
+            result.insert(result.end(), segment->items.begin(), segment->items.end());
+        }
+        return result;
+    }
+
+private:
+    struct Segment
+    {
+        std::vector<Item> items;
+        Segment* next = nullptr; // Next in pre-order.
+    };
+
+    struct Frame
+    {
+        Node const* node;
+        std::size_t next; // Next child to visit.
+        std::size_t end; // Children from end on have been given to other tasks.
+        Segment* resume; // Where the walk continues after this node, nullptr if in the same segment.
+    };
+
+    // Children begin..end of node, listed into segment.
+    struct Task
+    {
+        Node const* node;
+        std::size_t begin;
+        std::size_t end;
+        Segment* segment;
+    };
+
+    struct alignas(64) Worker
+    {
+        std::mutex mutex; // Protects tasks, which others steal from.
+        std::deque<Task> tasks;
+        std::deque<Segment> segments; // Created by this worker (addresses stay valid).
+    };
+
+    // Walks until the stack is empty (returns true) or limit nodes have been listed
+    // (limit 0 = no limit). Splits work for idle threads if worker is given.
+    bool walk(Worker* worker, std::vector<Frame>& stack, Segment*& current, std::size_t limit)
+    {
+        std::size_t visited = 0;
+        while (!stack.empty()) {
+            auto& frame = stack.back();
+            if (frame.next < frame.end) {
+                if (worker != nullptr && frame.end - frame.next >= 2 && hungry_.load(std::memory_order_relaxed) > 0) {
+                    split(*worker, frame, current);
+                }
+                Node const* child = children_(frame.node)[frame.next++];
+                current->items.push_back(item_(child));
+                stack.push_back({child, 0, children_(child).size(), nullptr}); // frame isn't valid after this.
+                if (limit != 0 && ++visited == limit) {
+                    return false;
+                }
+            }
+            else {
+                if (frame.resume != nullptr) {
+                    current = frame.resume;
+                }
+                stack.pop_back();
+            }
+        }
+        return true;
+    }
+
+    // Gives the second half of the remaining children of frame's node as a new task.
+    void split(Worker& worker, Frame& frame, Segment* current)
+    {
+        auto middle = frame.next + (frame.end - frame.next) / 2;
+        Segment* given = &worker.segments.emplace_back();
+        given->next = current->next;
+        current->next = given;
+        if (frame.resume == nullptr) {
+            Segment* resume = &worker.segments.emplace_back();
+            resume->next = given->next;
+            given->next = resume;
+            frame.resume = resume;
+        }
+        // Otherwise the node was split before, and the earlier given parts follow this one.
+
+        pending_.fetch_add(1);
+        {
+            std::lock_guard<std::mutex> guard(worker.mutex);
+            worker.tasks.push_back({frame.node, middle, frame.end, given});
+        }
+        frame.end = middle;
+    }
+
+    // Runs tasks of its own and stolen ones, until every task is done.
+    void work(Worker& worker)
+    {
+        std::vector<Frame> stack;
+        for (;;) {
+            Task task;
+            if (!take(worker, task)) {
+                hungry_.fetch_add(1);
+                bool found = false;
+                while (!found && pending_.load() != 0) {
+                    found = steal(worker, task);
+                    if (!found) {
+                        std::this_thread::yield();
+                    }
+                }
+                hungry_.fetch_sub(1);
+                if (!found) {
+                    return;
+                }
+            }
+            Segment* current = task.segment;
+            stack.push_back({task.node, task.begin, task.end, nullptr});
+            walk(&worker, stack, current, 0);
+            pending_.fetch_sub(1);
+        }
+    }
+
+    bool take(Worker& worker, Task& task)
+    {
+        std::lock_guard<std::mutex> guard(worker.mutex);
+        if (worker.tasks.empty()) {
+            return false;
+        }
+        task = worker.tasks.back();
+        worker.tasks.pop_back();
+        return true;
+    }
+
+    bool steal(Worker& thief, Task& task)
+    {
+        for (unsigned int w = 0; w < threads_; ++w) {
+            auto& victim = workers_[w];
+            if (&victim == &thief) {
+                continue;
+            }
+            std::lock_guard<std::mutex> guard(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = victim.tasks.front();
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    ChildrenFn children_;
+    ItemFn item_;
+    unsigned int threads_;
+    std::size_t sequential_limit_;
+    std::unique_ptr<Worker[]> workers_;
+    std::atomic<std::size_t> pending_{0}; // Tasks given or running, but not done.
+    std::atomic<unsigned int> hungry_{0}; // Threads looking for work.
+};
+
+#endif // PARALLELWALK_HH
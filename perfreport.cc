@@ -0,0 +1,502 @@
+// Perfreport.cc
+
+#include "perfreport.hh"
+#include "perfstats.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iomanip>
+
+namespace
+{
+// Minimal JSON document model, enough for reading back reports.
+struct JsonValue
+{
+    enum class Type { NUL, BOOL, NUMBER, STRING, ARRAY, OBJECT };
+
+    Type type = Type::NUL;
+    double number = 0;
+    std::string string;
+    std::vector<JsonValue> array;
+    std::vector<std::pair<std::string, JsonValue>> object;
+
+    // Returns nullptr if this is not an object or there's no such member.
+    JsonValue const* member(std::string const& name) const
+    {
+        for (auto const& [key, value] : object) {
+            if (key == name) { return &value; }
+        }
+        return nullptr;
+    }
+};
+
+class JsonParser
+{
+public:
+    JsonParser(std::string const& data) : begin_(data.data()), pos_(data.data()), end_(data.data() + data.size()) {}
+
+    bool parse(JsonValue& value, std::string& error)
+    {
+        if (!parse_value(value, 0)) {
+            error = "Invalid JSON at character " + std::to_string(pos_ - begin_);
+            return false;
+        }
+        skip_space();
+        if (pos_ != end_) {
+            error = "Extra data after JSON value";
+            return false;
+        }
+        return true;
+    }
+
+private:
+    // Nesting limit, so that malicious input can't overflow the stack.
+    static unsigned int const MAX_DEPTH = 64;
+
+    void skip_space()
+    {
+        while (pos_ != end_ && (*pos_ == ' ' || *pos_ == '\t' || *pos_ == '\n' || *pos_ == '\r')) { ++pos_; }
+    }
+
+    bool literal(char const* text)
+    {
+        auto length = std::char_traits<char>::length(text);
+        if (static_cast<std::size_t>(end_ - pos_) < length || std::string(pos_, length) != text) { return false; }
+        pos_ += length;
+        return true;
+    }
+
+    bool parse_string(std::string& value)
+    {
+        if (pos_ == end_ || *pos_ != '"') { return false; }
+        ++pos_;
+        value.clear();
+        while (pos_ != end_ && *pos_ != '"') {
+            if (*pos_ == '\\') {
+                if (++pos_ == end_) { return false; }
+                switch (*pos_) {
+                case 'n': value.push_back('\n'); break;
+                case 't': value.push_back('\t'); break;
+                case 'r': value.push_back('\r'); break;
+                case 'b': value.push_back('\b'); break;
+                case 'f': value.push_back('\f'); break;
+                case 'u': {
+                    // Reports only contain ASCII, other characters are replaced
+                    if (end_ - pos_ < 5) { return false; }
+                    unsigned int code = std::strtoul(std::string(pos_ + 1, 4).c_str(), nullptr, 16);
+                    value.push_back(code < 0x80 ? static_cast<char>(code) : '?');
+                    pos_ += 4;
+                    break;
+                }
+                default: value.push_back(*pos_); break;
+                }
+            }
+            else {
+                value.push_back(*pos_);
+            }
+            ++pos_;
+        }
+        if (pos_ == end_) { return false; }
+        ++pos_; // Closing quote
+        return true;
+    }
+
+    bool parse_value(JsonValue& value, unsigned int depth)
+    {
+        skip_space();
+        if (pos_ == end_ || depth > MAX_DEPTH) { return false; }
+
+        switch (*pos_) {
+        case '"':
+            value.type = JsonValue::Type::STRING;
+            return parse_string(value.string);
+        case '[': {
+            ++pos_;
+            value.type = JsonValue::Type::ARRAY;
+            skip_space();
+            if (pos_ != end_ && *pos_ == ']') { ++pos_; return true; }
+            while (true) {
+                value.array.emplace_back();
+                if (!parse_value(value.array.back(), depth + 1)) { return false; }
+                skip_space();
+                if (pos_ == end_) { return false; }
+                if (*pos_ == ']') { ++pos_; return true; }
+                if (*pos_ != ',') { return false; }
+                ++pos_;
+            }
+        }
+        case '{': {
+            ++pos_;
+            value.type = JsonValue::Type::OBJECT;
+            skip_space();
+            if (pos_ != end_ && *pos_ == '}') { ++pos_; return true; }
+            while (true) {
+                std::string key;
+                skip_space();
+                if (!parse_string(key)) { return false; }
+                skip_space();
+                if (pos_ == end_ || *pos_ != ':') { return false; }
+                ++pos_;
+                value.object.emplace_back(std::move(key), JsonValue());
+                if (!parse_value(value.object.back().second, depth + 1)) { return false; }
+                skip_space();
+                if (pos_ == end_) { return false; }
+                if (*pos_ == '}') { ++pos_; return true; }
+                if (*pos_ != ',') { return false; }
+                ++pos_;
+            }
+        }
+        case 't':
+            value.type = JsonValue::Type::BOOL;
+            value.number = 1;
+            return literal("true");
+        case 'f':
+            value.type = JsonValue::Type::BOOL;
+            return literal("false");
+        case 'n':
+            return literal("null");
+        default: {
+            std::string number(pos_, std::min<std::ptrdiff_t>(end_ - pos_, 64));
+            char* number_end = nullptr;
+            value.type = JsonValue::Type::NUMBER;
+            value.number = std::strtod(number.c_str(), &number_end);
+            if (number_end == number.c_str()) { return false; }
+            pos_ += number_end - number.c_str();
+            return true;
+        }
+        }
+    }
+
+    char const* begin_;
+    char const* pos_;
+    char const* end_;
+};
+
+double number_member(JsonValue const& object, std::string const& name)
+{
+    auto value = object.member(name);
+    return (value && value->type == JsonValue::Type::NUMBER) ? value->number : 0;
+}
+
+std::string string_member(JsonValue const& object, std::string const& name)
+{
+    auto value = object.member(name);
+    return (value && value->type == JsonValue::Type::STRING) ? value->string : std::string();
+}
+
+void write_json_string(std::ostream& output, std::string const& str)
+{
+    output << '"';
+    for (char c : str) {
+        if (c == '"' || c == '\\') { output << '\\' << c; }
+        else if (static_cast<unsigned char>(c) < 0x20) { output << ' '; }
+        else { output << c; }
+    }
+    output << '"';
+}
+
+// Sample variance of the means of runs (0 with a single run).
+double run_variance(std::vector<double> const& means)
+{
+    if (means.size() < 2) { return 0; }
+    double mean = 0;
+    for (double value : means) { mean += value; }
+    mean /= means.size();
+    double squares = 0;
+    for (double value : means) { squares += (value - mean) * (value - mean); }
+    return squares / (means.size() - 1);
+}
+
+// 97.5% quantile of Student's t distribution, i.e. the multiplier of the standard error
+// for a two-sided 95% interval. Degrees of freedom are rounded down (a wider interval).
+double t_quantile_975(double df)
+{
+    static double const table[] = {12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+                                   2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+                                   2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042};
+    if (df < 1) { df = 1; }
+    if (df < 31) { return table[static_cast<std::size_t>(df) - 1]; }
+    // Cornish-Fisher expansion around the normal quantile, accurate to 3 decimals here
+    double const z = 1.959964;
+    return z + (z * z * z + z) / (4 * df) + (5 * std::pow(z, 5) + 16 * z * z * z + 3 * z) / (96 * df * df);
+}
+}
+
+void PerfReport::add_command_result(std::string const& command, unsigned int n, LatencyHistogram const& latencies)
+{
+    CommandResult result;
+    result.command = command;
+    result.n = n;
+    result.calls = latencies.count();
+    result.mean_us = latencies.mean() / 1000.0;
+    result.stddev_us = latencies.stddev() / 1000.0;
+    result.p50_us = latencies.percentile(50) / 1000.0;
+    result.p90_us = latencies.percentile(90) / 1000.0;
+    result.p99_us = latencies.percentile(99) / 1000.0;
+    result.max_us = latencies.max() / 1000.0;
+    if (result.calls > 0) { result.run_means_us.push_back(result.mean_us); }
+    result.latencies = std::make_shared<LatencyHistogram const>(latencies);
+    command_results.push_back(result);
+}
+
+void PerfReport::merge_run(PerfReport const& run)
+{
+    if (commands.empty()) {
+        *this = run;
+        return;
+    }
+
+    for (auto const& other : run.size_results) {
+        auto pos = std::find_if(size_results.begin(), size_results.end(), [&](auto const& r){ return r.n == other.n; });
+        if (pos == size_results.end()) {
+            size_results.push_back(other);
+        }
+        else {
+            // Sums over runs, like the times of a single longer run
+            pos->add_sec += other.add_sec;
+            pos->cmds_sec += other.cmds_sec;
+            pos->total_sec += other.total_sec;
+        }
+    }
+
+    for (auto const& other : run.command_results) {
+        auto pos = std::find_if(command_results.begin(), command_results.end(),
+                                [&](auto const& r){ return r.command == other.command && r.n == other.n; });
+        if (pos == command_results.end()) {
+            command_results.push_back(other);
+            continue;
+        }
+        if (other.calls == 0) { continue; }
+        if (pos->calls == 0) {
+            *pos = other;
+            continue;
+        }
+
+        // Deviation of all calls pooled (parallel algorithm)
+        double count1 = pos->calls;
+        double count2 = other.calls;
+        double count = count1 + count2;
+        double delta = other.mean_us - pos->mean_us;
+        double m2 = pos->stddev_us * pos->stddev_us * std::max(count1 - 1, 0.0)
+                + other.stddev_us * other.stddev_us * std::max(count2 - 1, 0.0)
+                + delta * delta * count1 * count2 / count;
+        pos->stddev_us = (count > 1) ? std::sqrt(m2 / (count - 1)) : 0;
+        pos->calls += other.calls;
+
+        // Each run counts once in the mean, like in the confidence interval of compare()
+        pos->run_means_us.insert(pos->run_means_us.end(), other.run_means_us.begin(), other.run_means_us.end());
+        double sum = 0;
+        for (double mean : pos->run_means_us) { sum += mean; }
+        pos->mean_us = sum / pos->run_means_us.size();
+
+        // Percentiles of different runs can't be averaged, they are taken from the merged
+        // histogram. Results read from a report have no histogram, and keep their own.
+        if (pos->latencies && other.latencies) {
+            auto merged = std::make_shared<LatencyHistogram>(*pos->latencies);
+            merged->merge(*other.latencies);
+            pos->p50_us = merged->percentile(50) / 1000.0;
+            pos->p90_us = merged->percentile(90) / 1000.0;
+            pos->p99_us = merged->percentile(99) / 1000.0;
+            pos->latencies = std::move(merged);
+        }
+        pos->max_us = std::max(pos->max_us, other.max_us);
+    }
+
+    if (stopped.empty()) { stopped = run.stopped; }
+}
+
+void PerfReport::write_json(std::ostream& output) const
+{
+    auto old_precision = output.precision(9);
+
+    output << "{" << std::endl;
+    output << "  \"commands\": [";
+    for (std::size_t i = 0; i < commands.size(); ++i) {
+        if (i > 0) { output << ", "; }
+        write_json_string(output, commands[i]);
+    }
+    output << "]," << std::endl;
+    output << "  \"weights\": [";
+    for (std::size_t i = 0; i < weights.size(); ++i) {
+        output << (i > 0 ? ", " : "") << weights[i];
+    }
+    output << "]," << std::endl;
+    output << "  \"zipf\": " << zipf << "," << std::endl;
+    output << "  \"topology\": ";
+    write_json_string(output, topology);
+    output << "," << std::endl;
+    output << "  \"forest_roots\": " << forest_roots << "," << std::endl;
+    output << "  \"overhead_ns\": " << overhead_ns << "," << std::endl;
+    output << "  \"timeout\": " << timeout << "," << std::endl;
+    output << "  \"repeat_count\": " << repeat_count << "," << std::endl;
+    output << "  \"sizes\": [";
+    for (std::size_t i = 0; i < sizes.size(); ++i) {
+        output << (i > 0 ? ", " : "") << sizes[i];
+    }
+    output << "]," << std::endl;
+    output << "  \"stopped\": ";
+    write_json_string(output, stopped);
+    output << "," << std::endl;
+
+    output << "  \"size_results\": [";
+    for (std::size_t i = 0; i < size_results.size(); ++i) {
+        auto const& r = size_results[i];
+        output << (i > 0 ? "," : "") << std::endl
+               << "    {\"n\": " << r.n << ", \"add_sec\": " << r.add_sec << ", \"cmds_sec\": " << r.cmds_sec
+               << ", \"total_sec\": " << r.total_sec << "}";
+    }
+    output << std::endl << "  ]," << std::endl;
+
+    output << "  \"command_results\": [";
+    for (std::size_t i = 0; i < command_results.size(); ++i) {
+        auto const& r = command_results[i];
+        output << (i > 0 ? "," : "") << std::endl << "    {\"command\": ";
+        write_json_string(output, r.command);
+        output << ", \"n\": " << r.n << ", \"calls\": " << r.calls << ", \"mean_us\": " << r.mean_us
+               << ", \"stddev_us\": " << r.stddev_us << ", \"p50_us\": " << r.p50_us << ", \"p90_us\": " << r.p90_us
+               << ", \"p99_us\": " << r.p99_us << ", \"max_us\": " << r.max_us << ", \"run_means_us\": [";
+        for (std::size_t j = 0; j < r.run_means_us.size(); ++j) {
+            output << (j > 0 ? ", " : "") << r.run_means_us[j];
+        }
+        output << "]}";
+    }
+    output << std::endl << "  ]" << std::endl;
+    output << "}" << std::endl;
+
+    output.precision(old_precision);
+}
+
+void PerfReport::write_csv(std::ostream& output) const
+{
+    auto old_precision = output.precision(9);
+
+    // One row per command and N, times of the N repeated on each row
+    output << "command,n,calls,mean_us,stddev_us,p50_us,p90_us,p99_us,max_us,add_sec,cmds_sec,total_sec" << std::endl;
+    for (auto const& r : command_results) {
+        auto size = std::find_if(size_results.begin(), size_results.end(), [&](auto const& s){ return s.n == r.n; });
+        output << r.command << "," << r.n << "," << r.calls << "," << r.mean_us << "," << r.stddev_us << ","
+               << r.p50_us << "," << r.p90_us << "," << r.p99_us << "," << r.max_us << ",";
+        if (size != size_results.end()) {
+            output << size->add_sec << "," << size->cmds_sec << "," << size->total_sec;
+        }
+        else {
+            output << ",,";
+        }
+        output << std::endl;
+    }
+
+    output.precision(old_precision);
+}
+
+bool PerfReport::read_json(std::string const& data, PerfReport& report, std::string& error)
+{
+    JsonValue root;
+    JsonParser parser(data);
+    if (!parser.parse(root, error)) { return false; }
+    if (root.type != JsonValue::Type::OBJECT) {
+        error = "Report is not a JSON object";
+        return false;
+    }
+
+    report = PerfReport();
+    if (auto commands = root.member("commands")) {
+        for (auto const& command : commands->array) { report.commands.push_back(command.string); }
+    }
+    if (auto weights = root.member("weights")) {
+        for (auto const& weight : weights->array) { report.weights.push_back(static_cast<unsigned int>(weight.number)); }
+    }
+    report.zipf = number_member(root, "zipf");
+    report.topology = string_member(root, "topology");
+    report.forest_roots = static_cast<unsigned long>(number_member(root, "forest_roots"));
+    if (auto sizes = root.member("sizes")) {
+        for (auto const& size : sizes->array) { report.sizes.push_back(static_cast<unsigned int>(size.number)); }
+    }
+    report.overhead_ns = static_cast<std::uint64_t>(number_member(root, "overhead_ns"));
+    report.timeout = static_cast<unsigned int>(number_member(root, "timeout"));
+    report.repeat_count = static_cast<unsigned int>(number_member(root, "repeat_count"));
+    report.stopped = string_member(root, "stopped");
+
+    if (auto results = root.member("size_results")) {
+        for (auto const& r : results->array) {
+            SizeResult result;
+            result.n = static_cast<unsigned int>(number_member(r, "n"));
+            result.add_sec = number_member(r, "add_sec");
+            result.cmds_sec = number_member(r, "cmds_sec");
+            result.total_sec = number_member(r, "total_sec");
+            report.size_results.push_back(result);
+        }
+    }
+    if (auto results = root.member("command_results")) {
+        for (auto const& r : results->array) {
+            CommandResult result;
+            result.command = string_member(r, "command");
+            result.n = static_cast<unsigned int>(number_member(r, "n"));
+            result.calls = static_cast<std::uint64_t>(number_member(r, "calls"));
+            result.mean_us = number_member(r, "mean_us");
+            result.stddev_us = number_member(r, "stddev_us");
+            result.p50_us = number_member(r, "p50_us");
+            result.p90_us = number_member(r, "p90_us");
+            result.p99_us = number_member(r, "p99_us");
+            result.max_us = number_member(r, "max_us");
+            if (auto means = r.member("run_means_us")) {
+                for (auto const& mean : means->array) { result.run_means_us.push_back(mean.number); }
+            }
+            // Older reports are of a single run
+            if (result.run_means_us.empty() && result.calls > 0) { result.run_means_us.push_back(result.mean_us); }
+            report.command_results.push_back(result);
+        }
+    }
+
+    if (report.commands.empty() || report.sizes.empty()) {
+        error = "Report has no commands or sizes";
+        return false;
+    }
+    return true;
+}
+
+std::vector<PerfReport::Comparison> PerfReport::compare(PerfReport const& baseline, PerfReport const& current,
+                                                        double min_change)
+{
+    std::vector<Comparison> comparisons;
+    for (auto const& base : baseline.command_results) {
+        auto cur = std::find_if(current.command_results.begin(), current.command_results.end(),
+                                [&](auto const& r){ return r.command == base.command && r.n == base.n; });
+        if (cur == current.command_results.end() || base.run_means_us.empty() || cur->run_means_us.empty()) { continue; }
+
+        Comparison comparison;
+        comparison.command = base.command;
+        comparison.n = base.n;
+        comparison.baseline_us = base.mean_us;
+        comparison.current_us = cur->mean_us;
+        double difference = cur->mean_us - base.mean_us;
+
+        // Standard error of the difference and its degrees of freedom, over runs
+        double runs1 = base.run_means_us.size();
+        double runs2 = cur->run_means_us.size();
+        double variance1 = run_variance(base.run_means_us) / runs1;
+        double variance2 = run_variance(cur->run_means_us) / runs2;
+        double error = 0;
+        if (runs1 >= 2 && runs2 >= 2) {
+            // Welch-Satterthwaite
+            double variance = variance1 + variance2;
+            double denominator = variance1 * variance1 / (runs1 - 1) + variance2 * variance2 / (runs2 - 1);
+            double df = (denominator > 0) ? variance * variance / denominator : runs1 + runs2 - 2;
+            error = t_quantile_975(df) * std::sqrt(variance);
+            comparison.has_interval = true;
+        }
+        else if (runs1 + runs2 >= 3) {
+            // A single run has no variance of its own, the other one's is used for both
+            double variance = (runs1 >= 2) ? variance1 * runs1 : variance2 * runs2;
+            error = t_quantile_975(std::max(runs1, runs2) - 1) * std::sqrt(variance * (1 / runs1 + 1 / runs2));
+            comparison.has_interval = true;
+        }
+        comparison.ci_low_us = difference - error;
+        comparison.ci_high_us = difference + error;
+        comparison.change_percent = (base.mean_us > 0) ? 100.0 * difference / base.mean_us : 0;
+        comparison.slower = comparison.has_interval && comparison.ci_low_us > 0 && comparison.change_percent > 100.0 * min_change;
+        comparison.faster = comparison.has_interval && comparison.ci_high_us < 0 && comparison.change_percent < -100.0 * min_change;
+        comparisons.push_back(comparison);
+    }
+    return comparisons;
+}
@@ -0,0 +1,106 @@
+// Perfreport.hh
+//
+// Machine-readable perftest results and comparison against a saved baseline.
+//
+// A report holds the perftest parameters, the add/cmds/total times of every N and
+// per command latency statistics of every N. It can be written as JSON or CSV and
+// read back from JSON (the baseline of perfcompare).
+//
+// Comparison treats each run as one sample, because calls of the same run share its
+// data set and machine state and aren't independent. The difference of the mean
+// latencies gets a 95% confidence interval from the means of the runs (Student's t),
+// and a command/N is a significant slowdown only if the whole interval is above zero
+// and the mean is also slower by at least a minimum relative amount.
+
+#ifndef PERFREPORT_HH
+#define PERFREPORT_HH
+
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+class LatencyHistogram;
+
+class PerfReport
+{
+public:
+    // Times of one N.
+    struct SizeResult
+    {
+        unsigned int n = 0;
+        double add_sec = 0;
+        double cmds_sec = 0;
+        double total_sec = 0;
+    };
+
+    // Latency statistics of one command with one N, in microseconds.
+    struct CommandResult
+    {
+        std::string command;
+        unsigned int n = 0;
+        std::uint64_t calls = 0;
+        double mean_us = 0;
+        double stddev_us = 0;
+        double p50_us = 0;
+        double p90_us = 0;
+        double p99_us = 0;
+        double max_us = 0;
+        std::vector<double> run_means_us; // Mean of each run
+        std::shared_ptr<LatencyHistogram const> latencies; // Of all runs, not saved in reports
+    };
+
+    struct Comparison
+    {
+        std::string command;
+        unsigned int n = 0;
+        double baseline_us = 0;
+        double current_us = 0;
+        double change_percent = 0;
+        bool has_interval = false; // Runs have to vary to estimate the interval (3 runs at least)
+        double ci_low_us = 0; // 95% confidence interval of current - baseline
+        double ci_high_us = 0;
+        bool slower = false; // Significant slowdown
+        bool faster = false; // Significant speedup
+    };
+
+    std::vector<std::string> commands;
+    std::vector<unsigned int> weights; // Relative frequencies of commands, empty if chosen uniformly
+    double zipf = 0; // Skew of the IDs given to commands, 0 if uniform
+    std::string topology; // Reference topology of the generated data ("binary", "chain", ...)
+    unsigned long forest_roots = 0; // Number of trees, if topology is "forest"
+    unsigned int timeout = 0;
+    unsigned int repeat_count = 0;
+    std::uint64_t overhead_ns = 0; // Harness time per call, already subtracted from latencies
+    std::vector<unsigned int> sizes;
+    std::string stopped; // Reason if the test didn't run to the end (e.g. "Timeout!")
+
+    std::vector<SizeResult> size_results;
+    std::vector<CommandResult> command_results;
+
+    void add_command_result(std::string const& command, unsigned int n, LatencyHistogram const& latencies);
+
+    // Adds the results of another run of the same suite to this one. The mean is the
+    // mean of the runs' means (which are also kept separately), the deviation is pooled
+    // over all calls and the percentiles come from the merged latency histograms.
+    void merge_run(PerfReport const& run);
+
+    void write_json(std::ostream& output) const;
+    void write_csv(std::ostream& output) const;
+
+    // Estimate of performance: O(k), k being the length of the data
+    // Short rationale for estimate: Recursive descent parser looks at every character once.
+    static bool read_json(std::string const& data, PerfReport& report, std::string& error);
+
+    // Estimate of performance: O(b*c)
+    // Short rationale for estimate: Every baseline result b is looked up linearly from the
+    // current results c (both are small).
+    // Results which are only in one of the reports are left out. If both reports have
+    // several runs, their variances are estimated separately (Welch), otherwise the run
+    // variance of the one with several runs is used for both.
+    static std::vector<Comparison> compare(PerfReport const& baseline, PerfReport const& current,
+                                           double min_change = 0.05);
+};
+
+#endif // PERFREPORT_HH
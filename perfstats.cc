@@ -0,0 +1,440 @@
+// Perfstats.cc
+
+#include "perfstats.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+#include <string>
+
+namespace
+{
+// Updated by the operator new replacements below, but only while counting is on, so that
+// an allocation costs nothing more than a load of the flag otherwise. Relaxed atomics,
+// because only the totals matter, not the order of updates between threads.
+std::atomic<bool> counting{false};
+std::atomic<std::uint64_t> allocation_count{0};
+std::atomic<std::uint64_t> allocation_bytes{0};
+
+void count_allocation(std::size_t size)
+{
+    if (counting.load(std::memory_order_relaxed)) {
+        allocation_count.fetch_add(1, std::memory_order_relaxed);
+        allocation_bytes.fetch_add(size, std::memory_order_relaxed);
+    }
+}
+
+void* counted_alloc(std::size_t size)
+{
+    void* ptr = std::malloc(size == 0 ? 1 : size);
+    if (ptr) { count_allocation(size); }
+    return ptr;
+}
+
+void* counted_aligned_alloc(std::size_t size, std::align_val_t alignment)
+{
+    void* ptr = nullptr;
+    auto align = std::max(static_cast<std::size_t>(alignment), sizeof(void*));
+    if (posix_memalign(&ptr, align, size == 0 ? 1 : size) != 0) { return nullptr; }
+    count_allocation(size);
+    return ptr;
+}
+
+unsigned int highest_bit(std::uint64_t value)
+{
+    return 63 - static_cast<unsigned int>(__builtin_clzll(value));
+}
+
+// log1p(x)/x and expm1(x)/x, with Taylor series near zero where the divisions lose precision.
+double log1p_ratio(double x)
+{
+    if (std::abs(x) > 1e-8) { return std::log1p(x) / x; }
+    return 1 - x * (0.5 - x * (1.0 / 3.0 - 0.25 * x));
+}
+
+double expm1_ratio(double x)
+{
+    if (std::abs(x) > 1e-8) { return std::expm1(x) / x; }
+    return 1 + x * 0.5 * (1 + x * (1.0 / 3.0) * (1 + 0.25 * x));
+}
+}
+
+LatencyHistogram::LatencyHistogram()
+{
+    reset();
+}
+
+void LatencyHistogram::record(std::uint64_t value)
+{
+    ++counts_[bucket_index(value)];
+    if (count_ == 0 || value < min_) { min_ = value; }
+    if (value > max_) { max_ = value; }
+    ++count_;
+    sum_ += value;
+    sum_squares_ += static_cast<long double>(value) * value;
+}
+
+void LatencyHistogram::reset()
+{
+    counts_.fill(0);
+    count_ = 0;
+    min_ = 0;
+    max_ = 0;
+    sum_ = 0;
+    sum_squares_ = 0;
+}
+
+void LatencyHistogram::merge(LatencyHistogram const& other)
+{
+    if (other.count_ == 0) { return; }
+    for (unsigned int i = 0; i < BUCKET_COUNT; ++i) {
+        counts_[i] += other.counts_[i];
+    }
+    min_ = (count_ == 0) ? other.min_ : std::min(min_, other.min_);
+    max_ = std::max(max_, other.max_);
+    count_ += other.count_;
+    sum_ += other.sum_;
+    sum_squares_ += other.sum_squares_;
+}
+
+std::uint64_t LatencyHistogram::count() const
+{
+    return count_;
+}
+
+std::uint64_t LatencyHistogram::min() const
+{
+    return min_;
+}
+
+std::uint64_t LatencyHistogram::max() const
+{
+    return max_;
+}
+
+double LatencyHistogram::mean() const
+{
+    if (count_ == 0) { return 0; }
+    return static_cast<double>(sum_ / count_);
+}
+
+double LatencyHistogram::stddev() const
+{
+    if (count_ < 2) { return 0; }
+    long double mean = sum_ / count_;
+    long double variance = (sum_squares_ - count_ * mean * mean) / (count_ - 1);
+    return static_cast<double>(std::sqrt(std::max<long double>(variance, 0)));
+}
+
+std::uint64_t LatencyHistogram::percentile(double percent) const
+{
+    if (count_ == 0) { return 0; }
+
+    // Rank of the value (1..count), rounded up like HdrHistogram does.
+    auto rank = static_cast<std::uint64_t>(std::ceil(percent / 100.0 * count_));
+    rank = std::clamp<std::uint64_t>(rank, 1, count_);
+
+    std::uint64_t seen = 0;
+    for (unsigned int i = 0; i < BUCKET_COUNT; ++i) {
+        seen += counts_[i];
+        if (seen >= rank) {
+            return std::clamp(bucket_highest_value(i), min_, max_);
+        }
+    }
+    return max_;
+}
+
+unsigned int LatencyHistogram::bucket_index(std::uint64_t value)
+{
+    if (value < 2 * SUB_BUCKETS) { return static_cast<unsigned int>(value); }
+
+    // value >> shift is in [SUB_BUCKETS, 2*SUB_BUCKETS)
+    unsigned int shift = highest_bit(value) - SUB_BUCKET_BITS;
+    return shift * SUB_BUCKETS + static_cast<unsigned int>(value >> shift);
+}
+
+std::uint64_t LatencyHistogram::bucket_highest_value(unsigned int index)
+{
+    if (index < 2 * SUB_BUCKETS) { return index; }
+
+    unsigned int shift = index / SUB_BUCKETS - 1;
+    std::uint64_t sub = SUB_BUCKETS + index % SUB_BUCKETS;
+    return ((sub + 1) << shift) - 1;
+}
+
+char const* ComplexityFit::class_name(Class complexity)
+{
+    switch (complexity) {
+    case Class::CONSTANT: return "1";
+    case Class::LOG_N: return "log n";
+    case Class::N: return "n";
+    case Class::N_LOG_N: return "n log n";
+    case Class::N_SQUARED: return "n^2";
+    default: return "?";
+    }
+}
+
+ComplexityFit::Class ComplexityFit::class_from_name(std::string const& name)
+{
+    for (Class complexity : {Class::CONSTANT, Class::LOG_N, Class::N, Class::N_LOG_N, Class::N_SQUARED}) {
+        if (name == class_name(complexity)) { return complexity; }
+    }
+    return Class::UNKNOWN;
+}
+
+void ComplexityFit::add(double n, double time)
+{
+    if (n <= 0 || time <= 0) { return; }
+    log_n_.push_back(std::log(n));
+    log_time_.push_back(std::log(time));
+    min_n_ = (log_n_.size() == 1) ? n : std::min(min_n_, n);
+    max_n_ = std::max(max_n_, n);
+}
+
+std::size_t ComplexityFit::points() const
+{
+    return log_n_.size();
+}
+
+bool ComplexityFit::exponent(double& slope) const
+{
+    if (log_n_.size() < 2 || min_n_ == max_n_) { return false; }
+
+    double count = static_cast<double>(log_n_.size());
+    double sum_x = 0;
+    double sum_y = 0;
+    double sum_xx = 0;
+    double sum_xy = 0;
+    for (std::size_t i = 0; i < log_n_.size(); ++i) {
+        sum_x += log_n_[i];
+        sum_y += log_time_[i];
+        sum_xx += log_n_[i] * log_n_[i];
+        sum_xy += log_n_[i] * log_time_[i];
+    }
+    slope = (count * sum_xy - sum_x * sum_y) / (count * sum_xx - sum_x * sum_x);
+    return true;
+}
+
+double ComplexityFit::class_slope(Class complexity) const
+{
+    // log n is clamped to 1 so that tiny n don't give log(log(n)) <= 0
+    auto log_growth = [this](double base_exponent, bool log_factor) {
+        double lo = std::log(min_n_);
+        double hi = std::log(max_n_);
+        if (hi <= lo) { return base_exponent; }
+        double growth = base_exponent * (hi - lo);
+        if (log_factor) { growth += std::log(std::max(hi, 1.0)) - std::log(std::max(lo, 1.0)); }
+        return growth / (hi - lo);
+    };
+
+    switch (complexity) {
+    case Class::CONSTANT: return 0;
+    case Class::LOG_N: return log_growth(0, true);
+    case Class::N: return 1;
+    case Class::N_LOG_N: return log_growth(1, true);
+    case Class::N_SQUARED: return 2;
+    default: return 0;
+    }
+}
+
+ComplexityFit::Class ComplexityFit::best_class() const
+{
+    double slope = 0;
+    if (!exponent(slope)) { return Class::UNKNOWN; }
+
+    Class best = Class::UNKNOWN;
+    double best_diff = 0;
+    for (Class complexity : {Class::CONSTANT, Class::LOG_N, Class::N, Class::N_LOG_N, Class::N_SQUARED}) {
+        double diff = std::abs(slope - class_slope(complexity));
+        if (best == Class::UNKNOWN || diff < best_diff) {
+            best = complexity;
+            best_diff = diff;
+        }
+    }
+    return best;
+}
+
+bool ComplexityFit::disagrees(Class expected, double tolerance) const
+{
+    double slope = 0;
+    if (expected == Class::UNKNOWN || !exponent(slope)) { return false; }
+    return slope > class_slope(expected) + tolerance;
+}
+
+void MemoryStats::set_counting(bool on)
+{
+    counting.store(on, std::memory_order_relaxed);
+}
+
+bool MemoryStats::counting_allocations()
+{
+    return counting.load(std::memory_order_relaxed);
+}
+
+MemoryStats::Allocations MemoryStats::allocations()
+{
+    return {allocation_count.load(std::memory_order_relaxed), allocation_bytes.load(std::memory_order_relaxed)};
+}
+
+bool MemoryStats::resident_set(std::uint64_t& current, std::uint64_t& peak)
+{
+    std::ifstream status("/proc/self/status");
+    if (!status) { return false; }
+
+    bool found_current = false;
+    bool found_peak = false;
+    std::string line;
+    while (std::getline(status, line)) {
+        // Lines are like "VmRSS:     1234 kB"
+        if (line.compare(0, 6, "VmRSS:") == 0) {
+            current = std::strtoull(line.c_str() + 6, nullptr, 10) * 1024;
+            found_current = true;
+        }
+        else if (line.compare(0, 6, "VmHWM:") == 0) {
+            peak = std::strtoull(line.c_str() + 6, nullptr, 10) * 1024;
+            found_peak = true;
+        }
+    }
+    return found_current && found_peak;
+}
+
+bool MemoryStats::reset_peak_resident_set()
+{
+    std::ofstream clear_refs("/proc/self/clear_refs");
+    if (!clear_refs) { return false; }
+    clear_refs << "5" << std::flush; // 5 = reset peak RSS
+    return static_cast<bool>(clear_refs);
+}
+
+ZipfDistribution::ZipfDistribution(double s) : s_(s > 0 ? s : 0)
+{
+}
+
+double ZipfDistribution::skew() const
+{
+    return s_;
+}
+
+void ZipfDistribution::set_n(std::uint64_t n)
+{
+    n_ = n;
+    h_integral_x1_ = h_integral(1.5) - 1;
+    h_integral_n_ = h_integral(n + 0.5);
+    threshold_ = 2 - h_integral_inverse(h_integral(2.5) - h(2));
+}
+
+bool ZipfDistribution::try_sample(double u, std::uint64_t& rank) const
+{
+    // Ranks are 1..n here, an area under the hat function is picked and inverted.
+    double area = h_integral_n_ + u * (h_integral_x1_ - h_integral_n_);
+    double x = h_integral_inverse(area);
+    double k = std::floor(x + 0.5);
+    if (k < 1) { k = 1; }
+    else if (k > n_) { k = n_; }
+
+    if (k - x <= threshold_ || area >= h_integral(k + 0.5) - h(k)) {
+        rank = static_cast<std::uint64_t>(k) - 1;
+        return true;
+    }
+    return false;
+}
+
+double ZipfDistribution::h(double x) const
+{
+    return std::exp(-s_ * std::log(x));
+}
+
+double ZipfDistribution::h_integral(double x) const
+{
+    double log_x = std::log(x);
+    return expm1_ratio((1 - s_) * log_x) * log_x;
+}
+
+double ZipfDistribution::h_integral_inverse(double x) const
+{
+    double t = x * (1 - s_);
+    if (t < -1) { t = -1; } // Limited by rounding errors
+    return std::exp(log1p_ratio(t) * x);
+}
+
+// Replacements of the global allocation functions. Everything allocated with new
+// (including standard containers) goes through these.
+
+// As the standard requires, a failed allocation calls the new handler (which may free
+// memory) and tries again, and bad_alloc is thrown only when there is no handler.
+
+void* operator new(std::size_t size)
+{
+    for (;;) {
+        if (void* ptr = counted_alloc(size)) { return ptr; }
+        auto handler = std::get_new_handler();
+        if (!handler) { throw std::bad_alloc(); }
+        handler();
+    }
+}
+
+void* operator new[](std::size_t size)
+{
+    return operator new(size);
+}
+
+void* operator new(std::size_t size, std::nothrow_t const&) noexcept
+{
+    try {
+        return operator new(size);
+    }
+    catch (...) {
+        return nullptr;
+    }
+}
+
+void* operator new[](std::size_t size, std::nothrow_t const&) noexcept
+{
+    return operator new(size, std::nothrow);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment)
+{
+    for (;;) {
+        if (void* ptr = counted_aligned_alloc(size, alignment)) { return ptr; }
+        auto handler = std::get_new_handler();
+        if (!handler) { throw std::bad_alloc(); }
+        handler();
+    }
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment)
+{
+    return operator new(size, alignment);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment, std::nothrow_t const&) noexcept
+{
+    try {
+        return operator new(size, alignment);
+    }
+    catch (...) {
+        return nullptr;
+    }
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment, std::nothrow_t const&) noexcept
+{
+    return operator new(size, alignment, std::nothrow);
+}
+
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete[](void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::size_t) noexcept { std::free(ptr); }
+void operator delete[](void* ptr, std::size_t) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::nothrow_t const&) noexcept { std::free(ptr); }
+void operator delete[](void* ptr, std::nothrow_t const&) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::align_val_t) noexcept { std::free(ptr); }
+void operator delete[](void* ptr, std::align_val_t) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept { std::free(ptr); }
+void operator delete[](void* ptr, std::size_t, std::align_val_t) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::align_val_t, std::nothrow_t const&) noexcept { std::free(ptr); }
+void operator delete[](void* ptr, std::align_val_t, std::nothrow_t const&) noexcept { std::free(ptr); }
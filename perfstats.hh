@@ -0,0 +1,182 @@
+// Perfstats.hh
+//
+// Statistics helpers for performance tests.
+//
+// LatencyHistogram records individual call durations (nanoseconds) into
+// logarithmic buckets in the style of HdrHistogram: each power of two range is
+// split into SUB_BUCKETS linear buckets, so every recorded value is stored with
+// a relative error below 1/SUB_BUCKETS regardless of its magnitude. Recording is
+// O(1) and memory use is fixed, so millions of calls can be recorded without
+// storing them individually.
+//
+// MemoryStats reports allocations made through the global operator new (which is
+// replaced in perfstats.cc to count them while counting is turned on) and the resident
+// set size of the process from /proc/self/status.
+//
+// ComplexityFit fits a line to log(time) over log(N) and finds the complexity class
+// whose growth over the same N range is closest to the measured one.
+//
+// ZipfDistribution draws ranks 0..n-1 with probability proportional to 1/(rank+1)^s,
+// like the popularity of keys in real traffic. It uses rejection-inversion sampling
+// (Hormann & Derflinger), which needs no tables, so n can change between calls.
+
+#ifndef PERFSTATS_HH
+#define PERFSTATS_HH
+
+#include <array>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+class LatencyHistogram
+{
+public:
+    LatencyHistogram();
+
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: Bucket index is computed from the highest set bit.
+    void record(std::uint64_t value);
+
+    void reset();
+    // Adds the counts of another histogram to this one.
+    void merge(LatencyHistogram const& other);
+
+    std::uint64_t count() const;
+    std::uint64_t min() const;
+    std::uint64_t max() const;
+    double mean() const;
+    // Standard deviation of the recorded values (exact, not from the buckets).
+    double stddev() const;
+
+    // Estimate of performance: O(b), b being the number of buckets
+    // Short rationale for estimate: Buckets are summed until the percentile is reached.
+    // Returns the highest value equivalent to the bucket containing the percentile
+    // (0-100), but never more than the maximum recorded value. 0 if nothing recorded.
+    std::uint64_t percentile(double percent) const;
+
+private:
+    static unsigned int const SUB_BUCKET_BITS = 6;
+    static unsigned int const SUB_BUCKETS = 1u << SUB_BUCKET_BITS;
+    // Values below 2*SUB_BUCKETS are stored exactly, after that SUB_BUCKETS buckets per power of two.
+    static unsigned int const BUCKET_COUNT = 2 * SUB_BUCKETS + (64 - SUB_BUCKET_BITS - 1) * SUB_BUCKETS;
+
+    static unsigned int bucket_index(std::uint64_t value);
+    static std::uint64_t bucket_highest_value(unsigned int index);
+
+    std::array<std::uint64_t, BUCKET_COUNT> counts_;
+    std::uint64_t count_ = 0;
+    std::uint64_t min_ = 0;
+    std::uint64_t max_ = 0;
+    long double sum_ = 0;
+    long double sum_squares_ = 0;
+};
+
+class MemoryStats
+{
+public:
+    // Allocations made through global operator new (all forms) while counting was on.
+    struct Allocations
+    {
+        std::uint64_t count = 0;
+        std::uint64_t bytes = 0;
+
+        Allocations operator-(Allocations const& other) const { return {count - other.count, bytes - other.bytes}; }
+        Allocations& operator+=(Allocations const& other) { count += other.count; bytes += other.bytes; return *this; }
+    };
+
+    // Turns counting of allocations on or off (off at program start). While it is off,
+    // allocations don't touch the shared counters, which every thread would otherwise
+    // update on each allocation.
+    static void set_counting(bool on);
+    static bool counting_allocations();
+
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: Only reads two counters.
+    static Allocations allocations();
+
+    // Current and peak resident set size in bytes (VmRSS and VmHWM). Returns false if
+    // /proc/self/status can't be read (non-Linux systems).
+    static bool resident_set(std::uint64_t& current, std::uint64_t& peak);
+
+    // Resets the peak resident set size to the current one (Linux /proc/self/clear_refs),
+    // so the peak of a single test round can be measured. Returns false if not supported.
+    static bool reset_peak_resident_set();
+};
+
+class ComplexityFit
+{
+public:
+    enum class Class { CONSTANT, LOG_N, N, N_LOG_N, N_SQUARED, UNKNOWN };
+
+    // Names used in the machine-readable estimates: "1", "log n", "n", "n log n", "n^2".
+    static char const* class_name(Class complexity);
+    static Class class_from_name(std::string const& name);
+
+    // Adds a measurement: time (any unit) for size n. Non-positive values are ignored.
+    void add(double n, double time);
+    std::size_t points() const;
+
+    // Estimate of performance: O(p), p being the number of points
+    // Short rationale for estimate: Least squares line is computed with one pass.
+    // Slope of the least squares line of log(time) over log(n) (the "exponent").
+    // Returns false if there are fewer than two different n.
+    bool exponent(double& slope) const;
+
+    // Slope a class would have over the measured n range, e.g. n log n from
+    // 1000 to 100000 grows a bit faster than n, so its slope is about 1.17.
+    double class_slope(Class complexity) const;
+
+    // Class whose slope over the measured n range is closest to the measured exponent.
+    Class best_class() const;
+
+    // True if the measured exponent is more than tolerance above the slope of expected.
+    // Estimates are upper bounds, so growing more slowly than expected is not reported.
+    bool disagrees(Class expected, double tolerance = 0.25) const;
+
+private:
+    std::vector<double> log_n_;
+    std::vector<double> log_time_;
+    double min_n_ = 0;
+    double max_n_ = 0;
+};
+
+class ZipfDistribution
+{
+public:
+    // s is the skew, 0 gives a uniform distribution.
+    explicit ZipfDistribution(double s = 0);
+
+    double skew() const;
+
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: Expected number of rejection rounds is below 1.1
+    // for all s and n (constants are recomputed only when n changes).
+    template <typename Engine>
+    std::uint64_t operator()(Engine& engine, std::uint64_t n)
+    {
+        if (n <= 1) { return 0; }
+        if (n != n_) { set_n(n); }
+        std::uniform_real_distribution<double> uniform(0.0, 1.0);
+        std::uint64_t rank = 0;
+        while (!try_sample(uniform(engine), rank)) { }
+        return rank;
+    }
+
+private:
+    void set_n(std::uint64_t n);
+    // Returns false if the candidate drawn with u is rejected.
+    bool try_sample(double u, std::uint64_t& rank) const;
+
+    double h(double x) const;
+    double h_integral(double x) const;
+    double h_integral_inverse(double x) const;
+
+    double s_ = 0;
+    std::uint64_t n_ = 0;
+    double h_integral_x1_ = 0;
+    double h_integral_n_ = 0;
+    double threshold_ = 0;
+};
+
+#endif // PERFSTATS_HH
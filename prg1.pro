@@ -40,11 +40,29 @@ DEFINES += QT_DEPRECATED_WARNINGS
 
 SOURCES += \
     datastructures.cc \
+    mutationlog.cc \
+    changefeed.cc \
+    importer.cc \
+    perfstats.cc \
+    perfreport.cc \
+    workloadtrace.cc \
+    queryexecutor.cc \
     mainwindow.cc \
     mainprogram.cc
 
 HEADERS += \
     datastructures.hh \
+    shardedmap.hh \
+    parallelsort.hh \
+    parallelwalk.hh \
+    mutationlog.hh \
+    changefeed.hh \
+    importer.hh \
+    perfstats.hh \
+    perfreport.hh \
+    workloadtrace.hh \
+    queryexecutor.hh \
+    outputqueue.hh \
     mainwindow.hh \
     mainprogram.hh
 
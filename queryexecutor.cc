@@ -0,0 +1,44 @@
+// Queryexecutor.cc
+
+#include "queryexecutor.hh"
+
+QueryExecutor::QueryExecutor(unsigned int threads)
+{
+    if (threads == 0) { threads = 1; }
+    workers_.reserve(threads);
+    for (unsigned int i = 0; i < threads; ++i) {
+        workers_.emplace_back([this]() { work(); });
+    }
+}
+
+QueryExecutor::~QueryExecutor()
+{
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+        stopping_ = true;
+    }
+    work_available_.notify_all();
+    for (auto& worker : workers_) {
+        worker.join();
+    }
+}
+
+unsigned int QueryExecutor::threads() const
+{
+    return static_cast<unsigned int>(workers_.size());
+}
+
+void QueryExecutor::work()
+{
+    for (;;) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            work_available_.wait(lock, [this]() { return stopping_ || !tasks_.empty(); });
+            if (tasks_.empty()) { return; } // Stopping and nothing left to do
+            task = std::move(tasks_.front());
+            tasks_.pop_front();
+        }
+        task();
+    }
+}
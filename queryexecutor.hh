@@ -0,0 +1,66 @@
+// Queryexecutor.hh
+//
+// Fixed pool of worker threads for running read-only queries in the background
+// (MainProgram's async_queries command). submit() queues a function and returns a future
+// of its result. Tasks are started in submission order, but finish in any order, so a
+// caller which needs ordered output keeps the futures in submission order and waits for
+// the oldest one.
+//
+// The pool doesn't limit the number of waiting tasks. The caller bounds it (and the memory
+// of unread results) by waiting for old results before submitting more.
+
+#ifndef QUERYEXECUTOR_HH
+#define QUERYEXECUTOR_HH
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+class QueryExecutor
+{
+public:
+    // Starts the given number of threads (at least one).
+    explicit QueryExecutor(unsigned int threads);
+    // Runs the tasks already submitted, then stops the threads.
+    ~QueryExecutor();
+
+    QueryExecutor(QueryExecutor const&) = delete;
+    QueryExecutor& operator=(QueryExecutor const&) = delete;
+
+    unsigned int threads() const;
+
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: The task is appended to the queue and one waiting
+    // thread is woken up.
+    // Exceptions thrown by query are passed to the caller through the future.
+    template <typename Query>
+    std::future<std::invoke_result_t<Query>> submit(Query query)
+    {
+        // std::function needs a copyable function, so the packaged_task is shared.
+        auto task = std::make_shared<std::packaged_task<std::invoke_result_t<Query>()>>(std::move(query));
+        auto result = task->get_future();
+        {
+            std::lock_guard<std::mutex> guard(mutex_);
+            tasks_.push_back([task]() { (*task)(); });
+        }
+        work_available_.notify_one();
+        return result;
+    }
+
+private:
+    void work();
+
+    std::mutex mutex_; // Protects tasks_ and stopping_.
+    std::condition_variable work_available_;
+    std::deque<std::function<void()>> tasks_;
+    bool stopping_ = false;
+    std::vector<std::thread> workers_;
+};
+
+#endif // QUERYEXECUTOR_HH
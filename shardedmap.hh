@@ -0,0 +1,313 @@
+// Shardedmap.hh
+//
+// Ordered map split into shards by hash of the key. Single-key operations (find,
+// insert, erase) touch only the shard of the key, so callers can lock shards
+// separately (see Datastructures::Concurrency::STRIPED). Iteration goes through the
+// shards in key order with a k-way merge, so it sees the items in the same order as
+// one std::map would. With one shard (the default) everything is a plain std::map
+// operation.
+//
+// An iterator returned by find() or insert() points to one shard only. The merge
+// positions of the other shards are looked up the first time it is incremented.
+
+#ifndef SHARDEDMAP_HH
+#define SHARDEDMAP_HH
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+template <typename Key, typename Value, typename Hash = std::hash<Key>>
+class ShardedMap
+{
+public:
+    using Shard = std::map<Key, Value>;
+    using value_type = typename Shard::value_type;
+
+    template <bool Const>
+    class Iterator
+    {
+    public:
+        using ShardIterator = std::conditional_t<Const, typename Shard::const_iterator, typename Shard::iterator>;
+        using MapPointer = std::conditional_t<Const, ShardedMap const*, ShardedMap*>;
+
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = typename Shard::value_type;
+        using difference_type = std::ptrdiff_t;
+        using pointer = std::conditional_t<Const, value_type const*, value_type*>;
+        using reference = std::conditional_t<Const, value_type const&, value_type&>;
+
+        Iterator() = default;
+
+        reference operator*() const { return *pos_; }
+        pointer operator->() const { return &*pos_; }
+
+        // Estimate of performance: O(k), O(k*log(n/k)) for the first increment after find()
+        // Short rationale for estimate: The smallest next key of the k shards is searched
+        // linearly. A single-shard iterator first finds its position in every shard.
+        Iterator& operator++()
+        {
+            if (map_->shards_.size() == 1) {
+                if (++pos_ == map_->shards_[0].end()) {
+                    shard_ = END;
+                }
+                return *this;
+            }
+            if (heads_.empty()) {
+                // Key is in this shard only, so upper_bound() is the merge position in the others.
+                heads_.reserve(map_->shards_.size());
+                for (std::size_t i = 0; i < map_->shards_.size(); ++i) {
+                    heads_.push_back((i == shard_) ? std::next(pos_) : map_->shards_[i].upper_bound(pos_->first));
+                }
+            }
+            select_smallest();
+            return *this;
+        }
+
+        bool operator==(Iterator const& other) const
+        {
+            return shard_ == other.shard_ && (shard_ == END || pos_ == other.pos_);
+        }
+        bool operator!=(Iterator const& other) const { return !(*this == other); }
+
+    private:
+        friend class ShardedMap;
+
+        static std::size_t const END = static_cast<std::size_t>(-1);
+
+        Iterator(MapPointer map, std::size_t shard, ShardIterator pos) : map_(map), shard_(shard), pos_(pos) {}
+
+        // Starts a merge from the given position of every shard.
+        Iterator(MapPointer map, std::vector<ShardIterator> heads) : map_(map), shard_(END), heads_(std::move(heads))
+        {
+            select_smallest();
+        }
+
+        void select_smallest()
+        {
+            shard_ = END;
+            for (std::size_t i = 0; i < heads_.size(); ++i) {
+                if (heads_[i] != map_->shards_[i].end() && (shard_ == END || heads_[i]->first < heads_[shard_]->first)) {
+                    shard_ = i;
+                }
+            }
+            if (shard_ != END) {
+                pos_ = heads_[shard_]++;
+            }
+        }
+
+        MapPointer map_ = nullptr;
+        std::size_t shard_ = END;
+        ShardIterator pos_;
+        std::vector<ShardIterator> heads_; // Next unvisited item of each shard, empty if not merging.
+    };
+
+    using iterator = Iterator<false>;
+    using const_iterator = Iterator<true>;
+
+    explicit ShardedMap(std::size_t shard_count = 1) : shards_(shard_count > 0 ? shard_count : 1) {}
+
+    std::size_t shard_count() const { return shards_.size(); }
+    std::size_t shard_index(Key const& key) const
+    {
+        return (shards_.size() == 1) ? 0 : Hash()(key) % shards_.size();
+    }
+
+    // Estimate of performance: O(n*log(n))
+    // Short rationale for estimate: Every item is moved to a map of its new shard.
+    void reshard(std::size_t shard_count)
+    {
+        std::vector<Shard> old(shard_count > 0 ? shard_count : 1);
+        old.swap(shards_);
+        for (auto& shard : old) {
+            while (!shard.empty()) {
+                auto node = shard.extract(shard.begin()); // Items (and pointers to them) stay where they are.
+                shards_[shard_index(node.key())].insert(std::move(node));
+            }
+        }
+    }
+
+    // Estimate of performance: O(k)
+    // Short rationale for estimate: Sizes of the shards are summed.
+    std::size_t size() const
+    {
+        std::size_t total = 0;
+        for (auto const& shard : shards_) {
+            total += shard.size();
+        }
+        return total;
+    }
+
+    bool empty() const
+    {
+        for (auto const& shard : shards_) {
+            if (!shard.empty()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void clear()
+    {
+        for (auto& shard : shards_) {
+            shard.clear();
+        }
+    }
+
+    // Estimate of performance: O(log(n/k))
+    // Short rationale for estimate: Searched only from the shard of the key.
+    iterator find(Key const& key)
+    {
+        auto index = shard_index(key);
+        auto pos = shards_[index].find(key);
+        return (pos != shards_[index].end()) ? iterator(this, index, pos) : end();
+    }
+    const_iterator find(Key const& key) const
+    {
+        auto index = shard_index(key);
+        auto pos = shards_[index].find(key);
+        return (pos != shards_[index].end()) ? const_iterator(this, index, pos) : end();
+    }
+
+    // Estimate of performance: O(m*log(m) + m*log(n/k)), less if the keys are close together
+    // Short rationale for estimate: Keys are sorted by shard and key, and each shard is
+    // walked forward from the previous key's position. Only keys further than a few items
+    // away are searched from the root.
+    // Looks up m keys at once: result[i] points to the value of keys[i], or is nullptr.
+    std::vector<Value const*> find_many(std::vector<Key> const& keys) const
+    {
+        std::vector<std::pair<std::size_t, std::size_t>> order; // Shard and position in keys.
+        order.reserve(keys.size());
+        for (std::size_t i = 0; i < keys.size(); ++i) {
+            order.push_back({shard_index(keys[i]), i});
+        }
+        std::sort(order.begin(), order.end(), [&keys](auto const& a, auto const& b) {
+            return (a.first < b.first) || (a.first == b.first && keys[a.second] < keys[b.second]);
+        });
+
+        std::vector<Value const*> values(keys.size(), nullptr);
+        std::size_t shard = END_SHARD;
+        typename Shard::const_iterator pos;
+        for (auto const& [index, i] : order) {
+            auto const& map = shards_[index];
+            Key const& key = keys[i];
+            if (index != shard) {
+                shard = index;
+                pos = map.lower_bound(key);
+            }
+            else {
+                std::size_t steps = 0;
+                while (pos != map.end() && pos->first < key && steps++ < NEAR_STEPS) {
+                    ++pos;
+                }
+                if (pos != map.end() && pos->first < key) {
+                    pos = map.lower_bound(key);
+                }
+            }
+            if (pos != map.end() && !(key < pos->first)) {
+                values[i] = &(pos->second);
+            }
+        }
+        return values;
+    }
+
+    // Estimate of performance: O(log(n/k))
+    // Short rationale for estimate: Inserted only to the shard of the key.
+    std::pair<iterator, bool> insert(value_type const& item)
+    {
+        auto index = shard_index(item.first);
+        auto [pos, inserted] = shards_[index].insert(item);
+        return {iterator(this, index, pos), inserted};
+    }
+
+    void erase(iterator pos)
+    {
+        shards_[pos.shard_].erase(pos.pos_);
+    }
+
+    // Estimate of performance: O(k)
+    // Short rationale for estimate: First item of every shard is compared.
+    iterator begin()
+    {
+        if (shards_.size() == 1) {
+            return shards_[0].empty() ? end() : iterator(this, 0, shards_[0].begin());
+        }
+        std::vector<typename Shard::iterator> heads;
+        for (auto& shard : shards_) {
+            heads.push_back(shard.begin());
+        }
+        return iterator(this, std::move(heads));
+    }
+    const_iterator begin() const
+    {
+        if (shards_.size() == 1) {
+            return shards_[0].empty() ? end() : const_iterator(this, 0, shards_[0].begin());
+        }
+        std::vector<typename Shard::const_iterator> heads;
+        for (auto const& shard : shards_) {
+            heads.push_back(shard.begin());
+        }
+        return const_iterator(this, std::move(heads));
+    }
+
+    iterator end() { return iterator(this, iterator::END, {}); }
+    const_iterator end() const { return const_iterator(this, const_iterator::END, {}); }
+
+    // Estimate of performance: O(k*log(n/k))
+    // Short rationale for estimate: Position is searched from every shard.
+    iterator upper_bound(Key const& key)
+    {
+        if (shards_.size() == 1) {
+            auto pos = shards_[0].upper_bound(key);
+            return (pos != shards_[0].end()) ? iterator(this, 0, pos) : end();
+        }
+        std::vector<typename Shard::iterator> heads;
+        for (auto& shard : shards_) {
+            heads.push_back(shard.upper_bound(key));
+        }
+        return iterator(this, std::move(heads));
+    }
+
+    // Inserts items given in increasing key order, using the previous position in each
+    // shard as the hint, so that each insertion is amortized constant.
+    class OrderedInserter
+    {
+    public:
+        explicit OrderedInserter(ShardedMap& map) : map_(map)
+        {
+            for (auto& shard : map_.shards_) {
+                hints_.push_back(shard.end());
+            }
+        }
+
+        // Returns the item with the key and whether it was inserted (false if it existed).
+        template <typename... Args>
+        std::pair<Value*, bool> emplace(Key const& key, Args&&... args)
+        {
+            auto index = map_.shard_index(key);
+            auto& shard = map_.shards_[index];
+            auto size = shard.size();
+            auto pos = shard.emplace_hint(hints_[index], key, std::forward<Args>(args)...);
+            hints_[index] = std::next(pos);
+            return {&(pos->second), shard.size() != size};
+        }
+
+    private:
+        ShardedMap& map_;
+        std::vector<typename Shard::iterator> hints_;
+    };
+
+private:
+    static std::size_t const END_SHARD = static_cast<std::size_t>(-1);
+    static std::size_t const NEAR_STEPS = 8; // Further keys are searched with lower_bound().
+
+    std::vector<Shard> shards_;
+};
+
+#endif // SHARDEDMAP_HH
@@ -0,0 +1,546 @@
+// Workloadtrace.cc
+
+#include "workloadtrace.hh"
+
+#include <iterator>
+#include <thread>
+
+namespace
+{
+// Identifies trace files (and their format version).
+std::string const TRACE_MAGIC = "DSTRACE1";
+
+// Waits shorter than this are spun, longer ones slept (sleeping overshoots).
+std::chrono::microseconds const SPIN_LIMIT(200);
+
+// One decoded record, the fields used depend on the operation.
+struct Call
+{
+    WorkloadTrace::Operation operation = WorkloadTrace::Operation::OPERATION_END;
+    std::uint64_t time_ns = 0; // Since the first record.
+    AffiliationID affiliation;
+    PublicationID publication1 = NO_PUBLICATION;
+    PublicationID publication2 = NO_PUBLICATION;
+    Coord xy = NO_COORD;
+    Name name;
+    Year year = NO_YEAR;
+    std::vector<AffiliationID> affiliations;
+    std::vector<PublicationID> publications;
+};
+
+struct Reader
+{
+    char const* pos;
+    char const* end;
+
+    bool get_u8(std::uint8_t& value)
+    {
+        if (pos == end) { return false; }
+        value = static_cast<std::uint8_t>(*pos++);
+        return true;
+    }
+
+    bool get_varint(std::uint64_t& value)
+    {
+        value = 0;
+        for (unsigned int shift = 0; shift < 64 && pos != end; shift += 7) {
+            auto byte = static_cast<std::uint8_t>(*pos++);
+            value |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0) { return true; }
+        }
+        return false;
+    }
+
+    bool get_id(PublicationID& id)
+    {
+        std::uint64_t value = 0;
+        if (!get_varint(value)) { return false; }
+        id = value;
+        return true;
+    }
+
+    bool get_coord(Coord& xy)
+    {
+        std::uint64_t x = 0;
+        std::uint64_t y = 0;
+        if (!get_varint(x) || !get_varint(y)) { return false; }
+        // Zigzag decoding.
+        xy.x = static_cast<int>(static_cast<std::int64_t>(x >> 1) ^ -static_cast<std::int64_t>(x & 1));
+        xy.y = static_cast<int>(static_cast<std::int64_t>(y >> 1) ^ -static_cast<std::int64_t>(y & 1));
+        return true;
+    }
+
+    bool get_string(std::string& value)
+    {
+        std::uint64_t length = 0;
+        if (!get_varint(length) || static_cast<std::uint64_t>(end - pos) < length) { return false; }
+        value.assign(pos, length);
+        pos += length;
+        return true;
+    }
+};
+
+// Reads the arguments of the operation to call. Returns false if the record is cut short.
+bool decode_arguments(Reader& reader, Call& call)
+{
+    using Operation = WorkloadTrace::Operation;
+    std::uint64_t value = 0;
+    switch (call.operation) {
+    case Operation::GET_AFFILIATION_COUNT:
+    case Operation::CLEAR_ALL:
+    case Operation::GET_ALL_AFFILIATIONS:
+    case Operation::GET_AFFILIATIONS_ALPHABETICALLY:
+    case Operation::GET_AFFILIATIONS_DISTANCE_INCREASING:
+    case Operation::ALL_PUBLICATIONS:
+        return true;
+    case Operation::ADD_AFFILIATION:
+        return reader.get_string(call.affiliation) && reader.get_string(call.name) && reader.get_coord(call.xy);
+    case Operation::GET_AFFILIATION_NAME:
+    case Operation::GET_AFFILIATION_COORD:
+    case Operation::GET_PUBLICATIONS:
+    case Operation::REMOVE_AFFILIATION:
+        return reader.get_string(call.affiliation);
+    case Operation::FIND_AFFILIATION_WITH_COORD:
+    case Operation::GET_AFFILIATIONS_CLOSEST_TO:
+        return reader.get_coord(call.xy);
+    case Operation::CHANGE_AFFILIATION_COORD:
+        return reader.get_string(call.affiliation) && reader.get_coord(call.xy);
+    case Operation::ADD_PUBLICATION: {
+        std::uint64_t count = 0;
+        if (!reader.get_id(call.publication1) || !reader.get_string(call.name) ||
+            !reader.get_varint(value) || !reader.get_varint(count)) {
+            return false;
+        }
+        call.year = static_cast<Year>(value);
+        for (std::uint64_t i = 0; i < count; ++i) { // A bogus count runs out of data.
+            call.affiliations.emplace_back();
+            if (!reader.get_string(call.affiliations.back())) { return false; }
+        }
+        return true;
+    }
+    case Operation::GET_PUBLICATION_NAME:
+    case Operation::GET_PUBLICATION_YEAR:
+    case Operation::GET_AFFILIATIONS:
+    case Operation::GET_DIRECT_REFERENCES:
+    case Operation::GET_PARENT:
+    case Operation::GET_REFERENCED_BY_CHAIN:
+    case Operation::GET_ALL_REFERENCES:
+    case Operation::REMOVE_PUBLICATION:
+        return reader.get_id(call.publication1);
+    case Operation::ADD_REFERENCE:
+    case Operation::GET_CLOSEST_COMMON_PARENT:
+        return reader.get_id(call.publication1) && reader.get_id(call.publication2);
+    case Operation::ADD_AFFILIATION_TO_PUBLICATION:
+        return reader.get_string(call.affiliation) && reader.get_id(call.publication1);
+    case Operation::GET_PUBLICATIONS_AFTER:
+        if (!reader.get_string(call.affiliation) || !reader.get_varint(value)) { return false; }
+        call.year = static_cast<Year>(value);
+        return true;
+    case Operation::GET_PUBLICATION_NAMES:
+    case Operation::GET_PUBLICATION_YEARS:
+    case Operation::GET_PARENTS:
+    case Operation::GET_PUBLICATIONS_INFO:
+        if (!reader.get_varint(value)) { return false; }
+        for (std::uint64_t i = 0; i < value; ++i) { // A bogus count runs out of data.
+            call.publications.emplace_back();
+            if (!reader.get_id(call.publications.back())) { return false; }
+        }
+        return true;
+    case Operation::GET_AFFILIATION_COORDS:
+        if (!reader.get_varint(value)) { return false; }
+        for (std::uint64_t i = 0; i < value; ++i) {
+            call.affiliations.emplace_back();
+            if (!reader.get_string(call.affiliations.back())) { return false; }
+        }
+        return true;
+    case Operation::OPERATION_END:
+        break;
+    }
+    return false;
+}
+
+// Calls the Datastructures operation, returns something depending on the result so
+// that the call cannot be left out.
+std::size_t apply(Datastructures& ds, Call const& call)
+{
+    using Operation = WorkloadTrace::Operation;
+    switch (call.operation) {
+    case Operation::GET_AFFILIATION_COUNT: return ds.get_affiliation_count();
+    case Operation::CLEAR_ALL: ds.clear_all(); return 0;
+    case Operation::GET_ALL_AFFILIATIONS: return ds.get_all_affiliations().size();
+    case Operation::ADD_AFFILIATION: return ds.add_affiliation(call.affiliation, call.name, call.xy);
+    case Operation::GET_AFFILIATION_NAME: return ds.get_affiliation_name(call.affiliation).size();
+    case Operation::GET_AFFILIATION_COORD: return ds.get_affiliation_coord(call.affiliation).x;
+    case Operation::GET_AFFILIATIONS_ALPHABETICALLY: return ds.get_affiliations_alphabetically().size();
+    case Operation::GET_AFFILIATIONS_DISTANCE_INCREASING: return ds.get_affiliations_distance_increasing().size();
+    case Operation::FIND_AFFILIATION_WITH_COORD: return ds.find_affiliation_with_coord(call.xy).size();
+    case Operation::CHANGE_AFFILIATION_COORD: return ds.change_affiliation_coord(call.affiliation, call.xy);
+    case Operation::ADD_PUBLICATION: return ds.add_publication(call.publication1, call.name, call.year, call.affiliations);
+    case Operation::ALL_PUBLICATIONS: return ds.all_publications().size();
+    case Operation::GET_PUBLICATION_NAME: return ds.get_publication_name(call.publication1).size();
+    case Operation::GET_PUBLICATION_YEAR: return ds.get_publication_year(call.publication1);
+    case Operation::GET_AFFILIATIONS: return ds.get_affiliations(call.publication1).size();
+    case Operation::ADD_REFERENCE: return ds.add_reference(call.publication1, call.publication2);
+    case Operation::GET_DIRECT_REFERENCES: return ds.get_direct_references(call.publication1).size();
+    case Operation::ADD_AFFILIATION_TO_PUBLICATION: return ds.add_affiliation_to_publication(call.affiliation, call.publication1);
+    case Operation::GET_PUBLICATIONS: return ds.get_publications(call.affiliation).size();
+    case Operation::GET_PARENT: return ds.get_parent(call.publication1);
+    case Operation::GET_PUBLICATIONS_AFTER: return ds.get_publications_after(call.affiliation, call.year).size();
+    case Operation::GET_REFERENCED_BY_CHAIN: return ds.get_referenced_by_chain(call.publication1).size();
+    case Operation::GET_ALL_REFERENCES: return ds.get_all_references(call.publication1).size();
+    case Operation::GET_AFFILIATIONS_CLOSEST_TO: return ds.get_affiliations_closest_to(call.xy).size();
+    case Operation::REMOVE_AFFILIATION: return ds.remove_affiliation(call.affiliation);
+    case Operation::GET_CLOSEST_COMMON_PARENT: return ds.get_closest_common_parent(call.publication1, call.publication2);
+    case Operation::REMOVE_PUBLICATION: return ds.remove_publication(call.publication1);
+    case Operation::GET_PUBLICATION_NAMES: return ds.get_publication_names(call.publications).size();
+    case Operation::GET_PUBLICATION_YEARS: return ds.get_publication_years(call.publications).size();
+    case Operation::GET_PARENTS: return ds.get_parents(call.publications).size();
+    case Operation::GET_AFFILIATION_COORDS: return ds.get_affiliation_coords(call.affiliations).size();
+    case Operation::GET_PUBLICATIONS_INFO: return ds.get_publications_info(call.publications).size();
+    case Operation::OPERATION_END: break;
+    }
+    return 0;
+}
+}
+
+char const* WorkloadTrace::operation_name(Operation operation)
+{
+    static char const* const names[OPERATION_COUNT] = {
+        "",
+        "get_affiliation_count",
+        "clear_all",
+        "get_all_affiliations",
+        "add_affiliation",
+        "get_affiliation_name",
+        "get_affiliation_coord",
+        "get_affiliations_alphabetically",
+        "get_affiliations_distance_increasing",
+        "find_affiliation_with_coord",
+        "change_affiliation_coord",
+        "add_publication",
+        "all_publications",
+        "get_publication_name",
+        "get_publication_year",
+        "get_affiliations",
+        "add_reference",
+        "get_direct_references",
+        "add_affiliation_to_publication",
+        "get_publications",
+        "get_parent",
+        "get_publications_after",
+        "get_referenced_by_chain",
+        "get_all_references",
+        "get_affiliations_closest_to",
+        "remove_affiliation",
+        "get_closest_common_parent",
+        "remove_publication",
+        "get_publication_names",
+        "get_publication_years",
+        "get_parents",
+        "get_affiliation_coords",
+        "get_publications_info"
+    };
+    auto index = static_cast<unsigned int>(operation);
+    return (index < OPERATION_COUNT) ? names[index] : "";
+}
+
+WorkloadTrace::WorkloadTrace()
+{
+}
+
+WorkloadTrace::~WorkloadTrace()
+{
+    close();
+}
+
+bool WorkloadTrace::open(std::string const& filename)
+{
+    close();
+
+    std::lock_guard<std::mutex> guard(mutex_);
+    file_.open(filename, std::ios::binary | std::ios::trunc);
+    if (!file_) {
+        return false;
+    }
+    filename_ = filename;
+    records_ = 0;
+    failed_ = false;
+    buffer_ = TRACE_MAGIC;
+    previous_ = Clock::now();
+    return true;
+}
+
+bool WorkloadTrace::close()
+{
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (!file_.is_open()) {
+        return !failed_;
+    }
+    write_buffer();
+    file_.close();
+    if (!file_) {
+        failed_ = true;
+    }
+    return !failed_;
+}
+
+bool WorkloadTrace::is_open() const
+{
+    std::lock_guard<std::mutex> guard(mutex_);
+    return file_.is_open();
+}
+
+bool WorkloadTrace::failed() const
+{
+    std::lock_guard<std::mutex> guard(mutex_);
+    return failed_;
+}
+
+std::string const& WorkloadTrace::filename() const
+{
+    return filename_;
+}
+
+std::uint64_t WorkloadTrace::records() const
+{
+    std::lock_guard<std::mutex> guard(mutex_);
+    return records_;
+}
+
+void WorkloadTrace::put_varint(std::string& buf, std::uint64_t value)
+{
+    while (value >= 0x80) {
+        buf += static_cast<char>((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    buf += static_cast<char>(value);
+}
+
+void WorkloadTrace::put_coord(std::string& buf, Coord xy)
+{
+    // Zigzag encoding keeps small negative values short too.
+    auto zigzag = [](int value) {
+        auto wide = static_cast<std::int64_t>(value);
+        return static_cast<std::uint64_t>((wide << 1) ^ (wide >> 63));
+    };
+    put_varint(buf, zigzag(xy.x));
+    put_varint(buf, zigzag(xy.y));
+}
+
+void WorkloadTrace::put_string(std::string& buf, std::string const& value)
+{
+    put_varint(buf, value.size());
+    buf += value;
+}
+
+template <typename EncodeFields>
+void WorkloadTrace::write_record(Operation operation, EncodeFields encode_fields)
+{
+    // Held for the whole record, so records of concurrent callers don't interleave.
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (!file_.is_open()) {
+        return;
+    }
+    auto now = Clock::now();
+    auto delta = std::chrono::duration_cast<std::chrono::nanoseconds>(now - previous_).count();
+
+    std::size_t record_start = buffer_.size();
+    try {
+        buffer_ += static_cast<char>(operation);
+        put_varint(buffer_, (records_ == 0 || delta < 0) ? 0 : static_cast<std::uint64_t>(delta));
+        encode_fields(buffer_);
+    }
+    catch (...) {
+        buffer_.resize(record_start); // No half record is left in the buffer.
+        throw;
+    }
+    previous_ = now;
+    ++records_;
+
+    if (buffer_.size() >= WRITE_SIZE) {
+        write_buffer();
+    }
+}
+
+void WorkloadTrace::write_buffer()
+{
+    if (!failed_) {
+        file_.write(buffer_.data(), buffer_.size());
+        // The rest of the trace would have a gap, so nothing more is written after a failure.
+        if (!file_) {
+            failed_ = true;
+        }
+    }
+    buffer_.clear();
+}
+
+void WorkloadTrace::record(Operation operation)
+{
+    write_record(operation, [](std::string&) {});
+}
+
+void WorkloadTrace::record(Operation operation, AffiliationID const& id)
+{
+    write_record(operation, [&](std::string& buf) {
+        put_string(buf, id);
+    });
+}
+
+void WorkloadTrace::record(Operation operation, PublicationID id)
+{
+    write_record(operation, [&](std::string& buf) {
+        put_varint(buf, id);
+    });
+}
+
+void WorkloadTrace::record(Operation operation, Coord xy)
+{
+    write_record(operation, [&](std::string& buf) {
+        put_coord(buf, xy);
+    });
+}
+
+void WorkloadTrace::record(Operation operation, AffiliationID const& id, Coord xy)
+{
+    write_record(operation, [&](std::string& buf) {
+        put_string(buf, id);
+        put_coord(buf, xy);
+    });
+}
+
+void WorkloadTrace::record(Operation operation, AffiliationID const& id, PublicationID publicationid)
+{
+    write_record(operation, [&](std::string& buf) {
+        put_string(buf, id);
+        put_varint(buf, publicationid);
+    });
+}
+
+void WorkloadTrace::record(Operation operation, AffiliationID const& id, Year year)
+{
+    write_record(operation, [&](std::string& buf) {
+        put_string(buf, id);
+        put_varint(buf, year);
+    });
+}
+
+void WorkloadTrace::record(Operation operation, PublicationID id1, PublicationID id2)
+{
+    write_record(operation, [&](std::string& buf) {
+        put_varint(buf, id1);
+        put_varint(buf, id2);
+    });
+}
+
+void WorkloadTrace::record(Operation operation, std::vector<PublicationID> const& ids)
+{
+    write_record(operation, [&](std::string& buf) {
+        put_varint(buf, ids.size());
+        for (auto id : ids) {
+            put_varint(buf, id);
+        }
+    });
+}
+
+void WorkloadTrace::record(Operation operation, std::vector<AffiliationID> const& ids)
+{
+    write_record(operation, [&](std::string& buf) {
+        put_varint(buf, ids.size());
+        for (auto const& id : ids) {
+            put_string(buf, id);
+        }
+    });
+}
+
+void WorkloadTrace::record_add_affiliation(AffiliationID const& id, Name const& name, Coord xy)
+{
+    write_record(Operation::ADD_AFFILIATION, [&](std::string& buf) {
+        put_string(buf, id);
+        put_string(buf, name);
+        put_coord(buf, xy);
+    });
+}
+
+void WorkloadTrace::record_add_publication(PublicationID id, Name const& name, Year year,
+                                           std::vector<AffiliationID> const& affiliations)
+{
+    write_record(Operation::ADD_PUBLICATION, [&](std::string& buf) {
+        put_varint(buf, id);
+        put_string(buf, name);
+        put_varint(buf, year);
+        put_varint(buf, affiliations.size());
+        for (auto const& affiliation : affiliations) {
+            put_string(buf, affiliation);
+        }
+    });
+}
+
+bool WorkloadTrace::replay(std::string const& filename, Datastructures& ds, Mode mode,
+                           ReplayResult& result, std::string& error)
+{
+    result = ReplayResult();
+    result.operation_latencies.resize(OPERATION_COUNT);
+
+    std::ifstream input(filename, std::ios::binary);
+    if (!input) {
+        error = "Cannot open trace '" + filename + "'";
+        return false;
+    }
+    std::string data((std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>()); // O(file size)
+    if (data.compare(0, TRACE_MAGIC.size(), TRACE_MAGIC) != 0) {
+        error = "'" + filename + "' is not a trace file";
+        return false;
+    }
+
+    // Decoding is done before the clock starts, so only the calls are timed.
+    std::vector<Call> calls;
+    Reader reader{data.data() + TRACE_MAGIC.size(), data.data() + data.size()};
+    std::uint64_t time_ns = 0;
+    while (reader.pos != reader.end) {
+        Call call;
+        std::uint8_t op = 0;
+        std::uint64_t delta = 0;
+        if (!reader.get_u8(op) || op == 0 || op >= OPERATION_COUNT || !reader.get_varint(delta)) {
+            result.truncated = true;
+            break;
+        }
+        call.operation = static_cast<Operation>(op);
+        time_ns += delta;
+        call.time_ns = time_ns;
+        if (!decode_arguments(reader, call)) {
+            result.truncated = true;
+            break;
+        }
+        calls.push_back(std::move(call));
+    }
+    data.clear();
+    data.shrink_to_fit();
+    result.traced_sec = time_ns / 1e9;
+
+    std::size_t sink = 0;
+    auto start = Clock::now();
+    for (auto const& call : calls) {
+        auto due = start + std::chrono::nanoseconds(call.time_ns);
+        if (mode == Mode::TIMED) {
+            auto now = Clock::now();
+            if (due - now > SPIN_LIMIT) { std::this_thread::sleep_until(due - SPIN_LIMIT); }
+            while (Clock::now() < due) { }
+        }
+
+        auto call_start = Clock::now();
+        sink += apply(ds, call);
+        auto call_end = Clock::now();
+
+        // Timed latency includes waiting behind earlier calls that ran late.
+        auto since = (mode == Mode::TIMED && due < call_start) ? due : call_start;
+        auto latency = static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(call_end - since).count());
+        result.latencies.record(latency);
+        result.operation_latencies[static_cast<unsigned int>(call.operation)].record(latency);
+    }
+    result.elapsed_sec = std::chrono::duration<double>(Clock::now() - start).count();
+    result.calls = calls.size();
+
+    // Keeps the results alive without printing anything.
+    if (sink == static_cast<std::size_t>(-1)) { error = "sink"; }
+    return true;
+}
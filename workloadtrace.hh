@@ -0,0 +1,157 @@
+// Workloadtrace.hh
+//
+// Recording of Datastructures calls (arguments and inter-arrival times) to a compact
+// binary trace, and timed replay of a trace against Datastructures.
+//
+// Every public query and mutation of Datastructures is recorded when a trace is
+// attached (Datastructures::set_workload_trace), so the trace contains the calls the
+// program really made, also the ones made while formatting output (paged cursors are
+// not recorded). Records are buffered in memory and appended to the file in large writes.
+//
+// File layout: magic, then records
+//   record = u8 operation, varint nanoseconds since the previous record, arguments
+//   varint = unsigned LEB128, coordinates are zigzag encoded varints,
+//   strings and lists are a varint length followed by the items.
+// A record cut short (program killed while tracing) ends the replay.
+//
+// Replay either keeps the recorded inter-arrival times (latency is then measured from
+// the time the call was due, so a call delayed by a slow predecessor counts the wait
+// too) or runs the calls back to back as fast as possible.
+
+#ifndef WORKLOADTRACE_HH
+#define WORKLOADTRACE_HH
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "datastructures.hh"
+#include "perfstats.hh"
+
+class WorkloadTrace
+{
+public:
+    enum class Operation : unsigned char
+    {
+        GET_AFFILIATION_COUNT = 1,
+        CLEAR_ALL,
+        GET_ALL_AFFILIATIONS,
+        ADD_AFFILIATION,
+        GET_AFFILIATION_NAME,
+        GET_AFFILIATION_COORD,
+        GET_AFFILIATIONS_ALPHABETICALLY,
+        GET_AFFILIATIONS_DISTANCE_INCREASING,
+        FIND_AFFILIATION_WITH_COORD,
+        CHANGE_AFFILIATION_COORD,
+        ADD_PUBLICATION,
+        ALL_PUBLICATIONS,
+        GET_PUBLICATION_NAME,
+        GET_PUBLICATION_YEAR,
+        GET_AFFILIATIONS,
+        ADD_REFERENCE,
+        GET_DIRECT_REFERENCES,
+        ADD_AFFILIATION_TO_PUBLICATION,
+        GET_PUBLICATIONS,
+        GET_PARENT,
+        GET_PUBLICATIONS_AFTER,
+        GET_REFERENCED_BY_CHAIN,
+        GET_ALL_REFERENCES,
+        GET_AFFILIATIONS_CLOSEST_TO,
+        REMOVE_AFFILIATION,
+        GET_CLOSEST_COMMON_PARENT,
+        REMOVE_PUBLICATION,
+        GET_PUBLICATION_NAMES,
+        GET_PUBLICATION_YEARS,
+        GET_PARENTS,
+        GET_AFFILIATION_COORDS,
+        GET_PUBLICATIONS_INFO,
+        OPERATION_END
+    };
+    static unsigned int const OPERATION_COUNT = static_cast<unsigned int>(Operation::OPERATION_END);
+
+    // Name of the Datastructures function, "" for an invalid operation.
+    static char const* operation_name(Operation operation);
+
+    enum class Mode { TIMED, FAST };
+
+    struct ReplayResult
+    {
+        std::uint64_t calls = 0;
+        double elapsed_sec = 0; // From the first call to the end of the last one.
+        double traced_sec = 0; // Time span of the calls in the trace.
+        bool truncated = false; // Trace ended in the middle of a record.
+        LatencyHistogram latencies; // Nanoseconds, all calls.
+        std::vector<LatencyHistogram> operation_latencies; // Indexed by operation.
+    };
+
+    WorkloadTrace();
+    ~WorkloadTrace();
+
+    WorkloadTrace(WorkloadTrace const&) = delete;
+    WorkloadTrace& operator=(WorkloadTrace const&) = delete;
+
+    // Creates (truncates) the trace file and writes the header.
+    bool open(std::string const& filename);
+    // Writes the buffered records and closes the file. Returns false if writing the
+    // trace failed at any point since open(), and records are missing from the file.
+    bool close();
+    bool is_open() const;
+    // A write has failed since open(). Nothing more is written after that.
+    bool failed() const;
+    std::string const& filename() const;
+    std::uint64_t records() const;
+
+    // Estimate of performance: amortized O(k), k being the size of the arguments.
+    // Short rationale for estimate: Record is encoded to the end of a buffer, which is
+    // written to the file when it gets full.
+    void record(Operation operation);
+    void record(Operation operation, AffiliationID const& id);
+    void record(Operation operation, PublicationID id);
+    void record(Operation operation, Coord xy);
+    void record(Operation operation, AffiliationID const& id, Coord xy);
+    void record(Operation operation, AffiliationID const& id, PublicationID publicationid);
+    void record(Operation operation, AffiliationID const& id, Year year);
+    void record(Operation operation, PublicationID id1, PublicationID id2);
+    // Batch queries are one record with all their ids.
+    void record(Operation operation, std::vector<PublicationID> const& ids);
+    void record(Operation operation, std::vector<AffiliationID> const& ids);
+    void record_add_affiliation(AffiliationID const& id, Name const& name, Coord xy);
+    void record_add_publication(PublicationID id, Name const& name, Year year, std::vector<AffiliationID> const& affiliations);
+
+    // Estimate of performance: O(r*f), f being the cost of the traced call.
+    // Short rationale for estimate: The trace is decoded to memory first and then
+    // every record r is applied with the corresponding Datastructures operation.
+    // Datastructures must not have a trace attached while replaying.
+    static bool replay(std::string const& filename, Datastructures& ds, Mode mode,
+                       ReplayResult& result, std::string& error);
+
+    static void put_varint(std::string& buf, std::uint64_t value);
+    static void put_coord(std::string& buf, Coord xy);
+    static void put_string(std::string& buf, std::string const& value);
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    // Appends a record to the buffer under mutex_: the operation, the time since the
+    // previous record and then the arguments appended by encode_fields(buffer). If
+    // encoding throws, the buffer is left as it was. Does nothing if the trace isn't open.
+    template <typename EncodeFields>
+    void write_record(Operation operation, EncodeFields encode_fields);
+    // Writes the buffer to the file and empties it. Called with mutex_ held.
+    void write_buffer();
+
+    static std::size_t const WRITE_SIZE = 1 << 20;
+
+    std::string filename_;
+    std::ofstream file_;
+    std::string buffer_;
+    std::uint64_t records_ = 0;
+    Clock::time_point previous_;
+    bool failed_ = false;
+    mutable std::mutex mutex_; // Datastructures may record from several threads, see set_concurrency().
+};
+
+#endif // WORKLOADTRACE_HH